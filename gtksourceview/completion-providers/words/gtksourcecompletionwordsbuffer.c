@@ -48,6 +48,11 @@ struct _GtkSourceCompletionWordsBufferPrivate
 	guint scan_batch_size;
 	guint minimum_word_size;
 
+	/* Whether the text being deleted consists of whole lines, see
+	 * on_delete_range_before_cb().
+	 */
+	guint whole_lines_deleted : 1;
+
 	GHashTable *words;
 };
 
@@ -584,6 +589,22 @@ on_delete_range_before_cb (GtkTextBuffer                  *text_buffer,
 		gtk_text_region_destroy (buffer->priv->scan_region, TRUE);
 		buffer->priv->scan_region = gtk_text_region_new (text_buffer);
 	}
+
+	/* Whole lines, e.g. removed from the top of a log: the line following
+	 * them does not change, so its words are kept and it is not scanned
+	 * again.
+	 */
+	else if (gtk_text_iter_starts_line (start) &&
+		 gtk_text_iter_starts_line (end))
+	{
+		GtkTextRegion *remove_region;
+
+		remove_region = compute_remove_region (buffer, *start, *end);
+		remove_words_in_region (buffer, remove_region);
+		gtk_text_region_destroy (remove_region, TRUE);
+
+		buffer->priv->whole_lines_deleted = TRUE;
+	}
 	else
 	{
 		invalidate_region (buffer, start, end);
@@ -604,7 +625,14 @@ on_delete_range_after_cb (GtkTextBuffer                  *text_buffer,
 	 * the text deletion, the TextRegion is not removed from the scan
 	 * region. Hence two callbacks: before and after the text deletion.
 	 */
-	add_to_scan_region (buffer, start, end);
+	if (buffer->priv->whole_lines_deleted)
+	{
+		buffer->priv->whole_lines_deleted = FALSE;
+	}
+	else
+	{
+		add_to_scan_region (buffer, start, end);
+	}
 }
 
 static void
@@ -137,7 +137,6 @@
 /* For bracket matching */
 #define MAX_CHARS_BEFORE_FINDING_A_MATCH    10000
 
-#define TAG_CONTEXT_CLASS_NAME "GtkSourceViewTagContextClassName"
 
 /* Signals */
 enum {
@@ -157,6 +156,11 @@ enum {
 	PROP_HIGHLIGHT_SYNTAX,
 	PROP_HIGHLIGHT_MATCHING_BRACKETS,
 	PROP_MAX_UNDO_LEVELS,
+	PROP_MAX_HIGHLIGHT_LINE_LENGTH,
+	PROP_HIGHLIGHT_VISIBLE_ONLY,
+	PROP_HIGHLIGHT_SYNC_LINES,
+	PROP_APPEND_ONLY,
+	PROP_HIGHLIGHT_CACHE,
 	PROP_LANGUAGE,
 	PROP_STYLE_SCHEME,
 	PROP_UNDO_MANAGER
@@ -179,10 +183,16 @@ struct _GtkSourceBufferPrivate
 	GtkSourceUndoManager  *undo_manager;
 	gint                   max_undo_levels;
 
+	gint                   max_highlight_line_length;
+	gint                   highlight_sync_lines;
+
 	GList                 *search_contexts;
 
 	guint                  highlight_syntax : 1;
 	guint                  highlight_brackets : 1;
+	guint                  highlight_visible_only : 1;
+	guint                  append_only : 1;
+	guint                  highlight_cache : 1;
 	guint                  constructed : 1;
 	guint                  allow_bracket_match : 1;
 };
@@ -326,6 +336,98 @@ gtk_source_buffer_class_init (GtkSourceBufferClass *klass)
 							   1000,
 							   G_PARAM_READWRITE));
 
+	/**
+	 * GtkSourceBuffer:max-highlight-line-length:
+	 *
+	 * Number of bytes at the beginning of each line which are looked at
+	 * by syntax highlighting. The rest of a longer line gets the style
+	 * found at that point; contexts opened on that line end with it.
+	 * -1 means no limit.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_MAX_HIGHLIGHT_LINE_LENGTH,
+					 g_param_spec_int ("max-highlight-line-length",
+							   _("Maximum Highlight Line Length"),
+							   _("Number of bytes of each line "
+							     "to highlight"),
+							   -1,
+							   G_MAXINT,
+							   -1,
+							   G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceBuffer:highlight-visible-only:
+	 *
+	 * Whether syntax highlighting tags are kept only in the text shown
+	 * by the views, instead of in the whole buffer.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_HIGHLIGHT_VISIBLE_ONLY,
+					 g_param_spec_boolean ("highlight-visible-only",
+							       _("Highlight Visible Only"),
+							       _("Whether to keep syntax highlighting "
+								 "tags only in the visible text"),
+							       FALSE,
+							       G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceBuffer:highlight-sync-lines:
+	 *
+	 * Number of lines above the text to highlight from which syntax
+	 * analysis restarts, instead of analyzing the whole buffer from its
+	 * beginning. -1 means the whole buffer is analyzed.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_HIGHLIGHT_SYNC_LINES,
+					 g_param_spec_int ("highlight-sync-lines",
+							   _("Highlight Sync Lines"),
+							   _("Number of lines analyzed above "
+							     "the text to highlight"),
+							   -1,
+							   G_MAXINT,
+							   -1,
+							   G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceBuffer:append-only:
+	 *
+	 * Whether the buffer is used like a log: text is appended at the
+	 * end, and whole lines are removed from the beginning.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_APPEND_ONLY,
+					 g_param_spec_boolean ("append-only",
+							       _("Append Only"),
+							       _("Whether text is appended at the end "
+								 "and removed from the beginning"),
+							       FALSE,
+							       G_PARAM_READWRITE));
+
+	/**
+	 * GtkSourceBuffer:highlight-cache:
+	 *
+	 * Whether the syntax tree of the whole buffer is saved to, and
+	 * looked up in, a cache on disk.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_HIGHLIGHT_CACHE,
+					 g_param_spec_boolean ("highlight-cache",
+							       _("Highlight Cache"),
+							       _("Whether the syntax analysis is "
+								 "cached on disk"),
+							       FALSE,
+							       G_PARAM_READWRITE));
+
 	g_object_class_install_property (object_class,
 					 PROP_LANGUAGE,
 					 g_param_spec_object ("language",
@@ -511,6 +613,8 @@ gtk_source_buffer_init (GtkSourceBuffer *buffer)
 
 	priv->highlight_syntax = TRUE;
 	priv->highlight_brackets = TRUE;
+	priv->max_highlight_line_length = -1;
+	priv->highlight_sync_lines = -1;
 	priv->bracket_mark_cursor = NULL;
 	priv->bracket_mark_match = NULL;
 	priv->bracket_match = GTK_SOURCE_BRACKET_MATCH_NONE;
@@ -610,6 +714,31 @@ gtk_source_buffer_set_property (GObject      *object,
 							       g_value_get_int (value));
 			break;
 
+		case PROP_MAX_HIGHLIGHT_LINE_LENGTH:
+			gtk_source_buffer_set_max_highlight_line_length (source_buffer,
+									 g_value_get_int (value));
+			break;
+
+		case PROP_HIGHLIGHT_VISIBLE_ONLY:
+			gtk_source_buffer_set_highlight_visible_only (source_buffer,
+								      g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_SYNC_LINES:
+			gtk_source_buffer_set_highlight_sync_lines (source_buffer,
+								    g_value_get_int (value));
+			break;
+
+		case PROP_APPEND_ONLY:
+			gtk_source_buffer_set_append_only (source_buffer,
+							   g_value_get_boolean (value));
+			break;
+
+		case PROP_HIGHLIGHT_CACHE:
+			gtk_source_buffer_set_highlight_cache (source_buffer,
+							       g_value_get_boolean (value));
+			break;
+
 		case PROP_LANGUAGE:
 			gtk_source_buffer_set_language (source_buffer,
 							g_value_get_object (value));
@@ -660,6 +789,31 @@ gtk_source_buffer_get_property (GObject    *object,
 					 source_buffer->priv->max_undo_levels);
 			break;
 
+		case PROP_MAX_HIGHLIGHT_LINE_LENGTH:
+			g_value_set_int (value,
+					 source_buffer->priv->max_highlight_line_length);
+			break;
+
+		case PROP_HIGHLIGHT_VISIBLE_ONLY:
+			g_value_set_boolean (value,
+					     source_buffer->priv->highlight_visible_only);
+			break;
+
+		case PROP_HIGHLIGHT_SYNC_LINES:
+			g_value_set_int (value,
+					 source_buffer->priv->highlight_sync_lines);
+			break;
+
+		case PROP_APPEND_ONLY:
+			g_value_set_boolean (value,
+					     source_buffer->priv->append_only);
+			break;
+
+		case PROP_HIGHLIGHT_CACHE:
+			g_value_set_boolean (value,
+					     source_buffer->priv->highlight_cache);
+			break;
+
 		case PROP_LANGUAGE:
 			g_value_set_object (value, source_buffer->priv->language);
 			break;
@@ -1071,6 +1225,7 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 				     GtkTextIter   *end)
 {
 	gint offset, length;
+	gint n_lines = 0;
 	GtkTextMark *mark;
 	GtkTextIter iter;
 	GtkSourceBuffer *source_buffer = GTK_SOURCE_BUFFER (buffer);
@@ -1085,6 +1240,11 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 	offset = gtk_text_iter_get_offset (start);
 	length = gtk_text_iter_get_offset (end) - offset;
 
+	/* Whole lines deleted at the beginning, see
+	 * gtk_source_buffer_set_append_only(). */
+	if (gtk_text_iter_is_start (start) && gtk_text_iter_starts_line (end))
+		n_lines = gtk_text_iter_get_line (end);
+
 	GTK_TEXT_BUFFER_CLASS (gtk_source_buffer_parent_class)->delete_range (buffer, start, end);
 
 	mark = gtk_text_buffer_get_insert (buffer);
@@ -1092,7 +1252,10 @@ gtk_source_buffer_real_delete_range (GtkTextBuffer *buffer,
 	gtk_source_buffer_move_cursor (buffer, &iter, mark);
 
 	/* emit text deleted for engines */
-	if (source_buffer->priv->highlight_engine != NULL)
+	if (source_buffer->priv->highlight_engine != NULL && n_lines > 0)
+		_gtk_source_engine_text_truncated (source_buffer->priv->highlight_engine,
+						   length, n_lines);
+	else if (source_buffer->priv->highlight_engine != NULL)
 		_gtk_source_engine_text_deleted (source_buffer->priv->highlight_engine,
 						 offset, length);
 }
@@ -1359,6 +1522,289 @@ gtk_source_buffer_set_max_undo_levels (GtkSourceBuffer *buffer,
 	g_object_notify (G_OBJECT (buffer), "max-undo-levels");
 }
 
+/**
+ * gtk_source_buffer_get_max_highlight_line_length:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Returns the number of bytes at the beginning of each line which
+ * are looked at by syntax highlighting.
+ *
+ * Return value: the maximum length in bytes, or -1 if no limit is set.
+ *
+ * Since: 3.10
+ **/
+gint
+gtk_source_buffer_get_max_highlight_line_length (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), -1);
+
+	return buffer->priv->max_highlight_line_length;
+}
+
+/**
+ * gtk_source_buffer_set_max_highlight_line_length:
+ * @buffer: a #GtkSourceBuffer.
+ * @max_length: the maximum length in bytes, or -1.
+ *
+ * Limits syntax highlighting of long lines, such as the ones found in
+ * minified files, to the first @max_length bytes. The rest of a longer
+ * line gets the style found at that point, so only the beginning of the
+ * line is highlighted, but highlighting of the other lines does not have
+ * to wait for it.
+ *
+ * If @max_length is -1, no limit is set.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_set_max_highlight_line_length (GtkSourceBuffer *buffer,
+						 gint             max_length)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (max_length >= -1);
+
+	if (buffer->priv->max_highlight_line_length == max_length)
+	{
+		return;
+	}
+
+	buffer->priv->max_highlight_line_length = max_length;
+
+	g_object_notify (G_OBJECT (buffer), "max-highlight-line-length");
+}
+
+/**
+ * gtk_source_buffer_get_highlight_visible_only:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Determines whether syntax highlighting tags are kept only in the
+ * text shown by the views.
+ *
+ * Return value: %TRUE if tags are kept only in the visible text.
+ *
+ * Since: 3.10
+ **/
+gboolean
+gtk_source_buffer_get_highlight_visible_only (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_visible_only;
+}
+
+/**
+ * gtk_source_buffer_set_highlight_visible_only:
+ * @buffer: a #GtkSourceBuffer.
+ * @visible_only: %TRUE to keep syntax highlighting tags only in the
+ * visible text.
+ *
+ * Highlighting a big buffer puts a lot of tags in it, which take
+ * memory and make every insertion and deletion slower. If
+ * @visible_only is %TRUE, tags are applied to the text when a view
+ * shows it, and removed again from text which is not shown anymore,
+ * so only a bounded part of the buffer has them. The syntax
+ * analysis itself is still kept for the whole buffer, so text is
+ * highlighted right away when it is shown again.
+ *
+ * Context classes are not affected, so
+ * gtk_source_buffer_iter_has_context_class() works everywhere.
+ * Code reading the syntax tags of text which is not shown should
+ * call gtk_source_buffer_ensure_highlight() first.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_set_highlight_visible_only (GtkSourceBuffer *buffer,
+					      gboolean         visible_only)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+
+	visible_only = visible_only != FALSE;
+
+	if (buffer->priv->highlight_visible_only == visible_only)
+	{
+		return;
+	}
+
+	buffer->priv->highlight_visible_only = visible_only;
+
+	g_object_notify (G_OBJECT (buffer), "highlight-visible-only");
+}
+
+/**
+ * gtk_source_buffer_get_highlight_sync_lines:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Returns the number of lines above the text to highlight from which
+ * syntax analysis restarts.
+ *
+ * Return value: the number of lines, or -1 if the whole buffer is
+ * analyzed.
+ *
+ * Since: 3.10
+ **/
+gint
+gtk_source_buffer_get_highlight_sync_lines (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), -1);
+
+	return buffer->priv->highlight_sync_lines;
+}
+
+/**
+ * gtk_source_buffer_set_highlight_sync_lines:
+ * @buffer: a #GtkSourceBuffer.
+ * @sync_lines: the number of lines, or -1.
+ *
+ * Syntax highlighting of a line normally needs the whole text above
+ * it to be analyzed, which never finishes in practice for huge files
+ * such as logs opened at their end. If @sync_lines is not -1, only
+ * the text shown by the views and the text passed to
+ * gtk_source_buffer_ensure_highlight() is analyzed, each time
+ * restarting from the top level context of the language @sync_lines
+ * lines above it. Memory and CPU use then do not depend on the size
+ * of the buffer, but a construct which started more than @sync_lines
+ * lines above, like a long comment, may be highlighted wrongly.
+ *
+ * In this mode no syntax tree is kept, so
+ * gtk_source_buffer_iter_has_context_class() and the related functions
+ * find no context class, and syntax tags are kept only in the text
+ * shown by the views, like with
+ * gtk_source_buffer_set_highlight_visible_only().
+ *
+ * If @sync_lines is -1, the whole buffer is analyzed.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_set_highlight_sync_lines (GtkSourceBuffer *buffer,
+					    gint             sync_lines)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (sync_lines >= -1);
+
+	if (buffer->priv->highlight_sync_lines == sync_lines)
+	{
+		return;
+	}
+
+	buffer->priv->highlight_sync_lines = sync_lines;
+
+	g_object_notify (G_OBJECT (buffer), "highlight-sync-lines");
+}
+
+/**
+ * gtk_source_buffer_get_append_only:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Determines whether the buffer is optimized for text appended at the
+ * end and removed from the beginning.
+ *
+ * Return value: %TRUE if the buffer is in append-only mode.
+ *
+ * Since: 3.10
+ **/
+gboolean
+gtk_source_buffer_get_append_only (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->append_only;
+}
+
+/**
+ * gtk_source_buffer_set_append_only:
+ * @buffer: a #GtkSourceBuffer.
+ * @append_only: %TRUE to optimize for text appended at the end and
+ * removed from the beginning.
+ *
+ * Buffers showing logs get text appended at their end, and lose whole
+ * lines at their beginning to keep their size bounded. If @append_only
+ * is %TRUE, such changes cost only as much as the text appended or
+ * removed: only the new lines are analyzed by syntax highlighting,
+ * and the syntax tree of the remaining text is kept when lines are
+ * removed from the beginning, if no context spans the removed text
+ * and the rest. Search contexts and the words completion provider
+ * scan again only the lines next to the change, even for regex
+ * searches, so a regex match spanning more lines may be missed.
+ *
+ * The buffer can still be modified anywhere else, such changes are
+ * not optimized.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_set_append_only (GtkSourceBuffer *buffer,
+				   gboolean         append_only)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+
+	append_only = append_only != FALSE;
+
+	if (buffer->priv->append_only == append_only)
+	{
+		return;
+	}
+
+	buffer->priv->append_only = append_only;
+
+	g_object_notify (G_OBJECT (buffer), "append-only");
+}
+
+/**
+ * gtk_source_buffer_get_highlight_cache:
+ * @buffer: a #GtkSourceBuffer.
+ *
+ * Determines whether the syntax analysis of the buffer is cached on
+ * disk.
+ *
+ * Return value: %TRUE if the highlight cache is used.
+ *
+ * Since: 3.10
+ **/
+gboolean
+gtk_source_buffer_get_highlight_cache (GtkSourceBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
+
+	return buffer->priv->highlight_cache;
+}
+
+/**
+ * gtk_source_buffer_set_highlight_cache:
+ * @buffer: a #GtkSourceBuffer.
+ * @highlight_cache: %TRUE to cache the syntax analysis on disk.
+ *
+ * If @highlight_cache is %TRUE, the syntax tree built by the analysis
+ * of the whole buffer is saved in the user cache directory, see
+ * g_get_user_cache_dir(). When text is loaded in an empty buffer
+ * later, and it is the same text as a saved one, highlighted with the
+ * same versions of the language definitions, the syntax tree is read
+ * back in a separate thread instead of analyzing the text again.
+ *
+ * Set it before loading the text. The least recently used cache files
+ * are removed when the cache directory grows over 64 MB.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_set_highlight_cache (GtkSourceBuffer *buffer,
+				       gboolean         highlight_cache)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+
+	highlight_cache = highlight_cache != FALSE;
+
+	if (buffer->priv->highlight_cache == highlight_cache)
+	{
+		return;
+	}
+
+	buffer->priv->highlight_cache = highlight_cache;
+
+	g_object_notify (G_OBJECT (buffer), "highlight-cache");
+}
+
 /**
  * gtk_source_buffer_begin_not_undoable_action:
  * @buffer: a #GtkSourceBuffer.
@@ -2346,8 +2792,6 @@ gtk_source_buffer_iter_has_context_class (GtkSourceBuffer   *buffer,
                                           const GtkTextIter *iter,
                                           const gchar       *context_class)
 {
-	GtkTextTag *tag;
-
 	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
@@ -2357,17 +2801,9 @@ gtk_source_buffer_iter_has_context_class (GtkSourceBuffer   *buffer,
 		return FALSE;
 	}
 
-	tag = _gtk_source_engine_get_context_class_tag (buffer->priv->highlight_engine,
-							context_class);
-
-	if (tag != NULL)
-	{
-		return gtk_text_iter_has_tag (iter, tag);
-	}
-	else
-	{
-		return FALSE;
-	}
+	return _gtk_source_engine_iter_has_context_class (buffer->priv->highlight_engine,
+							  iter,
+							  context_class);
 }
 
 /**
@@ -2389,31 +2825,16 @@ gchar **
 gtk_source_buffer_get_context_classes_at_iter (GtkSourceBuffer   *buffer,
                                                const GtkTextIter *iter)
 {
-	GSList *tags;
-	GSList *item;
-	GPtrArray *ret;
-
 	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), NULL);
 	g_return_val_if_fail (iter != NULL, NULL);
 
-	tags = gtk_text_iter_get_tags (iter);
-	ret = g_ptr_array_new ();
-
-	for (item = tags; item; item = g_slist_next (item))
+	if (buffer->priv->highlight_engine == NULL)
 	{
-		gchar const *name = g_object_get_data (G_OBJECT (item->data),
-		                                       TAG_CONTEXT_CLASS_NAME);
-
-		if (name != NULL)
-		{
-			g_ptr_array_add (ret, g_strdup (name));
-		}
+		return g_new0 (gchar *, 1);
 	}
 
-	g_slist_free (tags);
-
-	g_ptr_array_add (ret, NULL);
-	return (gchar **) g_ptr_array_free (ret, FALSE);
+	return _gtk_source_engine_get_context_classes_at_iter (buffer->priv->highlight_engine,
+							       iter);
 }
 
 /**
@@ -2439,8 +2860,6 @@ gtk_source_buffer_iter_forward_to_context_class_toggle (GtkSourceBuffer *buffer,
                                                         GtkTextIter     *iter,
                                                         const gchar     *context_class)
 {
-	GtkTextTag *tag;
-
 	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
@@ -2450,17 +2869,9 @@ gtk_source_buffer_iter_forward_to_context_class_toggle (GtkSourceBuffer *buffer,
 		return FALSE;
 	}
 
-	tag = _gtk_source_engine_get_context_class_tag (buffer->priv->highlight_engine,
-							context_class);
-
-	if (tag == NULL)
-	{
-		return FALSE;
-	}
-	else
-	{
-		return gtk_text_iter_forward_to_tag_toggle (iter, tag);
-	}
+	return _gtk_source_engine_iter_forward_to_context_class_toggle (buffer->priv->highlight_engine,
+									iter,
+									context_class);
 }
 
 /**
@@ -2486,8 +2897,6 @@ gtk_source_buffer_iter_backward_to_context_class_toggle (GtkSourceBuffer *buffer
                                                          GtkTextIter     *iter,
                                                          const gchar     *context_class)
 {
-	GtkTextTag *tag;
-
 	g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), FALSE);
 	g_return_val_if_fail (iter != NULL, FALSE);
 	g_return_val_if_fail (context_class != NULL, FALSE);
@@ -2497,17 +2906,58 @@ gtk_source_buffer_iter_backward_to_context_class_toggle (GtkSourceBuffer *buffer
 		return FALSE;
 	}
 
-	tag = _gtk_source_engine_get_context_class_tag (buffer->priv->highlight_engine,
-							context_class);
+	return _gtk_source_engine_iter_backward_to_context_class_toggle (buffer->priv->highlight_engine,
+									 iter,
+									 context_class);
+}
 
-	if (tag == NULL)
-	{
-		return FALSE;
-	}
-	else
+/**
+ * gtk_source_buffer_foreach_token:
+ * @buffer: a #GtkSourceBuffer.
+ * @start: start of the region.
+ * @end: end of the region.
+ * @func: (scope call): function called for each token.
+ * @user_data: user data passed to @func.
+ *
+ * Calls @func for each token of the syntax highlighting between @start
+ * and @end, i.e. for each part of the text which has a style or
+ * context classes. The region is analyzed first if needed, but no tags
+ * are applied to it, so this is cheaper than walking the tags with
+ * gtk_text_iter_forward_to_tag_toggle().
+ *
+ * Tokens are nested: a string may contain an escape character, and
+ * the whole text has the context classes of the language, if any. They
+ * are given in order of their beginning, and a token is given before
+ * the ones nested in it. Tokens crossing @start or @end are cut there.
+ * @context_classes are all the classes of the token, including the
+ * ones it takes from the tokens containing it.
+ *
+ * The buffer must not be modified by @func.
+ *
+ * Since: 3.10
+ **/
+void
+gtk_source_buffer_foreach_token (GtkSourceBuffer    *buffer,
+				 const GtkTextIter  *start,
+				 const GtkTextIter  *end,
+				 GtkSourceTokenFunc  func,
+				 gpointer            user_data)
+{
+	g_return_if_fail (GTK_SOURCE_IS_BUFFER (buffer));
+	g_return_if_fail (start != NULL);
+	g_return_if_fail (end != NULL);
+	g_return_if_fail (func != NULL);
+
+	if (buffer->priv->highlight_engine == NULL)
 	{
-		return gtk_text_iter_backward_to_tag_toggle (iter, tag);
+		return;
 	}
+
+	_gtk_source_engine_foreach_token (buffer->priv->highlight_engine,
+					  start,
+					  end,
+					  func,
+					  user_data);
 }
 
 /**
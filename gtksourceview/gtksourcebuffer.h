@@ -56,6 +56,29 @@ typedef enum
 	GTK_SOURCE_BRACKET_MATCH_FOUND
 } GtkSourceBracketMatchType;
 
+/**
+ * GtkSourceTokenFunc:
+ * @buffer: the #GtkSourceBuffer.
+ * @start_offset: the offset of the beginning of the token.
+ * @end_offset: the offset of the end of the token.
+ * @style_id: (allow-none): the id of the style of the token, or %NULL.
+ * @context_classes: (array zero-terminated=1): the context classes of
+ * the token.
+ * @user_data: user data passed to gtk_source_buffer_foreach_token().
+ *
+ * Function called for each token by gtk_source_buffer_foreach_token().
+ * @style_id and @context_classes are owned by the buffer and are only
+ * valid during the call.
+ *
+ * Since: 3.10
+ */
+typedef void (* GtkSourceTokenFunc) (GtkSourceBuffer     *buffer,
+				     gint                 start_offset,
+				     gint                 end_offset,
+				     const gchar         *style_id,
+				     const gchar * const *context_classes,
+				     gpointer             user_data);
+
 struct _GtkSourceBuffer
 {
 	GtkTextBuffer parent_instance;
@@ -104,6 +127,31 @@ gint			 gtk_source_buffer_get_max_undo_levels			(GtkSourceBuffer        *buffer)
 void			 gtk_source_buffer_set_max_undo_levels			(GtkSourceBuffer        *buffer,
 										 gint                    max_undo_levels);
 
+gint			 gtk_source_buffer_get_max_highlight_line_length	(GtkSourceBuffer        *buffer);
+
+void			 gtk_source_buffer_set_max_highlight_line_length	(GtkSourceBuffer        *buffer,
+										 gint                    max_length);
+
+gboolean		 gtk_source_buffer_get_highlight_visible_only		(GtkSourceBuffer        *buffer);
+
+void			 gtk_source_buffer_set_highlight_visible_only		(GtkSourceBuffer        *buffer,
+										 gboolean                visible_only);
+
+gint			 gtk_source_buffer_get_highlight_sync_lines		(GtkSourceBuffer        *buffer);
+
+void			 gtk_source_buffer_set_highlight_sync_lines		(GtkSourceBuffer        *buffer,
+										 gint                    sync_lines);
+
+gboolean		 gtk_source_buffer_get_append_only			(GtkSourceBuffer        *buffer);
+
+void			 gtk_source_buffer_set_append_only			(GtkSourceBuffer        *buffer,
+										 gboolean                append_only);
+
+gboolean		 gtk_source_buffer_get_highlight_cache			(GtkSourceBuffer        *buffer);
+
+void			 gtk_source_buffer_set_highlight_cache			(GtkSourceBuffer        *buffer,
+										 gboolean                highlight_cache);
+
 GtkSourceLanguage 	*gtk_source_buffer_get_language				(GtkSourceBuffer        *buffer);
 
 void			 gtk_source_buffer_set_language				(GtkSourceBuffer        *buffer,
@@ -175,6 +223,12 @@ gboolean		 gtk_source_buffer_iter_backward_to_context_class_toggle
 										 GtkTextIter		*iter,
 										 const gchar		*context_class);
 
+void			 gtk_source_buffer_foreach_token			(GtkSourceBuffer	*buffer,
+										 const GtkTextIter	*start,
+										 const GtkTextIter	*end,
+										 GtkSourceTokenFunc	 func,
+										 gpointer		 user_data);
+
 GtkSourceUndoManager	*gtk_source_buffer_get_undo_manager			(GtkSourceBuffer	*buffer);
 
 void			 gtk_source_buffer_set_undo_manager			(GtkSourceBuffer	*buffer,
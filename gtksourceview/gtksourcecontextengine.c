@@ -22,6 +22,7 @@
 
 #include <string.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "gtksourceview-i18n.h"
 #include "gtksourcecontextengine.h"
 #include "gtktextregion.h"
@@ -63,17 +64,72 @@
 
 /* Priority of long running idle which is used to analyze whole buffer, if
  * the engine wasn't quick enough to analyze it in one shot. */
-/* FIXME this priority is low, since we don't want to block other gui stuff.
- * But, e.g. if we have a big file, and scroll down, we do want the engine
- * to analyze quickly. Perhaps we want to reinstall first_update in case
- * of expose events or something. */
+/* This priority is low, since we don't want to block other gui stuff.
+ * The visible area is taken care of in update_highlight, see
+ * highlight_window(). */
 #define INCREMENTAL_UPDATE_PRIORITY	G_PRIORITY_LOW
 
 /* Maximal amount of time allowed to spent in one cycle of background idle. */
 #define INCREMENTAL_UPDATE_TIME_SLICE	30
 
-/* Maximal amount of time allowed to spent highlihting a single line. If it
- * is not enough, then highlighting is disabled. */
+/* Maximal amount of time allowed to spent analyzing the visible area when
+ * a frame is drawn. Should leave enough of the frame for drawing itself. */
+#define FRAME_UPDATE_TIME_SLICE		8
+
+/* Number of lines analyzed above the visible area when it is far from the
+ * analyzed text, in hope that the state is the same there as in the
+ * root context. */
+#define RESYNC_LINES			50
+
+/* Buffers with at least this many characters which cannot be analyzed in
+ * the first idle are analyzed from scratch in a separate thread. */
+#define BACKGROUND_ANALYSIS_MIN_CHARS	(256 * 1024)
+
+/* Minimal length in bytes of the chunks of text which the background
+ * analysis hands to other threads, see split_background_analysis_(). */
+#define PARALLEL_ANALYSIS_MIN_BYTES	(256 * 1024)
+
+/* Number of characters which may keep syntax tags out of the area
+ * last highlighted when GtkSourceBuffer:highlight-visible-only is set. */
+#define HIDDEN_TAGS_MAX_CHARS		(128 * 1024)
+
+/* Number of nodes in a block allocated by NodePool. */
+#define NODE_POOL_BLOCK_SIZE		128
+
+/* Maximal number of lines in the line cache, and maximal length in
+ * bytes of a line to be put there. */
+#define LINE_CACHE_SIZE			256
+#define LINE_CACHE_MAX_LINE_LENGTH	1024
+
+/* Number of lines fetched at once from the buffer by get_line_info(). */
+#define LINE_CHUNK_LINES		256
+
+/* Maximal length in bytes of a word in a KeywordSet. */
+#define KEYWORD_MAX_LENGTH		64
+
+/* Maximal number of separate invalid regions, see invalidate_region(). */
+#define INVALID_REGIONS_MAX		64
+
+/* Distance in lines between line states, see set_line_state(). */
+#define LINE_STATE_INTERVAL		64
+
+/* Version and GVariant type of highlight cache files, see
+ * save_highlight_cache(). */
+#define HIGHLIGHT_CACHE_VERSION		2
+#define HIGHLIGHT_CACHE_FORMAT		"(usssiiia(iis)a(iiiiiib)a(iuii)a(ii))"
+
+/* Key of the engine in the data of the buffer, see
+ * _gtk_source_context_engine_get_for_buffer(). */
+#define ENGINE_DATA_KEY			"gtk-source-context-engine"
+
+/* Size in bytes above which the least recently used highlight cache
+ * files are removed, see prune_highlight_cache_(). */
+#define HIGHLIGHT_CACHE_MAX_SIZE	(64 * 1024 * 1024)
+
+/* Maximal amount of time allowed to spent highlihting a single line when
+ * there is no time limit. If it is not enough, contexts are not looked for
+ * in the rest of the line. If a single step of the analysis takes this much
+ * time, then highlighting is disabled. */
 #define MAX_TIME_FOR_ONE_LINE		2000
 
 #define GTK_SOURCE_CONTEXT_ENGINE_ERROR (gtk_source_context_engine_error_quark ())
@@ -110,7 +166,12 @@
 #define SEGMENT_IS_SIMPLE(s) CONTEXT_IS_SIMPLE ((s)->context)
 #define SEGMENT_IS_CONTAINER(s) CONTEXT_IS_CONTAINER ((s)->context)
 
-#define TAG_CONTEXT_CLASS_NAME "GtkSourceViewTagContextClassName"
+/* Is there a single context of this definition for a given parent? Not if
+ * the end regex refers to the start match, see create_child_context(). */
+#define DEFINITION_IS_FIXED(def) \
+	((def)->type != CONTEXT_TYPE_CONTAINER || \
+	 (def)->u.start_end.end == NULL || \
+	 _gtk_source_regex_is_resolved ((def)->u.start_end.end))
 
 typedef struct _SubPatternDefinition SubPatternDefinition;
 typedef struct _SubPattern SubPattern;
@@ -122,7 +183,16 @@ typedef struct _DefinitionChild DefinitionChild;
 typedef struct _DefinitionsIter DefinitionsIter;
 typedef struct _LineInfo LineInfo;
 typedef struct _InvalidRegion InvalidRegion;
-typedef struct _ContextClassTag ContextClassTag;
+typedef struct _BackgroundAnalysis BackgroundAnalysis;
+typedef struct _AnalysisChunk AnalysisChunk;
+typedef struct _LineState LineState;
+typedef struct _NodePool NodePool;
+typedef struct _PartialLine PartialLine;
+typedef struct _CachedSegment CachedSegment;
+typedef struct _LineCacheEntry LineCacheEntry;
+typedef struct _KeywordSet KeywordSet;
+typedef struct _CacheWriter CacheWriter;
+typedef struct _CacheSave CacheSave;
 
 typedef enum {
 	GTK_SOURCE_CONTEXT_ENGINE_ERROR_DUPLICATED_ID = 0,
@@ -178,10 +248,32 @@ struct _ContextDefinition
 	 * context. */
 	GtkSourceRegex		*reg_all;
 
+	/* Words matched by a simple context whose regex is a plain list
+	 * of keywords, see keyword_set_new_from_pattern(). */
+	KeywordSet		*keywords;
+
+	/* Union of the keyword sets of the children, whose regexes are
+	 * not included in reg_all. See get_child_keywords(). */
+	KeywordSet		*child_keywords;
+	gint			 child_keywords_ready;
+
 	guint			flags : 8;
 	guint			ref_count : 24;
 };
 
+/* Keywords which are looked up in a hash table instead of being matched
+ * by the regex, which is still used to confirm a match. */
+struct _KeywordSet
+{
+	/* Keywords matched case sensitively. */
+	GHashTable		*words;
+
+	/* Keywords matched case insensitively, lower case. */
+	GHashTable		*folded_words;
+
+	gsize			 max_length;
+};
+
 struct _SubPatternDefinition
 {
 #ifdef NEED_DEBUG_ID
@@ -252,12 +344,6 @@ struct _Context
 	GtkTextTag		*tag;
 	GtkTextTag	       **subpattern_tags;
 
-	/* Cache for generated list of class tags */
-	GSList                  *context_classes;
-
-	/* Cache for generated list of subpattern class tags */
-	GSList                 **subpattern_context_classes;
-
 	guint			 ref_count;
 	/* see context_freeze() */
 	guint                    frozen : 1;
@@ -313,6 +399,8 @@ struct _Segment
 	/* Whether this segment is a whole good segment, or it's an
 	 * an end of bigger one left after erase_segments() call. */
 	guint			 is_start : 1;
+	/* Number of line states pointing to it. */
+	guint			 line_states : 30;
 };
 
 struct _SubPattern
@@ -353,11 +441,90 @@ struct _LineInfo
 	/* Length of the line text not including line terminator */
 	gint			 char_length;
 	gint			 byte_length;
+	/* Last position converted by line_pos_to_offset(), in bytes
+	 * and in characters. Not used if the line is ASCII, i.e. if
+	 * char_length == byte_length. */
+	gint			 last_byte_pos;
+	gint			 last_char_pos;
+};
+
+/* The state at the beginning of a line: the segment which contains
+ * the preceding line terminator. Its context (contexts are shared
+ * between segments) stands for the whole stack of contexts. */
+struct _LineState
+{
+	gint			 line;
+	Segment			*segment;
+};
+
+/* A line whose analysis was interrupted because update_syntax() ran out
+ * of time, see analyze_line(). */
+struct _PartialLine
+{
+	/* The line, its text points to @text. */
+	LineInfo		 line;
+	gchar			*text;
+	/* Where to continue: position in the line, bytes, and the state
+	 * there. */
+	gint			 line_pos;
+	Segment			*state;
+};
+
+/* Copy of a segment created by analyze_line(), with offsets relative
+ * to the start of the line. */
+struct _CachedSegment
+{
+	Context			*context;
+	gint			 start_at;
+	gint			 end_at;
+	gint			 start_len;
+	gint			 end_len;
+	guint			 is_start : 1;
+
+	/* Sub patterns with relative offsets, in reverse order. */
+	SubPattern		*sub_patterns;
+	CachedSegment		*children;
+	CachedSegment		*next;
+};
+
+/* Result of analysis of a line which starts and ends in the same
+ * segment, see line_cache_lookup(). */
+struct _LineCacheEntry
+{
+	/* The key: context of the segment and line text. */
+	Context			*context;
+	gchar			*text;
+	gint			 byte_length;
+	guint			 hash;
+
+	/* Segments created in the line, children of the segment. */
+	CachedSegment		*children;
+	/* Sub patterns added to the segment itself. */
+	SubPattern		*sub_patterns;
+
+	/* Link in line_cache_queue. */
+	GList			*link;
+};
+
+/* Allocator for segments and sub patterns of one engine: nodes are
+ * cut from big blocks and freed nodes are kept in a list for reuse,
+ * so that the whole tree can be released at once. */
+struct _NodePool
+{
+	gsize			 node_size;
+	GSList			*blocks;
+	GSList			*last_block;
+	/* Number of never used nodes at the end of the first block. */
+	guint			 n_unused;
+	/* Singly linked through the first pointer of a node. The last
+	 * node is kept so that node_pool_merge() does not walk the list. */
+	gpointer		 free_list;
+	gpointer		 free_tail;
 };
 
+/* Text changed since the tree was last updated, see update_tree(). */
 struct _InvalidRegion
 {
-	gboolean		 empty;
 	GtkTextMark		*start;
 	GtkTextMark		*end;
 	/* offset_at(end) - delta == original offset,
@@ -371,12 +538,6 @@ struct _GtkSourceContextClass
 	gboolean  enabled;
 };
 
-struct _ContextClassTag
-{
-	GtkTextTag *tag;
-	gboolean enabled;
-};
-
 struct _GtkSourceContextData
 {
 	guint			 ref_count;
@@ -385,6 +546,126 @@ struct _GtkSourceContextData
 
 	/* Contains every ContextDefinition indexed by its id. */
 	GHashTable		*definitions;
+
+	/* reg_all regexes of contexts whose transitions depend on their
+	 * ancestors, indexed by the definitions they are built from, see
+	 * create_reg_all() and reg_all_key(). Only those which do not
+	 * contain text matched by start regexes are kept. */
+	GHashTable		*regexes;
+
+	/* Regexes and reg_all caches in the definitions are shared by all
+	 * engines using this language, including background analysis
+	 * threads, so they may only be used with this lock held. Threads
+	 * with a regex slot of their own match regexes without it, see
+	 * _gtk_source_regex_acquire_thread_slot(), the caches are still
+	 * filled with the lock held. */
+	GRecMutex		 lock;
+};
+
+/* Whole buffer analysis done in a separate thread, see
+ * start_background_analysis(). */
+struct _BackgroundAnalysis
+{
+	GtkSourceContextEngine	*ce;
+
+	/* Engine which owns the syntax tree being built, it is not
+	 * attached to any buffer. */
+	GtkSourceContextEngine	*scratch;
+
+	/* Snapshot of buffer text, and its end. */
+	gchar			*text;
+	const gchar		*text_end;
+
+	/* Chunks of the snapshot analyzed by other threads at the same
+	 * time, the thread itself analyzes the text before the first one.
+	 * There are chunks only if the thread has a regex slot, see
+	 * split_background_analysis_(). */
+	AnalysisChunk		*chunks;
+	guint			 n_chunks;
+	gint			 regex_slot;
+
+	/* Languages of the highlight cache file the thread reads the tree
+	 * from before analyzing the snapshot, or %NULL if the cache is not
+	 * looked up, see load_highlight_cache(). The number of lines and
+	 * characters of the snapshot, whether the tree was read, and
+	 * whether a cache file was found but did not match the snapshot. */
+	gchar			*cache_languages;
+	gint			 n_lines;
+	gint			 char_count;
+	gboolean		 loaded;
+	gboolean		 rejected;
+
+	GThread			*thread;
+	/* Source attached before the thread starts, which the thread
+	 * makes ready when it is done. Only the main thread attaches
+	 * and destroys it. */
+	GSource			*done_source;
+	gint			 cancelled;
+};
+
+/* Part of the text snapshot analyzed speculatively by a thread of its
+ * own, starting in the root context, see verify_chunk_(). */
+struct _AnalysisChunk
+{
+	BackgroundAnalysis	*bg;
+
+	/* Engine which owns the syntax tree of the chunk. Offsets and
+	 * line numbers in it are relative to the beginning of the chunk. */
+	GtkSourceContextEngine	*scratch;
+
+	/* The chunk begins at the beginning of a line and ends after a line
+	 * terminator, or at the end of the snapshot. */
+	const gchar		*text;
+	const gchar		*text_end;
+
+	/* Length of the chunk in characters, number of line terminators
+	 * in it, and the state at its end. */
+	gint			 char_count;
+	gint			 n_lines;
+	Segment			*state;
+
+	/* First top level segment of the chunk tree which does not end
+	 * before the line being verified, see chunk_in_sync_at_(). */
+	Segment			*cursor;
+
+	GThread			*thread;
+	gint			 regex_slot;
+};
+
+/* Syntax tree being serialized by save_highlight_cache(). */
+struct _CacheWriter
+{
+	/* Contexts and segments written so far, mapped to their
+	 * index in the cache file plus one. */
+	GHashTable		*contexts;
+	GHashTable		*segments;
+
+	GVariantBuilder		 contexts_builder;
+	GVariantBuilder		 segments_builder;
+	GVariantBuilder		 sub_patterns_builder;
+
+	/* Whether the tree cannot be saved. */
+	gboolean		 failed;
+};
+
+/* Highlight cache file written by a separate thread, so that the text
+ * checksum and the file system are not waited for, see
+ * save_highlight_cache(). */
+struct _CacheSave
+{
+	/* Snapshot of buffer text. */
+	gchar			*text;
+
+	gchar			*lang_id;
+	gchar			*languages;
+	gint			 max_line_length;
+	gint			 n_lines;
+	gint			 char_count;
+
+	GVariant		*contexts;
+	GVariant		*segments;
+	GVariant		*sub_patterns;
+	GVariant		*line_states;
 };
 
 struct _GtkSourceContextEnginePrivate
@@ -400,8 +681,6 @@ struct _GtkSourceContextEnginePrivate
 	 * tag priorities */
 	guint			 n_tags;
 
-	GHashTable		*context_classes;
-
 	/* Whether or not to actually highlight the buffer. */
 	gboolean		 highlight;
 
@@ -410,6 +689,16 @@ struct _GtkSourceContextEnginePrivate
 
 	/* Region covering the unhighlighted text. */
 	GtkTextRegion		*refresh_region;
+	/* Region highlighted ahead of the analysis, see highlight_window(). */
+	GtkTextRegion		*provisional_region;
+	/* Tree analyzed by highlight_window(), kept between frames along
+	 * with the offset and the state where its analysis stopped. */
+	GtkSourceContextEngine	*window_scratch;
+	gint			 window_end;
+	Segment			*window_state;
+	/* Region which has syntax tags, or NULL if it is not tracked,
+	 * see forget_hidden_tags(). */
+	GtkTextRegion		*tagged_region;
 
 	/* Tree of contexts. */
 	Context			*root_context;
@@ -419,12 +708,110 @@ struct _GtkSourceContextEnginePrivate
 
 	/* list of Segment* */
 	GSList			*invalid;
-	InvalidRegion		 invalid_region;
+	/* InvalidRegion's, sorted and disjoint. */
+	GArray			*invalid_regions;
+
+	/* LineState's for every LINE_STATE_INTERVAL'th line, sorted by
+	 * line, and number of lines in the buffer they correspond to. */
+	GArray			*line_states;
+	gint			 n_lines;
+	/* Destroyed segments still pointed to by line_states, see
+	 * forget_dropped_segments(). */
+	GPtrArray		*dropped_segments;
+
+	/* Memory for the syntax tree. */
+	NodePool		 segment_pool;
+	NodePool		 sub_pattern_pool;
+
+	/* LineCacheEntry's, and the queue of them with the least
+	 * recently used ones at the head. */
+	GHashTable		*line_cache;
+	GQueue			 line_cache_queue;
+	guint			 line_cache_hits;
+	guint			 line_cache_misses;
+
+	/* Number of calls to gtk_text_buffer_apply_tag() and
+	 * gtk_text_buffer_remove_tag() made by update_tags(), and
+	 * number of calls it avoided compared to removing every tag
+	 * and applying them again. */
+	guint			 tag_operations;
+	guint			 tag_operations_saved;
+
+	/* Number of lines analyze_line() was called on from their
+	 * beginning, including the ones found in the line cache and the
+	 * ones analyzed in other threads, see finish_background_analysis(). */
+	guint			 lines_analyzed;
 
 	guint			 first_update;
 	guint			 incremental_update;
+
+	/* Analysis running in a separate thread, or NULL. */
+	BackgroundAnalysis	*background;
+
+	/* Number of chunks background analyses are split into, or 0 for
+	 * one per processor; and number of chunks analyzed by threads
+	 * other than the first one, see split_background_analysis_(). */
+	guint			 parallel_chunks;
+	guint			 chunks_analyzed;
+
+	/* Line to be analyzed first by update_syntax(), or NULL. */
+	PartialLine		*partial_line;
+
+	/* Text following the last line fetched by get_line_info(),
+	 * from chunk_pos in bytes, which is at chunk_offset in the
+	 * buffer; or NULL if the buffer changed since it was fetched. */
+	gchar			*chunk;
+	gint			 chunk_pos;
+	gint			 chunk_offset;
+
+	/* Text of the line being analyzed, reused for every line. */
+	gchar			*line_text;
+	gsize			 line_text_size;
+
+	/* Number of bytes at the beginning of a line in which contexts
+	 * are looked for, or -1 if there is no limit. */
+	gint			 max_line_length;
+
+	/* Whether the tree is built from text which does not begin at the
+	 * beginning of the buffer, so that its first line is not the first
+	 * one, see split_background_analysis_(). */
+	gboolean		 no_first_line;
+
+	/* Number of lines above the highlighted text from which it is
+	 * analyzed, or -1 if the whole buffer is analyzed, see
+	 * highlight_window(). */
+	gint			 sync_lines;
+
+	/* Whether text is appended at the end and truncated at the
+	 * beginning of the buffer, see append_range_() and
+	 * truncate_tree_(). */
+	gboolean		 append_only;
+
+	/* Whether the syntax tree is kept in the highlight cache, and
+	 * whether the cache is to be looked up before analyzing the
+	 * text, or the tree saved once it is analyzed. See
+	 * load_highlight_cache() and save_highlight_cache(). */
+	gboolean		 highlight_cache;
+	guint			 cache_load_pending : 1;
+	guint			 cache_save_pending : 1;
+	/* Number of trees read from the cache, and of cache files
+	 * found but ignored, see read_highlight_cache_(). */
+	guint			 cache_loads;
+	guint			 cache_rejects;
+	/* Thread writing the tree, see save_highlight_cache(). */
+	GThread			*cache_save_thread;
 };
 
+/* Number of reg_all regexes compiled and reused by create_reg_all()
+ * in all languages, and time spent compiling them. */
+static struct
+{
+	GMutex			 lock;
+	guint			 compiled;
+	guint			 reused;
+	gdouble			 compile_time;
+} reg_all_stats;
+
 #ifdef ENABLE_CHECK_TREE
 static void check_tree (GtkSourceContextEngine *ce);
 static void check_segment_list (Segment *segment);
@@ -453,12 +840,17 @@ static Segment	       *segment_new		(GtkSourceContextEngine *ce,
 						 gint			 start_at,
 						 gint			 end_at,
 						 gboolean		 is_start);
-static Context	       *context_new		(Context		*parent,
+static gint		line_pos_to_offset	(LineInfo		*line,
+						 gint			 pos);
+static Context	       *context_new		(GtkSourceContextEngine	*ce,
+						 Context		*parent,
 						 ContextDefinition	*definition,
 						 const gchar		*line_text,
 						 const gchar		*style,
 						 gboolean                ignore_children_style);
 static void		context_unref		(Context		*context);
+static void		context_free_		(Context		*context);
+static void		context_destroy_tree_	(Context		*context);
 static void		context_freeze		(Context		*context);
 static void		context_thaw		(Context		*context);
 static void		erase_segments		(GtkSourceContextEngine *ce,
@@ -476,6 +868,7 @@ static void		find_insertion_place	(Segment		*segment,
 						 Segment		*hint);
 static void		segment_destroy		(GtkSourceContextEngine	*ce,
 						 Segment		*segment);
+static void		segment_tree_destroy	(GtkSourceContextEngine	*ce);
 static ContextDefinition *context_definition_ref(ContextDefinition	*definition);
 static void		context_definition_unref(ContextDefinition	*definition);
 
@@ -492,8 +885,65 @@ static void		definition_iter_destroy	(DefinitionsIter	*iter);
 static void		update_syntax		(GtkSourceContextEngine	*ce,
 						 const GtkTextIter	*end,
 						 gint			 time);
+static void		update_line_states	(GtkSourceContextEngine *ce,
+						 gint			 start_line,
+						 gint			 end_line);
+static void		clear_line_states	(GtkSourceContextEngine *ce);
+static void		partial_line_free	(GtkSourceContextEngine *ce);
+static void		forget_line_chunk	(GtkSourceContextEngine *ce);
+static void		line_cache_clear	(GtkSourceContextEngine *ce);
+static guint		line_cache_entry_hash	(const LineCacheEntry	*entry);
+static gboolean		line_cache_entry_equal	(const LineCacheEntry	*entry1,
+						 const LineCacheEntry	*entry2);
+static void		invalidate_partial_line	(GtkSourceContextEngine *ce);
+static void		forget_dropped_segments	(GtkSourceContextEngine *ce);
+static gboolean		all_analyzed		(GtkSourceContextEngine *ce);
 static void		install_idle_worker	(GtkSourceContextEngine	*ce);
 static void		install_first_update	(GtkSourceContextEngine	*ce);
+static gboolean		start_background_analysis (GtkSourceContextEngine *ce,
+						 gchar			*cache_languages);
+static void		finish_background_analysis (GtkSourceContextEngine *ce,
+						 gboolean		 cancel);
+static void		buffer_notify_max_line_length_cb (GtkSourceContextEngine *ce);
+static void		buffer_notify_highlight_visible_only_cb (GtkSourceContextEngine *ce);
+static void		buffer_notify_sync_lines_cb (GtkSourceContextEngine *ce);
+static void		buffer_notify_append_only_cb (GtkSourceContextEngine *ce);
+static void		buffer_notify_highlight_cache_cb (GtkSourceContextEngine *ce);
+static gboolean		load_highlight_cache	(GtkSourceContextEngine *ce);
+static void		save_highlight_cache	(GtkSourceContextEngine *ce);
+static void		wait_highlight_cache_save (GtkSourceContextEngine *ce);
+static gboolean		read_highlight_cache_	(BackgroundAnalysis	*bg);
+static void		highlight_window	(GtkSourceContextEngine *ce,
+						 const GtkTextIter	*start,
+						 const GtkTextIter	*end,
+						 gint			 time);
+static void		highlight_visible_area	(GtkSourceContextEngine *ce,
+						 const GtkTextIter	*start,
+						 const GtkTextIter	*end,
+						 gint			 invalid_line);
+static void		forget_provisional_highlighting (GtkSourceContextEngine *ce);
+static void		window_scratch_free	(GtkSourceContextEngine *ce);
+static gboolean		gtk_source_context_engine_iter_has_context_class
+						(GtkSourceEngine	*engine,
+						 const GtkTextIter	*iter,
+						 const gchar		*context_class);
+static gchar	      **gtk_source_context_engine_get_context_classes_at_iter
+						(GtkSourceEngine	*engine,
+						 const GtkTextIter	*iter);
+static gboolean		gtk_source_context_engine_iter_forward_to_context_class_toggle
+						(GtkSourceEngine	*engine,
+						 GtkTextIter		*iter,
+						 const gchar		*context_class);
+static gboolean		gtk_source_context_engine_iter_backward_to_context_class_toggle
+						(GtkSourceEngine	*engine,
+						 GtkTextIter		*iter,
+						 const gchar		*context_class);
+static void		gtk_source_context_engine_foreach_token
+						(GtkSourceEngine	*engine,
+						 const GtkTextIter	*start,
+						 const GtkTextIter	*end,
+						 GtkSourceTokenFunc	 func,
+						 gpointer		 user_data);
 
 static ContextDefinition *
 gtk_source_context_data_lookup (GtkSourceContextData *ctx_data, const char *id)
@@ -516,6 +966,139 @@ gtk_source_context_data_lookup_root (GtkSourceContextData *ctx_data)
 	return root_definition;
 }
 
+/* NODE POOL -------------------------------------------------------------- */
+
+static void
+node_pool_init (NodePool *pool,
+		gsize     node_size)
+{
+	pool->node_size = MAX (node_size, sizeof (gpointer));
+	pool->blocks = NULL;
+	pool->last_block = NULL;
+	pool->n_unused = 0;
+	pool->free_list = NULL;
+	pool->free_tail = NULL;
+}
+
+/**
+ * node_pool_alloc0:
+ * @pool: #NodePool.
+ *
+ * Returns: new zero-filled node.
+ */
+static gpointer
+node_pool_alloc0 (NodePool *pool)
+{
+	gpointer node;
+
+	if (pool->free_list != NULL)
+	{
+		node = pool->free_list;
+		pool->free_list = *(gpointer *) node;
+
+		if (pool->free_list == NULL)
+			pool->free_tail = NULL;
+	}
+	else
+	{
+		if (pool->n_unused == 0)
+		{
+			pool->blocks = g_slist_prepend (pool->blocks,
+							g_malloc (pool->node_size * NODE_POOL_BLOCK_SIZE));
+			pool->n_unused = NODE_POOL_BLOCK_SIZE;
+
+			if (pool->last_block == NULL)
+				pool->last_block = pool->blocks;
+		}
+
+		node = (gchar *) pool->blocks->data +
+			pool->node_size * (NODE_POOL_BLOCK_SIZE - pool->n_unused);
+		pool->n_unused--;
+	}
+
+	return memset (node, 0, pool->node_size);
+}
+
+static void
+node_pool_free (NodePool *pool,
+		gpointer  node)
+{
+#ifdef ENABLE_DEBUG
+	/* Do not reuse it, so that using freed nodes is noticed */
+	memset (node, 1, pool->node_size);
+#else
+	*(gpointer *) node = pool->free_list;
+	pool->free_list = node;
+
+	if (pool->free_tail == NULL)
+		pool->free_tail = node;
+#endif
+}
+
+/**
+ * node_pool_clear:
+ * @pool: #NodePool.
+ *
+ * Frees all nodes at once.
+ */
+static void
+node_pool_clear (NodePool *pool)
+{
+	g_slist_free_full (pool->blocks, g_free);
+	node_pool_init (pool, pool->node_size);
+}
+
+/**
+ * node_pool_merge:
+ * @pool: #NodePool.
+ * @other: #NodePool with nodes of the same size.
+ *
+ * Takes all the nodes of @other, which is left empty. The nodes
+ * never allocated in the current block of @other are not used
+ * until @pool is cleared.
+ */
+static void
+node_pool_merge (NodePool *pool,
+		 NodePool *other)
+{
+	g_assert (pool->node_size == other->node_size);
+
+	if (other->free_list != NULL)
+	{
+		*(gpointer *) other->free_tail = pool->free_list;
+
+		if (pool->free_list == NULL)
+			pool->free_tail = other->free_tail;
+
+		pool->free_list = other->free_list;
+	}
+
+	/* The current block of @pool stays the first one. */
+	if (other->blocks != NULL)
+	{
+		if (pool->last_block != NULL)
+			pool->last_block->next = other->blocks;
+		else
+			pool->blocks = other->blocks;
+
+		pool->last_block = other->last_block;
+	}
+
+	node_pool_init (other, other->node_size);
+}
+
+/**
+ * node_pool_get_size:
+ * @pool: #NodePool.
+ *
+ * Returns: amount of memory allocated by the pool in bytes.
+ */
+static gsize
+node_pool_get_size (NodePool *pool)
+{
+	return g_slist_length (pool->blocks) * pool->node_size * NODE_POOL_BLOCK_SIZE;
+}
+
 /* TAGS AND STUFF -------------------------------------------------------------- */
 
 GtkSourceContextClass *
@@ -543,24 +1126,6 @@ gtk_source_context_class_free (GtkSourceContextClass *cclass)
 	g_slice_free (GtkSourceContextClass, cclass);
 }
 
-static ContextClassTag *
-context_class_tag_new (GtkTextTag *tag,
-                       gboolean    enabled)
-{
-	ContextClassTag *attrtag = g_slice_new (ContextClassTag);
-
-	attrtag->tag = tag;
-	attrtag->enabled = enabled;
-
-	return attrtag;
-}
-
-static void
-context_class_tag_free (ContextClassTag *attrtag)
-{
-	g_slice_free (ContextClassTag, attrtag);
-}
-
 struct BufAndIters {
 	GtkTextBuffer *buffer;
 	const GtkTextIter *start, *end;
@@ -784,308 +1349,339 @@ get_context_tag (GtkSourceContextEngine *ce,
 	return context->tag;
 }
 
-static void
-apply_tags (GtkSourceContextEngine *ce,
-	    Segment                *segment,
-	    gint                    start_offset,
-	    gint                    end_offset)
+/* A tag to be applied to a range of text. Tags are collected from
+ * the tree first, and then compared with the ones in the buffer by
+ * update_tags(). */
+typedef struct
 {
-	GtkTextTag *tag;
-	GtkTextIter start_iter, end_iter;
-	GtkTextBuffer *buffer = ce->priv->buffer;
-	SubPattern *sp;
-	Segment *child;
+	GtkTextTag	*tag;
+	gint		 start_at;
+	gint		 end_at;
+	/* Order in which the tags would be applied. */
+	guint		 index;
+} TagSpan;
 
-	g_assert (segment != NULL);
+static void
+add_tag_span (GArray     *spans,
+	      GtkTextTag *tag,
+	      gint        start_at,
+	      gint        end_at)
+{
+	TagSpan span;
 
-	if (SEGMENT_IS_INVALID (segment))
+	if (start_at >= end_at)
 		return;
 
-	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
-		return;
+	span.tag = tag;
+	span.start_at = start_at;
+	span.end_at = end_at;
+	span.index = spans->len;
 
-	start_offset = MAX (start_offset, segment->start_at);
-	end_offset = MIN (end_offset, segment->end_at);
+	g_array_append_val (spans, span);
+}
 
-	tag = get_context_tag (ce, segment->context);
+static gint
+tag_span_cmp (const TagSpan *span1,
+	      const TagSpan *span2)
+{
+	if (span1->tag != span2->tag)
+		return GPOINTER_TO_SIZE (span1->tag) < GPOINTER_TO_SIZE (span2->tag) ? -1 : 1;
 
-	if (tag != NULL)
-	{
-		gint style_start_at, style_end_at;
+	if (span1->start_at != span2->start_at)
+		return span1->start_at < span2->start_at ? -1 : 1;
 
-		style_start_at = start_offset;
-		style_end_at = end_offset;
+	return span1->index < span2->index ? -1 : (span1->index > span2->index ? 1 : 0);
+}
 
-		if (HAS_OPTION (segment->context->definition, STYLE_INSIDE))
-		{
-			style_start_at = MAX (segment->start_at + segment->start_len, start_offset);
-			style_end_at = MIN (segment->end_at - segment->end_len, end_offset);
-		}
+static gint
+tag_cmp (GtkTextTag **tag1,
+	 GtkTextTag **tag2)
+{
+	if (*tag1 == *tag2)
+		return 0;
 
-		if (style_start_at > style_end_at)
-		{
-			g_critical ("%s: oops", G_STRLOC);
-		}
-		else
-		{
-			gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, style_start_at);
-			end_iter = start_iter;
-			gtk_text_iter_forward_chars (&end_iter, style_end_at - style_start_at);
-			gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
-		}
-	}
+	return GPOINTER_TO_SIZE (*tag1) < GPOINTER_TO_SIZE (*tag2) ? -1 : 1;
+}
 
-	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+/**
+ * tag_spans_applied_:
+ * @buffer: #GtkTextBuffer.
+ * @tag: #GtkTextTag.
+ * @spans: sorted, disjoint and not adjacent spans of @tag.
+ * @n_spans: number of @spans.
+ * @start_offset: beginning of the region.
+ * @end_offset: end of the region.
+ *
+ * Returns: whether @tag is applied exactly to @spans between
+ * @start_offset and @end_offset in @buffer.
+ */
+static gboolean
+tag_spans_applied_ (GtkTextBuffer *buffer,
+		    GtkTextTag    *tag,
+		    const TagSpan *spans,
+		    guint          n_spans,
+		    gint           start_offset,
+		    gint           end_offset)
+{
+	GtkTextIter iter;
+	guint i = 0;
+
+	gtk_text_buffer_get_iter_at_offset (buffer, &iter, start_offset);
+
+	while (TRUE)
 	{
-		if (sp->start_at >= start_offset && sp->end_at <= end_offset)
-		{
-			gint start = MAX (start_offset, sp->start_at);
-			gint end = MIN (end_offset, sp->end_at);
+		gint start_at, end_at;
 
-			tag = get_subpattern_tag (ce, segment->context, sp->definition);
+		if (!gtk_text_iter_has_tag (&iter, tag) &&
+		    !gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+			break;
 
-			if (tag != NULL)
-			{
-				gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start);
-				end_iter = start_iter;
-				gtk_text_iter_forward_chars (&end_iter, end - start);
-				gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
-			}
-		}
-	}
+		start_at = gtk_text_iter_get_offset (&iter);
 
-	for (child = segment->children;
-	     child != NULL && child->start_at < end_offset;
-	     child = child->next)
-	{
-		if (child->end_at > start_offset)
-			apply_tags (ce, child, start_offset, end_offset);
-	}
-}
+		if (start_at >= end_offset)
+			break;
 
-static void
-highlight_region (GtkSourceContextEngine *ce,
-		  GtkTextIter            *start,
-		  GtkTextIter            *end)
-{
-#ifdef ENABLE_PROFILE
-	GTimer *timer;
-#endif
+		gtk_text_iter_forward_to_tag_toggle (&iter, tag);
+		end_at = MIN (gtk_text_iter_get_offset (&iter), end_offset);
 
-	if (gtk_text_iter_starts_line (end))
-		gtk_text_iter_backward_char (end);
-	if (gtk_text_iter_compare (start, end) >= 0)
-		return;
+		if (i == n_spans ||
+		    spans[i].start_at != start_at ||
+		    spans[i].end_at != end_at)
+			return FALSE;
 
-#ifdef ENABLE_PROFILE
-	timer = g_timer_new ();
-#endif
+		i++;
 
-	/* First we need to delete tags in the regions. */
-	unhighlight_region (ce, start, end);
+		if (end_at == end_offset)
+			break;
+	}
 
-	apply_tags (ce, ce->priv->root_segment,
-		    gtk_text_iter_get_offset (start),
-		    gtk_text_iter_get_offset (end));
-
-#ifdef ENABLE_PROFILE
-	g_print ("highlight (from %d to %d), %g ms elapsed\n",
-		 gtk_text_iter_get_offset (start),
-		 gtk_text_iter_get_offset (end),
-		 g_timer_elapsed (timer, NULL) * 1000);
-	g_timer_destroy (timer);
-#endif
-}
+	return i == n_spans;
+}
 
 /**
- * ensure_highlighted:
- * @ce: a #GtkSourceContextEngine.
- * @start: the beginning of the region to highlight.
- * @end: the end of the region to highlight.
+ * update_tag_:
+ * @ce: #GtkSourceContextEngine.
+ * @tag: #GtkTextTag.
+ * @spans: spans of @tag collected in the region, sorted by offset.
+ * @n_spans: number of @spans.
+ * @start: beginning of the region.
+ * @end: end of the region.
  *
- * Updates text tags in reanalyzed parts of given area.
- * It applies tags according to whatever is in the syntax
- * tree currently, so highlighting may not be correct
- * (gtk_source_context_engine_update_highlight is the method
- * that actually ensures correct highlighting).
+ * Makes @tag cover exactly @spans between @start and @end, unless
+ * it does already.
+ *
+ * Returns: the number of tags applied and removed.
  */
-static void
-ensure_highlighted (GtkSourceContextEngine *ce,
-		    const GtkTextIter      *start,
-		    const GtkTextIter      *end)
+static guint
+update_tag_ (GtkSourceContextEngine *ce,
+	     GtkTextTag             *tag,
+	     TagSpan                *spans,
+	     guint                   n_spans,
+	     const GtkTextIter      *start,
+	     const GtkTextIter      *end)
 {
-	GtkTextRegion *region;
-	GtkTextRegionIterator reg_iter;
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	guint n_merged = 0;
+	guint i;
 
-	/* Get the subregions not yet highlighted. */
-	region = gtk_text_region_intersect (ce->priv->refresh_region, start, end);
+	/* The buffer merges overlapping and adjacent ranges of
+	 * a tag, so do it here to compare. */
+	for (i = 0; i < n_spans; i++)
+	{
+		if (n_merged > 0 && spans[i].start_at <= spans[n_merged - 1].end_at)
+			spans[n_merged - 1].end_at = MAX (spans[n_merged - 1].end_at,
+							  spans[i].end_at);
+		else
+			spans[n_merged++] = spans[i];
+	}
 
-	if (region == NULL)
-		return;
+	if (tag_spans_applied_ (buffer, tag, spans, n_merged,
+				gtk_text_iter_get_offset (start),
+				gtk_text_iter_get_offset (end)))
+		return 0;
 
-	gtk_text_region_get_iterator (region, &reg_iter, 0);
+	gtk_text_buffer_remove_tag (buffer, tag, start, end);
 
-	/* Highlight all subregions from the intersection.
-	 * hopefully this will only be one subregion. */
-	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	for (i = 0; i < n_merged; i++)
 	{
-		GtkTextIter s, e;
-		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
-		highlight_region (ce, &s, &e);
-		gtk_text_region_iterator_next (&reg_iter);
-	}
+		GtkTextIter span_start, span_end;
 
-	gtk_text_region_destroy (region, TRUE);
+		gtk_text_buffer_get_iter_at_offset (buffer, &span_start, spans[i].start_at);
+		span_end = span_start;
+		gtk_text_iter_forward_chars (&span_end, spans[i].end_at - spans[i].start_at);
 
-	/* Remove the just highlighted region. */
-	gtk_text_region_subtract (ce->priv->refresh_region, start, end);
+		gtk_text_buffer_apply_tag (buffer, tag, &span_start, &span_end);
+	}
+
+	return n_merged + 1;
 }
 
-static GtkTextTag *
-get_context_class_tag (GtkSourceContextEngine *ce,
-		       gchar const            *name)
+/**
+ * mark_tag_in_region_:
+ * @tags: syntax tags, sorted with tag_cmp().
+ * @in_region: flags for @tags.
+ * @tag: a tag found in the region.
+ *
+ * Sets the flag of @tag if it is one of @tags, i.e. not a tag
+ * which does not belong to the engine.
+ */
+static void
+mark_tag_in_region_ (GPtrArray  *tags,
+		     gboolean   *in_region,
+		     GtkTextTag *tag)
 {
-	GtkTextTag *ret;
-
-	ret = g_hash_table_lookup (ce->priv->context_classes, name);
+	guint lo = 0;
+	guint hi = tags->len;
 
-	if (ret == NULL)
+	while (lo < hi)
 	{
-		ret = gtk_text_buffer_create_tag (ce->priv->buffer, NULL, NULL);
-		g_object_set_data_full (G_OBJECT (ret),
-		                        TAG_CONTEXT_CLASS_NAME,
-		                        g_strdup (name),
-		                        (GDestroyNotify)g_free);
+		guint mid = (lo + hi) / 2;
+		GtkTextTag *mid_tag = g_ptr_array_index (tags, mid);
 
-		g_hash_table_insert (ce->priv->context_classes,
-		                     g_strdup (name),
-		                     ret);
-	}
+		if (mid_tag == tag)
+		{
+			in_region[mid] = TRUE;
+			return;
+		}
 
-	return ret;
+		if (GPOINTER_TO_SIZE (mid_tag) < GPOINTER_TO_SIZE (tag))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 }
 
-static GSList *
-extend_context_classes (GtkSourceContextEngine *ce,
-                        GSList                 *definitions)
+/**
+ * update_tags:
+ * @ce: #GtkSourceContextEngine.
+ * @tags: all the syntax tags which may be in the region.
+ * @spans: #TagSpan's collected from the tree for the region.
+ * @start: beginning of the region.
+ * @end: end of the region.
+ *
+ * Makes the tags in the region match @spans. Reanalyzing text often
+ * gives the segments it replaces, e.g. when typing in a comment, so
+ * instead of removing all the tags and applying them again, which
+ * makes the buffer toggle them and the view redraw, tags which are
+ * already right are left alone. Only the tags which have spans, or
+ * are found in the region by a single walk over its tag toggles, are
+ * looked at, not every tag the engine created.
+ */
+static void
+update_tags (GtkSourceContextEngine *ce,
+	     GPtrArray              *tags,
+	     GArray                 *spans,
+	     const GtkTextIter      *start,
+	     const GtkTextIter      *end)
 {
-	GSList *item;
-	GSList *ret = NULL;
+	GtkTextIter iter;
+	GSList *found, *l;
+	gboolean *in_region;
+	guint n_calls = 0;
+	guint i;
+	guint j = 0;
+
+	g_array_sort (spans, (GCompareFunc) tag_span_cmp);
+	g_ptr_array_sort (tags, (GCompareFunc) tag_cmp);
 
-	for (item = definitions; item != NULL; item = g_slist_next (item))
+	in_region = g_new0 (gboolean, tags->len);
+
+	iter = *start;
+	found = gtk_text_iter_get_tags (&iter);
+
+	while (TRUE)
 	{
-		GtkSourceContextClass *cclass = item->data;
-		ContextClassTag *attrtag = context_class_tag_new (get_context_class_tag (ce, cclass->name),
-		                                                  cclass->enabled);
+		for (l = found; l != NULL; l = l->next)
+			mark_tag_in_region_ (tags, in_region, l->data);
+		g_slist_free (found);
+
+		if (!gtk_text_iter_forward_to_tag_toggle (&iter, NULL) ||
+		    gtk_text_iter_compare (&iter, end) >= 0)
+			break;
 
-		ret = g_slist_prepend (ret, attrtag);
+		found = gtk_text_iter_get_toggled_tags (&iter, TRUE);
 	}
 
-	return g_slist_reverse (ret);
-}
+	for (i = 0; i < tags->len; i++)
+	{
+		GtkTextTag *tag = g_ptr_array_index (tags, i);
+		guint first;
 
-static GSList *
-get_subpattern_context_classes (GtkSourceContextEngine *ce,
-                                Context                *context,
-                                SubPatternDefinition   *sp_def)
-{
-	g_assert (sp_def->index < context->definition->n_sub_patterns);
+		while (j < spans->len &&
+		       GPOINTER_TO_SIZE (g_array_index (spans, TagSpan, j).tag) < GPOINTER_TO_SIZE (tag))
+			j++;
 
-	if (context->subpattern_context_classes == NULL)
-		context->subpattern_context_classes = g_new0 (GSList *, context->definition->n_sub_patterns);
+		first = j;
 
-	if (context->subpattern_context_classes[sp_def->index] == NULL)
-	{
-		context->subpattern_context_classes[sp_def->index] =
-				extend_context_classes (ce,
-		                                        sp_def->context_classes);
-	}
+		while (j < spans->len && g_array_index (spans, TagSpan, j).tag == tag)
+			j++;
 
-	return context->subpattern_context_classes[sp_def->index];
-}
+		if (first == j && !in_region[i])
+			continue;
 
-static GSList *
-get_context_classes (GtkSourceContextEngine *ce,
-                     Context                *context)
-{
-	if (context->context_classes == NULL)
-	{
-		context->context_classes =
-				extend_context_classes (ce,
-		                                        context->definition->context_classes);
+		n_calls += update_tag_ (ce, tag, &g_array_index (spans, TagSpan, first),
+					j - first, start, end);
 	}
 
-	return context->context_classes;
+	/* Removing every tag and applying every span would take
+	 * tags->len + spans->len calls. */
+	ce->priv->tag_operations += n_calls;
+	ce->priv->tag_operations_saved += tags->len + spans->len - n_calls;
+
+	g_free (in_region);
 }
 
 static void
-apply_context_classes (GtkSourceContextEngine *ce,
-                       GSList                 *context_classes,
-                       gint                    start,
-                       gint                    end)
+add_syntax_tags_cb (G_GNUC_UNUSED gpointer style,
+		    GSList                *tags,
+		    GPtrArray             *array)
 {
-	GtkTextIter start_iter;
-	GtkTextIter end_iter;
-	GSList *item;
-
-	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &start_iter, start);
-	end_iter = start_iter;
-	gtk_text_iter_forward_chars (&end_iter, end - start);
-
-	for (item = context_classes; item != NULL; item = g_slist_next (item))
-	{
-		ContextClassTag *attrtag = item->data;
-
-		if (attrtag->enabled)
-		{
-			gtk_text_buffer_apply_tag (ce->priv->buffer,
-			                           attrtag->tag,
-			                           &start_iter,
-			                           &end_iter);
-		}
-		else
-		{
-			gtk_text_buffer_remove_tag (ce->priv->buffer,
-			                            attrtag->tag,
-			                            &start_iter,
-			                            &end_iter);
-		}
-	}
+	for (; tags != NULL; tags = tags->next)
+		g_ptr_array_add (array, tags->data);
 }
 
 static void
-add_region_context_classes (GtkSourceContextEngine *ce,
-                            Segment                *segment,
-                            gint                    start_offset,
-                            gint                    end_offset)
+collect_tags (GtkSourceContextEngine *ce,
+	      Segment                *segment,
+	      gint                    start_offset,
+	      gint                    end_offset,
+	      GArray                 *spans)
 {
+	GtkTextTag *tag;
 	SubPattern *sp;
 	Segment *child;
-	GSList *context_classes;
 
 	g_assert (segment != NULL);
 
 	if (SEGMENT_IS_INVALID (segment))
-	{
 		return;
-	}
 
 	if (segment->start_at >= end_offset || segment->end_at <= start_offset)
-	{
 		return;
-	}
+
 
 	start_offset = MAX (start_offset, segment->start_at);
 	end_offset = MIN (end_offset, segment->end_at);
 
-	context_classes = get_context_classes (ce, segment->context);
+	tag = get_context_tag (ce, segment->context);
 
-	if (context_classes != NULL)
+	if (tag != NULL)
 	{
-		apply_context_classes (ce,
-		                       context_classes,
-		                       start_offset,
-		                       end_offset);
+		gint style_start_at, style_end_at;
+
+		style_start_at = start_offset;
+		style_end_at = end_offset;
+
+		if (HAS_OPTION (segment->context->definition, STYLE_INSIDE))
+		{
+			style_start_at = MAX (segment->start_at + segment->start_len, start_offset);
+			style_end_at = MIN (segment->end_at - segment->end_len, end_offset);
+		}
+
+		if (style_start_at > style_end_at)
+			g_critical ("%s: oops", G_STRLOC);
+		else
+			add_tag_span (spans, tag, style_start_at, style_end_at);
 	}
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
@@ -1095,17 +1691,10 @@ add_region_context_classes (GtkSourceContextEngine *ce,
 			gint start = MAX (start_offset, sp->start_at);
 			gint end = MIN (end_offset, sp->end_at);
 
-			context_classes = get_subpattern_context_classes (ce,
-			                                                  segment->context,
-			                                                  sp->definition);
+			tag = get_subpattern_tag (ce, segment->context, sp->definition);
 
-			if (context_classes != NULL)
-			{
-				apply_context_classes (ce,
-				                       context_classes,
-				                       start,
-				                       end);
-			}
+			if (tag != NULL)
+				add_tag_span (spans, tag, start, end);
 		}
 	}
 
@@ -1114,84 +1703,186 @@ add_region_context_classes (GtkSourceContextEngine *ce,
 	     child = child->next)
 	{
 		if (child->end_at > start_offset)
-		{
-			add_region_context_classes (ce, child, start_offset, end_offset);
-		}
+			collect_tags (ce, child, start_offset, end_offset, spans);
 	}
 }
 
+/**
+ * apply_tags:
+ * @ce: #GtkSourceContextEngine.
+ * @root_segment: root of the tree to take highlighting from.
+ * @start: beginning of the region.
+ * @end: end of the region.
+ *
+ * Sets the syntax tags in the region according to the tree,
+ * see update_tags().
+ */
 static void
-remove_region_context_class_cb (G_GNUC_UNUSED gpointer class,
-                                GtkTextTag             *tag,
-                                gpointer                user_data)
+apply_tags (GtkSourceContextEngine *ce,
+	    Segment                *root_segment,
+	    const GtkTextIter      *start,
+	    const GtkTextIter      *end)
 {
-	struct BufAndIters *data = user_data;
-	gtk_text_buffer_remove_tag (data->buffer,
-	                            tag,
-	                            data->start,
-	                            data->end);
-}
+	GArray *spans;
+	GPtrArray *tags;
 
-static void
-remove_region_context_classes (GtkSourceContextEngine *ce,
-                               const GtkTextIter      *start,
-                               const GtkTextIter      *end)
-{
-	struct BufAndIters data;
+	spans = g_array_new (FALSE, FALSE, sizeof (TagSpan));
+	tags = g_ptr_array_new ();
 
-	data.buffer = ce->priv->buffer;
-	data.start = start;
-	data.end = end;
+	collect_tags (ce, root_segment,
+		      gtk_text_iter_get_offset (start),
+		      gtk_text_iter_get_offset (end),
+		      spans);
 
-	if (gtk_text_iter_equal (start, end))
-		return;
+	/* collect_tags() may create tags, get them after it. */
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) add_syntax_tags_cb, tags);
 
-	g_hash_table_foreach (ce->priv->context_classes,
-	                      (GHFunc) remove_region_context_class_cb,
-	                      &data);
+	update_tags (ce, tags, spans, start, end);
+
+	if (ce->priv->tagged_region != NULL)
+		gtk_text_region_add (ce->priv->tagged_region, start, end);
+
+	g_ptr_array_free (tags, TRUE);
+	g_array_free (spans, TRUE);
 }
 
 static void
-refresh_context_classes (GtkSourceContextEngine *ce,
-                         const GtkTextIter      *start,
-                         const GtkTextIter      *end)
+highlight_region (GtkSourceContextEngine *ce,
+		  GtkTextIter            *start,
+		  GtkTextIter            *end)
 {
 #ifdef ENABLE_PROFILE
 	GTimer *timer;
 #endif
-	GtkTextIter realend = *end;
-
-	if (gtk_text_iter_starts_line (&realend))
-	{
-		gtk_text_iter_backward_char (&realend);
-	}
 
-	if (gtk_text_iter_compare (start, &realend) >= 0)
-	{
+	if (gtk_text_iter_starts_line (end))
+		gtk_text_iter_backward_char (end);
+	if (gtk_text_iter_compare (start, end) >= 0)
 		return;
-	}
 
 #ifdef ENABLE_PROFILE
 	timer = g_timer_new ();
 #endif
 
-	/* First we need to delete tags in the regions. */
-	remove_region_context_classes (ce, start, &realend);
-
-	add_region_context_classes (ce,
-	                            ce->priv->root_segment,
-	                            gtk_text_iter_get_offset (start),
-	                            gtk_text_iter_get_offset (&realend));
+	apply_tags (ce, ce->priv->root_segment, start, end);
 
 #ifdef ENABLE_PROFILE
-	g_print ("applied context classes (from %d to %d), %g ms elapsed\n",
+	g_print ("highlight (from %d to %d), %g ms elapsed\n",
 		 gtk_text_iter_get_offset (start),
-		 gtk_text_iter_get_offset (&realend),
+		 gtk_text_iter_get_offset (end),
 		 g_timer_elapsed (timer, NULL) * 1000);
 	g_timer_destroy (timer);
 #endif
 }
 
+/**
+ * ensure_highlighted:
+ * @ce: a #GtkSourceContextEngine.
+ * @start: the beginning of the region to highlight.
+ * @end: the end of the region to highlight.
+ *
+ * Updates text tags in reanalyzed parts of given area.
+ * It applies tags according to whatever is in the syntax
+ * tree currently, so highlighting may not be correct
+ * (gtk_source_context_engine_update_highlight is the method
+ * that actually ensures correct highlighting).
+ */
+static void
+ensure_highlighted (GtkSourceContextEngine *ce,
+		    const GtkTextIter      *start,
+		    const GtkTextIter      *end)
+{
+	GtkTextRegion *region;
+	GtkTextRegionIterator reg_iter;
+
+	/* Get the subregions not yet highlighted. */
+	region = gtk_text_region_intersect (ce->priv->refresh_region, start, end);
+
+	if (region == NULL)
+		return;
+
+	gtk_text_region_get_iterator (region, &reg_iter, 0);
+
+	/* Highlight all subregions from the intersection.
+	 * hopefully this will only be one subregion. */
+	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	{
+		GtkTextIter s, e;
+		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+		highlight_region (ce, &s, &e);
+		gtk_text_region_iterator_next (&reg_iter);
+	}
+
+	gtk_text_region_destroy (region, TRUE);
+
+	/* Remove the just highlighted region. */
+	gtk_text_region_subtract (ce->priv->refresh_region, start, end);
+}
+
+/**
+ * forget_hidden_tags:
+ * @ce: a #GtkSourceContextEngine.
+ * @start: the beginning of the area being highlighted.
+ * @end: the end of the area being highlighted.
+ *
+ * When GtkSourceBuffer:highlight-visible-only is set, only the
+ * text views ask to highlight, i.e. the text they show, needs
+ * syntax tags. Once the tagged text gets bigger than
+ * HIDDEN_TAGS_MAX_CHARS, the tags are removed from everything
+ * but the area being highlighted, and the rest is put back to
+ * refresh_region to be highlighted again when it is shown. So
+ * the text buffer does not keep tag toggles for the whole text,
+ * and edits do not have to update them.
+ *
+ * Several views showing different parts of the buffer each keep
+ * their area tagged as long as it fits in the limit.
+ */
+static void
+forget_hidden_tags (GtkSourceContextEngine *ce,
+		    const GtkTextIter      *start,
+		    const GtkTextIter      *end)
+{
+	GtkTextRegion *kept;
+	GtkTextRegionIterator reg_iter;
+	gint n_chars = 0;
+
+	if (ce->priv->tagged_region == NULL)
+		return;
+
+	gtk_text_region_get_iterator (ce->priv->tagged_region, &reg_iter, 0);
+
+	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	{
+		GtkTextIter s, e;
+
+		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+		n_chars += gtk_text_iter_get_offset (&e) - gtk_text_iter_get_offset (&s);
+		gtk_text_region_iterator_next (&reg_iter);
+	}
+
+	if (n_chars <= HIDDEN_TAGS_MAX_CHARS)
+		return;
+
+	kept = gtk_text_region_intersect (ce->priv->tagged_region, start, end);
+	gtk_text_region_subtract (ce->priv->tagged_region, start, end);
+
+	gtk_text_region_get_iterator (ce->priv->tagged_region, &reg_iter, 0);
+
+	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	{
+		GtkTextIter s, e;
+
+		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+		unhighlight_region (ce, &s, &e);
+		gtk_text_region_add (ce->priv->refresh_region, &s, &e);
+		gtk_text_region_subtract (ce->priv->provisional_region, &s, &e);
+		gtk_text_region_iterator_next (&reg_iter);
+	}
+
+	gtk_text_region_destroy (ce->priv->tagged_region, TRUE);
+	ce->priv->tagged_region = kept != NULL ? kept : gtk_text_region_new (ce->priv->buffer);
+}
+
 /*
  * refresh_range:
  * @ce: a #GtkSourceContextEngine.
@@ -1212,9 +1903,6 @@ refresh_range (GtkSourceContextEngine *ce,
 	if (gtk_text_iter_equal (start, end))
 		return;
 
-	/* Refresh the contex classes here */
-	refresh_context_classes (ce, start, end);
-
 	/* Here we need to make sure we do not make it redraw next line */
 	real_end = *end;
 	if (gtk_text_iter_starts_line (&real_end))
@@ -1306,24 +1994,20 @@ remove_invalid (GtkSourceContextEngine *ce,
 }
 
 /**
- * fix_offsets_insert_:
+ * segment_shift:
  * @segment: segment.
- * @start: start offset.
- * @delta: length of inserted text.
+ * @delta: amount to move the segment by.
  *
- * Recursively updates offsets after inserting text. To be called
- * only from insert_range().
+ * Recursively moves the segment with its children and sub patterns
+ * by @delta characters.
  */
 static void
-fix_offsets_insert_ (Segment *segment,
-		     gint     start,
-		     gint     delta)
+segment_shift (Segment *segment,
+	       gint     delta)
 {
 	Segment *child;
 	SubPattern *sp;
 
-	g_assert (segment->start_at >= start);
-
 	if (delta == 0)
 		return;
 
@@ -1331,7 +2015,7 @@ fix_offsets_insert_ (Segment *segment,
 	segment->end_at += delta;
 
 	for (child = segment->children; child != NULL; child = child->next)
-		fix_offsets_insert_ (child, start, delta);
+		segment_shift (child, delta);
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
@@ -1504,6 +2188,7 @@ find_insertion_place (Segment  *segment,
 {
 	g_assert (segment->start_at <= offset && segment->end_at >= offset);
 
+
 	*prev = NULL;
 	*next = NULL;
 
@@ -1591,6 +2276,7 @@ segment_add_subpattern (Segment    *state,
 
 /**
  * sub_pattern_new:
+ * @ce: the engine.
  * @segment: the segment.
  * @start_at: start offset of the subpattern.
  * @end_at: end offset of the subpattern.
@@ -1602,14 +2288,15 @@ segment_add_subpattern (Segment    *state,
  * Returns: new subpattern.
  */
 static SubPattern *
-sub_pattern_new (Segment              *segment,
-		 gint                  start_at,
-		 gint                  end_at,
-		 SubPatternDefinition *sp_def)
+sub_pattern_new (GtkSourceContextEngine *ce,
+		 Segment                *segment,
+		 gint                    start_at,
+		 gint                    end_at,
+		 SubPatternDefinition   *sp_def)
 {
 	SubPattern *sp;
 
-	sp = g_slice_new (SubPattern);
+	sp = node_pool_alloc0 (&ce->priv->sub_pattern_pool);
 	sp->start_at = start_at;
 	sp->end_at = end_at;
 	sp->definition = sp_def;
@@ -1621,18 +2308,16 @@ sub_pattern_new (Segment              *segment,
 
 /**
  * sub_pattern_free:
+ * @ce: the engine.
  * @sp: subppatern.
  *
- * Calls g_free on subpattern, was useful for debugging.
+ * Returns subpattern to the pool.
  */
 static inline void
-sub_pattern_free (SubPattern *sp)
+sub_pattern_free (GtkSourceContextEngine *ce,
+		  SubPattern             *sp)
 {
-#ifdef ENABLE_DEBUG
-	memset (sp, 1, sizeof (SubPattern));
-#else
-	g_slice_free (SubPattern, sp);
-#endif
+	node_pool_free (&ce->priv->sub_pattern_pool, sp);
 }
 
 /**
@@ -1657,7 +2342,7 @@ segment_make_invalid_ (GtkSourceContextEngine *ce,
 	while (sp != NULL)
 	{
 		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
+		sub_pattern_free (ce, sp);
 		sp = next;
 	}
 
@@ -1716,7 +2401,8 @@ simple_segment_split_ (GtkSourceContextEngine *ce,
 		}
 		else
 		{
-			sub_pattern_new (new_segment,
+			sub_pattern_new (ce,
+					 new_segment,
 					 offset,
 					 sp->end_at,
 					 sp->definition);
@@ -1732,68 +2418,138 @@ simple_segment_split_ (GtkSourceContextEngine *ce,
 	return invalid;
 }
 
+static gint
+get_mark_offset (GtkTextBuffer *buffer,
+		  GtkTextMark   *mark)
+{
+	GtkTextIter iter;
+
+	gtk_text_buffer_get_iter_at_mark (buffer, &iter, mark);
+	return gtk_text_iter_get_offset (&iter);
+}
+
+static void
+invalid_region_free_marks (GtkSourceContextEngine *ce,
+			   InvalidRegion          *region)
+{
+	gtk_text_buffer_delete_mark (ce->priv->buffer, region->start);
+	gtk_text_buffer_delete_mark (ce->priv->buffer, region->end);
+}
+
 /**
  * invalidate_region:
  * @ce: a #GtkSourceContextEngine.
  * @offset: the start of invalidated area.
  * @length: the length of the area.
  *
- * Adds the area to the invalid region and queues highlighting.
+ * Adds the area to the invalid regions and queues highlighting.
  * @length may be negative which means deletion; positive
  * means insertion; 0 means "something happened here", it's
  * treated as zero-length insertion.
+ *
+ * The area is merged with the regions it touches, and stays
+ * separate from the others, so that edits far apart, e.g. done
+ * by search and replace, do not make update_tree() invalidate
+ * all the text between them. When there are INVALID_REGIONS_MAX
+ * regions, it is merged with the nearest one instead.
  */
 static void
 invalidate_region (GtkSourceContextEngine *ce,
 		   gint                    offset,
 		   gint                    length)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
+	GArray *regions = ce->priv->invalid_regions;
 	GtkTextBuffer *buffer = ce->priv->buffer;
+	InvalidRegion *region;
 	GtkTextIter iter;
 	gint end_offset;
+	gint start_at, end_at;
+	guint first, last, i;
 
 	end_offset = length >= 0 ? offset + length : offset;
 
-	if (region->empty)
+	/* Deleted text takes the marks of the regions in it to @offset,
+	 * so touching @offset is enough to be affected by a deletion. */
+	for (first = 0; first < regions->len; first++)
 	{
-		region->empty = FALSE;
-		region->delta = length;
+		region = &g_array_index (regions, InvalidRegion, first);
 
-		gtk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
-		gtk_text_buffer_move_mark (buffer, region->start, &iter);
+		if (get_mark_offset (buffer, region->end) >= offset)
+			break;
+	}
+
+	for (last = first; last < regions->len; last++)
+	{
+		region = &g_array_index (regions, InvalidRegion, last);
+
+		if (get_mark_offset (buffer, region->start) > end_offset)
+			break;
+	}
+
+	if (first == last && regions->len < INVALID_REGIONS_MAX)
+	{
+		InvalidRegion new_region;
 
+		gtk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
+		new_region.start = gtk_text_buffer_create_mark (buffer, NULL, &iter, TRUE);
 		gtk_text_iter_set_offset (&iter, end_offset);
-		gtk_text_buffer_move_mark (buffer, region->end, &iter);
+		new_region.end = gtk_text_buffer_create_mark (buffer, NULL, &iter, FALSE);
+		new_region.delta = length;
+
+		g_array_insert_val (regions, first, new_region);
 	}
 	else
 	{
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
-
-		if (gtk_text_iter_get_offset (&iter) > offset)
+		if (first == last)
 		{
-			gtk_text_iter_set_offset (&iter, offset);
-			gtk_text_buffer_move_mark (buffer, region->start, &iter);
+			/* Too many regions, take the nearest one. */
+			if (first == regions->len ||
+			    (first > 0 &&
+			     offset - get_mark_offset (buffer, g_array_index (regions, InvalidRegion, first - 1).end) <
+			     get_mark_offset (buffer, g_array_index (regions, InvalidRegion, first).start) - end_offset))
+				first--;
+			else
+				last++;
 		}
 
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
+		region = &g_array_index (regions, InvalidRegion, first);
+		start_at = MIN (offset, get_mark_offset (buffer, region->start));
+		end_at = MAX (end_offset,
+			      get_mark_offset (buffer, g_array_index (regions, InvalidRegion, last - 1).end));
 
-		if (gtk_text_iter_get_offset (&iter) < end_offset)
+		gtk_text_buffer_get_iter_at_offset (buffer, &iter, start_at);
+		gtk_text_buffer_move_mark (buffer, region->start, &iter);
+		gtk_text_iter_set_offset (&iter, end_at);
+		gtk_text_buffer_move_mark (buffer, region->end, &iter);
+
+		region->delta += length;
+
+		for (i = first + 1; i < last; i++)
 		{
-			gtk_text_iter_set_offset (&iter, end_offset);
-			gtk_text_buffer_move_mark (buffer, region->end, &iter);
+			InvalidRegion *merged = &g_array_index (regions, InvalidRegion, i);
+
+			region->delta += merged->delta;
+			invalid_region_free_marks (ce, merged);
 		}
 
-		region->delta += length;
+		if (last > first + 1)
+			g_array_remove_range (regions, first + 1, last - first - 1);
 	}
 
 	DEBUG (({
-		gint start, end;
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->start);
-		start = gtk_text_iter_get_offset (&iter);
-		gtk_text_buffer_get_iter_at_mark (buffer, &iter, region->end);
-		end = gtk_text_iter_get_offset (&iter);
-		g_assert (start <= end - region->delta);
+		gint prev_end = -1;
+
+		for (i = 0; i < regions->len; i++)
+		{
+			gint start, end;
+
+			region = &g_array_index (regions, InvalidRegion, i);
+			start = get_mark_offset (buffer, region->start);
+			end = get_mark_offset (buffer, region->end);
+			g_assert (start <= end - region->delta);
+			g_assert (start >= prev_end);
+			prev_end = end;
+		}
 	}));
 
 	CHECK_TREE (ce);
@@ -1900,7 +2656,10 @@ insert_range (GtkSourceContextEngine *ce,
 			SubPattern *sp;
 
 			for (tmp = segment->next; tmp != NULL; tmp = tmp->next)
-				fix_offsets_insert_ (tmp, offset, length);
+			{
+				g_assert (tmp->start_at >= offset);
+				segment_shift (tmp, length);
+			}
 
 			segment->end_at += length;
 
@@ -1919,6 +2678,49 @@ insert_range (GtkSourceContextEngine *ce,
 	CHECK_TREE (ce);
 }
 
+/**
+ * append_range_:
+ * @ce: a #GtkSourceContextEngine.
+ * @start_offset: the start of inserted text.
+ * @end_offset: the end of inserted text.
+ *
+ * In append-only mode, applies text inserted at the end of the buffer
+ * to the tree right away instead of adding it to invalid_regions:
+ * nothing before it changes, so only the new text (and the rest of
+ * the line it is appended to) is analyzed.
+ * Called only from gtk_source_context_engine_text_inserted().
+ *
+ * Returns: %FALSE if the insertion has to go through invalid_regions.
+ */
+static gboolean
+append_range_ (GtkSourceContextEngine *ce,
+	       gint                    start_offset,
+	       gint                    end_offset)
+{
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	GtkTextIter iter;
+
+	if (end_offset != gtk_text_buffer_get_char_count (buffer) ||
+	    ce->priv->invalid_regions->len != 0 ||
+	    ce->priv->background != NULL)
+		return FALSE;
+
+	invalidate_partial_line (ce);
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	insert_range (ce, start_offset, end_offset - start_offset);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	gtk_text_buffer_get_iter_at_offset (buffer, &iter, start_offset);
+	update_line_states (ce, gtk_text_iter_get_line (&iter),
+			    gtk_text_buffer_get_line_count (buffer) - 1);
+
+	forget_provisional_highlighting (ce);
+	install_first_update (ce);
+
+	return TRUE;
+}
+
 /**
  * gtk_source_context_engine_text_inserted:
  * @ce: a #GtkSourceContextEngine.
@@ -1935,11 +2737,32 @@ gtk_source_context_engine_text_inserted (GtkSourceEngine *engine,
 	GtkTextIter iter;
 	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
+	forget_line_chunk (ce);
+
+	/* There is no tree to update, see highlight_window(). */
+	if (ce->priv->sync_lines >= 0)
+	{
+		forget_provisional_highlighting (ce);
+		return;
+	}
+
 	if (!ce->priv->disabled)
 	{
 		g_return_if_fail (start_offset < end_offset);
 
+		if (ce->priv->append_only &&
+		    append_range_ (ce, start_offset, end_offset))
+			return;
+
+		invalidate_partial_line (ce);
 		invalidate_region (ce, start_offset, end_offset - start_offset);
+		forget_provisional_highlighting (ce);
+
+		/* Text loaded into an empty buffer may be in the cache,
+		 * later insertions are not looked up. */
+		if (ce->priv->highlight_cache &&
+		    gtk_text_buffer_get_char_count (ce->priv->buffer) == end_offset - start_offset)
+			ce->priv->cache_load_pending = TRUE;
 
 		/* If end_offset is at the start of a line (enter key pressed) then
 		 * we need to invalidate the whole new line, otherwise it may not be
@@ -1988,7 +2811,8 @@ fix_offset_delete_one_ (gint offset,
  * @length: length of deleted text.
  * @hint: some segment somewhere near deleted text to optimize search.
  *
- * Recursively updates offsets after deleting text. To be called
+ * Recursively updates offsets after deleting text. Segments which
+ * are entirely after deleted text are simply moved. To be called
  * only from delete_range_().
  */
 static void
@@ -2002,6 +2826,13 @@ fix_offsets_delete_ (Segment *segment,
 
 	g_return_if_fail (segment->end_at > offset);
 
+	if (segment->start_at >= offset + length)
+	{
+		segment_shift (segment, -length);
+		return;
+	}
+
+
 	if (hint != NULL)
 		while (hint != NULL && hint->parent != segment)
 			hint = hint->parent;
@@ -2076,10 +2907,143 @@ gtk_source_context_engine_text_deleted (GtkSourceEngine *engine,
 
 	g_return_if_fail (length > 0);
 
+	forget_line_chunk (ce);
+
+	if (ce->priv->sync_lines >= 0)
+	{
+		forget_provisional_highlighting (ce);
+		return;
+	}
+
 	if (!ce->priv->disabled)
 	{
+		invalidate_partial_line (ce);
 		invalidate_region (ce, offset, - length);
+		forget_provisional_highlighting (ce);
+	}
+}
+
+/**
+ * truncate_tree_:
+ * @ce: a #GtkSourceContextEngine.
+ * @length: the length of deleted text.
+ * @n_lines: the number of deleted lines.
+ *
+ * In append-only mode, drops the top level segments in the first
+ * @n_lines lines instead of reanalyzing the text following them.
+ * It's possible only if no segment but the root spans the boundary,
+ * i.e. the analysis of the remaining text starts in the root context
+ * as it does at the beginning of the buffer.
+ *
+ * The remaining segments are moved by -@length, their text is not
+ * analyzed again. Called only from gtk_source_context_engine_text_truncated().
+ *
+ * Returns: %FALSE if the deletion has to go through invalid_regions.
+ */
+static gboolean
+truncate_tree_ (GtkSourceContextEngine *ce,
+		gint                    length,
+		gint                    n_lines)
+{
+	Segment *root = ce->priv->root_segment;
+	GArray *states = ce->priv->line_states;
+	Segment *first_kept, *child;
+	GSList *l;
+	guint i;
+
+	if (ce->priv->invalid_regions->len != 0 ||
+	    ce->priv->background != NULL ||
+	    ce->priv->partial_line != NULL)
+		return FALSE;
+
+	for (l = ce->priv->invalid; l != NULL; l = l->next)
+		if (((Segment *) l->data)->start_at <= length)
+			return FALSE;
+
+
+	/* Zero-length segments at @length belong to the first kept line. */
+	for (first_kept = root->children; first_kept != NULL; first_kept = first_kept->next)
+		if (first_kept->end_at > length || first_kept->start_at >= length)
+			break;
+
+	if (first_kept != NULL && first_kept->start_at < length)
+		return FALSE;
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+
+	forget_dropped_segments (ce);
+
+	/* States of the deleted lines and of the first kept one point
+	 * to the dropped segments or to the root. Release them so that
+	 * segment_destroy() frees the dropped ones right away. */
+	for (i = 0; i < states->len; i++)
+	{
+		LineState *ls = &g_array_index (states, LineState, i);
+
+		if (ls->line > n_lines)
+			break;
+
+		ls->segment->line_states--;
+	}
+
+	g_array_remove_range (states, 0, i);
+
+	for (i = 0; i < states->len; i++)
+		g_array_index (states, LineState, i).line -= n_lines;
+
+	ce->priv->n_lines -= n_lines;
+
+	child = root->children;
+	while (child != first_kept)
+	{
+		Segment *next = child->next;
+		segment_destroy (ce, child);
+		child = next;
+	}
+
+	root->children = first_kept;
+	if (first_kept != NULL)
+		first_kept->prev = NULL;
+	else
+		root->last_child = NULL;
+
+	for (child = first_kept; child != NULL; child = child->next)
+		segment_shift (child, -length);
+
+	root->end_at -= length;
+
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	CHECK_TREE (ce);
+
+	return TRUE;
+}
+
+/**
+ * gtk_source_context_engine_text_truncated:
+ * @ce: a #GtkSourceContextEngine.
+ * @length: the length (in characters) of deleted text.
+ * @n_lines: the number of deleted lines.
+ *
+ * Called from GtkTextBuffer::delete_range when whole lines are
+ * deleted at the beginning of the buffer.
+ */
+static void
+gtk_source_context_engine_text_truncated (GtkSourceEngine *engine,
+					  gint             length,
+					  gint             n_lines)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	if (ce->priv->append_only && ce->priv->sync_lines < 0 &&
+	    !ce->priv->disabled && truncate_tree_ (ce, length, n_lines))
+	{
+		forget_line_chunk (ce);
+		forget_provisional_highlighting (ce);
+		return;
 	}
+
+	gtk_source_context_engine_text_deleted (engine, 0, length);
 }
 
 /**
@@ -2091,7 +3055,7 @@ gtk_source_context_engine_text_deleted (GtkSourceEngine *engine,
 static Segment *
 get_invalid_segment (GtkSourceContextEngine *ce)
 {
-	g_return_val_if_fail (ce->priv->invalid_region.empty, NULL);
+	g_return_val_if_fail (ce->priv->invalid_regions->len == 0, NULL);
 	return ce->priv->invalid ? ce->priv->invalid->data : NULL;
 }
 
@@ -2107,14 +3071,12 @@ get_invalid_line (GtkSourceContextEngine *ce)
 	GtkTextIter iter;
 	gint offset = G_MAXINT;
 
-	if (!ce->priv->invalid_region.empty)
+	if (ce->priv->invalid_regions->len != 0)
 	{
-		gint tmp;
-		gtk_text_buffer_get_iter_at_mark (ce->priv->buffer,
-						  &iter,
-						  ce->priv->invalid_region.start);
-		tmp = gtk_text_iter_get_offset (&iter);
-		offset = MIN (offset, tmp);
+		InvalidRegion *region;
+
+		region = &g_array_index (ce->priv->invalid_regions, InvalidRegion, 0);
+		offset = MIN (offset, get_mark_offset (ce->priv->buffer, region->start));
 	}
 
 	if (ce->priv->invalid)
@@ -2123,6 +3085,9 @@ get_invalid_line (GtkSourceContextEngine *ce)
 		offset = MIN (offset, segment->start_at);
 	}
 
+	if (ce->priv->partial_line)
+		offset = MIN (offset, ce->priv->partial_line->line.start_at);
+
 	if (offset == G_MAXINT)
 		return -1;
 
@@ -2131,26 +3096,29 @@ get_invalid_line (GtkSourceContextEngine *ce)
 }
 
 /**
- * update_tree:
+ * update_tree_region_:
  * @ce: a #GtkSourceContextEngine.
+ * @region: #InvalidRegion.
  *
- * Modifies syntax tree according to data in invalid_region.
+ * Modifies syntax tree according to @region. Offsets in the tree
+ * after @region must already match the buffer but for the changes
+ * in the following regions.
  */
 static void
-update_tree (GtkSourceContextEngine *ce)
+update_tree_region_ (GtkSourceContextEngine *ce,
+		     InvalidRegion          *region)
 {
-	InvalidRegion *region = &ce->priv->invalid_region;
 	gint start, end, delta;
+	gint start_line, end_line;
 	gint erase_start, erase_end;
 	GtkTextIter iter;
 
-	if (region->empty)
-		return;
-
 	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->start);
 	start = gtk_text_iter_get_offset (&iter);
+	start_line = gtk_text_iter_get_line (&iter);
 	gtk_text_buffer_get_iter_at_mark (ce->priv->buffer, &iter, region->end);
 	end = gtk_text_iter_get_offset (&iter);
+	end_line = gtk_text_iter_get_line (&iter);
 
 	delta = region->delta;
 
@@ -2188,14 +3156,43 @@ update_tree (GtkSourceContextEngine *ce)
 		insert_range (ce, start, 0);
 	}
 
-	region->empty = TRUE;
+	update_line_states (ce, start_line, end_line);
 
 #ifdef ENABLE_CHECK_TREE
 	g_assert (get_invalid_at (ce, start) != NULL);
-	CHECK_TREE (ce);
 #endif
 }
 
+/**
+ * update_tree:
+ * @ce: a #GtkSourceContextEngine.
+ *
+ * Modifies syntax tree according to data in invalid_regions.
+ * Regions are applied from the start of the buffer, so that
+ * each one finds the tree offsets before it already shifted.
+ */
+static void
+update_tree (GtkSourceContextEngine *ce)
+{
+	GArray *regions = ce->priv->invalid_regions;
+	guint i;
+
+	if (regions->len == 0)
+		return;
+
+	for (i = 0; i < regions->len; i++)
+	{
+		InvalidRegion *region = &g_array_index (regions, InvalidRegion, i);
+
+		update_tree_region_ (ce, region);
+		invalid_region_free_marks (ce, region);
+	}
+
+	g_array_set_size (regions, 0);
+
+	CHECK_TREE (ce);
+}
+
 /**
  * gtk_source_context_engine_update_highlight:
  * @ce: a #GtkSourceContextEngine.
@@ -2222,6 +3219,30 @@ gtk_source_context_engine_update_highlight (GtkSourceEngine   *engine,
 	if (!ce->priv->highlight || ce->priv->disabled)
 		return;
 
+	/* Only a window around the area is analyzed, there is
+	 * no idle worker to wait for. */
+	if (ce->priv->sync_lines >= 0)
+	{
+		highlight_window (ce, start, end, 0);
+		forget_hidden_tags (ce, start, end);
+		return;
+	}
+
+	/* The cache is read in background, the wait below picks the
+	 * tree up. */
+	if (synchronous)
+		load_highlight_cache (ce);
+
+	/* Tree being built in background covers the whole buffer,
+	 * so wait for it instead of analyzing the same text again. */
+	if (synchronous && ce->priv->background != NULL)
+	{
+		finish_background_analysis (ce, FALSE);
+
+		if (ce->priv->disabled)
+			return;
+	}
+
 	invalid_line = get_invalid_line (ce);
 	end_line = gtk_text_iter_get_line (end);
 
@@ -2248,8 +3269,14 @@ gtk_source_context_engine_update_highlight (GtkSourceEngine   *engine,
 			ensure_highlighted (ce, start, &valid_end);
 		}
 
-		install_first_update (ce);
+		highlight_visible_area (ce, start, end, invalid_line);
+
+		if (!ce->priv->disabled && !all_analyzed (ce))
+			install_first_update (ce);
 	}
+
+	if (!ce->priv->disabled)
+		forget_hidden_tags (ce, start, end);
 }
 
 /**
@@ -2307,7 +3334,8 @@ buffer_notify_highlight_syntax_cb (GtkSourceContextEngine *ce)
 static gboolean
 all_analyzed (GtkSourceContextEngine *ce)
 {
-	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty;
+	return ce->priv->invalid == NULL && ce->priv->invalid_regions->len == 0 &&
+		ce->priv->partial_line == NULL;
 }
 
 /**
@@ -2324,6 +3352,12 @@ idle_worker (GtkSourceContextEngine *ce)
 
 	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
 
+	if (ce->priv->background != NULL)
+	{
+		ce->priv->incremental_update = 0;
+		return G_SOURCE_REMOVE;
+	}
+
 	/* analyze batch of text */
 	update_syntax (ce, NULL, INCREMENTAL_UPDATE_TIME_SLICE);
 	CHECK_TREE (ce);
@@ -2342,20 +3376,37 @@ idle_worker (GtkSourceContextEngine *ce)
  * @ce: a #GtkSourceContextEngine.
  *
  * Same as idle_worker, except: it runs once, and install idle_worker
- * if not everything was analyzed at once.
+ * if not everything was analyzed at once. If the buffer is big, the
+ * rest is analyzed in a separate thread instead.
  */
 static gboolean
 first_update_callback (GtkSourceContextEngine *ce)
 {
 	g_return_val_if_fail (ce->priv->buffer != NULL, G_SOURCE_REMOVE);
 
+	/* Changes are picked up when background analysis is done. */
+	if (ce->priv->background != NULL)
+	{
+		ce->priv->first_update = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	if (load_highlight_cache (ce))
+	{
+		ce->priv->first_update = 0;
+		return G_SOURCE_REMOVE;
+	}
+
 	/* analyze batch of text */
 	update_syntax (ce, NULL, FIRST_UPDATE_TIME_SLICE);
 	CHECK_TREE (ce);
 
 	ce->priv->first_update = 0;
 
-	if (!all_analyzed (ce))
+	if (ce->priv->disabled)
+		return G_SOURCE_REMOVE;
+
+	if (!all_analyzed (ce) && !start_background_analysis (ce, NULL))
 		install_idle_worker (ce);
 
 	return G_SOURCE_REMOVE;
@@ -2371,7 +3422,8 @@ first_update_callback (GtkSourceContextEngine *ce)
 static void
 install_idle_worker (GtkSourceContextEngine *ce)
 {
-	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0)
+	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0 &&
+	    ce->priv->background == NULL)
 		ce->priv->incremental_update =
 			gdk_threads_add_idle_full (INCREMENTAL_UPDATE_PRIORITY,
 			                           (GSourceFunc) idle_worker, ce, NULL);
@@ -2432,14 +3484,6 @@ remove_tags_hash_cb (G_GNUC_UNUSED gpointer style,
 	g_slist_free (tags);
 }
 
-static void
-remove_context_classes_hash_cb (G_GNUC_UNUSED gpointer class,
-                                GtkTextTag             *tag,
-                                GtkTextTagTable        *table)
-{
-	gtk_text_tag_table_remove (table, tag);
-}
-
 /**
  * destroy_tags_hash:
  * @ce: #GtkSourceContextEngine.
@@ -2455,15 +3499,6 @@ destroy_tags_hash (GtkSourceContextEngine *ce)
 	ce->priv->tags = NULL;
 }
 
-static void
-destroy_context_classes_hash (GtkSourceContextEngine *ce)
-{
-	g_hash_table_foreach (ce->priv->context_classes, (GHFunc) remove_context_classes_hash_cb,
-	                      gtk_text_buffer_get_tag_table (ce->priv->buffer));
-	g_hash_table_destroy (ce->priv->context_classes);
-	ce->priv->context_classes = NULL;
-}
-
 /**
  * gtk_source_context_engine_attach_buffer:
  * @ce: #GtkSourceContextEngine.
@@ -2477,6 +3512,7 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 					 GtkTextBuffer   *buffer)
 {
 	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	guint i;
 
 	g_return_if_fail (!buffer || GTK_IS_TEXT_BUFFER (buffer));
 
@@ -2489,6 +3525,28 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
 						      (gpointer) buffer_notify_highlight_syntax_cb,
 						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_max_line_length_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_highlight_visible_only_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_sync_lines_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_append_only_cb,
+						      ce);
+		g_signal_handlers_disconnect_by_func (ce->priv->buffer,
+						      (gpointer) buffer_notify_highlight_cache_cb,
+						      ce);
+
+		if (g_object_get_data (G_OBJECT (ce->priv->buffer), ENGINE_DATA_KEY) == ce)
+			g_object_set_data (G_OBJECT (ce->priv->buffer), ENGINE_DATA_KEY, NULL);
+
+		if (ce->priv->background != NULL)
+			finish_background_analysis (ce, TRUE);
+		wait_highlight_cache_save (ce);
 
 		if (ce->priv->first_update != 0)
 			g_source_remove (ce->priv->first_update);
@@ -2496,25 +3554,20 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 			g_source_remove (ce->priv->incremental_update);
 		ce->priv->first_update = 0;
 		ce->priv->incremental_update = 0;
+		ce->priv->cache_load_pending = FALSE;
+		ce->priv->cache_save_pending = FALSE;
+
+		ce->priv->n_lines = 1;
+		forget_line_chunk (ce);
 
-		if (ce->priv->root_segment != NULL)
-			segment_destroy (ce, ce->priv->root_segment);
-		if (ce->priv->root_context != NULL)
-			context_unref (ce->priv->root_context);
-		g_assert (!ce->priv->invalid);
-		g_slist_free (ce->priv->invalid);
-		ce->priv->root_segment = NULL;
-		ce->priv->root_context = NULL;
-		ce->priv->invalid = NULL;
-
-		if (ce->priv->invalid_region.start != NULL)
-			gtk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.start);
-		if (ce->priv->invalid_region.end != NULL)
-			gtk_text_buffer_delete_mark (ce->priv->buffer,
-						     ce->priv->invalid_region.end);
-		ce->priv->invalid_region.start = NULL;
-		ce->priv->invalid_region.end = NULL;
+		g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+		segment_tree_destroy (ce);
+		g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+		for (i = 0; i < ce->priv->invalid_regions->len; i++)
+			invalid_region_free_marks (ce, &g_array_index (ce->priv->invalid_regions,
+								       InvalidRegion, i));
+		g_array_set_size (ce->priv->invalid_regions, 0);
 
 		/* this deletes tags from the tag table, therefore there is no need
 		 * in removing tags from the text (it may be very slow).
@@ -2525,11 +3578,19 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 		destroy_tags_hash (ce);
 		ce->priv->n_tags = 0;
 
-		destroy_context_classes_hash (ce);
-
 		if (ce->priv->refresh_region != NULL)
 			gtk_text_region_destroy (ce->priv->refresh_region, FALSE);
 		ce->priv->refresh_region = NULL;
+
+		if (ce->priv->provisional_region != NULL)
+			gtk_text_region_destroy (ce->priv->provisional_region, FALSE);
+		ce->priv->provisional_region = NULL;
+
+		window_scratch_free (ce);
+
+		if (ce->priv->tagged_region != NULL)
+			gtk_text_region_destroy (ce->priv->tagged_region, FALSE);
+		ce->priv->tagged_region = NULL;
 	}
 
 	ce->priv->buffer = buffer;
@@ -2538,6 +3599,7 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 	{
 		ContextDefinition *main_definition;
 		GtkTextIter start, end;
+		gboolean visible_only;
 
 		main_definition = gtk_source_context_data_lookup_root (ce->priv->ctx_data);
 
@@ -2545,38 +3607,73 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 		 * never happen, _gtk_source_context_data_finish_parse checks main context. */
 		g_assert (main_definition != NULL);
 
-		ce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, FALSE);
+		g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+		ce->priv->root_context = context_new (ce, NULL, main_definition, NULL, NULL, FALSE);
 		ce->priv->root_segment = create_segment (ce, NULL, ce->priv->root_context, 0, 0, TRUE, NULL);
+		g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
 
 		ce->priv->tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-		ce->priv->context_classes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-		gtk_text_buffer_get_bounds (buffer, &start, &end);
-		ce->priv->invalid_region.start = gtk_text_buffer_create_mark (buffer, NULL,
-									      &start, TRUE);
-		ce->priv->invalid_region.end = gtk_text_buffer_create_mark (buffer, NULL,
-									    &end, FALSE);
 
-		if (gtk_text_buffer_get_char_count (buffer) != 0)
-		{
-			ce->priv->invalid_region.empty = FALSE;
-			ce->priv->invalid_region.delta = gtk_text_buffer_get_char_count (buffer);
-		}
-		else
+		g_object_get (buffer,
+			      "highlight-syntax", &ce->priv->highlight,
+			      "max-highlight-line-length", &ce->priv->max_line_length,
+			      "highlight-visible-only", &visible_only,
+			      "highlight-sync-lines", &ce->priv->sync_lines,
+			      "append-only", &ce->priv->append_only,
+			      "highlight-cache", &ce->priv->highlight_cache,
+			      NULL);
+
+		ce->priv->cache_load_pending = ce->priv->highlight_cache;
+
+		/* In bounded mode the text is never analyzed as a whole,
+		 * the root segment stays empty. */
+		if (gtk_text_buffer_get_char_count (buffer) != 0 &&
+		    ce->priv->sync_lines < 0)
 		{
-			ce->priv->invalid_region.empty = TRUE;
-			ce->priv->invalid_region.delta = 0;
+			InvalidRegion region;
+
+			gtk_text_buffer_get_bounds (buffer, &start, &end);
+			region.start = gtk_text_buffer_create_mark (buffer, NULL, &start, TRUE);
+			region.end = gtk_text_buffer_create_mark (buffer, NULL, &end, FALSE);
+			region.delta = gtk_text_buffer_get_char_count (buffer);
+			g_array_append_val (ce->priv->invalid_regions, region);
 		}
 
-		g_object_get (buffer, "highlight-syntax", &ce->priv->highlight, NULL);
 		ce->priv->refresh_region = gtk_text_region_new (buffer);
+		ce->priv->provisional_region = gtk_text_region_new (buffer);
+
+		if (visible_only || ce->priv->sync_lines >= 0)
+			ce->priv->tagged_region = gtk_text_region_new (buffer);
 
 		g_signal_connect_swapped (buffer,
 					  "notify::highlight-syntax",
 					  G_CALLBACK (buffer_notify_highlight_syntax_cb),
 					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::max-highlight-line-length",
+					  G_CALLBACK (buffer_notify_max_line_length_cb),
+					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-visible-only",
+					  G_CALLBACK (buffer_notify_highlight_visible_only_cb),
+					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-sync-lines",
+					  G_CALLBACK (buffer_notify_sync_lines_cb),
+					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::append-only",
+					  G_CALLBACK (buffer_notify_append_only_cb),
+					  ce);
+		g_signal_connect_swapped (buffer,
+					  "notify::highlight-cache",
+					  G_CALLBACK (buffer_notify_highlight_cache_cb),
+					  ce);
 
-		install_first_update (ce);
+		g_object_set_data (G_OBJECT (buffer), ENGINE_DATA_KEY, ce);
+
+		if (ce->priv->sync_lines < 0)
+			install_first_update (ce);
 	}
 }
 
@@ -2600,33 +3697,114 @@ disable_syntax_analysis (GtkSourceContextEngine *ce)
 }
 
 static void
-set_tag_style_hash_cb (const char             *style,
-		       GSList                 *tags,
-		       GtkSourceContextEngine *ce)
+buffer_notify_max_line_length_cb (GtkSourceContextEngine *ce)
 {
-	while (tags != NULL)
-	{
-		set_tag_style (ce, tags->data, style);
-		tags = tags->next;
-	}
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	gint max_line_length;
+
+	g_object_get (buffer, "max-highlight-line-length", &max_line_length, NULL);
+
+	if (max_line_length == ce->priv->max_line_length)
+		return;
+
+	/* Lines analyzed with the old limit are not known, so start over. */
+	g_object_ref (buffer);
+	gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), NULL);
+	gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), buffer);
+	g_object_unref (buffer);
 }
 
-/**
- * gtk_source_context_engine_set_style_scheme:
- * @engine: #GtkSourceContextEngine.
- * @scheme: #GtkSourceStyleScheme to set.
- *
- * GtkSourceEngine::set_style_scheme method.
- * Sets current style scheme, updates tag styles and everything.
- */
 static void
-gtk_source_context_engine_set_style_scheme (GtkSourceEngine      *engine,
-					    GtkSourceStyleScheme *scheme)
+buffer_notify_highlight_visible_only_cb (GtkSourceContextEngine *ce)
 {
-	GtkSourceContextEngine *ce;
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	gboolean visible_only;
 
-	g_return_if_fail (GTK_SOURCE_IS_CONTEXT_ENGINE (engine));
-	g_return_if_fail (GTK_SOURCE_IS_STYLE_SCHEME (scheme) || scheme == NULL);
+	g_object_get (buffer, "highlight-visible-only", &visible_only, NULL);
+
+	if (visible_only)
+	{
+		GtkTextIter start, end;
+
+		if (ce->priv->tagged_region != NULL)
+			return;
+
+		/* Anything may be tagged, forget_hidden_tags() sorts it out. */
+		ce->priv->tagged_region = gtk_text_region_new (buffer);
+		gtk_text_buffer_get_bounds (buffer, &start, &end);
+		gtk_text_region_add (ce->priv->tagged_region, &start, &end);
+	}
+	else if (ce->priv->tagged_region != NULL && ce->priv->sync_lines < 0)
+	{
+		gtk_text_region_destroy (ce->priv->tagged_region, TRUE);
+		ce->priv->tagged_region = NULL;
+	}
+}
+
+static void
+buffer_notify_sync_lines_cb (GtkSourceContextEngine *ce)
+{
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	gint sync_lines;
+
+	g_object_get (buffer, "highlight-sync-lines", &sync_lines, NULL);
+
+	if (sync_lines == ce->priv->sync_lines)
+		return;
+
+	/* Switching between the whole tree and windows, or changing
+	 * the window size, invalidates everything. */
+	g_object_ref (buffer);
+	gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), NULL);
+	gtk_source_context_engine_attach_buffer (GTK_SOURCE_ENGINE (ce), buffer);
+	g_object_unref (buffer);
+}
+
+static void
+buffer_notify_append_only_cb (GtkSourceContextEngine *ce)
+{
+	g_object_get (ce->priv->buffer, "append-only", &ce->priv->append_only, NULL);
+}
+
+static void
+buffer_notify_highlight_cache_cb (GtkSourceContextEngine *ce)
+{
+	g_object_get (ce->priv->buffer, "highlight-cache", &ce->priv->highlight_cache, NULL);
+
+	/* Save the tree as soon as it is analyzed, it may be now. */
+	ce->priv->cache_load_pending = ce->priv->highlight_cache;
+	ce->priv->cache_save_pending = ce->priv->highlight_cache;
+	save_highlight_cache (ce);
+}
+
+static void
+set_tag_style_hash_cb (const char             *style,
+		       GSList                 *tags,
+		       GtkSourceContextEngine *ce)
+{
+	while (tags != NULL)
+	{
+		set_tag_style (ce, tags->data, style);
+		tags = tags->next;
+	}
+}
+
+/**
+ * gtk_source_context_engine_set_style_scheme:
+ * @engine: #GtkSourceContextEngine.
+ * @scheme: #GtkSourceStyleScheme to set.
+ *
+ * GtkSourceEngine::set_style_scheme method.
+ * Sets current style scheme, updates tag styles and everything.
+ */
+static void
+gtk_source_context_engine_set_style_scheme (GtkSourceEngine      *engine,
+					    GtkSourceStyleScheme *scheme)
+{
+	GtkSourceContextEngine *ce;
+
+	g_return_if_fail (GTK_SOURCE_IS_CONTEXT_ENGINE (engine));
+	g_return_if_fail (GTK_SOURCE_IS_STYLE_SCHEME (scheme) || scheme == NULL);
 
 	ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
 
@@ -2658,6 +3836,20 @@ gtk_source_context_engine_finalize (GObject *object)
 	g_assert (!ce->priv->root_segment);
 	g_assert (!ce->priv->first_update);
 	g_assert (!ce->priv->incremental_update);
+	g_assert (!ce->priv->background);
+	g_assert (!ce->priv->cache_save_thread);
+
+	g_array_free (ce->priv->line_states, TRUE);
+	g_assert (ce->priv->dropped_segments->len == 0);
+	g_ptr_array_free (ce->priv->dropped_segments, TRUE);
+	g_assert (ce->priv->invalid_regions->len == 0);
+	g_array_free (ce->priv->invalid_regions, TRUE);
+	node_pool_clear (&ce->priv->segment_pool);
+	node_pool_clear (&ce->priv->sub_pattern_pool);
+	g_assert (g_hash_table_size (ce->priv->line_cache) == 0);
+	g_hash_table_destroy (ce->priv->line_cache);
+	forget_line_chunk (ce);
+	g_free (ce->priv->line_text);
 
 	_gtk_source_context_data_unref (ce->priv->ctx_data);
 
@@ -2667,22 +3859,6 @@ gtk_source_context_engine_finalize (GObject *object)
 	G_OBJECT_CLASS (_gtk_source_context_engine_parent_class)->finalize (object);
 }
 
-static GtkTextTag *
-gtk_source_context_engine_get_context_class_tag (GtkSourceEngine *engine,
-						 const gchar     *context_class)
-{
-	GHashTable *hash_table = GTK_SOURCE_CONTEXT_ENGINE (engine)->priv->context_classes;
-
-	if (hash_table == NULL)
-	{
-		/* This happens when highlighting is disabled */
-		return NULL;
-	}
-
-	return g_hash_table_lookup (hash_table,
-				    context_class);
-}
-
 static void
 _gtk_source_context_engine_class_init (GtkSourceContextEngineClass *klass)
 {
@@ -2694,15 +3870,31 @@ _gtk_source_context_engine_class_init (GtkSourceContextEngineClass *klass)
 	engine_class->attach_buffer = gtk_source_context_engine_attach_buffer;
 	engine_class->text_inserted = gtk_source_context_engine_text_inserted;
 	engine_class->text_deleted = gtk_source_context_engine_text_deleted;
+	engine_class->text_truncated = gtk_source_context_engine_text_truncated;
 	engine_class->update_highlight = gtk_source_context_engine_update_highlight;
 	engine_class->set_style_scheme = gtk_source_context_engine_set_style_scheme;
-	engine_class->get_context_class_tag = gtk_source_context_engine_get_context_class_tag;
+	engine_class->iter_has_context_class = gtk_source_context_engine_iter_has_context_class;
+	engine_class->get_context_classes_at_iter = gtk_source_context_engine_get_context_classes_at_iter;
+	engine_class->iter_forward_to_context_class_toggle = gtk_source_context_engine_iter_forward_to_context_class_toggle;
+	engine_class->iter_backward_to_context_class_toggle = gtk_source_context_engine_iter_backward_to_context_class_toggle;
+	engine_class->foreach_token = gtk_source_context_engine_foreach_token;
 }
 
 static void
 _gtk_source_context_engine_init (GtkSourceContextEngine *ce)
 {
 	ce->priv = _gtk_source_context_engine_get_instance_private (ce);
+	ce->priv->line_states = g_array_new (FALSE, FALSE, sizeof (LineState));
+	ce->priv->dropped_segments = g_ptr_array_new ();
+	ce->priv->invalid_regions = g_array_new (FALSE, FALSE, sizeof (InvalidRegion));
+	ce->priv->n_lines = 1;
+	ce->priv->max_line_length = -1;
+	ce->priv->sync_lines = -1;
+	node_pool_init (&ce->priv->segment_pool, sizeof (Segment));
+	node_pool_init (&ce->priv->sub_pattern_pool, sizeof (SubPattern));
+	ce->priv->line_cache = g_hash_table_new ((GHashFunc) line_cache_entry_hash,
+						 (GEqualFunc) line_cache_entry_equal);
+	g_queue_init (&ce->priv->line_cache_queue);
 }
 
 GtkSourceContextEngine *
@@ -2738,6 +3930,9 @@ _gtk_source_context_data_new (GtkSourceLanguage *lang)
 	ctx_data->lang = lang;
 	ctx_data->definitions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
 						       (GDestroyNotify) context_definition_unref);
+	ctx_data->regexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						   (GDestroyNotify) _gtk_source_regex_unref);
+	g_rec_mutex_init (&ctx_data->lock);
 
 	return ctx_data;
 }
@@ -2768,7 +3963,9 @@ _gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
 		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
 		    ctx_data->lang->priv->ctx_data == ctx_data)
 			ctx_data->lang->priv->ctx_data = NULL;
+		g_hash_table_destroy (ctx_data->regexes);
 		g_hash_table_destroy (ctx_data->definitions);
+		g_rec_mutex_clear (&ctx_data->lock);
 		g_slice_free (GtkSourceContextData, ctx_data);
 	}
 }
@@ -2777,6 +3974,7 @@ _gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
 
 /**
  * apply_sub_patterns:
+ * @ce: #GtkSourceContextEngine.
  * @contextstate: a #Context.
  * @line_starts_at: beginning offset of the line.
  * @line: the line to analyze.
@@ -2788,10 +3986,11 @@ _gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
  * Applies sub patterns of kind @where to the matched text.
  */
 static void
-apply_sub_patterns (Segment         *state,
-		    LineInfo        *line,
-		    GtkSourceRegex  *regex,
-		    SubPatternWhere  where)
+apply_sub_patterns (GtkSourceContextEngine *ce,
+		    Segment                *state,
+		    LineInfo               *line,
+		    GtkSourceRegex         *regex,
+		    SubPatternWhere         where)
 {
 	GSList *sub_pattern_list = state->context->definition->sub_patterns;
 
@@ -2799,26 +3998,30 @@ apply_sub_patterns (Segment         *state,
 	{
 		gint start_pos;
 		gint end_pos;
+		gint start_at;
+		gint end_at;
 
-		_gtk_source_regex_fetch_pos (regex, line->text, 0, &start_pos, &end_pos);
+		_gtk_source_regex_fetch_pos_bytes (regex, 0, &start_pos, &end_pos);
+		start_at = line_pos_to_offset (line, start_pos);
+		end_at = line_pos_to_offset (line, end_pos);
 
 		if (where == SUB_PATTERN_WHERE_START)
 		{
-			if (line->start_at + start_pos != state->start_at)
+			if (start_at != state->start_at)
 				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos > state->end_at)
+			else if (end_at > state->end_at)
 				g_critical ("%s: oops", G_STRLOC);
 			else
-				state->start_len = line->start_at + end_pos - state->start_at;
+				state->start_len = end_at - state->start_at;
 		}
 		else
 		{
-			if (line->start_at + start_pos < state->start_at)
+			if (start_at < state->start_at)
 				g_critical ("%s: oops", G_STRLOC);
-			else if (line->start_at + end_pos != state->end_at)
+			else if (end_at != state->end_at)
 				g_critical ("%s: oops", G_STRLOC);
 			else
-				state->end_len = state->end_at - line->start_at - start_pos;
+				state->end_len = state->end_at - start_at;
 		}
 	}
 
@@ -2833,26 +4036,25 @@ apply_sub_patterns (Segment         *state,
 
 			if (sp_def->is_named)
 			{
-				_gtk_source_regex_fetch_named_pos (regex,
-								   line->text,
-								   sp_def->u.name,
-								   &start_pos,
-								   &end_pos);
+				_gtk_source_regex_fetch_named_pos_bytes (regex,
+									 sp_def->u.name,
+									 &start_pos,
+									 &end_pos);
 			}
 			else
 			{
-				_gtk_source_regex_fetch_pos (regex,
-							     line->text,
-							     sp_def->u.num,
-							     &start_pos,
-							     &end_pos);
+				_gtk_source_regex_fetch_pos_bytes (regex,
+								   sp_def->u.num,
+								   &start_pos,
+								   &end_pos);
 			}
 
 			if (start_pos >= 0 && start_pos != end_pos)
 			{
-				sub_pattern_new (state,
-						 line->start_at + start_pos,
-						 line->start_at + end_pos,
+				sub_pattern_new (ce,
+						 state,
+						 line_pos_to_offset (line, start_pos),
+						 line_pos_to_offset (line, end_pos),
 						 sp_def);
 			}
 		}
@@ -2935,17 +4137,42 @@ can_apply_match (Context        *state,
 	return TRUE;
 }
 
+/**
+ * line_pos_to_offset:
+ * @line: analyzed line.
+ * @pos: position inside @line, bytes.
+ *
+ * Converts @pos to an offset in the buffer. Positions are converted
+ * mostly in increasing order, so for non-ASCII lines it walks from the
+ * previously converted position, which keeps analysis of long lines
+ * linear.
+ *
+ * Returns: character offset of @pos in the buffer.
+ */
 static gint
 line_pos_to_offset (LineInfo *line,
 		    gint      pos)
 {
 	if (line->char_length != line->byte_length)
-		pos = g_utf8_pointer_to_offset (line->text, line->text + pos);
+	{
+		if (pos < line->last_byte_pos - pos)
+		{
+			line->last_byte_pos = 0;
+			line->last_char_pos = 0;
+		}
+
+		line->last_char_pos += g_utf8_pointer_to_offset (line->text + line->last_byte_pos,
+								 line->text + pos);
+		line->last_byte_pos = pos;
+		pos = line->last_char_pos;
+	}
+
 	return line->start_at + pos;
 }
 
 /**
  * apply_match:
+ * @ce: #GtkSourceContextEngine.
  * @state: the current state of the parser.
  * @line: the line to analyze.
  * @line_pos: position in the line, bytes.
@@ -2963,11 +4190,12 @@ line_pos_to_offset (LineInfo *line,
  * Returns: %TRUE if the match can be applied.
  */
 static gboolean
-apply_match (Segment         *state,
-	     LineInfo        *line,
-	     gint            *line_pos,
-	     GtkSourceRegex  *regex,
-	     SubPatternWhere  where)
+apply_match (GtkSourceContextEngine *ce,
+	     Segment                *state,
+	     LineInfo               *line,
+	     gint                   *line_pos,
+	     GtkSourceRegex         *regex,
+	     SubPatternWhere         where)
 {
 	gint match_end;
 
@@ -2975,21 +4203,351 @@ apply_match (Segment         *state,
 		return FALSE;
 
 	segment_extend (state, line_pos_to_offset (line, match_end));
-	apply_sub_patterns (state, line, regex, where);
+	apply_sub_patterns (ce, state, line, regex, where);
 	*line_pos = match_end;
 
 	return TRUE;
 }
 
+/* KEYWORD SETS ----------------------------------------------------------- */
+
+#define IS_WORD_BYTE(c) (g_ascii_isalnum (c) || (c) == '_')
+
+static void
+keyword_set_add_ (KeywordSet  *set,
+		  const gchar *word,
+		  gsize        length,
+		  gboolean     caseless)
+{
+	GHashTable **words = caseless ? &set->folded_words : &set->words;
+
+	if (*words == NULL)
+		*words = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	g_hash_table_add (*words, caseless ? g_ascii_strdown (word, length) :
+					      g_strndup (word, length));
+	set->max_length = MAX (set->max_length, length);
+}
+
+static void
+keyword_set_free (KeywordSet *set)
+{
+	if (set != NULL)
+	{
+		if (set->words != NULL)
+			g_hash_table_destroy (set->words);
+		if (set->folded_words != NULL)
+			g_hash_table_destroy (set->folded_words);
+		g_slice_free (KeywordSet, set);
+	}
+}
+
+/**
+ * keyword_set_new_from_pattern:
+ * @pattern: a match regex.
+ *
+ * Checks whether @pattern is a list of keywords as generated by the
+ * parser from &lt;keyword&gt; elements with default prefix and suffix,
+ * i.e. "(?i-x)\b(word1|word2|...)\b" where words are made of ASCII
+ * letters, digits and underscores.
+ *
+ * Returns: a new #KeywordSet containing the words, or %NULL.
+ */
+static KeywordSet *
+keyword_set_new_from_pattern (const gchar *pattern)
+{
+	KeywordSet *set;
+	const gchar *p;
+	gboolean caseless = FALSE;
+	gboolean negated = FALSE;
+
+	if (!g_str_has_prefix (pattern, "(?"))
+		return NULL;
+
+	for (p = pattern + 2; *p != ')'; p++)
+	{
+		switch (*p)
+		{
+			case 'i':
+				caseless = !negated;
+				break;
+			case 'x':
+			case 'J':
+				break;
+			case '-':
+				negated = TRUE;
+				break;
+			default:
+				return NULL;
+		}
+	}
+
+	p++;
+
+	if (!g_str_has_prefix (p, "\\b("))
+		return NULL;
+
+	set = g_slice_new0 (KeywordSet);
+
+	for (p += 3; ; p++)
+	{
+		const gchar *word = p;
+
+		while (IS_WORD_BYTE (*p))
+			p++;
+
+		if (p == word || p - word > KEYWORD_MAX_LENGTH)
+			break;
+
+		keyword_set_add_ (set, word, p - word, caseless);
+
+		if (*p != '|')
+		{
+			if (*p == ')' && strcmp (p + 1, "\\b") == 0)
+				return set;
+			break;
+		}
+	}
+
+	keyword_set_free (set);
+	return NULL;
+}
+
+static void
+merge_words_ (KeywordSet *set,
+	      GHashTable *words,
+	      gboolean    caseless)
+{
+	GHashTableIter iter;
+	const gchar *word;
+
+	if (words == NULL)
+		return;
+
+	g_hash_table_iter_init (&iter, words);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &word, NULL))
+		keyword_set_add_ (set, word, strlen (word), caseless);
+}
+
+/**
+ * get_child_keywords:
+ * @ctx_data: #GtkSourceContextData.
+ * @definition: context definition.
+ *
+ * Returns keywords of all the children of @definition which have a
+ * keyword set, creating the union on first use. These children are
+ * not part of reg_all, see next_segment().
+ *
+ * Returns: a #KeywordSet, or %NULL if no child has keywords.
+ */
+static KeywordSet *
+get_child_keywords (GtkSourceContextData *ctx_data,
+		    ContextDefinition    *definition)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+
+	if (g_atomic_int_get (&definition->child_keywords_ready))
+		return definition->child_keywords;
+
+	/* Analysis threads may get here without the lock. */
+	g_rec_mutex_lock (&ctx_data->lock);
+
+	if (definition->child_keywords_ready)
+	{
+		g_rec_mutex_unlock (&ctx_data->lock);
+		return definition->child_keywords;
+	}
+
+	definition_iter_init (&iter, definition);
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+	{
+		KeywordSet *keywords = child_def->u.definition->keywords;
+
+		if (keywords == NULL)
+			continue;
+
+		if (definition->child_keywords == NULL)
+			definition->child_keywords = g_slice_new0 (KeywordSet);
+
+		merge_words_ (definition->child_keywords, keywords->words, FALSE);
+		merge_words_ (definition->child_keywords, keywords->folded_words, TRUE);
+	}
+	definition_iter_destroy (&iter);
+
+	g_atomic_int_set (&definition->child_keywords_ready, TRUE);
+	g_rec_mutex_unlock (&ctx_data->lock);
+
+	return definition->child_keywords;
+}
+
+static gboolean
+keyword_set_contains_ (KeywordSet  *set,
+		       const gchar *text,
+		       gsize        length)
+{
+	gchar word[KEYWORD_MAX_LENGTH + 1];
+	gsize i;
+
+	if (length > set->max_length)
+		return FALSE;
+
+	memcpy (word, text, length);
+	word[length] = 0;
+
+	if (set->words != NULL && g_hash_table_contains (set->words, word))
+		return TRUE;
+
+	if (set->folded_words == NULL)
+		return FALSE;
+
+	for (i = 0; i < length; i++)
+		word[i] = g_ascii_tolower (word[i]);
+
+	return g_hash_table_contains (set->folded_words, word);
+}
+
+/**
+ * keyword_set_find:
+ * @set: a #KeywordSet.
+ * @line: analyzed line.
+ * @pos: the position inside @line to start from, bytes.
+ * @limit: position inside @line where to stop, bytes.
+ *
+ * Looks for the first position in [@pos, @limit) where a word from
+ * @set may start. It may return positions where the keyword regex does
+ * not match, e.g. when non-ASCII characters follow the word, since
+ * only ASCII is classified here; but it never skips a position where
+ * it does match.
+ *
+ * Returns: the position, or -1 if not found.
+ */
+static gint
+keyword_set_find (KeywordSet *set,
+		  LineInfo   *line,
+		  gint        pos,
+		  gint        limit)
+{
+	const gchar *text = line->text;
+	gint p = pos;
+
+	limit = MIN (limit, line->byte_length);
+
+	/* Not at the beginning of a word. */
+	if (p > 0 && IS_WORD_BYTE (text[p - 1]))
+	{
+		while (p < line->byte_length && IS_WORD_BYTE (text[p]))
+			p++;
+	}
+
+	while (p < limit)
+	{
+		guchar c = text[p];
+
+		if (IS_WORD_BYTE (c))
+		{
+			gint start = p;
+
+			while (p < line->byte_length && IS_WORD_BYTE (text[p]))
+				p++;
+
+			if ((p < line->byte_length && (guchar) text[p] >= 0x80) ||
+			    keyword_set_contains_ (set, text + start, p - start))
+			{
+				return start;
+			}
+		}
+		/* Some non-ASCII characters match ASCII letters caselessly. */
+		else if (c >= 0xC0 && set->folded_words != NULL)
+		{
+			return p;
+		}
+		else
+		{
+			p++;
+		}
+	}
+
+	return -1;
+}
+
+static void
+reg_all_stats_add_ (guint   compiled,
+		    guint   reused,
+		    gdouble compile_time)
+{
+	g_mutex_lock (&reg_all_stats.lock);
+	reg_all_stats.compiled += compiled;
+	reg_all_stats.reused += reused;
+	reg_all_stats.compile_time += compile_time;
+	g_mutex_unlock (&reg_all_stats.lock);
+}
+
+/**
+ * reg_all_key:
+ * @context: a #Context.
+ *
+ * The reg_all regex of a context is built from its definition, and
+ * from the end regexes of the ancestors which can terminate it, see
+ * create_reg_all(). Which ones can is decided by the definitions of
+ * the contexts walked up there and by their all_ancestors_extend
+ * flags; and the end regexes are those of the definitions, unless
+ * they are resolved from the text matched by start regexes.
+ *
+ * Returns: a string identifying the reg_all regex of @context among
+ * the regexes of its language, the key of the regex in the regexes
+ * of #GtkSourceContextData, or %NULL if the regex contains text
+ * matched by a start regex.
+ */
+static gchar *
+reg_all_key (Context *context)
+{
+	ContextDefinition *definition = context->definition;
+	GString *key;
+	Context *tmp;
+
+	if (definition->type == CONTEXT_TYPE_CONTAINER &&
+	    definition->u.start_end.end != NULL &&
+	    !_gtk_source_regex_is_resolved (definition->u.start_end.end))
+		return NULL;
+
+	key = g_string_sized_new (64);
+
+	for (tmp = context; ; tmp = tmp->parent)
+	{
+		gint depth = tmp->parent == NULL ? 0 : tmp->parent->parent == NULL ? 1 : 2;
+
+		g_string_append_printf (key, "%p/%d/%d;",
+					(gpointer) tmp->definition,
+					tmp->all_ancestors_extend,
+					depth);
+
+		if (!ANCESTOR_CAN_END_CONTEXT (tmp))
+			break;
+
+		if (!CONTEXT_EXTENDS_PARENT (tmp) &&
+		    tmp->parent->end != NULL &&
+		    !_gtk_source_regex_is_resolved (tmp->parent->definition->u.start_end.end))
+		{
+			g_string_free (key, TRUE);
+			return NULL;
+		}
+	}
+
+	return g_string_free (key, FALSE);
+}
+
 /**
  * create_reg_all:
+ * @ctx_data: #GtkSourceContextData the definition belongs to.
  * @context: context.
  * @definition: context definition.
  *
  * Creates regular expression for all possible transitions: it
  * combines terminating regex, terminating regexes of parent
  * contexts if those can terminate this one, and start regexes
- * of child contexts.
+ * of child contexts. Children with a keyword set are left out,
+ * next_segment() looks for them separately.
  *
  * It takes as an argument actual context or a context definition. In
  * case when context end depends on start (\%{foo@start} references),
@@ -2998,21 +4556,47 @@ apply_match (Segment         *state,
  * when no contexts exist yet. This is why this function has its funny
  * arguments.
  *
+ * A regex created for a context does not depend on the buffer unless
+ * it contains an end regex resolved from the matched text, so it is
+ * kept in @ctx_data and shared by all contexts (in all buffers) with
+ * the same definition and ancestors. It is indexed by reg_all_key(),
+ * which names everything the pattern is built from, so the pattern
+ * is not even built again for them.
+ *
  * Returns: resulting regex or %NULL when pcre failed to compile the regex.
  */
 static GtkSourceRegex *
-create_reg_all (Context           *context,
-		ContextDefinition *definition)
+create_reg_all (GtkSourceContextData *ctx_data,
+		Context              *context,
+		ContextDefinition    *definition)
 {
 	DefinitionsIter iter;
 	DefinitionChild *child_def;
 	GString *all;
 	GtkSourceRegex *regex;
 	GError *error = NULL;
+	gboolean shared = context != NULL;
+	gchar *key = NULL;
+	GTimer *timer;
 
 	g_return_val_if_fail ((context == NULL && definition != NULL) ||
 			      (context != NULL && definition == NULL), NULL);
 
+	if (context != NULL)
+		key = reg_all_key (context);
+
+	if (key != NULL)
+	{
+		regex = g_hash_table_lookup (ctx_data->regexes, key);
+
+		if (regex != NULL)
+		{
+			g_free (key);
+			reg_all_stats_add_ (0, 1, 0);
+			return _gtk_source_regex_ref (regex);
+		}
+	}
+
 	if (definition == NULL)
 		definition = context->definition;
 
@@ -3032,6 +4616,7 @@ create_reg_all (Context           *context,
 		{
 			g_return_val_if_fail (context && context->end, NULL);
 			end = context->end;
+			shared = FALSE;
 		}
 
 		g_string_append (all, _gtk_source_regex_get_pattern (end));
@@ -3053,7 +4638,12 @@ create_reg_all (Context           *context,
 				 * Remove FIXME's below if everything is fine. */
 
 				if (tmp->parent->end != NULL)
+				{
 					g_string_append (all, _gtk_source_regex_get_pattern (tmp->parent->end));
+
+					if (!_gtk_source_regex_is_resolved (tmp->parent->definition->u.start_end.end))
+						shared = FALSE;
+				}
 				/* FIXME ?
 				 * The old code insisted on having tmp->parent->end != NULL here,
 				 * though e.g. in case line-comment -> email-address it's not the case.
@@ -3096,7 +4686,7 @@ create_reg_all (Context           *context,
 				g_return_val_if_reached (NULL);
 		}
 
-		if (child_regex != NULL)
+		if (child_regex != NULL && child_def->u.definition->keywords == NULL)
 		{
 			g_string_append (all, _gtk_source_regex_get_pattern (child_regex));
 			g_string_append (all, "|");
@@ -3106,9 +4696,28 @@ create_reg_all (Context           *context,
 
 	if (all->len > 1)
 		g_string_truncate (all, all->len - 1);
+	/* Only keywords, next_segment() must not stop everywhere. */
+	else if (get_child_keywords (ctx_data, definition) != NULL)
+		g_string_append (all, "(?!)");
 	g_string_append (all, ")");
 
+	/* The key is there exactly when the pattern can be shared. */
+	g_assert ((key != NULL) == shared);
+
+	timer = g_timer_new ();
 	regex = _gtk_source_regex_new (all->str, 0, &error);
+	reg_all_stats_add_ (1, 0, g_timer_elapsed (timer, NULL));
+	g_timer_destroy (timer);
+
+	if (regex != NULL && key != NULL)
+	{
+		g_hash_table_insert (ctx_data->regexes, key,
+				     _gtk_source_regex_ref (regex));
+		g_string_free (all, TRUE);
+		return regex;
+	}
+
+	g_free (key);
 
 	if (regex == NULL)
 	{
@@ -3136,11 +4745,12 @@ context_ref (Context *context)
 
 /* does not copy style */
 static Context *
-context_new (Context           *parent,
-	     ContextDefinition *definition,
-	     const gchar       *line_text,
-	     const gchar       *style,
-	     gboolean           ignore_children_style)
+context_new (GtkSourceContextEngine *ce,
+	     Context                *parent,
+	     ContextDefinition      *definition,
+	     const gchar            *line_text,
+	     const gchar            *style,
+	     gboolean                ignore_children_style)
 {
 	Context *context;
 
@@ -3173,21 +4783,27 @@ context_new (Context           *parent,
 	}
 
 	/* Create reg_all. If it is possibile we share the same reg_all
-	 * for more contexts storing it in the definition. */
+	 * for more contexts storing it in the definition. The lock is
+	 * needed for analysis threads which do not hold it otherwise,
+	 * see start_background_analysis(). */
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+
 	if (ANCESTOR_CAN_END_CONTEXT (context) ||
 	    (definition->type == CONTEXT_TYPE_CONTAINER &&
 	     definition->u.start_end.end != NULL &&
 	     !_gtk_source_regex_is_resolved (definition->u.start_end.end)))
 	{
-		context->reg_all = create_reg_all (context, NULL);
+		context->reg_all = create_reg_all (ce->priv->ctx_data, context, NULL);
 	}
 	else
 	{
 		if (!definition->reg_all)
-			definition->reg_all = create_reg_all (NULL, definition);
+			definition->reg_all = create_reg_all (ce->priv->ctx_data, NULL, definition);
 		context->reg_all = _gtk_source_regex_ref (definition->reg_all);
 	}
 
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
 #ifdef ENABLE_DEBUG
 	{
 		GString *str = g_string_new (definition->id);
@@ -3279,7 +4895,6 @@ static void
 context_unref (Context *context)
 {
 	ContextPtr *children;
-	gint i;
 
 	if (context == NULL || --context->ref_count != 0)
 		return;
@@ -3318,21 +4933,59 @@ context_unref (Context *context)
 	if (context->parent != NULL)
 		context_remove_child (context->parent, context);
 
-	_gtk_source_regex_unref (context->end);
-	_gtk_source_regex_unref (context->reg_all);
+	context_free_ (context);
+}
+
+static void
+context_destroy_tree_hash_cb (G_GNUC_UNUSED gpointer text,
+			      Context *context)
+{
+	context_destroy_tree_ (context);
+}
+
+/**
+ * context_destroy_tree_:
+ * @context: the context.
+ *
+ * Frees @context and all its descendants regardless of their
+ * reference counts. Used together with node_pool_clear(), when
+ * the whole syntax tree is thrown away and it would be a waste
+ * of time to unref contexts segment by segment.
+ */
+static void
+context_destroy_tree_ (Context *context)
+{
+	ContextPtr *ptr = context->children;
 
-	if (context->subpattern_context_classes != NULL)
+	while (ptr != NULL)
 	{
-		for (i = 0; i < context->definition->n_sub_patterns; ++i)
+		ContextPtr *next = ptr->next;
+
+		if (ptr->fixed)
 		{
-			g_slist_free_full (context->subpattern_context_classes[i],
-			                   (GDestroyNotify)context_class_tag_free);
+			context_destroy_tree_ (ptr->u.context);
+		}
+		else
+		{
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_destroy_tree_hash_cb,
+					      NULL);
+			g_hash_table_destroy (ptr->u.hash);
 		}
+
+		g_slice_free (ContextPtr, ptr);
+		ptr = next;
 	}
 
-	g_slist_free_full (context->context_classes, (GDestroyNotify)context_class_tag_free);
+	context_free_ (context);
+}
+
+static void
+context_free_ (Context *context)
+{
+	_gtk_source_regex_unref (context->end);
+	_gtk_source_regex_unref (context->reg_all);
 
-	g_free (context->subpattern_context_classes);
 	g_free (context->subpattern_tags);
 
 	g_slice_free (Context, context);
@@ -3438,9 +5091,10 @@ context_thaw (Context *ctx)
 }
 
 static Context *
-create_child_context (Context           *parent,
-		      DefinitionChild   *child_def,
-		      const gchar       *line_text)
+create_child_context (GtkSourceContextEngine *ce,
+		      Context                *parent,
+		      DefinitionChild        *child_def,
+		      const gchar            *line_text)
 {
 	Context *context;
 	ContextPtr *ptr;
@@ -3460,12 +5114,8 @@ create_child_context (Context           *parent,
 		parent->children = ptr;
 		ptr->definition = definition;
 
-		if (definition->type != CONTEXT_TYPE_CONTAINER ||
-		    !definition->u.start_end.end ||
-		    _gtk_source_regex_is_resolved (definition->u.start_end.end))
-		{
+		if (DEFINITION_IS_FIXED (definition))
 			ptr->fixed = TRUE;
-		}
 
 		if (!ptr->fixed)
 			ptr->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -3488,7 +5138,8 @@ create_child_context (Context           *parent,
 		return context_ref (context);
 	}
 
-	context = context_new (parent,
+	context = context_new (ce,
+			       parent,
 			       definition,
 			       line_text,
 			       child_def->override_style ? child_def->style :
@@ -3533,7 +5184,7 @@ segment_new (GtkSourceContextEngine *ce,
 	g_assert (!is_start || context != NULL);
 #endif
 
-	segment = g_slice_new0 (Segment);
+	segment = node_pool_alloc0 (&ce->priv->segment_pool);
 	segment->parent = parent;
 	segment->context = context_ref (context);
 	segment->start_at = start_at;
@@ -3638,6 +5289,7 @@ find_segment_position (Segment  *parent,
 	g_assert (parent->start_at <= start_at && end_at <= parent->end_at);
 	g_assert (!hint || hint->parent == parent);
 
+
 	*prev = *next = NULL;
 
 	if (parent->children == NULL)
@@ -3778,7 +5430,7 @@ segment_destroy_children (GtkSourceContextEngine *ce,
 	while (sp != NULL)
 	{
 		SubPattern *next = sp->next;
-		sub_pattern_free (sp);
+		sub_pattern_free (ce, sp);
 		sp = next;
 	}
 }
@@ -3815,10 +5467,43 @@ segment_destroy (GtkSourceContextEngine *ce,
 
 #ifdef ENABLE_DEBUG
 	g_assert (!g_slist_find (ce->priv->invalid, segment));
-	memset (segment, 1, sizeof (Segment));
-#else
-	g_slice_free (Segment, segment);
 #endif
+
+	/* Line states pointing to it are removed later, all at once. */
+	if (segment->line_states != 0)
+		g_ptr_array_add (ce->priv->dropped_segments, segment);
+	else
+		node_pool_free (&ce->priv->segment_pool, segment);
+}
+
+/**
+ * segment_tree_destroy:
+ * @ce: the engine.
+ *
+ * Frees the whole syntax tree along with the root context. Unlike
+ * segment_destroy() it does not visit the segments, their memory
+ * is released by the pools at once.
+ */
+static void
+segment_tree_destroy (GtkSourceContextEngine *ce)
+{
+	clear_line_states (ce);
+	partial_line_free (ce);
+	line_cache_clear (ce);
+
+	g_slist_free (ce->priv->invalid);
+	ce->priv->invalid = NULL;
+	ce->priv->hint = NULL;
+	ce->priv->hint2 = NULL;
+
+	if (ce->priv->root_context != NULL)
+		context_destroy_tree_ (ce->priv->root_context);
+
+	node_pool_clear (&ce->priv->segment_pool);
+	node_pool_clear (&ce->priv->sub_pattern_pool);
+
+	ce->priv->root_context = NULL;
+	ce->priv->root_segment = NULL;
 }
 
 /**
@@ -3852,7 +5537,7 @@ container_context_starts_here (GtkSourceContextEngine  *ce,
 		return FALSE;
 	}
 
-	new_context = create_child_context (state->context, child_def, line->text);
+	new_context = create_child_context (ce, state->context, child_def, line->text);
 	g_return_val_if_fail (new_context != NULL, FALSE);
 
 	if (!can_apply_match (new_context, line, *line_pos, &match_end,
@@ -3887,7 +5572,7 @@ container_context_starts_here (GtkSourceContextEngine  *ce,
 		return FALSE;
 	}
 
-	apply_sub_patterns (new_segment, line,
+	apply_sub_patterns (ce, new_segment, line,
 			    definition->u.start_end.start,
 			    SUB_PATTERN_WHERE_START);
 	*line_pos = match_end;
@@ -3918,6 +5603,12 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 
 	g_assert (*line_pos <= line->byte_length);
 
+	if (definition->keywords != NULL &&
+	    keyword_set_find (definition->keywords, line, *line_pos, *line_pos + 1) < 0)
+	{
+		return FALSE;
+	}
+
 	if (!_gtk_source_regex_match (definition->u.match,
 				      line->text,
 				      line->byte_length,
@@ -3926,7 +5617,7 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 		return FALSE;
 	}
 
-	new_context = create_child_context (state->context, child_def, line->text);
+	new_context = create_child_context (ce, state->context, child_def, line->text);
 	g_return_val_if_fail (new_context != NULL, FALSE);
 
 	if (!can_apply_match (new_context, line, *line_pos, &match_end, definition->u.match))
@@ -3961,7 +5652,7 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 					      line_pos_to_offset (line, match_end),
 					      TRUE,
 					      ce->priv->hint2);
-		apply_sub_patterns (new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
+		apply_sub_patterns (ce, new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
 		ce->priv->hint2 = new_segment;
 	}
 
@@ -4176,10 +5867,14 @@ next_segment (GtkSourceContextEngine  *ce,
 	      Segment                **new_state)
 {
 	gint pos = *line_pos;
+	gint reg_all_pos = -1;
+	KeywordSet *keywords;
 
 	g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
 	g_assert (pos <= line->byte_length);
 
+	keywords = get_child_keywords (ce->priv->ctx_data, state->context->definition);
+
 	while (pos <= line->byte_length)
 	{
 		DefinitionsIter def_iter;
@@ -4188,16 +5883,38 @@ next_segment (GtkSourceContextEngine  *ce,
 
 		if (state->context->reg_all)
 		{
-			if (!_gtk_source_regex_match (state->context->reg_all,
-						      line->text,
-						      line->byte_length,
-						      pos))
+			gint keyword_pos = -1;
+
+			/* reg_all does not contain keywords, so the next
+			 * transition is the first of the reg_all match and
+			 * a word from the keyword sets. The reg_all match
+			 * is still valid if we skipped a keyword candidate
+			 * which did not match. */
+			if (reg_all_pos < pos)
 			{
-				return FALSE;
+				if (_gtk_source_regex_match (state->context->reg_all,
+							     line->text,
+							     line->byte_length,
+							     pos))
+				{
+					_gtk_source_regex_fetch_pos_bytes (state->context->reg_all,
+									   0, &reg_all_pos, NULL);
+				}
+				else
+				{
+					reg_all_pos = G_MAXINT;
+				}
 			}
 
-			_gtk_source_regex_fetch_pos_bytes (state->context->reg_all,
-							   0, &pos, NULL);
+			if (keywords != NULL)
+				keyword_pos = keyword_set_find (keywords, line, pos, reg_all_pos);
+
+			if (keyword_pos >= 0)
+				pos = keyword_pos;
+			else if (reg_all_pos != G_MAXINT)
+				pos = reg_all_pos;
+			else
+				return FALSE;
 		}
 
 		/* Does an ancestor end here? */
@@ -4228,7 +5945,8 @@ next_segment (GtkSourceContextEngine  *ce,
 			if (!HAS_OPTION (child_def->u.definition, EXTEND_PARENT) && context_end_found)
 				try_this = FALSE;
 
-			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) && line->start_at != 0)
+			if (HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY) &&
+			    (line->start_at != 0 || ce->priv->no_first_line))
 				try_this = FALSE;
 
 			if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
@@ -4272,7 +5990,7 @@ next_segment (GtkSourceContextEngine  *ce,
 			 * Still, it may happen that parent context ends in
 			 * the middle of the end regex match, apply_match()
 			 * checks this. */
-			if (apply_match (state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
+			if (apply_match (ce, state, line, &pos, state->context->end, SUB_PATTERN_WHERE_END))
 			{
 				g_assert (pos <= line->byte_length);
 
@@ -4400,1148 +6118,5587 @@ delete_zero_length_segments (GtkSourceContextEngine *ce,
 	}
 }
 
-/**
- * analyze_line:
- * @ce: #GtkSourceContextEngine.
- * @state: the state at the beginning of line.
- * @line: the line.
- * @hint: a child of @state around start of line, to make it faster.
- *
- * Finds contexts at the line and updates the syntax tree on it.
- *
- * Returns: starting state at the next line.
- */
-static Segment *
-analyze_line (GtkSourceContextEngine *ce,
-	      Segment                *state,
-	      LineInfo               *line)
+/* LINE CACHE ------------------------------------------------------------- */
+
+static guint
+line_cache_entry_hash (const LineCacheEntry *entry)
 {
-	gint line_pos = 0;
-	GList *end_segments = NULL;
-	GTimer *timer;
+	return entry->hash;
+}
 
-	g_assert (SEGMENT_IS_CONTAINER (state));
+static gboolean
+line_cache_entry_equal (const LineCacheEntry *entry1,
+			const LineCacheEntry *entry2)
+{
+	return entry1->hash == entry2->hash &&
+	       entry1->context == entry2->context &&
+	       entry1->byte_length == entry2->byte_length &&
+	       memcmp (entry1->text, entry2->text, entry1->byte_length) == 0;
+}
 
-        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                ce->priv->hint2 = state->last_child;
-        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+static guint
+line_hash (Context  *context,
+	   LineInfo *line)
+{
+	guint hash = GPOINTER_TO_UINT (context);
+	gint i;
 
-	timer = g_timer_new ();
+	for (i = 0; i < line->byte_length; i++)
+		hash = (hash << 5) - hash + line->text[i];
 
-	/* Find the contexts in the line. */
-	while (line_pos <= line->byte_length)
-	{
-		Segment *new_state = NULL;
+	return hash;
+}
 
-		if (!next_segment (ce, state, line, &line_pos, &new_state))
-			break;
+static SubPattern *
+sub_patterns_copy_ (SubPattern *sp,
+		    gint        delta)
+{
+	SubPattern *copy = NULL;
 
-		if (g_timer_elapsed (timer, NULL) * 1000 > MAX_TIME_FOR_ONE_LINE)
-		{
-			g_critical ("%s",
-			            _("Highlighting a single line took too much time, "
-				      "syntax highlighting will be disabled"));
-			disable_syntax_analysis (ce);
-			break;
-		}
+	for ( ; sp != NULL; sp = sp->next)
+	{
+		SubPattern *tmp = g_slice_new (SubPattern);
+		tmp->definition = sp->definition;
+		tmp->start_at = sp->start_at + delta;
+		tmp->end_at = sp->end_at + delta;
+		tmp->next = copy;
+		copy = tmp;
+	}
 
-		g_assert (new_state != NULL);
-		g_assert (SEGMENT_IS_CONTAINER (new_state));
+	return copy;
+}
 
-		state = new_state;
+static void
+sub_patterns_free_ (SubPattern *sp)
+{
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		g_slice_free (SubPattern, sp);
+		sp = next;
+	}
+}
 
-                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != state)
-                        ce->priv->hint2 = state->last_child;
-                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == state);
+static void
+cached_segments_free_ (CachedSegment *cs)
+{
+	while (cs != NULL)
+	{
+		CachedSegment *next = cs->next;
 
-		/* XXX this a temporary workaround for zero-length segments in the end
-		 * of line. there are no zero-length segments in the middle because it goes
-		 * into infinite loop in that case. */
-		/* state may be extended later, so not all elements of new_segments
-		 * really have zero length */
-		if (state->start_at == line->char_length)
-			end_segments = g_list_prepend (end_segments, state);
-	}
+		context_unref (cs->context);
+		sub_patterns_free_ (cs->sub_patterns);
+		cached_segments_free_ (cs->children);
+		g_slice_free (CachedSegment, cs);
 
-	g_timer_destroy (timer);
-	if (ce->priv->disabled)
-		return NULL;
+		cs = next;
+	}
+}
 
-	/* Extend current state to the end of line. */
-	segment_extend (state, line->start_at + line->char_length);
-	g_assert (line_pos <= line->byte_length);
+/**
+ * cached_segment_new_:
+ * @first: first segment to copy.
+ * @last: last segment to copy.
+ * @line_start: offset of the line.
+ *
+ * Copies segments from @first to @last and their children.
+ *
+ * Returns: list of #CachedSegment, or %NULL if some segment is invalid.
+ */
+static CachedSegment *
+cached_segment_new_ (Segment *first,
+		     Segment *last,
+		     gint     line_start)
+{
+	CachedSegment *list = NULL, *list_last = NULL;
+	Segment *s;
 
-	/* Verify if we need to close the context because we are at
-	 * the end of the line. */
-	if (ANCESTOR_CAN_END_CONTEXT (state->context) ||
-	    SEGMENT_END_AT_LINE_END (state))
+	for (s = first; s != NULL; s = s->next)
 	{
-		state = check_line_end (ce, state);
-	}
+		CachedSegment *cs;
 
-	/* Extend the segment to the beginning of next line. */
-	g_assert (SEGMENT_IS_CONTAINER (state));
-	segment_extend (state, NEXT_LINE_OFFSET (line));
+		if (SEGMENT_IS_INVALID (s))
+		{
+			cached_segments_free_ (list);
+			return NULL;
+		}
 
-	/* if it's the last line, don't bother with zero length segments */
-	if (!line->eol_length)
-		g_list_free (end_segments);
-	else
-		delete_zero_length_segments (ce, end_segments);
 
-	CHECK_TREE (ce);
+		cs = g_slice_new0 (CachedSegment);
+		cs->context = context_ref (s->context);
+		cs->start_at = s->start_at - line_start;
+		cs->end_at = s->end_at - line_start;
+		cs->start_len = s->start_len;
+		cs->end_len = s->end_len;
+		cs->is_start = s->is_start;
+		cs->sub_patterns = sub_patterns_copy_ (s->sub_patterns, -line_start);
 
-	return state;
+		if (s->children != NULL)
+		{
+			cs->children = cached_segment_new_ (s->children, s->last_child, line_start);
+
+			if (cs->children == NULL)
+			{
+				cached_segments_free_ (cs);
+				cached_segments_free_ (list);
+				return NULL;
+			}
+		}
+
+		if (list_last != NULL)
+			list_last->next = cs;
+		else
+			list = cs;
+		list_last = cs;
+
+		if (s == last)
+			break;
+	}
+
+	return list;
+}
+
+static void
+line_cache_entry_free (LineCacheEntry *entry)
+{
+	context_unref (entry->context);
+	cached_segments_free_ (entry->children);
+	sub_patterns_free_ (entry->sub_patterns);
+	g_free (entry->text);
+	g_slice_free (LineCacheEntry, entry);
 }
 
 /**
- * get_line_info:
- * @buffer: #GtkTextBuffer.
- * @line_start: iterator pointing to the beginning of line.
- * @line_end: iterator pointing to the beginning of next line or to the end
- * of this line if it's the last line in @buffer.
- * @line: #LineInfo structure to be filled.
+ * line_cache_clear:
+ * @ce: #GtkSourceContextEngine.
  *
- * Retrieves line text from the buffer, finds line terminator and fills
- * @line structure.
+ * Removes all entries from the cache. Must be called before the
+ * contexts are destroyed, see segment_tree_destroy().
  */
 static void
-get_line_info (GtkTextBuffer     *buffer,
-	       const GtkTextIter *line_start,
-	       const GtkTextIter *line_end,
-	       LineInfo          *line)
+line_cache_clear (GtkSourceContextEngine *ce)
 {
-	g_assert (!gtk_text_iter_equal (line_start, line_end));
+	LineCacheEntry *entry;
 
-	line->text = gtk_text_buffer_get_slice (buffer, line_start, line_end, TRUE);
-	line->start_at = gtk_text_iter_get_offset (line_start);
+	g_hash_table_remove_all (ce->priv->line_cache);
 
-	if (!gtk_text_iter_starts_line (line_end))
-	{
-		line->eol_length = 0;
-		line->char_length = g_utf8_strlen (line->text, -1);
-		line->byte_length = strlen (line->text);
-	}
-	else
-	{
-		gint eol_index, next_line_index;
-
-		pango_find_paragraph_boundary (line->text, -1,
-					       &eol_index,
-					       &next_line_index);
+	while ((entry = g_queue_pop_head (&ce->priv->line_cache_queue)) != NULL)
+		line_cache_entry_free (entry);
+}
 
-		g_assert (eol_index < next_line_index);
+/**
+ * definition_has_once_only_child:
+ * @definition: context definition.
+ *
+ * Returns: whether @definition contains once-only contexts. Analysis
+ * of a line in such a context depends not only on the line text, but
+ * also on what is found in the preceding lines.
+ */
+static gboolean
+definition_has_once_only_child (ContextDefinition *definition)
+{
+	DefinitionsIter def_iter;
+	DefinitionChild *child_def;
+	gboolean retval = FALSE;
 
-		line->char_length = g_utf8_strlen (line->text, eol_index);
-		line->eol_length = g_utf8_strlen (line->text + eol_index, -1);
-		line->byte_length = eol_index;
+	definition_iter_init (&def_iter, definition);
+	while ((child_def = definition_iter_next (&def_iter)) != NULL)
+	{
+		if (HAS_OPTION (child_def->u.definition, ONCE_ONLY))
+		{
+			retval = TRUE;
+			break;
+		}
 	}
+	definition_iter_destroy (&def_iter);
 
-	g_assert (gtk_text_iter_get_offset (line_end) ==
-			line->start_at + line->char_length + line->eol_length);
+	return retval;
 }
 
 /**
- * line_info_destroy:
- * @line: #LineInfo.
+ * line_cache_copy_segment_:
+ * @ce: #GtkSourceContextEngine.
+ * @parent: the parent segment.
+ * @cs: cached segment.
+ * @line_start: offset of the line.
  *
- * Destroys data allocated by get_line_info().
+ * Creates a segment from @cs and its children in the tree.
+ * Called only from line_cache_lookup().
  */
 static void
-line_info_destroy (LineInfo *line)
+line_cache_copy_segment_ (GtkSourceContextEngine *ce,
+			  Segment                *parent,
+			  CachedSegment          *cs,
+			  gint                    line_start)
 {
-	g_free (line->text);
+	Segment *segment;
+	CachedSegment *child;
+	SubPattern *sp;
+
+	segment = create_segment (ce, parent, cs->context,
+				  line_start + cs->start_at,
+				  line_start + cs->end_at,
+				  cs->is_start, NULL);
+	segment->start_len = cs->start_len;
+	segment->end_len = cs->end_len;
+
+	for (sp = cs->sub_patterns; sp != NULL; sp = sp->next)
+		sub_pattern_new (ce, segment,
+				 line_start + sp->start_at,
+				 line_start + sp->end_at,
+				 sp->definition);
+
+	for (child = cs->children; child != NULL; child = child->next)
+		line_cache_copy_segment_ (ce, segment, child, line_start);
 }
 
 /**
- * segment_tree_zero_len:
- * @ce: #GtkSoucreContextEngine.
+ * line_cache_lookup:
+ * @ce: #GtkSourceContextEngine.
+ * @state: the state at the beginning of @line.
+ * @line: the line.
  *
- * Erases syntax tree and sets root segment length to zero.
- * It's a shortcut for case when all the text is deleted from
- * the buffer.
+ * Lines which start and end in the same segment, i.e. contain only
+ * complete contexts, are put into the cache by line_cache_store().
+ * If the same text is found in the same context later, e.g. in a log
+ * file, the segments are copied from the cache instead of running
+ * the regexes again.
+ *
+ * Returns: whether @line was found in the cache and the segments
+ * were added to the tree.
  */
-static void
-segment_tree_zero_len (GtkSourceContextEngine *ce)
+static gboolean
+line_cache_lookup (GtkSourceContextEngine *ce,
+		   Segment                *state,
+		   LineInfo               *line)
 {
-	Segment *root = ce->priv->root_segment;
-	segment_destroy_children (ce, root);
-	root->start_at = root->end_at = 0;
-	CHECK_TREE (ce);
-}
+	LineCacheEntry key;
+	LineCacheEntry *entry;
+	CachedSegment *cs;
+	SubPattern *sp;
 
-#ifdef ENABLE_CHECK_TREE
-static Segment *
-get_segment_at_offset_slow_ (Segment *segment,
-			     gint     offset)
-{
-	Segment *child;
+	if (line->start_at == 0 || line->eol_length == 0 ||
+	    line->byte_length > LINE_CACHE_MAX_LINE_LENGTH)
+		return FALSE;
 
-start:
-	if (segment->parent == NULL && offset == segment->end_at)
-		return segment;
+	key.context = state->context;
+	key.text = line->text;
+	key.byte_length = line->byte_length;
+	key.hash = line_hash (state->context, line);
 
-	if (segment->start_at > offset)
-	{
-		g_assert (segment->parent != NULL);
-		segment = segment->parent;
-		goto start;
-	}
+	entry = g_hash_table_lookup (ce->priv->line_cache, &key);
 
-	if (segment->start_at == offset)
+	if (entry == NULL)
 	{
-		if (segment->children != NULL && segment->children->start_at == offset)
-		{
-			segment = segment->children;
-			goto start;
-		}
-
-		return segment;
+		ce->priv->line_cache_misses++;
+		return FALSE;
 	}
 
-        if (segment->end_at <= offset && segment->parent != NULL)
-	{
-		if (segment->next != NULL)
-		{
-			if (segment->next->start_at > offset)
-				return segment->parent;
+	ce->priv->line_cache_hits++;
 
-			segment = segment->next;
-		}
-		else
-		{
-			segment = segment->parent;
-		}
+	g_queue_unlink (&ce->priv->line_cache_queue, entry->link);
+	g_queue_push_tail_link (&ce->priv->line_cache_queue, entry->link);
 
-		goto start;
-	}
+	segment_extend (state, NEXT_LINE_OFFSET (line));
 
-	for (child = segment->children; child != NULL; child = child->next)
-	{
-		if (child->start_at == offset)
-		{
-			segment = child;
-			goto start;
-		}
+	for (cs = entry->children; cs != NULL; cs = cs->next)
+		line_cache_copy_segment_ (ce, state, cs, line->start_at);
 
-		if (child->end_at <= offset)
-			continue;
+	for (sp = entry->sub_patterns; sp != NULL; sp = sp->next)
+		sub_pattern_new (ce, state,
+				 line->start_at + sp->start_at,
+				 line->start_at + sp->end_at,
+				 sp->definition);
 
-		if (child->start_at > offset)
-			break;
+	ce->priv->hint2 = NULL;
 
-		segment = child;
-		goto start;
-	}
+	CHECK_TREE (ce);
 
-	return segment;
+	return TRUE;
 }
-#endif /* ENABLE_CHECK_TREE */
 
-#define SEGMENT_IS_ZERO_LEN_AT(s,o) ((s)->start_at == (o) && (s)->end_at == (o))
-#define SEGMENT_CONTAINS(s,o) ((s)->start_at <= (o) && (s)->end_at > (o))
-#define SEGMENT_DISTANCE(s,o) (MIN (ABS ((s)->start_at - (o)), ABS ((s)->end_at - (o))))
-static Segment *
-get_segment_in_ (Segment *segment,
-		 gint     offset)
+/**
+ * line_cache_store:
+ * @ce: #GtkSourceContextEngine.
+ * @state: the state at the beginning and at the end of @line.
+ * @line: the line just analyzed.
+ *
+ * Puts the result of analysis of @line into the cache, see
+ * line_cache_lookup().
+ */
+static void
+line_cache_store (GtkSourceContextEngine *ce,
+		  Segment                *state,
+		  LineInfo               *line)
 {
-	Segment *child;
+	LineCacheEntry *entry;
+	Segment *first, *last;
+	SubPattern *sp;
+	gint line_end = NEXT_LINE_OFFSET (line);
+	gint steps = 0;
 
-	g_assert (segment->start_at <= offset && segment->end_at > offset);
+	if (line->start_at == 0 || line->eol_length == 0 ||
+	    line->byte_length > LINE_CACHE_MAX_LINE_LENGTH ||
+	    definition_has_once_only_child (state->context->definition))
+		return;
 
-	if (segment->children == NULL)
-		return segment;
 
-	if (segment->children == segment->last_child)
-	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->children, offset))
-			return segment->children;
+	/* Find the children created in the line. They are close to
+	 * hint2, or at the end if the line was appended to the tree. */
+	last = ce->priv->hint2;
+	if (last == NULL || last->parent != state)
+		last = state->last_child;
 
-		if (SEGMENT_CONTAINS (segment->children, offset))
-			return get_segment_in_ (segment->children, offset);
+	while (last != NULL && last->start_at >= line_end)
+	{
+		last = last->prev;
+		if (++steps > LINE_CACHE_SIZE)
+			return;
+	}
 
-		return segment;
+	first = last;
+	while (first != NULL && first->prev != NULL &&
+	       first->prev->start_at >= line->start_at)
+	{
+		first = first->prev;
+		if (++steps > LINE_CACHE_SIZE)
+			return;
 	}
 
-	if (segment->children->start_at > offset || segment->last_child->end_at < offset)
-		return segment;
+	if (first != NULL && first->start_at < line->start_at)
+		first = last = NULL;
 
-	if (SEGMENT_DISTANCE (segment->children, offset) >= SEGMENT_DISTANCE (segment->last_child, offset))
-	{
-		for (child = segment->children; child; child = child->next)
-		{
-			if (child->start_at > offset)
-				return segment;
+	entry = g_slice_new0 (LineCacheEntry);
 
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
-				return child;
+	if (first != NULL)
+	{
+		entry->children = cached_segment_new_ (first, last, line->start_at);
 
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
+		if (entry->children == NULL)
+		{
+			g_slice_free (LineCacheEntry, entry);
+			return;
 		}
 	}
-	else
+
+	for (sp = state->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		for (child = segment->last_child; child; child = child->prev)
+		if (sp->start_at >= line->start_at && sp->end_at <= line_end)
 		{
-			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
-			{
-				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (child->prev, offset))
-					child = child->prev;
-				return child;
-			}
-
-			if (child->end_at <= offset)
-				return segment;
-
-			if (SEGMENT_CONTAINS (child, offset))
-				return get_segment_in_ (child, offset);
+			SubPattern *tmp = g_slice_new (SubPattern);
+			tmp->definition = sp->definition;
+			tmp->start_at = sp->start_at - line->start_at;
+			tmp->end_at = sp->end_at - line->start_at;
+			tmp->next = entry->sub_patterns;
+			entry->sub_patterns = tmp;
 		}
 	}
 
-	return segment;
-}
+	entry->context = context_ref (state->context);
+	entry->text = g_strndup (line->text, line->byte_length);
+	entry->byte_length = line->byte_length;
+	entry->hash = line_hash (state->context, line);
 
-/* assumes zero-length segments can't have children */
-static Segment *
-get_segment_ (Segment *segment,
-	      gint     offset)
-{
-	if (segment->parent != NULL)
+	if (g_hash_table_lookup (ce->priv->line_cache, entry) != NULL)
 	{
-		if (!SEGMENT_CONTAINS (segment->parent, offset))
-			return get_segment_ (segment->parent, offset);
+		line_cache_entry_free (entry);
+		return;
 	}
-	else
+
+	if (g_queue_get_length (&ce->priv->line_cache_queue) >= LINE_CACHE_SIZE)
 	{
-		g_assert (offset >= segment->start_at);
-		g_assert (offset <= segment->end_at);
+		LineCacheEntry *old = g_queue_pop_head (&ce->priv->line_cache_queue);
+		g_hash_table_remove (ce->priv->line_cache, old);
+		line_cache_entry_free (old);
 	}
 
-	if (SEGMENT_CONTAINS (segment, offset))
-		return get_segment_in_ (segment, offset);
+	g_queue_push_tail (&ce->priv->line_cache_queue, entry);
+	entry->link = ce->priv->line_cache_queue.tail;
+	g_hash_table_add (ce->priv->line_cache, entry);
+}
 
-	if (SEGMENT_IS_ZERO_LEN_AT (segment, offset))
+/**
+ * analyze_line:
+ * @ce: #GtkSourceContextEngine.
+ * @state: the state at @line_pos, updated as the line is analyzed.
+ * @line: the line.
+ * @line_pos: position in the line to start at, bytes.
+ * @timer: timer to check against @time, or %NULL.
+ * @time: time limit in milliseconds, or 0.
+ *
+ * Finds contexts at the line and updates the syntax tree on it.
+ * If @time elapses on @timer before the line is done, it stops
+ * with @state being the state at @line_pos, so the analysis
+ * may be continued later from there.
+ *
+ * Returns: %TRUE if the line is done, @state is then the starting
+ * state at the next line; %FALSE if it stopped in the middle.
+ */
+static gboolean
+analyze_line (GtkSourceContextEngine  *ce,
+	      Segment                **state,
+	      LineInfo                *line,
+	      gint                    *line_pos,
+	      GTimer                  *timer,
+	      gint                     time)
+{
+	GList *end_segments = NULL;
+	GTimer *line_timer;
+	gint max_length = ce->priv->max_line_length;
+	Segment *entry_state = NULL;
+	gboolean complete = TRUE;
+	gboolean cut = FALSE;
+
+	g_assert (SEGMENT_IS_CONTAINER (*state));
+
+	if (*line_pos == 0)
 	{
-		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			segment = segment->prev;
-		return segment;
+		ce->priv->lines_analyzed++;
+
+		if (line_cache_lookup (ce, *state, line))
+			return TRUE;
+
+		entry_state = *state;
 	}
 
-	if (offset < segment->start_at)
+        if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != *state)
+                ce->priv->hint2 = (*state)->last_child;
+        g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == *state);
+
+	line_timer = g_timer_new ();
+
+	/* Find the contexts in the line. */
+	while (*line_pos <= line->byte_length)
 	{
-		while (segment->prev != NULL && segment->prev->start_at > offset)
-			segment = segment->prev;
+		Segment *new_state = NULL;
+		gdouble step_start;
 
-		g_assert (!segment->prev || segment->prev->start_at <= offset);
+		/* Contexts are not looked for past the limit, the rest
+		 * of the line belongs to the current state. */
+		if (max_length >= 0 && *line_pos >= max_length)
+		{
+			cut = TRUE;
+			break;
+		}
 
-		if (segment->prev == NULL)
-			return segment->parent;
+		if (time != 0 && end_segments == NULL &&
+		    g_timer_elapsed (timer, NULL) * 1000 > time)
+		{
+			g_timer_destroy (line_timer);
+			segment_extend (*state, line_pos_to_offset (line, *line_pos));
+			CHECK_TREE (ce);
+			return FALSE;
+		}
 
-		if (segment->prev->end_at > offset)
-			return get_segment_in_ (segment->prev, offset);
+		step_start = g_timer_elapsed (line_timer, NULL);
 
-		if (segment->prev->end_at == offset)
+		if (!next_segment (ce, *state, line, line_pos, &new_state))
+			break;
+
+		if ((g_timer_elapsed (line_timer, NULL) - step_start) * 1000 > MAX_TIME_FOR_ONE_LINE)
 		{
-			if (SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-			{
-				segment = segment->prev;
-				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
-					segment = segment->prev;
-				return segment;
-			}
+			g_critical ("%s",
+			            _("Highlighting a single line took too much time, "
+				      "syntax highlighting will be disabled"));
+			disable_syntax_analysis (ce);
+			break;
+		}
 
-			return segment->parent;
+		g_assert (new_state != NULL);
+		g_assert (SEGMENT_IS_CONTAINER (new_state));
+
+		*state = new_state;
+
+                if (ce->priv->hint2 == NULL || ce->priv->hint2->parent != *state)
+                        ce->priv->hint2 = (*state)->last_child;
+                g_assert (!ce->priv->hint2 || ce->priv->hint2->parent == *state);
+
+		/* XXX this a temporary workaround for zero-length segments in the end
+		 * of line. there are no zero-length segments in the middle because it goes
+		 * into infinite loop in that case. */
+		/* state may be extended later, so not all elements of new_segments
+		 * really have zero length */
+		if ((*state)->start_at == line->char_length)
+			end_segments = g_list_prepend (end_segments, *state);
+
+		if (time == 0 && g_timer_elapsed (line_timer, NULL) * 1000 > MAX_TIME_FOR_ONE_LINE)
+		{
+			g_warning ("%s",
+				   _("Highlighting a single line took too much time, "
+				     "the rest of the line will not be highlighted"));
+			complete = FALSE;
+			break;
 		}
+	}
 
-		/* segment->prev->end_at < offset */
-		return segment->parent;
+	g_timer_destroy (line_timer);
+	if (ce->priv->disabled)
+	{
+		g_list_free (end_segments);
+		return TRUE;
 	}
 
-	/* offset >= segment->end_at, not zero-length */
+	/* Extend current state to the end of line. */
+	segment_extend (*state, line->start_at + line->char_length);
+	g_assert (*line_pos <= line->byte_length);
 
-	while (segment->next != NULL)
+	/* The end of contexts opened on a line cut at the limit is not
+	 * looked for, so they end with the line instead of swallowing
+	 * the following lines. */
+	if (cut)
 	{
-		if (SEGMENT_IS_ZERO_LEN_AT (segment->next, offset))
-			return segment->next;
+		Segment *opened = NULL;
 
-		if (segment->next->end_at > offset)
+		while ((*state)->parent != NULL && (*state)->start_at >= line->start_at)
 		{
-			if (segment->next->start_at <= offset)
-				return get_segment_in_ (segment->next, offset);
-			else
-				return segment->parent;
+			opened = *state;
+			*state = (*state)->parent;
 		}
 
-		segment = segment->next;
+		if (opened != NULL)
+			ce->priv->hint2 = opened;
 	}
 
-	return segment->parent;
+	/* Verify if we need to close the context because we are at
+	 * the end of the line. */
+	if (ANCESTOR_CAN_END_CONTEXT ((*state)->context) ||
+	    SEGMENT_END_AT_LINE_END (*state))
+	{
+		*state = check_line_end (ce, *state);
+	}
+
+	/* Extend the segment to the beginning of next line. */
+	g_assert (SEGMENT_IS_CONTAINER (*state));
+	segment_extend (*state, NEXT_LINE_OFFSET (line));
+
+	/* if it's the last line, don't bother with zero length segments */
+	if (!line->eol_length)
+		g_list_free (end_segments);
+	else
+		delete_zero_length_segments (ce, end_segments);
+
+	CHECK_TREE (ce);
+
+	if (complete && *state == entry_state)
+		line_cache_store (ce, *state, line);
+
+	return TRUE;
 }
-#undef SEGMENT_IS_ZERO_LEN_AT
-#undef SEGMENT_CONTAINS
-#undef SEGMENT_DISTANCE
 
 /**
- * get_segment_at_offset:
- * @ce: #GtkSoucreContextEngine.
- * @hint: segment to start search from or %NULL.
- * @offset: the offset, characters.
+ * find_line_end:
+ * @text: text starting at the beginning of the line.
+ * @line: #LineInfo structure whose lengths are filled.
  *
- * Finds the deepest segment "at @offset".
- * More precisely, it returns toplevel segment if
- * @offset is equal to length of buffer; or non-zero-length
- * segment which contains character at @offset; or zero-length
- * segment at @offset. In case when there are several zero-length
- * segments, it returns the first one.
+ * Finds line terminator in @text. Line terminators are the ones
+ * pango_find_paragraph_boundary() and #GtkTextBuffer recognize:
+ * \n, \r, \r\n and U+2029. They are looked for in the same pass
+ * which counts characters, so the text is scanned only once.
+ *
+ * Returns: length in bytes of the line including line terminator.
  */
-static Segment *
-get_segment_at_offset (GtkSourceContextEngine *ce,
-		       Segment                *hint,
-		       gint                    offset)
+static gint
+find_line_end (const gchar *text,
+	       LineInfo    *line)
 {
-	Segment *result;
-
-	if (offset == ce->priv->root_segment->end_at)
-		return ce->priv->root_segment;
+	const guchar *p = (const guchar *) text;
+	gint char_length = 0;
+	gint eol_index;
+	gint next_line_index;
 
-#ifdef ENABLE_DEBUG
-	/* if you see this message (often), then something is
-	 * wrong with the hints business, i.e. optimizations
-	 * do not work quite like they should */
-	if (hint == NULL || hint == ce->priv->root_segment)
+	while (*p != '\n' && *p != '\r' && *p != '\0')
 	{
-		static int c;
-		g_print ("searching from root %d\n", ++c);
+		if (*p >= 0x80)
+		{
+			/* U+2029 PARAGRAPH SEPARATOR. */
+			if (p[0] == 0xE2 && p[1] == 0x80 && p[2] == 0xA9)
+				break;
+
+			/* Continuation bytes do not start characters. */
+			if ((*p & 0xC0) == 0x80)
+				char_length--;
+		}
+
+		char_length++;
+		p++;
 	}
-#endif
 
-	result = get_segment_ (hint ? hint : ce->priv->root_segment, offset);
+	eol_index = (const gchar *) p - text;
 
-#ifdef ENABLE_CHECK_TREE
-	g_assert (result == get_segment_at_offset_slow_ (hint, offset));
-#endif
+	if (*p == '\0')
+	{
+		line->eol_length = 0;
+		next_line_index = eol_index;
+	}
+	else if (*p == '\r' && p[1] == '\n')
+	{
+		line->eol_length = 2;
+		next_line_index = eol_index + 2;
+	}
+	else
+	{
+		line->eol_length = 1;
+		next_line_index = eol_index + (*p == 0xE2 ? 3 : 1);
+	}
 
-	return result;
+	line->char_length = char_length;
+	line->byte_length = eol_index;
+
+	return next_line_index;
 }
 
 /**
- * segment_remove:
+ * fill_line_info:
+ * @ce: #GtkSourceContextEngine which stores the line text.
+ * @text: text starting at the beginning of the line.
+ * @start_at: character offset of the line.
+ * @line: #LineInfo structure to be filled.
+ *
+ * Finds line terminator in @text, see find_line_end(), copies the
+ * line to the line text storage of @ce and fills @line structure.
+ * @line text is valid until the next call, it must be copied to be
+ * kept longer.
+ *
+ * Returns: length in bytes of the line including line terminator.
+ */
+static gint
+fill_line_info (GtkSourceContextEngine *ce,
+		const gchar            *text,
+		gint                    start_at,
+		LineInfo               *line)
+{
+	gint next_line_index;
+
+	next_line_index = find_line_end (text, line);
+
+	if (ce->priv->line_text_size < (gsize) next_line_index + 1)
+	{
+		ce->priv->line_text_size = MAX (ce->priv->line_text_size * 2,
+						(gsize) next_line_index + 1);
+		ce->priv->line_text = g_realloc (ce->priv->line_text,
+						 ce->priv->line_text_size);
+	}
+
+	memcpy (ce->priv->line_text, text, next_line_index);
+	ce->priv->line_text[next_line_index] = '\0';
+
+	line->text = ce->priv->line_text;
+	line->start_at = start_at;
+	line->last_byte_pos = 0;
+	line->last_char_pos = 0;
+
+	return next_line_index;
+}
+
+/**
+ * forget_line_chunk:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Frees the text fetched ahead by get_line_info(). Called when
+ * the buffer changes.
+ */
+static void
+forget_line_chunk (GtkSourceContextEngine *ce)
+{
+	g_free (ce->priv->chunk);
+	ce->priv->chunk = NULL;
+}
+
+/**
+ * get_line_info:
+ * @ce: #GtkSourceContextEngine which stores the line text.
+ * @buffer: #GtkTextBuffer.
+ * @line_start: iterator pointing to the beginning of line.
+ * @line_end: iterator pointing to the beginning of next line or to the end
+ * of this line if it's the last line in @buffer.
+ * @line: #LineInfo structure to be filled.
+ *
+ * Retrieves line text from the buffer, finds line terminator and fills
+ * @line structure, see fill_line_info().
+ *
+ * When the line follows the one fetched before, text is fetched
+ * LINE_CHUNK_LINES lines at a time and kept until the buffer changes,
+ * so analyzing consecutive lines, what update_syntax() does, allocates
+ * memory only once per chunk instead of once per line. A line asked
+ * for out of sequence is fetched alone, it may well be the only one.
+ */
+static void
+get_line_info (GtkSourceContextEngine *ce,
+	       GtkTextBuffer          *buffer,
+	       const GtkTextIter      *line_start,
+	       const GtkTextIter      *line_end,
+	       LineInfo               *line)
+{
+	gint start_at;
+
+	g_assert (!gtk_text_iter_equal (line_start, line_end));
+
+	start_at = gtk_text_iter_get_offset (line_start);
+
+	if (ce->priv->chunk == NULL || ce->priv->chunk_offset != start_at)
+	{
+		g_free (ce->priv->chunk);
+		ce->priv->chunk = gtk_text_buffer_get_slice (buffer, line_start,
+							     line_end, TRUE);
+		ce->priv->chunk_pos = 0;
+	}
+	else if (ce->priv->chunk[ce->priv->chunk_pos] == '\0')
+	{
+		GtkTextIter chunk_end = *line_start;
+
+		gtk_text_iter_forward_lines (&chunk_end, LINE_CHUNK_LINES);
+
+		g_free (ce->priv->chunk);
+		ce->priv->chunk = gtk_text_buffer_get_slice (buffer, line_start,
+							     &chunk_end, TRUE);
+		ce->priv->chunk_pos = 0;
+	}
+
+	ce->priv->chunk_pos += fill_line_info (ce, ce->priv->chunk + ce->priv->chunk_pos,
+					       start_at, line);
+	ce->priv->chunk_offset = NEXT_LINE_OFFSET (line);
+
+	g_assert (gtk_text_iter_get_offset (line_end) == NEXT_LINE_OFFSET (line));
+}
+
+/**
+ * segment_tree_zero_len:
  * @ce: #GtkSoucreContextEngine.
- * @segment: segment to remove.
  *
- * Removes the segment from syntax tree and frees it.
- * It correctly updates parent's children list, not
- * like segment_destroy() where caller has to take care
- * of tree integrity.
+ * Erases syntax tree and sets root segment length to zero.
+ * It's a shortcut for case when all the text is deleted from
+ * the buffer.
  */
 static void
-segment_remove (GtkSourceContextEngine *ce,
-		Segment                *segment)
+segment_tree_zero_len (GtkSourceContextEngine *ce)
 {
-	if (segment->next != NULL)
-		segment->next->prev = segment->prev;
+	Segment *root = ce->priv->root_segment;
+	clear_line_states (ce);
+	partial_line_free (ce);
+	segment_destroy_children (ce, root);
+	root->start_at = root->end_at = 0;
+	CHECK_TREE (ce);
+}
+
+#ifdef ENABLE_CHECK_TREE
+static Segment *
+get_segment_at_offset_slow_ (Segment *segment,
+			     gint     offset)
+{
+	Segment *child;
+
+start:
+
+	if (segment->parent == NULL && offset == segment->end_at)
+		return segment;
+
+	if (segment->start_at > offset)
+	{
+		g_assert (segment->parent != NULL);
+		segment = segment->parent;
+		goto start;
+	}
+
+	if (segment->start_at == offset)
+	{
+		if (segment->children != NULL && segment->children->start_at == offset)
+		{
+			segment = segment->children;
+			goto start;
+		}
+
+		return segment;
+	}
+
+        if (segment->end_at <= offset && segment->parent != NULL)
+	{
+		if (segment->next != NULL)
+		{
+			if (segment->next->start_at > offset)
+				return segment->parent;
+
+			segment = segment->next;
+		}
+		else
+		{
+			segment = segment->parent;
+		}
+
+		goto start;
+	}
+
+	for (child = segment->children; child != NULL; child = child->next)
+	{
+		if (child->start_at == offset)
+		{
+			segment = child;
+			goto start;
+		}
+
+		if (child->end_at <= offset)
+			continue;
+
+		if (child->start_at > offset)
+			break;
+
+		segment = child;
+		goto start;
+	}
+
+	return segment;
+}
+#endif /* ENABLE_CHECK_TREE */
+
+#define SEGMENT_IS_ZERO_LEN_AT(s,o) ((s)->start_at == (o) && (s)->end_at == (o))
+#define SEGMENT_CONTAINS(s,o) ((s)->start_at <= (o) && (s)->end_at > (o))
+#define SEGMENT_DISTANCE(s,o) (MIN (ABS ((s)->start_at - (o)), ABS ((s)->end_at - (o))))
+static Segment *
+get_segment_in_ (Segment *segment,
+		 gint     offset)
+{
+	Segment *child;
+
+	g_assert (segment->start_at <= offset && segment->end_at > offset);
+
+
+	if (segment->children == NULL)
+		return segment;
+
+	if (segment->children == segment->last_child)
+	{
+		if (SEGMENT_IS_ZERO_LEN_AT (segment->children, offset))
+			return segment->children;
+
+		if (SEGMENT_CONTAINS (segment->children, offset))
+			return get_segment_in_ (segment->children, offset);
+
+		return segment;
+	}
+
+	if (segment->children->start_at > offset || segment->last_child->end_at < offset)
+		return segment;
+
+	if (SEGMENT_DISTANCE (segment->children, offset) >= SEGMENT_DISTANCE (segment->last_child, offset))
+	{
+		for (child = segment->children; child; child = child->next)
+		{
+			if (child->start_at > offset)
+				return segment;
+
+			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
+				return child;
+
+			if (SEGMENT_CONTAINS (child, offset))
+				return get_segment_in_ (child, offset);
+		}
+	}
 	else
-		segment->parent->last_child = segment->prev;
+	{
+		for (child = segment->last_child; child; child = child->prev)
+		{
+			if (SEGMENT_IS_ZERO_LEN_AT (child, offset))
+			{
+				while (child->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (child->prev, offset))
+					child = child->prev;
+				return child;
+			}
+
+			if (child->end_at <= offset)
+				return segment;
+
+			if (SEGMENT_CONTAINS (child, offset))
+				return get_segment_in_ (child, offset);
+		}
+	}
+
+	return segment;
+}
+
+/* assumes zero-length segments can't have children */
+static Segment *
+get_segment_ (Segment *segment,
+	      gint     offset)
+{
+	if (segment->parent != NULL)
+	{
+		if (!SEGMENT_CONTAINS (segment->parent, offset))
+			return get_segment_ (segment->parent, offset);
+	}
+	else
+	{
+		g_assert (offset >= segment->start_at);
+		g_assert (offset <= segment->end_at);
+	}
+
+	if (SEGMENT_CONTAINS (segment, offset))
+		return get_segment_in_ (segment, offset);
+
+	if (SEGMENT_IS_ZERO_LEN_AT (segment, offset))
+	{
+		while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+			segment = segment->prev;
+		return segment;
+	}
+
+	if (offset < segment->start_at)
+	{
+		while (segment->prev != NULL && segment->prev->start_at > offset)
+			segment = segment->prev;
+
+		g_assert (!segment->prev || segment->prev->start_at <= offset);
+
+		if (segment->prev == NULL)
+			return segment->parent;
+
+		if (segment->prev->end_at > offset)
+			return get_segment_in_ (segment->prev, offset);
+
+		if (segment->prev->end_at == offset)
+		{
+			if (SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+			{
+				segment = segment->prev;
+				while (segment->prev != NULL && SEGMENT_IS_ZERO_LEN_AT (segment->prev, offset))
+					segment = segment->prev;
+				return segment;
+			}
+
+			return segment->parent;
+		}
+
+		/* segment->prev->end_at < offset */
+		return segment->parent;
+	}
+
+	/* offset >= segment->end_at, not zero-length */
+
+	while (segment->next != NULL)
+	{
+		if (SEGMENT_IS_ZERO_LEN_AT (segment->next, offset))
+			return segment->next;
+
+		if (segment->next->end_at > offset)
+		{
+			if (segment->next->start_at <= offset)
+				return get_segment_in_ (segment->next, offset);
+			else
+				return segment->parent;
+		}
+
+		segment = segment->next;
+	}
+
+	return segment->parent;
+}
+#undef SEGMENT_IS_ZERO_LEN_AT
+#undef SEGMENT_CONTAINS
+#undef SEGMENT_DISTANCE
+
+/**
+ * get_segment_at_offset:
+ * @ce: #GtkSoucreContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: the offset, characters.
+ *
+ * Finds the deepest segment "at @offset".
+ * More precisely, it returns toplevel segment if
+ * @offset is equal to length of buffer; or non-zero-length
+ * segment which contains character at @offset; or zero-length
+ * segment at @offset. In case when there are several zero-length
+ * segments, it returns the first one.
+ */
+static Segment *
+get_segment_at_offset (GtkSourceContextEngine *ce,
+		       Segment                *hint,
+		       gint                    offset)
+{
+	Segment *result;
+
+	if (offset == ce->priv->root_segment->end_at)
+		return ce->priv->root_segment;
+
+#ifdef ENABLE_DEBUG
+	/* if you see this message (often), then something is
+	 * wrong with the hints business, i.e. optimizations
+	 * do not work quite like they should */
+	if (hint == NULL || hint == ce->priv->root_segment)
+	{
+		static int c;
+		g_print ("searching from root %d\n", ++c);
+	}
+#endif
+
+	result = get_segment_ (hint ? hint : ce->priv->root_segment, offset);
+
+#ifdef ENABLE_CHECK_TREE
+	g_assert (result == get_segment_at_offset_slow_ (hint, offset));
+#endif
+
+	return result;
+}
+
+/**
+ * segment_remove:
+ * @ce: #GtkSoucreContextEngine.
+ * @segment: segment to remove.
+ *
+ * Removes the segment from syntax tree and frees it.
+ * It correctly updates parent's children list, not
+ * like segment_destroy() where caller has to take care
+ * of tree integrity.
+ */
+static void
+segment_remove (GtkSourceContextEngine *ce,
+		Segment                *segment)
+{
+	if (segment->next != NULL)
+		segment->next->prev = segment->prev;
+	else
+		segment->parent->last_child = segment->prev;
+
+	if (segment->prev != NULL)
+		segment->prev->next = segment->next;
+	else
+		segment->parent->children = segment->next;
+
+	/* if ce->priv->hint is being deleted, set it to some
+	 * neighbour segment */
+	if (ce->priv->hint == segment)
+	{
+		if (segment->next != NULL)
+			ce->priv->hint = segment->next;
+		else if (segment->prev != NULL)
+			ce->priv->hint = segment->prev;
+		else
+			ce->priv->hint = segment->parent;
+	}
+
+        /* if ce->priv->hint2 is being deleted, set it to some
+         * neighbour segment */
+        if (ce->priv->hint2 == segment)
+        {
+                if (segment->next != NULL)
+                        ce->priv->hint2 = segment->next;
+                else if (segment->prev != NULL)
+                        ce->priv->hint2 = segment->prev;
+                else
+                        ce->priv->hint2 = segment->parent;
+        }
+
+	segment_destroy (ce, segment);
+}
+
+static void
+segment_erase_middle_ (GtkSourceContextEngine *ce,
+		       Segment                *segment,
+		       gint                    start,
+		       gint                    end)
+{
+	Segment *new_segment, *child;
+	SubPattern *sp;
+
+	new_segment = segment_new (ce,
+				   segment->parent,
+				   segment->context,
+				   end,
+				   segment->end_at,
+				   FALSE);
+	segment->end_at = start;
+
+	new_segment->next = segment->next;
+	segment->next = new_segment;
+	new_segment->prev = segment;
+
+	if (new_segment->next != NULL)
+		new_segment->next->prev = new_segment;
+	else
+		new_segment->parent->last_child = new_segment;
+
+	child = segment->children;
+	segment->children = NULL;
+	segment->last_child = NULL;
+
+	while (child != NULL)
+	{
+		Segment *append_to;
+		Segment *next = child->next;
+
+		if (child->start_at < start)
+		{
+			g_assert (child->end_at <= start);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (child->start_at >= end);
+			append_to = new_segment;
+		}
+
+		child->parent = append_to;
+
+		if (append_to->last_child != NULL)
+		{
+			append_to->last_child->next = child;
+			child->prev = append_to->last_child;
+			child->next = NULL;
+			append_to->last_child = child;
+		}
+		else
+		{
+			child->next = child->prev = NULL;
+			append_to->last_child = child;
+			append_to->children = child;
+		}
+
+		child = next;
+	}
+
+	sp = segment->sub_patterns;
+	segment->sub_patterns = NULL;
+
+	while (sp != NULL)
+	{
+		SubPattern *next = sp->next;
+		Segment *append_to;
+
+		if (sp->start_at < start)
+		{
+			sp->end_at = MIN (sp->end_at, start);
+			append_to = segment;
+		}
+		else
+		{
+			g_assert (sp->end_at > end);
+			sp->start_at = MAX (sp->start_at, end);
+			append_to = new_segment;
+		}
+
+		sp->next = append_to->sub_patterns;
+		append_to->sub_patterns = sp;
+
+		sp = next;
+	}
+
+	CHECK_SEGMENT_CHILDREN (segment);
+	CHECK_SEGMENT_CHILDREN (new_segment);
+}
+
+/**
+ * segment_erase_range_:
+ * @ce: #GtkSourceContextEngine.
+ * @segment: the segment.
+ * @start: start offset of range to erase, characters.
+ * @end: end offset of range to erase, characters.
+ *
+ * Recurisvely removes segments from [@start, @end] interval
+ * starting from @segment. If @segment belongs to the range,
+ * or it's a zero-length segment at @end offset, and it's not
+ * the toplevel segment, then it's removed from the tree.
+ * If @segment intersects with the range (unless it's the toplevel
+ * segment), then its ends are adjusted appropriately, and it's
+ * split into two if it completely contains the range.
+ */
+static void
+segment_erase_range_ (GtkSourceContextEngine *ce,
+		      Segment                *segment,
+		      gint                    start,
+		      gint                    end)
+{
+	g_assert (start < end);
+
+	if (segment->start_at == segment->end_at)
+	{
+		if (segment->start_at >= start && segment->start_at <= end)
+			segment_remove (ce, segment);
+		return;
+	}
+
+	if (segment->start_at > end || segment->end_at < start)
+		return;
+
+	if (segment->start_at >= start && segment->end_at <= end && segment->parent)
+	{
+		segment_remove (ce, segment);
+		return;
+	}
+
+
+	if (segment->start_at == end)
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL && child->start_at == end)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+	else if (segment->end_at == start)
+	{
+		Segment *child = segment->last_child;
+
+		while (child != NULL && child->end_at == start)
+		{
+			Segment *prev = child->prev;
+			segment_erase_range_ (ce, child, start, end);
+			child = prev;
+		}
+	}
+	else
+	{
+		Segment *child = segment->children;
+
+		while (child != NULL)
+		{
+			Segment *next = child->next;
+			segment_erase_range_ (ce, child, start, end);
+			child = next;
+		}
+	}
+
+	if (segment->sub_patterns != NULL)
+	{
+		SubPattern *sp;
+
+		sp = segment->sub_patterns;
+		segment->sub_patterns = NULL;
+
+		while (sp != NULL)
+		{
+			SubPattern *next = sp->next;
+
+			if (sp->start_at >= start && sp->end_at <= end)
+				sub_pattern_free (ce, sp);
+			else
+				segment_add_subpattern (segment, sp);
+
+			sp = next;
+		}
+	}
+
+	if (segment->parent != NULL)
+	{
+		/* Now all children and subpatterns are cleaned up,
+		 * so we only need to split segment properly if its middle
+		 * was erased. Otherwise, only ends need to be adjusted. */
+		if (segment->start_at < start && segment->end_at > end)
+		{
+			segment_erase_middle_ (ce, segment, start, end);
+		}
+		else
+		{
+			g_assert ((segment->start_at >= start && segment->end_at > end) ||
+				  (segment->start_at < start && segment->end_at <= end));
+
+			if (segment->end_at > end)
+			{
+				/* If we erase the beginning, we need to clear
+				 * is_start flag. */
+				segment->start_at = end;
+				segment->is_start = FALSE;
+			}
+			else
+			{
+				segment->end_at = start;
+			}
+		}
+	}
+}
+
+/**
+ * segment_merge:
+ * @ce: #GtkSourceContextEngine.
+ * @first: first segment.
+ * @second: second segment.
+ *
+ * Merges adjacent segments @first and @second given
+ * their contexts are equal.
+ */
+static void
+segment_merge (GtkSourceContextEngine *ce,
+	       Segment                *first,
+	       Segment                *second)
+{
+	Segment *parent;
+
+	if (first == second)
+		return;
+
+	g_assert (!SEGMENT_IS_INVALID (first));
+	g_assert (first->context == second->context);
+	g_assert (first->end_at == second->start_at);
+
+	if (first->parent != second->parent)
+		segment_merge (ce, first->parent, second->parent);
+
+	parent = first->parent;
+
+	g_assert (first->next == second);
+	g_assert (first->parent == second->parent);
+	g_assert (second != parent->children);
+
+	if (second == parent->last_child)
+		parent->last_child = first;
+	first->next = second->next;
+	if (second->next != NULL)
+		second->next->prev = first;
+
+	first->end_at = second->end_at;
+
+	if (second->children != NULL)
+	{
+		Segment *child;
+
+		for (child = second->children; child != NULL; child = child->next)
+			child->parent = first;
+
+		if (first->children == NULL)
+		{
+			g_assert (!first->last_child);
+			first->children = second->children;
+			first->last_child = second->last_child;
+		}
+		else
+		{
+			first->last_child->next = second->children;
+			second->children->prev = first->last_child;
+			first->last_child = second->last_child;
+		}
+	}
+
+	if (second->sub_patterns != NULL)
+	{
+		if (first->sub_patterns == NULL)
+		{
+			first->sub_patterns = second->sub_patterns;
+		}
+		else
+		{
+			while (second->sub_patterns != NULL)
+			{
+				SubPattern *sp = second->sub_patterns;
+				second->sub_patterns = sp->next;
+				sp->next = first->sub_patterns;
+				first->sub_patterns = sp;
+			}
+		}
+	}
+
+	second->children = NULL;
+	second->last_child = NULL;
+	second->sub_patterns = NULL;
+
+	segment_destroy (ce, second);
+}
+
+/**
+ * erase_segments:
+ * @ce: #GtkSourceContextEngine.
+ * @start: start offset of region to erase, characters.
+ * @end: end offset of region to erase, characters.
+ * @hint: segment around @start to make it faster.
+ *
+ * Erases all non-toplevel segments in the interval
+ * [@start, @end]. Its action on the tree is roughly
+ * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
+ * (but that does not accept toplevel segment).
+ */
+static void
+erase_segments (GtkSourceContextEngine *ce,
+		gint                    start,
+		gint                    end,
+		Segment                *hint)
+{
+	Segment *root = ce->priv->root_segment;
+	Segment *child, *hint_prev;
+
+	if (root->children == NULL)
+		return;
+
+	if (hint == NULL)
+		hint = ce->priv->hint;
+
+	if (hint != NULL)
+		while (hint != NULL && hint->parent != ce->priv->root_segment)
+			hint = hint->parent;
+
+	if (hint == NULL)
+		hint = root->children;
+
+	hint_prev = hint->prev;
+
+	child = hint;
+	while (child != NULL)
+	{
+		Segment *next = child->next;
+
+		if (child->end_at < start)
+		{
+			child = next;
+
+			if (next != NULL)
+				ce->priv->hint = next;
+
+			continue;
+		}
+
+		if (child->start_at > end)
+		{
+			ce->priv->hint = child;
+			break;
+		}
+
+		segment_erase_range_ (ce, child, start, end);
+		child = next;
+	}
+
+	child = hint_prev;
+	while (child != NULL)
+	{
+		Segment *prev = child->prev;
+
+		if (ce->priv->hint == NULL)
+			ce->priv->hint = child;
+
+		if (child->start_at > end)
+		{
+			child = prev;
+			continue;
+		}
+
+		if (child->end_at < start)
+		{
+			break;
+		}
+
+		segment_erase_range_ (ce, child, start, end);
+		child = prev;
+	}
+
+	CHECK_TREE (ce);
+}
+
+/* LINE STATES ------------------------------------------------------------ */
+
+/**
+ * find_line_state_:
+ * @ce: #GtkSourceContextEngine.
+ * @line: line number.
+ *
+ * Returns: index of the last line state at or before @line, or -1.
+ */
+static gint
+find_line_state_ (GtkSourceContextEngine *ce,
+		  gint                    line)
+{
+	GArray *states = ce->priv->line_states;
+	gint lo = 0, hi = states->len;
+
+	while (lo < hi)
+	{
+		gint mid = (lo + hi) / 2;
+
+		if (g_array_index (states, LineState, mid).line <= line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/**
+ * set_line_state:
+ * @ce: #GtkSourceContextEngine.
+ * @line: line number.
+ * @state: the segment containing line terminator of the previous line.
+ *
+ * Remembers the state at the beginning of @line, if it's one of
+ * the lines for which states are kept.
+ */
+static void
+set_line_state (GtkSourceContextEngine *ce,
+		gint                    line,
+		Segment                *state)
+{
+	LineState *ls;
+	gint i;
+
+	if (line == 0 || line % LINE_STATE_INTERVAL != 0)
+		return;
+
+	forget_dropped_segments (ce);
+	i = find_line_state_ (ce, line);
+
+	if (i >= 0 && g_array_index (ce->priv->line_states, LineState, i).line == line)
+	{
+		ls = &g_array_index (ce->priv->line_states, LineState, i);
+		ls->segment->line_states--;
+	}
+	else
+	{
+		LineState new_ls;
+
+		new_ls.line = line;
+		g_array_insert_val (ce->priv->line_states, i + 1, new_ls);
+		ls = &g_array_index (ce->priv->line_states, LineState, i + 1);
+	}
+
+	ls->segment = state;
+	state->line_states++;
+}
+
+/**
+ * get_line_state:
+ * @ce: #GtkSourceContextEngine.
+ * @line: line number.
+ *
+ * Returns: the segment known to be the state at the beginning of
+ * the nearest line at or before @line, or %NULL. It is a good hint
+ * for get_segment_at_offset(), but it is the exact state at
+ * @line only if @line is analyzed and it's one of the lines for
+ * which states are kept.
+ */
+static Segment *
+get_line_state (GtkSourceContextEngine *ce,
+		gint                    line)
+{
+	Segment *segment;
+	gint i;
+
+	forget_dropped_segments (ce);
+	i = find_line_state_ (ce, line);
+
+	if (i < 0)
+		return NULL;
+
+	segment = g_array_index (ce->priv->line_states, LineState, i).segment;
+
+	return segment;
+}
+
+/**
+ * forget_dropped_segments:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Looking for the line states pointing to every segment
+ * segment_destroy() destroys would go through all the states for
+ * each of them. Instead the destroyed segments are kept in
+ * dropped_segments, and their states are removed here in a single
+ * pass before the states are used. The segments are freed only
+ * then, so that a new segment at the same address is not taken
+ * for them.
+ */
+static void
+forget_dropped_segments (GtkSourceContextEngine *ce)
+{
+	GPtrArray *dropped = ce->priv->dropped_segments;
+	GArray *states = ce->priv->line_states;
+	GHashTable *set;
+	guint i, n_kept = 0;
+
+	if (dropped->len == 0)
+		return;
+
+	set = g_hash_table_new (NULL, NULL);
+
+	for (i = 0; i < dropped->len; i++)
+		g_hash_table_add (set, g_ptr_array_index (dropped, i));
+
+	for (i = 0; i < states->len; i++)
+	{
+		LineState *ls = &g_array_index (states, LineState, i);
+
+		if (!g_hash_table_contains (set, ls->segment))
+			g_array_index (states, LineState, n_kept++) = *ls;
+	}
+
+	g_array_set_size (states, n_kept);
+	g_hash_table_destroy (set);
+
+	for (i = 0; i < dropped->len; i++)
+		node_pool_free (&ce->priv->segment_pool, g_ptr_array_index (dropped, i));
+
+	g_ptr_array_set_size (dropped, 0);
+}
+
+/**
+ * clear_line_states:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Forgets all line states. Must be called before destroying
+ * the whole tree, it's faster than removing them one by one.
+ */
+static void
+clear_line_states (GtkSourceContextEngine *ce)
+{
+	GArray *states = ce->priv->line_states;
+	guint i;
+
+	for (i = 0; i < states->len; i++)
+		g_array_index (states, LineState, i).segment->line_states--;
+
+	g_array_set_size (states, 0);
+
+	/* Nothing points to them now. */
+	for (i = 0; i < ce->priv->dropped_segments->len; i++)
+		node_pool_free (&ce->priv->segment_pool,
+				g_ptr_array_index (ce->priv->dropped_segments, i));
+
+	g_ptr_array_set_size (ce->priv->dropped_segments, 0);
+}
+
+/**
+ * update_line_states:
+ * @ce: #GtkSourceContextEngine.
+ * @start_line: first changed line.
+ * @end_line: last changed line.
+ *
+ * Called when text between @start_line and @end_line (current line
+ * numbers) is changed. Forgets states inside the changed text and
+ * renumbers the ones after it.
+ */
+static void
+update_line_states (GtkSourceContextEngine *ce,
+		    gint                    start_line,
+		    gint                    end_line)
+{
+	GArray *states = ce->priv->line_states;
+	gint n_lines, delta, i, last;
+
+	n_lines = gtk_text_buffer_get_line_count (ce->priv->buffer);
+	delta = n_lines - ce->priv->n_lines;
+	ce->priv->n_lines = n_lines;
+
+	forget_dropped_segments (ce);
+	i = find_line_state_ (ce, start_line) + 1;
+
+	for (last = i;
+	     last < (gint) states->len &&
+	     g_array_index (states, LineState, last).line <= end_line - delta;
+	     last++)
+	{
+		g_array_index (states, LineState, last).segment->line_states--;
+	}
+
+	if (last > i)
+		g_array_remove_range (states, i, last - i);
+
+	if (delta != 0)
+		for ( ; i < (gint) states->len; i++)
+			g_array_index (states, LineState, i).line += delta;
+}
+
+/* PARTIAL LINE ----------------------------------------------------------- */
+
+/**
+ * partial_line_free:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Forgets the line whose analysis was interrupted, see
+ * analyze_line(). Called when the tree is destroyed.
+ */
+static void
+partial_line_free (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->partial_line != NULL)
+	{
+		g_free (ce->priv->partial_line->text);
+		g_slice_free (PartialLine, ce->priv->partial_line);
+		ce->priv->partial_line = NULL;
+	}
+}
+
+/**
+ * invalidate_partial_line:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Called before the buffer modification is added to invalid_regions:
+ * the analysis of the partial line cannot be continued after that,
+ * so the whole line is marked invalid to be analyzed from scratch.
+ * The tree still matches buffer contents here, since update_tree()
+ * is called before a line is analyzed.
+ */
+static void
+invalidate_partial_line (GtkSourceContextEngine *ce)
+{
+	LineInfo *line;
+
+	if (ce->priv->partial_line == NULL)
+		return;
+
+	line = &ce->priv->partial_line->line;
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	erase_segments (ce, line->start_at, NEXT_LINE_OFFSET (line), NULL);
+	create_segment (ce, ce->priv->root_segment, NULL,
+			line->start_at, NEXT_LINE_OFFSET (line), FALSE, NULL);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	partial_line_free (ce);
+}
+
+#define IS_BOM(c) (c == 0xFEFF)
+
+/**
+ * update_syntax:
+ * @ce: #GtkSourceContextEngine.
+ * @end: desired end of region to analyze or %NULL.
+ * @time: maximal amount of time in milliseconds allowed to spend here
+ * or 0 for 'unlimited'.
+ *
+ * Updates syntax tree. If @end is not %NULL, then it analyzes
+ * (reanalyzes invalid areas in) region from start of buffer
+ * to @end. Otherwise, it analyzes batch of text starting at
+ * first invalid line.
+ * In order to avoid blocking ui it uses a timer and stops
+ * when time elapsed is greater than @time, so analyzed region is
+ * not necessarily what's requested (unless @time is 0).
+ * Long lines may be interrupted in the middle, then analysis
+ * continues from there on the next call, see partial_line.
+ */
+/* XXX it must be refactored. */
+static void
+update_syntax (GtkSourceContextEngine *ce,
+	       const GtkTextIter      *end,
+	       gint                    time)
+{
+	GtkTextBuffer *buffer;
+	GtkTextIter start_iter, end_iter;
+	GtkTextIter line_start, line_end;
+	Segment *state;
+	Segment *invalid;
+	gint start_offset, end_offset;
+	gint line_start_offset, line_end_offset;
+	gint invalid_start;
+	gint analyzed_end;
+	gboolean first_line = FALSE;
+	GTimer *timer;
+
+	buffer = ce->priv->buffer;
+	state = ce->priv->root_segment;
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	context_freeze (ce->priv->root_context);
+	update_tree (ce);
+
+	if (!gtk_text_buffer_get_char_count (buffer))
+	{
+		segment_tree_zero_len (ce);
+		goto out;
+	}
+
+	invalid = get_invalid_segment (ce);
+
+	/* Everything before the partial line is analyzed. */
+	if (ce->priv->partial_line != NULL)
+		invalid_start = ce->priv->partial_line->line.start_at;
+	else if (invalid != NULL)
+		invalid_start = invalid->start_at;
+	else
+		goto out;
+
+	if (end != NULL && invalid_start >= gtk_text_iter_get_offset (end))
+		goto out;
+
+	if (end != NULL)
+	{
+		end_offset = gtk_text_iter_get_offset (end);
+		start_offset = MIN (end_offset, invalid_start);
+	}
+	else
+	{
+		start_offset = invalid_start;
+		end_offset = gtk_text_buffer_get_char_count (buffer);
+	}
+
+	gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
+	gtk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
+
+	/* The partial line may start after BOM. */
+	if (!gtk_text_iter_starts_line (&start_iter) && ce->priv->partial_line == NULL)
+	{
+		gtk_text_iter_set_line_offset (&start_iter, 0);
+		start_offset = gtk_text_iter_get_offset (&start_iter);
+	}
+
+	if (!gtk_text_iter_starts_line (&end_iter))
+	{
+		gtk_text_iter_forward_line (&end_iter);
+		end_offset = gtk_text_iter_get_offset (&end_iter);
+	}
+
+	if (0 == start_offset && ce->priv->partial_line == NULL)
+	{
+		first_line = TRUE;
+
+		/* If it is the first line and it starts with BOM, skip it
+		 * since regexes in lang files do not take it into account */
+		gunichar c = gtk_text_iter_get_char (&start_iter);
+		if (IS_BOM (c))
+		{
+			gtk_text_iter_forward_char (&start_iter);
+			start_offset = gtk_text_iter_get_offset (&start_iter);
+		}
+	}
+
+	/* This happens after deleting all text on last line. */
+	if (start_offset == end_offset)
+	{
+		g_assert (end_offset == gtk_text_buffer_get_char_count (buffer));
+		g_assert (g_slist_length (ce->priv->invalid) == 1);
+		segment_remove (ce, invalid);
+		CHECK_TREE (ce);
+		goto out;
+	}
+
+
+	/* Main loop */
+
+	line_start = start_iter;
+	line_start_offset = start_offset;
+	line_end = line_start;
+	gtk_text_iter_forward_line (&line_end);
+	line_end_offset = gtk_text_iter_get_offset (&line_end);
+	analyzed_end = line_end_offset;
+
+	timer = g_timer_new ();
+
+	while (TRUE)
+	{
+		LineInfo line;
+		gchar *partial_text = NULL;
+		gint line_pos = 0;
+		gboolean next_line_invalid = FALSE;
+		gboolean need_invalidate_next = FALSE;
+
+		/* Last buffer line. */
+		if (line_start_offset == line_end_offset)
+		{
+			g_assert (line_start_offset == gtk_text_buffer_get_char_count (buffer));
+			break;
+		}
+
+		if (ce->priv->partial_line != NULL)
+		{
+			/* Continue where the previous call stopped. */
+			PartialLine *partial = ce->priv->partial_line;
+
+			g_assert (partial->line.start_at == line_start_offset);
+
+			line = partial->line;
+			partial_text = partial->text;
+			line_pos = partial->line_pos;
+			state = partial->state;
+
+			g_slice_free (PartialLine, partial);
+			ce->priv->partial_line = NULL;
+			ce->priv->hint2 = NULL;
+		}
+		else
+		{
+			/* Analyze the line */
+			erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
+			get_line_info (ce, buffer, &line_start, &line_end, &line);
+
+#ifdef ENABLE_CHECK_TREE
+			{
+				Segment *inv = get_invalid_segment (ce);
+				g_assert (inv == NULL || inv->start_at >= line_end_offset);
+			}
+#endif
+
+			if (first_line)
+			{
+				state = ce->priv->root_segment;
+			}
+			else
+			{
+				Segment *hint = ce->priv->hint;
+
+				/* Without a hint the search would start from the root. */
+				if (hint == NULL)
+					hint = get_line_state (ce, gtk_text_iter_get_line (&line_start));
+
+				state = get_segment_at_offset (ce,
+							       hint ? hint : state,
+							       line_start_offset - 1);
+			}
+
+			g_assert (state->context != NULL);
+
+			ce->priv->hint2 = ce->priv->hint;
+
+			if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
+				ce->priv->hint2 = NULL;
+		}
+
+		if (!analyze_line (ce, &state, &line, &line_pos, timer, time))
+		{
+			PartialLine *partial;
+
+			/* Out of time in the middle of a long line: keep what
+			 * is analyzed and continue on the next call. The line
+			 * text is copied since get_line_info() reuses it. */
+			if (partial_text == NULL)
+				partial_text = g_strdup (line.text);
+
+			partial = g_slice_new (PartialLine);
+			partial->line = line;
+			partial->line.text = partial_text;
+			partial->text = partial_text;
+			partial->line_pos = line_pos;
+			partial->state = state;
+			ce->priv->partial_line = partial;
+			ce->priv->hint = state;
+
+			analyzed_end = line_pos_to_offset (&line, line_pos);
+			gtk_text_buffer_get_iter_at_offset (buffer, &line_end, analyzed_end);
+			gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
+			break;
+		}
+
+		/* At this point analyze_line() could have disabled highlighting */
+		if (ce->priv->disabled)
+		{
+			g_free (partial_text);
+			g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+			return;
+		}
+
+#ifdef ENABLE_CHECK_TREE
+		{
+			Segment *inv = get_invalid_segment (ce);
+			g_assert (inv == NULL || inv->start_at >= line_end_offset);
+		}
+#endif
+
+		/* XXX this is wrong */
+		/* I don't know anymore why it's wrong, I guess it means
+		 * "may be inefficient" */
+		if (ce->priv->hint2 != NULL)
+			ce->priv->hint = ce->priv->hint2;
+		else
+			ce->priv->hint = state;
+
+		if (line.eol_length != 0)
+			set_line_state (ce, gtk_text_iter_get_line (&line_end), state);
+
+		g_free (partial_text);
+
+		gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
+		analyzed_end = line_end_offset;
+		invalid = get_invalid_segment (ce);
+
+		if (invalid != NULL)
+		{
+			GtkTextIter iter;
+
+			gtk_text_buffer_get_iter_at_offset (buffer, &iter, invalid->start_at);
+			gtk_text_iter_set_line_offset (&iter, 0);
+
+			if (gtk_text_iter_get_offset (&iter) == line_end_offset)
+				next_line_invalid = TRUE;
+		}
+
+		if (!next_line_invalid)
+		{
+			Segment *old_state, *hint;
+
+			hint = ce->priv->hint ? ce->priv->hint : state;
+			old_state = get_segment_at_offset (ce, hint, line_end_offset);
+
+			/* We can merge old and new stuff if: contexts are the same,
+			 * and the segment on the next line is continuation of the
+			 * segment from previous line. */
+			if (old_state != state &&
+			    (old_state->context != state->context || state->is_start))
+			{
+				need_invalidate_next = TRUE;
+				next_line_invalid = TRUE;
+			}
+			else
+			{
+				segment_merge (ce, state, old_state);
+				CHECK_TREE (ce);
+			}
+		}
+
+		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
+		    line_end_offset >= end_offset ||
+		    (invalid == NULL && !next_line_invalid))
+		{
+			if (need_invalidate_next)
+				insert_range (ce, line_end_offset, 0);
+			break;
+		}
+
+		if (next_line_invalid)
+		{
+			line_start_offset = line_end_offset;
+			line_start = line_end;
+			gtk_text_iter_forward_line (&line_end);
+			line_end_offset = gtk_text_iter_get_offset (&line_end);
+		}
+		else
+		{
+			gtk_text_buffer_get_iter_at_offset (buffer, &line_start, invalid->start_at);
+			gtk_text_iter_set_line_offset (&line_start, 0);
+			line_start_offset = gtk_text_iter_get_offset (&line_start);
+			line_end = line_start;
+			gtk_text_iter_forward_line (&line_end);
+			line_end_offset = gtk_text_iter_get_offset (&line_end);
+		}
+
+		first_line = (0 == line_start_offset);
+	}
+
+	if (analyzed_end == gtk_text_buffer_get_char_count (buffer))
+	{
+		g_assert (g_slist_length (ce->priv->invalid) <= 1);
+
+		if (ce->priv->invalid != NULL)
+		{
+			invalid = get_invalid_segment (ce);
+			segment_remove (ce, invalid);
+			CHECK_TREE (ce);
+		}
+	}
+
+	if (!all_analyzed (ce))
+		install_idle_worker (ce);
+
+	gtk_text_iter_set_offset (&end_iter, analyzed_end);
+
+	gtk_text_region_subtract (ce->priv->provisional_region, &start_iter, &end_iter);
+	refresh_range (ce, &start_iter, &end_iter);
+
+	if (all_analyzed (ce))
+		save_highlight_cache (ce);
+
+	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
+			  analyzed_end - start_offset, start_offset, analyzed_end,
+			  g_timer_elapsed (timer, NULL) * 1000));
+
+	g_timer_destroy (timer);
+
+out:
+	/* must call context_thaw, so this is the only return point */
+	context_thaw (ce->priv->root_context);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+}
+
+
+static void
+context_get_size_hash_cb (G_GNUC_UNUSED gpointer text,
+			  Context *context,
+			  gsize   *size);
+
+/**
+ * context_get_size_:
+ * @context: the context.
+ *
+ * Returns: approximate amount of memory used by @context and its
+ * descendants, not counting regexes.
+ */
+static gsize
+context_get_size_ (Context *context)
+{
+	ContextPtr *ptr;
+	gsize size = sizeof (Context);
+
+	for (ptr = context->children; ptr != NULL; ptr = ptr->next)
+	{
+		size += sizeof (ContextPtr);
+
+		if (ptr->fixed)
+			size += context_get_size_ (ptr->u.context);
+		else
+			g_hash_table_foreach (ptr->u.hash,
+					      (GHFunc) context_get_size_hash_cb,
+					      &size);
+	}
+
+	return size;
+}
+
+static void
+context_get_size_hash_cb (G_GNUC_UNUSED gpointer text,
+			  Context *context,
+			  gsize   *size)
+{
+	*size += context_get_size_ (context);
+}
+
+/**
+ * _gtk_source_context_engine_get_for_buffer:
+ * @buffer: a #GtkTextBuffer.
+ *
+ * Gets the engine highlighting @buffer, so that its statistics can be
+ * looked at. Unit tests linked to libgtksourceview-private have a copy
+ * of this file of their own, in which the engine type is not
+ * registered: the functions they call on the engine check it only
+ * against %NULL.
+ *
+ * Returns: (transfer none): the engine attached to @buffer, or %NULL.
+ */
+GtkSourceContextEngine *
+_gtk_source_context_engine_get_for_buffer (GtkTextBuffer *buffer)
+{
+	g_return_val_if_fail (GTK_IS_TEXT_BUFFER (buffer), NULL);
+
+	return g_object_get_data (G_OBJECT (buffer), ENGINE_DATA_KEY);
+}
+
+/**
+ * _gtk_source_context_engine_get_memory_usage:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Returns: approximate amount of memory in bytes used by the
+ * syntax tree of the buffer.
+ */
+gsize
+_gtk_source_context_engine_get_memory_usage (GtkSourceContextEngine *ce)
+{
+	gsize size;
+
+	g_return_val_if_fail (ce != NULL, 0);
+
+	size = node_pool_get_size (&ce->priv->segment_pool) +
+	       node_pool_get_size (&ce->priv->sub_pattern_pool) +
+	       ce->priv->line_states->len * sizeof (LineState);
+
+	if (ce->priv->root_context != NULL)
+		size += context_get_size_ (ce->priv->root_context);
+
+	return size;
+}
+
+/**
+ * _gtk_source_context_engine_get_line_cache_stats:
+ * @ce: #GtkSourceContextEngine.
+ * @hits: (out) (allow-none): return location for the number of lines
+ * taken from the line cache, or %NULL.
+ * @misses: (out) (allow-none): return location for the number of lines
+ * looked up in the line cache and analyzed, or %NULL.
+ *
+ * Gets statistics of the line cache, see line_cache_lookup().
+ */
+void
+_gtk_source_context_engine_get_line_cache_stats (GtkSourceContextEngine *ce,
+						 guint                  *hits,
+						 guint                  *misses)
+{
+	g_return_if_fail (ce != NULL);
+
+	if (hits != NULL)
+		*hits = ce->priv->line_cache_hits;
+
+	if (misses != NULL)
+		*misses = ce->priv->line_cache_misses;
+}
+
+/**
+ * _gtk_source_context_engine_get_tag_stats:
+ * @ce: #GtkSourceContextEngine.
+ * @operations: (out) (allow-none): return location for the number of
+ * tags applied to and removed from the buffer, or %NULL.
+ * @saved: (out) (allow-none): return location for the number of
+ * those operations avoided because the tags were already right, or
+ * %NULL.
+ *
+ * Gets statistics about tag updates, see update_tags().
+ */
+void
+_gtk_source_context_engine_get_tag_stats (GtkSourceContextEngine *ce,
+					  guint                  *operations,
+					  guint                  *saved)
+{
+	g_return_if_fail (ce != NULL);
+
+	if (operations != NULL)
+		*operations = ce->priv->tag_operations;
+
+	if (saved != NULL)
+		*saved = ce->priv->tag_operations_saved;
+}
+
+/**
+ * _gtk_source_context_engine_get_cache_stats:
+ * @ce: #GtkSourceContextEngine.
+ * @loads: (out) (allow-none): return location for the number of trees
+ * read from the highlight cache, or %NULL.
+ * @rejects: (out) (allow-none): return location for the number of
+ * cache files found but ignored because they did not match the text
+ * or could not be parsed, or %NULL.
+ *
+ * Gets statistics about the highlight cache, see
+ * read_highlight_cache_().
+ */
+void
+_gtk_source_context_engine_get_cache_stats (GtkSourceContextEngine *ce,
+					    guint                  *loads,
+					    guint                  *rejects)
+{
+	g_return_if_fail (ce != NULL);
+
+	if (loads != NULL)
+		*loads = ce->priv->cache_loads;
+
+	if (rejects != NULL)
+		*rejects = ce->priv->cache_rejects;
+}
+
+/**
+ * _gtk_source_context_engine_get_analysis_stats:
+ * @ce: #GtkSourceContextEngine.
+ * @lines: (out) (allow-none): return location for the number of lines
+ * analyzed so far, or %NULL.
+ *
+ * Gets statistics about the analysis, see analyze_line(). A line
+ * analyzed again after a change counts again.
+ */
+void
+_gtk_source_context_engine_get_analysis_stats (GtkSourceContextEngine *ce,
+					       guint                  *lines)
+{
+	g_return_if_fail (ce != NULL);
+
+	if (lines != NULL)
+		*lines = ce->priv->lines_analyzed;
+}
+
+/**
+ * _gtk_source_context_engine_set_parallel_chunks:
+ * @ce: #GtkSourceContextEngine.
+ * @n_chunks: number of chunks to split background analyses into, or 0
+ * for one per processor.
+ *
+ * Sets how many threads analyze big buffers, see
+ * split_background_analysis_(). Chunks are never smaller than
+ * PARALLEL_ANALYSIS_MIN_BYTES though. Takes effect with the next
+ * background analysis.
+ */
+void
+_gtk_source_context_engine_set_parallel_chunks (GtkSourceContextEngine *ce,
+						guint                   n_chunks)
+{
+	g_return_if_fail (ce != NULL);
+
+	ce->priv->parallel_chunks = n_chunks;
+}
+
+/**
+ * _gtk_source_context_engine_get_parallel_stats:
+ * @ce: #GtkSourceContextEngine.
+ * @chunks: (out) (allow-none): return location for the number of
+ * chunks analyzed in parallel with the beginning of the text, or %NULL.
+ *
+ * Gets statistics about background analyses split into chunks, see
+ * split_background_analysis_().
+ */
+void
+_gtk_source_context_engine_get_parallel_stats (GtkSourceContextEngine *ce,
+					       guint                  *chunks)
+{
+	g_return_if_fail (ce != NULL);
+
+	if (chunks != NULL)
+		*chunks = ce->priv->chunks_analyzed;
+}
+
+/**
+ * _gtk_source_context_engine_get_reg_all_stats:
+ * @compiled: (out) (allow-none): return location for the number of
+ * reg_all regexes compiled, or %NULL.
+ * @reused: (out) (allow-none): return location for the number of
+ * reg_all regexes shared with other contexts instead of being
+ * compiled, or %NULL.
+ * @compile_time: (out) (allow-none): return location for the time
+ * in seconds spent compiling reg_all regexes, or %NULL.
+ *
+ * Gets statistics about the regexes created by create_reg_all(),
+ * since the start of the program and for all the languages.
+ */
+void
+_gtk_source_context_engine_get_reg_all_stats (guint   *compiled,
+					      guint   *reused,
+					      gdouble *compile_time)
+{
+	g_mutex_lock (&reg_all_stats.lock);
+
+	if (compiled != NULL)
+		*compiled = reg_all_stats.compiled;
+	if (reused != NULL)
+		*reused = reg_all_stats.reused;
+	if (compile_time != NULL)
+		*compile_time = reg_all_stats.compile_time;
+
+	g_mutex_unlock (&reg_all_stats.lock);
+}
+
+/* BACKGROUND ANALYSIS ---------------------------------------------------- */
+
+/**
+ * background_analysis_done_cb:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Dispatched once the analysis thread makes done_source ready.
+ * finish_background_analysis() destroys the source.
+ */
+static gboolean
+background_analysis_done_cb (GtkSourceContextEngine *ce)
+{
+	finish_background_analysis (ce, FALSE);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+background_analysis_done_dispatch_ (G_GNUC_UNUSED GSource *source,
+				    GSourceFunc             callback,
+				    gpointer                user_data)
+{
+	return callback (user_data);
+}
+
+/* A source which is dispatched when its ready time is set, see
+ * g_source_set_ready_time(). */
+static GSourceFuncs background_analysis_done_funcs = {
+	NULL,
+	NULL,
+	background_analysis_done_dispatch_,
+	NULL
+};
+
+/**
+ * background_analyze_line_:
+ * @ce: the engine owning the tree.
+ * @state: (inout): the state at the beginning of the line.
+ * @text: (inout): the text from the beginning of the line, moved
+ * to the next line.
+ * @offset: (inout): offset of the line, moved to the next line.
+ * @line_no: (inout): number of the line, moved to the next line.
+ *
+ * Analyzes a line of the text snapshot into the syntax tree of @ce.
+ * This is what update_syntax() does, except the tree is always built
+ * from scratch, so there is nothing to erase or merge.
+ */
+static void
+background_analyze_line_ (GtkSourceContextEngine  *ce,
+			  Segment                **state,
+			  const gchar            **text,
+			  gint                    *offset,
+			  gint                    *line_no)
+{
+	LineInfo line;
+	gint line_pos = 0;
+
+	*text += fill_line_info (ce, *text, *offset, &line);
+
+	ce->priv->hint2 = ce->priv->hint;
+
+	if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != *state)
+		ce->priv->hint2 = NULL;
+
+	analyze_line (ce, state, &line, &line_pos, NULL, 0);
+
+	if (ce->priv->hint2 != NULL)
+		ce->priv->hint = ce->priv->hint2;
+	else
+		ce->priv->hint = *state;
+
+	if (line.eol_length != 0)
+		set_line_state (ce, ++*line_no, *state);
+
+	*offset = NEXT_LINE_OFFSET (&line);
+}
+
+/**
+ * analysis_chunk_thread:
+ * @chunk: #AnalysisChunk.
+ *
+ * Thread function: analyzes @chunk as if it started in the root
+ * context. Offsets in the chunk tree are relative to the chunk, but
+ * first-line-only contexts are not looked for, see no_first_line.
+ */
+static gpointer
+analysis_chunk_thread (AnalysisChunk *chunk)
+{
+	GtkSourceContextEngine *ce = chunk->scratch;
+	Segment *state = ce->priv->root_segment;
+	const gchar *text = chunk->text;
+	gint offset = 0;
+	gint line_no = 0;
+
+	_gtk_source_regex_set_thread_slot (chunk->regex_slot);
+
+	while (text < chunk->text_end && !g_atomic_int_get (&chunk->bg->cancelled))
+	{
+		background_analyze_line_ (ce, &state, &text, &offset, &line_no);
+
+		if (ce->priv->disabled)
+			break;
+	}
+
+	_gtk_source_regex_set_thread_slot (0);
+
+	chunk->char_count = offset;
+	chunk->n_lines = line_no;
+	chunk->state = state;
+
+	return NULL;
+}
+
+/**
+ * graft_context_:
+ * @contexts: contexts of a chunk tree mapped to the contexts of
+ * the tree it is grafted onto.
+ * @context: a context of the chunk tree.
+ *
+ * Returns: the context of the grafted tree which stands for
+ * @context: the one create_child_context() would find there, or
+ * @context itself, moved there with its children, if there is none.
+ */
+static Context *
+graft_context_ (GHashTable *contexts,
+		Context    *context)
+{
+	Context *parent;
+	Context *result = NULL;
+	ContextPtr *ptr, *dest;
+	gpointer key = NULL;
+
+	parent = g_hash_table_lookup (contexts, context);
+	if (parent != NULL)
+		return parent;
+
+	parent = graft_context_ (contexts, context->parent);
+
+	for (ptr = context->parent->children;
+	     ptr->definition != context->definition;
+	     ptr = ptr->next) ;
+
+	if (!ptr->fixed)
+	{
+		GHashTableIter iter;
+		gpointer value;
+
+		g_hash_table_iter_init (&iter, ptr->u.hash);
+		while (g_hash_table_iter_next (&iter, &key, &value) && value != context) ;
+	}
+
+	for (dest = parent->children;
+	     dest != NULL && dest->definition != context->definition;
+	     dest = dest->next) ;
+
+	if (dest != NULL)
+		result = dest->fixed ? dest->u.context : g_hash_table_lookup (dest->u.hash, key);
+
+	if (result == NULL)
+	{
+		if (dest == NULL)
+		{
+			dest = g_slice_new0 (ContextPtr);
+			dest->next = parent->children;
+			parent->children = dest;
+			dest->definition = context->definition;
+			dest->fixed = ptr->fixed;
+
+			if (!dest->fixed)
+				dest->u.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		}
+
+		if (dest->fixed)
+			dest->u.context = context;
+		else
+			g_hash_table_insert (dest->u.hash, g_strdup (key), context);
+
+		context_remove_child (context->parent, context);
+		context->parent = parent;
+		result = context;
+	}
+
+	g_hash_table_insert (contexts, context, result);
+	return result;
+}
+
+static void
+graft_segment_contexts_ (GHashTable *contexts,
+			 Segment    *segment)
+{
+	Context *context;
+	Segment *child;
+
+	context = graft_context_ (contexts, segment->context);
+
+	/* The old context goes away with the chunk tree, regardless
+	 * of its reference count. */
+	if (context != segment->context)
+		segment->context = context_ref (context);
+
+	for (child = segment->children; child != NULL; child = child->next)
+		graft_segment_contexts_ (contexts, child);
+}
+
+/**
+ * chunk_in_sync_at_:
+ * @chunk: #AnalysisChunk.
+ * @offset: offset of a line, relative to @chunk, not less than
+ * in the previous call.
+ *
+ * Returns: whether the state at @offset in the chunk tree is
+ * the root context.
+ */
+static gboolean
+chunk_in_sync_at_ (AnalysisChunk *chunk,
+		   gint           offset)
+{
+	Segment *segment = chunk->cursor;
+
+	while (segment != NULL && segment->start_at < offset && segment->end_at <= offset)
+		segment = segment->next;
+
+	chunk->cursor = segment;
+
+	return segment == NULL || segment->start_at >= offset;
+}
+
+/**
+ * graft_chunk_:
+ * @ce: the engine of the background analysis.
+ * @chunk: #AnalysisChunk.
+ * @offset: offset of @chunk in the snapshot.
+ * @first_line: line number of @chunk in the snapshot.
+ * @chunk_offset: offset relative to @chunk where the tree of @ce
+ * ends, the root context must be the state there in both trees.
+ * @chunk_line: line number of @chunk_offset relative to @chunk.
+ *
+ * Moves the part of the chunk tree after @chunk_offset to the end
+ * of the tree of @ce. The rest of it is destroyed, @ce has its own
+ * analysis of it.
+ *
+ * Returns: the state at the end of @chunk, in the tree of @ce.
+ */
+static Segment *
+graft_chunk_ (GtkSourceContextEngine *ce,
+	      AnalysisChunk          *chunk,
+	      gint                    offset,
+	      gint                    first_line,
+	      gint                    chunk_offset,
+	      gint                    chunk_line)
+{
+	GtkSourceContextEngine *scratch = chunk->scratch;
+	Segment *root = ce->priv->root_segment;
+	Segment *chunk_root = scratch->priv->root_segment;
+	GArray *states = scratch->priv->line_states;
+	GHashTable *contexts;
+	Segment *child;
+	Segment *state;
+	guint i;
+
+	g_assert (scratch->priv->invalid == NULL);
+
+	/* Entries reference contexts of the chunk tree. */
+	line_cache_clear (scratch);
+
+	while (chunk_root->children != chunk->cursor)
+	{
+		child = chunk_root->children;
+		chunk_root->children = child->next;
+		segment_destroy (scratch, child);
+	}
+
+	forget_dropped_segments (scratch);
+
+	if (chunk_root->children != NULL)
+		chunk_root->children->prev = NULL;
+	else
+		chunk_root->last_child = NULL;
+
+	contexts = g_hash_table_new (NULL, NULL);
+	g_hash_table_insert (contexts, scratch->priv->root_context, ce->priv->root_context);
+
+	for (child = chunk_root->children; child != NULL; child = child->next)
+	{
+		child->parent = root;
+		segment_shift (child, offset);
+
+		graft_segment_contexts_ (contexts, child);
+	}
+
+	g_hash_table_destroy (contexts);
+
+
+	if (chunk_root->children != NULL)
+	{
+		chunk_root->children->prev = root->last_child;
+
+		if (root->last_child != NULL)
+			root->last_child->next = chunk_root->children;
+		else
+			root->children = chunk_root->children;
+
+		root->last_child = chunk_root->last_child;
+	}
+
+	root->end_at = offset + chunk->char_count;
+
+	/* The state at @chunk_line is already set by @ce. */
+	for (i = 0; i < states->len; i++)
+	{
+		LineState ls = g_array_index (states, LineState, i);
+
+		if (ls.line <= chunk_line)
+		{
+			ls.segment->line_states--;
+			continue;
+		}
+
+		if (ls.segment == chunk_root)
+		{
+			ls.segment = root;
+			root->line_states++;
+		}
+
+		ls.line += first_line;
+		g_array_append_val (ce->priv->line_states, ls);
+	}
+
+	/* The segments of the moved states keep their counts. */
+	g_array_set_size (states, 0);
+
+	state = chunk->state == chunk_root ? root : chunk->state;
+
+	node_pool_merge (&ce->priv->segment_pool, &scratch->priv->segment_pool);
+	node_pool_merge (&ce->priv->sub_pattern_pool, &scratch->priv->sub_pattern_pool);
+
+	node_pool_free (&ce->priv->segment_pool, chunk_root);
+	scratch->priv->root_segment = NULL;
+	scratch->priv->hint = NULL;
+	scratch->priv->hint2 = NULL;
+
+	ce->priv->hint = state;
+
+	return state;
+}
+
+/**
+ * verify_chunk_:
+ * @ce: the engine of the background analysis.
+ * @chunk: #AnalysisChunk which follows the text analyzed by @ce.
+ * @state: (inout): the state at the beginning of @chunk.
+ * @text: (inout): text of @chunk, moved to its end.
+ * @offset: (inout): offset of @chunk, moved to its end.
+ * @line_no: (inout): line number of @chunk, moved to its end.
+ *
+ * The chunk was analyzed as if it started in the root context. If
+ * it does, its tree is simply grafted onto the tree of @ce. Otherwise
+ * the chunk is analyzed again by @ce, until a line where the state is
+ * the root context in both analyses, often a few lines later, e.g.
+ * after the end of a comment which started before the chunk. The
+ * chunk tree is grafted from there.
+ */
+static void
+verify_chunk_ (GtkSourceContextEngine  *ce,
+	       AnalysisChunk           *chunk,
+	       Segment                **state,
+	       const gchar            **text,
+	       gint                    *offset,
+	       gint                    *line_no)
+{
+	Segment *chunk_root = chunk->scratch->priv->root_segment;
+	gint chunk_start = *offset;
+	gint first_line = *line_no;
+
+	chunk->cursor = chunk_root->children;
+
+	while (*text < chunk->text_end && !g_atomic_int_get (&chunk->bg->cancelled))
+	{
+		if (*state == ce->priv->root_segment &&
+		    chunk_in_sync_at_ (chunk, *offset - chunk_start))
+		{
+			*state = graft_chunk_ (ce, chunk, chunk_start, first_line,
+					       *offset - chunk_start,
+					       *line_no - first_line);
+			*text = chunk->text_end;
+			*offset = chunk_start + chunk->char_count;
+			*line_no = first_line + chunk->n_lines;
+			return;
+		}
+
+		background_analyze_line_ (ce, state, text, offset, line_no);
+
+		if (ce->priv->disabled)
+			return;
+	}
+}
+
+/**
+ * background_analysis_thread:
+ * @bg: #BackgroundAnalysis.
+ *
+ * Thread function: reads the tree from the highlight cache if it is
+ * looked up and found there, see read_highlight_cache_(). Otherwise,
+ * starts the threads analyzing the chunks, analyzes the text before
+ * them into the syntax tree of the scratch engine, then verifies the
+ * chunks one by one, see verify_chunk_().
+ */
+static gpointer
+background_analysis_thread (BackgroundAnalysis *bg)
+{
+	GtkSourceContextEngine *ce = bg->scratch;
+	GRecMutex *lock = &ce->priv->ctx_data->lock;
+	Segment *state = ce->priv->root_segment;
+	const gchar *text = bg->text;
+	const gchar *text_end;
+	gint offset = 0;
+	gint line_no = 0;
+	guint i;
+
+	/* The tree may be in the highlight cache, see
+	 * load_highlight_cache(). The chunks are not analyzed then. */
+	if (read_highlight_cache_ (bg))
+	{
+		g_source_set_ready_time (bg->done_source, 0);
+		return NULL;
+	}
+
+	for (i = 0; i < bg->n_chunks; i++)
+	{
+		bg->chunks[i].thread = g_thread_new ("gtksourceview-highlight",
+						     (GThreadFunc) analysis_chunk_thread,
+						     &bg->chunks[i]);
+	}
+
+	text_end = bg->n_chunks != 0 ? bg->chunks[0].text : bg->text_end;
+
+	/* Regexes in lang files do not take BOM into account. */
+	if (IS_BOM (g_utf8_get_char (text)))
+	{
+		text = g_utf8_next_char (text);
+		offset = 1;
+	}
+
+	_gtk_source_regex_set_thread_slot (bg->regex_slot);
+
+	g_rec_mutex_lock (lock);
+	context_freeze (ce->priv->root_context);
+	g_rec_mutex_unlock (lock);
+
+	while (text < text_end && !g_atomic_int_get (&bg->cancelled))
+	{
+		/* Without a regex slot, the lock is taken for every line so
+		 * that other buffers using the same language are not blocked
+		 * for long. */
+		if (bg->regex_slot == 0)
+			g_rec_mutex_lock (lock);
+
+		background_analyze_line_ (ce, &state, &text, &offset, &line_no);
+
+		if (bg->regex_slot == 0)
+			g_rec_mutex_unlock (lock);
+
+		if (ce->priv->disabled)
+			break;
+	}
+
+	for (i = 0; i < bg->n_chunks; i++)
+	{
+		AnalysisChunk *chunk = &bg->chunks[i];
+
+		/* Stop the other threads. */
+		if (ce->priv->disabled)
+			g_atomic_int_set (&bg->cancelled, TRUE);
+
+		g_thread_join (chunk->thread);
+
+		if (g_atomic_int_get (&bg->cancelled))
+			continue;
+
+		if (chunk->scratch->priv->disabled)
+		{
+			ce->priv->disabled = TRUE;
+			continue;
+		}
+
+		verify_chunk_ (ce, chunk, &state, &text, &offset, &line_no);
+	}
+
+	g_rec_mutex_lock (lock);
+	context_thaw (ce->priv->root_context);
+	g_rec_mutex_unlock (lock);
+
+	_gtk_source_regex_set_thread_slot (0);
+
+	ce->priv->n_lines = line_no + 1;
+
+	/* Setting the ready time is thread safe, the source itself
+	 * belongs to the main thread. */
+	g_source_set_ready_time (bg->done_source, 0);
+
+	return NULL;
+}
+
+/**
+ * background_scratch_new_:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Creates an engine not attached to any buffer for a syntax tree
+ * built by the background analysis, or by
+ * _gtk_source_context_engine_highlight_text(), in which case @ce is
+ * not attached to any buffer either. Called with the lock held.
+ *
+ * Returns: the new engine.
+ */
+static GtkSourceContextEngine *
+background_scratch_new_ (GtkSourceContextEngine *ce)
+{
+	GtkSourceContextEngine *scratch;
+
+	scratch = _gtk_source_context_engine_new (ce->priv->ctx_data);
+	scratch->priv->max_line_length = ce->priv->max_line_length;
+	scratch->priv->root_context = context_new (scratch, NULL,
+						   gtk_source_context_data_lookup_root (ce->priv->ctx_data),
+						   NULL, NULL, FALSE);
+	scratch->priv->root_segment = create_segment (scratch, NULL, scratch->priv->root_context,
+						      0, 0, TRUE, NULL);
+
+	return scratch;
+}
+
+/**
+ * split_background_analysis_:
+ * @bg: #BackgroundAnalysis.
+ *
+ * Splits the text snapshot into chunks analyzed in parallel, one per
+ * processor unless _gtk_source_context_engine_set_parallel_chunks()
+ * says otherwise, as long as they are big enough and there are regex
+ * slots left for their threads. Called with the lock held.
+ */
+static void
+split_background_analysis_ (BackgroundAnalysis *bg)
+{
+	gsize length = bg->text_end - bg->text;
+	const gchar *prev = bg->text;
+	guint n_chunks;
+	guint i;
+
+	n_chunks = bg->ce->priv->parallel_chunks;
+
+	if (n_chunks == 0)
+		n_chunks = g_get_num_processors ();
+
+	n_chunks = MIN (n_chunks, length / PARALLEL_ANALYSIS_MIN_BYTES);
+
+	if (n_chunks < 2)
+		return;
+
+	/* A chunk cannot know which once-only contexts the text before it
+	 * has, so its tree could not be grafted even where the state is
+	 * the root context in both analyses. */
+	if (definition_has_once_only_child (gtk_source_context_data_lookup_root (bg->ce->priv->ctx_data)))
+		return;
+
+	bg->regex_slot = _gtk_source_regex_acquire_thread_slot ();
+
+	if (bg->regex_slot == 0)
+		return;
+
+	bg->chunks = g_new0 (AnalysisChunk, n_chunks - 1);
+
+	for (i = 1; i < n_chunks; i++)
+	{
+		AnalysisChunk *chunk = &bg->chunks[bg->n_chunks];
+		const gchar *p = bg->text + length / n_chunks * i;
+		gint slot;
+
+		if (p <= prev)
+			continue;
+
+		/* Chunks begin at the beginning of a line. */
+		p = memchr (p, '\n', bg->text_end - p);
+
+		if (p == NULL || p + 1 == bg->text_end)
+			break;
+
+		slot = _gtk_source_regex_acquire_thread_slot ();
+
+		if (slot == 0)
+			break;
+
+		chunk->bg = bg;
+		chunk->scratch = background_scratch_new_ (bg->ce);
+		chunk->scratch->priv->no_first_line = TRUE;
+		chunk->text = p + 1;
+		chunk->regex_slot = slot;
+
+		prev = chunk->text;
+		bg->n_chunks++;
+	}
+
+	for (i = 0; i < bg->n_chunks; i++)
+	{
+		bg->chunks[i].text_end = i + 1 < bg->n_chunks ?
+					 bg->chunks[i + 1].text : bg->text_end;
+	}
+
+	if (bg->n_chunks == 0)
+	{
+		_gtk_source_regex_release_thread_slot (bg->regex_slot);
+		bg->regex_slot = 0;
+		g_free (bg->chunks);
+		bg->chunks = NULL;
+	}
+}
+
+/**
+ * start_background_analysis:
+ * @ce: #GtkSourceContextEngine.
+ * @cache_languages: (transfer full) (allow-none): languages of the
+ * highlight cache file to read the tree from, or %NULL, see
+ * load_highlight_cache().
+ *
+ * If the buffer is big enough, or it is looked up in the highlight
+ * cache, starts analyzing the whole buffer in a separate thread, so
+ * that the main loop is not kept busy by the idle worker for a long
+ * time, see background_analysis_thread(). The new syntax tree replaces
+ * the current one when it is ready, see finish_background_analysis().
+ * Changes made to the buffer in the meantime are accumulated in
+ * invalid_regions, which are relative to the text snapshot taken here.
+ *
+ * Big snapshots are split into chunks analyzed by more threads at once,
+ * see split_background_analysis_().
+ *
+ * Returns: whether the analysis was started.
+ */
+static gboolean
+start_background_analysis (GtkSourceContextEngine *ce,
+			   gchar                  *cache_languages)
+{
+	BackgroundAnalysis *bg;
+	GtkTextIter start, end;
+
+	if (ce->priv->background != NULL)
+	{
+		g_free (cache_languages);
+		return TRUE;
+	}
+
+	if (cache_languages == NULL &&
+	    gtk_text_buffer_get_char_count (ce->priv->buffer) < BACKGROUND_ANALYSIS_MIN_CHARS)
+		return FALSE;
+
+	gtk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+
+	bg = g_slice_new0 (BackgroundAnalysis);
+	bg->ce = ce;
+	bg->text = gtk_text_buffer_get_slice (ce->priv->buffer, &start, &end, TRUE);
+	bg->text_end = bg->text + strlen (bg->text);
+	bg->cache_languages = cache_languages;
+	bg->n_lines = gtk_text_buffer_get_line_count (ce->priv->buffer);
+	bg->char_count = gtk_text_buffer_get_char_count (ce->priv->buffer);
+
+	/* Make the tree match the snapshot, so that invalid_regions
+	 * afterwards describe changes made to the snapshot. */
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	update_tree (ce);
+
+	bg->scratch = background_scratch_new_ (ce);
+	split_background_analysis_ (bg);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	ce->priv->background = bg;
+
+	if (ce->priv->incremental_update != 0)
+	{
+		g_source_remove (ce->priv->incremental_update);
+		ce->priv->incremental_update = 0;
+	}
+
+	bg->done_source = g_source_new (&background_analysis_done_funcs, sizeof (GSource));
+	g_source_set_priority (bg->done_source, FIRST_UPDATE_PRIORITY);
+	g_source_set_callback (bg->done_source,
+			       (GSourceFunc) background_analysis_done_cb,
+			       ce,
+			       NULL);
+	g_source_attach (bg->done_source, NULL);
+
+	bg->thread = g_thread_new ("gtksourceview-highlight",
+				   (GThreadFunc) background_analysis_thread,
+				   bg);
+
+	return TRUE;
+}
+
+/**
+ * take_scratch_tree:
+ * @ce: #GtkSourceContextEngine.
+ * @scratch: engine which owns a syntax tree of the whole buffer.
+ *
+ * Replaces the syntax tree of @ce with the one of @scratch, which
+ * is left without a tree. Called with the lock held.
+ */
+static void
+take_scratch_tree (GtkSourceContextEngine *ce,
+		   GtkSourceContextEngine *scratch)
+{
+	GArray *line_states;
+	NodePool pool;
+
+	g_assert (scratch->priv->invalid == NULL);
+
+	/* Entries reference contexts of the tree. */
+	line_cache_clear (scratch);
+	forget_dropped_segments (scratch);
+
+	segment_tree_destroy (ce);
+
+	ce->priv->root_context = scratch->priv->root_context;
+	ce->priv->root_segment = scratch->priv->root_segment;
+
+	/* The new tree lives in the scratch engine's pools. */
+	pool = ce->priv->segment_pool;
+	ce->priv->segment_pool = scratch->priv->segment_pool;
+	scratch->priv->segment_pool = pool;
+	pool = ce->priv->sub_pattern_pool;
+	ce->priv->sub_pattern_pool = scratch->priv->sub_pattern_pool;
+	scratch->priv->sub_pattern_pool = pool;
+
+	line_states = ce->priv->line_states;
+	ce->priv->line_states = scratch->priv->line_states;
+	ce->priv->n_lines = scratch->priv->n_lines;
+	scratch->priv->line_states = line_states;
+
+	scratch->priv->root_context = NULL;
+	scratch->priv->root_segment = NULL;
+}
+
+/**
+ * finish_background_analysis:
+ * @ce: #GtkSourceContextEngine.
+ * @cancel: whether to throw away the result.
+ *
+ * Waits for the analysis thread and, unless @cancel is %TRUE,
+ * replaces the syntax tree with the one built by the thread and
+ * queues highlighting of the whole buffer.
+ */
+static void
+finish_background_analysis (GtkSourceContextEngine *ce,
+			    gboolean                cancel)
+{
+	BackgroundAnalysis *bg = ce->priv->background;
+	GtkSourceContextEngine *scratch;
+	gboolean disabled;
+	gboolean loaded;
+	gboolean rejected;
+	guint i;
+
+	g_return_if_fail (bg != NULL);
+
+	if (cancel)
+		g_atomic_int_set (&bg->cancelled, TRUE);
+
+	g_thread_join (bg->thread);
+
+	g_source_destroy (bg->done_source);
+	g_source_unref (bg->done_source);
+
+	ce->priv->background = NULL;
+	scratch = bg->scratch;
+	disabled = scratch->priv->disabled;
+	loaded = bg->loaded;
+	rejected = bg->rejected;
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+
+	if (!cancel && !disabled)
+	{
+		take_scratch_tree (ce, scratch);
+		ce->priv->chunks_analyzed += bg->n_chunks;
+	}
+	else
+	{
+		segment_tree_destroy (scratch);
+	}
+
+	/* What is left of the chunk trees after grafting. */
+	for (i = 0; i < bg->n_chunks; i++)
+		segment_tree_destroy (bg->chunks[i].scratch);
+
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	ce->priv->lines_analyzed += scratch->priv->lines_analyzed;
+
+	for (i = 0; i < bg->n_chunks; i++)
+	{
+		ce->priv->lines_analyzed += bg->chunks[i].scratch->priv->lines_analyzed;
+		g_object_unref (bg->chunks[i].scratch);
+		_gtk_source_regex_release_thread_slot (bg->chunks[i].regex_slot);
+	}
+
+	if (bg->regex_slot != 0)
+		_gtk_source_regex_release_thread_slot (bg->regex_slot);
+
+	g_object_unref (scratch);
+	g_free (bg->chunks);
+	g_free (bg->text);
+	g_free (bg->cache_languages);
+	g_slice_free (BackgroundAnalysis, bg);
+
+	/* The tree read from the cache need not be saved again. */
+	if (loaded && !cancel)
+		ce->priv->cache_save_pending = FALSE;
+
+	if (!cancel)
+	{
+		ce->priv->cache_loads += loaded ? 1 : 0;
+		ce->priv->cache_rejects += rejected ? 1 : 0;
+	}
+
+	if (disabled && !cancel)
+	{
+		disable_syntax_analysis (ce);
+	}
+	else if (!cancel)
+	{
+		GtkTextIter start, end;
+
+		forget_provisional_highlighting (ce);
+
+		gtk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+		gtk_text_region_add (ce->priv->refresh_region, &start, &end);
+		refresh_range (ce, &start, &end);
+
+		if (!all_analyzed (ce))
+			install_first_update (ce);
+		else
+			save_highlight_cache (ce);
+	}
+}
+
+
+/* HIGHLIGHT CACHE -------------------------------------------------------- */
+
+/*
+ * The syntax tree of the whole buffer may be saved to a file in the user
+ * cache directory once it is analyzed, and read back when the same text
+ * is loaded again, see gtk_source_buffer_set_highlight_cache(). The file
+ * is a GVariant of type HIGHLIGHT_CACHE_FORMAT:
+ *
+ * - a header: the format version, the checksum of the text, the id of
+ *   the language, the ids and modification times of the files of all the
+ *   languages the definitions come from, see highlight_cache_languages_(),
+ *   max_line_length, and the number of lines and characters of the text;
+ * - the contexts, the root one excluded: the index of the parent context,
+ *   the position of the DefinitionChild in the parent definition, see
+ *   definition_iter_next(), and the id of the definition;
+ * - the segments, in tree order: the index of the parent segment and of
+ *   the context, the offsets, start_len, end_len and is_start;
+ * - the sub patterns: the index of the segment, the index of the
+ *   SubPatternDefinition and the offsets;
+ * - the line states: the line and the index of the segment.
+ *
+ * Contexts whose end regex refers to the start match are not saved, the
+ * match is not in the tree.
+ *
+ * Neither the checksum of the text nor the file system is waited for on
+ * the main thread: the file is read by the background analysis before it
+ * analyzes the text, see read_highlight_cache_(), and written by a thread
+ * of its own, see save_highlight_cache(). The file is read without
+ * trusting it: the tree is checked against the text, see
+ * read_cache_tree_(), and any mismatch makes the text analyzed as usual.
+ * Reading a file touches it, and the least recently used files are
+ * removed when the cache grows over HIGHLIGHT_CACHE_MAX_SIZE, see
+ * prune_highlight_cache_().
+ */
+
+/* A file in the cache directory, see prune_highlight_cache_(). */
+typedef struct
+{
+	gchar		*filename;
+	gint64		 mtime;
+	goffset		 size;
+} CacheFileInfo;
+
+/**
+ * highlight_cache_languages_:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Definitions may come from other languages than the one of @ce, and
+ * a change to any of their files may change the tree. Called only from
+ * load_highlight_cache() and save_highlight_cache().
+ *
+ * Returns: the ids and modification times of the files of all the
+ * languages with definitions in the context data, sorted by id, or
+ * %NULL if a language file is not known.
+ */
+static gchar *
+highlight_cache_languages_ (GtkSourceContextEngine *ce)
+{
+	GtkSourceLanguageManager *lm;
+	GHashTableIter iter;
+	GHashTable *ids;
+	GString *languages;
+	GList *list;
+	GList *l;
+	const gchar *key;
+
+	lm = _gtk_source_language_get_language_manager (ce->priv->ctx_data->lang);
+
+	if (lm == NULL)
+		return NULL;
+
+	/* Definition ids are decorated with the language id. */
+	ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_iter_init (&iter, ce->priv->ctx_data->definitions);
+
+	while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL))
+	{
+		const gchar *colon = strchr (key, ':');
+
+		g_hash_table_add (ids, colon != NULL ? g_strndup (key, colon - key) : g_strdup (key));
+	}
+
+	list = g_list_sort (g_hash_table_get_keys (ids), (GCompareFunc) strcmp);
+	languages = g_string_new (NULL);
+
+	for (l = list; l != NULL; l = l->next)
+	{
+		GtkSourceLanguage *lang;
+		GStatBuf buf;
+
+		lang = gtk_source_language_manager_get_language (lm, l->data);
+
+		if (lang == NULL || lang->priv->lang_file_name == NULL ||
+		    g_stat (lang->priv->lang_file_name, &buf) != 0)
+			break;
+
+		g_string_append_printf (languages, "%s:%" G_GINT64_FORMAT ";",
+					(const gchar *) l->data, (gint64) buf.st_mtime);
+	}
+
+	/* A language file which is not known cannot be checked. */
+	if (l != NULL)
+	{
+		g_string_free (languages, TRUE);
+		languages = NULL;
+	}
+
+	g_list_free (list);
+	g_hash_table_destroy (ids);
+
+	return languages != NULL ? g_string_free (languages, FALSE) : NULL;
+}
+
+/**
+ * highlight_cache_file:
+ * @lang_id: id of the language.
+ * @checksum: checksum of the text.
+ *
+ * Returns: the name of the cache file for the text.
+ */
+static gchar *
+highlight_cache_file (const gchar *lang_id,
+		      const gchar *checksum)
+{
+	gchar *basename;
+	gchar *filename;
+
+	basename = g_strdup_printf ("%s-%s", lang_id, checksum);
+	filename = g_build_filename (g_get_user_cache_dir (),
+				     "gtksourceview-3.0",
+				     "highlight",
+				     basename,
+				     NULL);
+	g_free (basename);
+
+	return filename;
+}
+
+static gint
+cache_file_info_compare_ (const CacheFileInfo *a,
+			  const CacheFileInfo *b)
+{
+	return a->mtime < b->mtime ? -1 : a->mtime > b->mtime;
+}
+
+/**
+ * prune_highlight_cache_:
+ * @dirname: the cache directory.
+ *
+ * Removes the least recently used cache files while the files
+ * take more than HIGHLIGHT_CACHE_MAX_SIZE. Called only from
+ * save_highlight_cache_thread().
+ */
+static void
+prune_highlight_cache_ (const gchar *dirname)
+{
+	GDir *dir;
+	GArray *files;
+	const gchar *name;
+	goffset total = 0;
+	guint i;
+
+	dir = g_dir_open (dirname, 0, NULL);
+
+	if (dir == NULL)
+		return;
+
+	files = g_array_new (FALSE, FALSE, sizeof (CacheFileInfo));
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+	{
+		CacheFileInfo info;
+		GStatBuf buf;
+
+		info.filename = g_build_filename (dirname, name, NULL);
+
+		if (g_stat (info.filename, &buf) != 0)
+		{
+			g_free (info.filename);
+			continue;
+		}
+
+		info.mtime = buf.st_mtime;
+		info.size = buf.st_size;
+		total += info.size;
+		g_array_append_val (files, info);
+	}
+
+	g_dir_close (dir);
+
+	if (total > HIGHLIGHT_CACHE_MAX_SIZE)
+		g_array_sort (files, (GCompareFunc) cache_file_info_compare_);
+
+	for (i = 0; i < files->len; i++)
+	{
+		CacheFileInfo *info = &g_array_index (files, CacheFileInfo, i);
+
+		if (total > HIGHLIGHT_CACHE_MAX_SIZE && g_remove (info->filename) == 0)
+		{
+			DEBUG (g_print ("removed %s\n", info->filename));
+			total -= info->size;
+		}
+
+		g_free (info->filename);
+	}
+
+	g_array_free (files, TRUE);
+}
+
+/**
+ * cache_writer_add_context_:
+ * @writer: #CacheWriter.
+ * @context: the context.
+ *
+ * Writes @context and its ancestors if they are not written yet.
+ * Called only from cache_writer_add_segment_().
+ *
+ * Returns: index of @context in the cache file, or -1 if it
+ * cannot be saved.
+ */
+static gint
+cache_writer_add_context_ (CacheWriter *writer,
+			   Context     *context)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+	gint index;
+	gint parent;
+	gint position = 0;
+
+	index = GPOINTER_TO_INT (g_hash_table_lookup (writer->contexts, context)) - 1;
+
+	if (index >= 0)
+		return index;
+
+	if (context->parent == NULL || !DEFINITION_IS_FIXED (context->definition))
+	{
+		writer->failed = TRUE;
+		return -1;
+	}
+
+	parent = cache_writer_add_context_ (writer, context->parent);
+
+	if (parent < 0)
+		return -1;
+
+	/* The child which create_child_context() creates the
+	 * same context from, see context_new(). */
+	definition_iter_init (&iter, context->parent->definition);
+
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+	{
+		if (child_def->u.definition == context->definition)
+		{
+			const gchar *style = context->definition->default_style;
+			gboolean ignore_children_style = FALSE;
+
+			if (child_def->override_style)
+			{
+				style = child_def->style;
+				ignore_children_style = child_def->override_style_deep;
+			}
+
+			if (context->parent->ignore_children_style)
+			{
+				style = NULL;
+				ignore_children_style = TRUE;
+			}
+
+			if (style == context->style &&
+			    !ignore_children_style == !context->ignore_children_style)
+				break;
+		}
+
+		position++;
+	}
+
+	definition_iter_destroy (&iter);
+
+	if (child_def == NULL)
+	{
+		writer->failed = TRUE;
+		return -1;
+	}
+
+	index = g_hash_table_size (writer->contexts);
+	g_hash_table_insert (writer->contexts, context, GINT_TO_POINTER (index + 1));
+	g_variant_builder_add (&writer->contexts_builder, "(iis)",
+			       parent, position, context->definition->id);
+
+	return index;
+}
+
+/**
+ * cache_writer_add_segment_:
+ * @writer: #CacheWriter.
+ * @segment: the segment.
+ * @parent: index of the parent segment, or -1.
+ *
+ * Writes @segment along with its sub patterns and descendants.
+ * Called only from save_highlight_cache().
+ */
+static void
+cache_writer_add_segment_ (CacheWriter *writer,
+			   Segment     *segment,
+			   gint         parent)
+{
+	Segment *child;
+	SubPattern *sp;
+	gint index;
+	gint context;
+
+	if (SEGMENT_IS_INVALID (segment))
+	{
+		writer->failed = TRUE;
+		return;
+	}
+
+	context = cache_writer_add_context_ (writer, segment->context);
+
+	if (context < 0)
+		return;
+
+
+	index = g_hash_table_size (writer->segments);
+	g_hash_table_insert (writer->segments, segment, GINT_TO_POINTER (index + 1));
+	g_variant_builder_add (&writer->segments_builder, "(iiiiiib)",
+			       parent, context,
+			       segment->start_at, segment->end_at,
+			       segment->start_len, segment->end_len,
+			       (gboolean) segment->is_start);
+
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+		g_variant_builder_add (&writer->sub_patterns_builder, "(iuii)",
+				       index, sp->definition->index,
+				       sp->start_at, sp->end_at);
+
+	for (child = segment->children; child != NULL && !writer->failed; child = child->next)
+		cache_writer_add_segment_ (writer, child, index);
+}
+
+/**
+ * save_highlight_cache_thread:
+ * @save: #CacheSave.
+ *
+ * Thread function: computes the checksum of the text, writes the
+ * cache file and prunes the cache directory.
+ */
+static gpointer
+save_highlight_cache_thread (CacheSave *save)
+{
+	GVariant *variant;
+	GError *error = NULL;
+	gchar *checksum;
+	gchar *filename;
+	gchar *dirname;
+
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, save->text, -1);
+	filename = highlight_cache_file (save->lang_id, checksum);
+
+	/* The arrays are floating, the variant takes them. */
+	variant = g_variant_new ("(usssiii@a(iis)@a(iiiiiib)@a(iuii)@a(ii))",
+				 HIGHLIGHT_CACHE_VERSION,
+				 checksum,
+				 save->lang_id,
+				 save->languages,
+				 save->max_line_length,
+				 save->n_lines,
+				 save->char_count,
+				 save->contexts,
+				 save->segments,
+				 save->sub_patterns,
+				 save->line_states);
+	g_variant_ref_sink (variant);
+
+	/* The cache is optional, failing to write it is not an error. */
+	dirname = g_path_get_dirname (filename);
+
+	if (g_mkdir_with_parents (dirname, 0700) != 0 ||
+	    !g_file_set_contents (filename,
+				  g_variant_get_data (variant),
+				  g_variant_get_size (variant),
+				  &error))
+	{
+		DEBUG (g_print ("could not save %s: %s\n", filename,
+				error != NULL ? error->message : "no directory"));
+		g_clear_error (&error);
+	}
+	else
+	{
+		prune_highlight_cache_ (dirname);
+	}
+
+	g_variant_unref (variant);
+	g_free (dirname);
+	g_free (checksum);
+	g_free (filename);
+
+	g_free (save->text);
+	g_free (save->lang_id);
+	g_free (save->languages);
+	g_slice_free (CacheSave, save);
+
+	return NULL;
+}
+
+/**
+ * wait_highlight_cache_save:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Waits for the thread writing the cache file, if any.
+ */
+static void
+wait_highlight_cache_save (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->cache_save_thread != NULL)
+	{
+		g_thread_join (ce->priv->cache_save_thread);
+		ce->priv->cache_save_thread = NULL;
+	}
+}
+
+/**
+ * save_highlight_cache:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Saves the syntax tree to the highlight cache if it is to be saved
+ * and the whole buffer is analyzed. The tree is serialized here, the
+ * file is written by save_highlight_cache_thread().
+ */
+static void
+save_highlight_cache (GtkSourceContextEngine *ce)
+{
+	CacheWriter writer;
+	GVariantBuilder line_states_builder;
+	GtkTextIter start, end;
+	CacheSave *save;
+	gchar *languages;
+	guint i;
+
+	if (!ce->priv->cache_save_pending || ce->priv->disabled ||
+	    ce->priv->sync_lines >= 0 || ce->priv->background != NULL ||
+	    !all_analyzed (ce) ||
+	    gtk_text_buffer_get_char_count (ce->priv->buffer) == 0)
+		return;
+
+	ce->priv->cache_save_pending = FALSE;
+
+	languages = highlight_cache_languages_ (ce);
+
+	if (languages == NULL)
+		return;
+
+	writer.contexts = g_hash_table_new (NULL, NULL);
+	writer.segments = g_hash_table_new (NULL, NULL);
+	writer.failed = FALSE;
+	g_variant_builder_init (&writer.contexts_builder, G_VARIANT_TYPE ("a(iis)"));
+	g_variant_builder_init (&writer.segments_builder, G_VARIANT_TYPE ("a(iiiiiib)"));
+	g_variant_builder_init (&writer.sub_patterns_builder, G_VARIANT_TYPE ("a(iuii)"));
+	g_variant_builder_init (&line_states_builder, G_VARIANT_TYPE ("a(ii)"));
+
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	forget_dropped_segments (ce);
+
+	/* The root context is the one everything starts from. */
+	g_hash_table_insert (writer.contexts, ce->priv->root_context, GINT_TO_POINTER (1));
+	cache_writer_add_segment_ (&writer, ce->priv->root_segment, -1);
+
+	for (i = 0; i < ce->priv->line_states->len && !writer.failed; i++)
+	{
+		LineState *ls = &g_array_index (ce->priv->line_states, LineState, i);
+		gint index;
+
+		index = GPOINTER_TO_INT (g_hash_table_lookup (writer.segments, ls->segment)) - 1;
+
+		if (index < 0)
+			writer.failed = TRUE;
+		else
+			g_variant_builder_add (&line_states_builder, "(ii)", ls->line, index);
+	}
+
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	g_hash_table_destroy (writer.contexts);
+	g_hash_table_destroy (writer.segments);
+
+	if (writer.failed)
+	{
+		DEBUG (g_print ("syntax tree of %s buffer cannot be cached\n",
+				gtk_source_language_get_id (ce->priv->ctx_data->lang)));
+		g_variant_builder_clear (&writer.contexts_builder);
+		g_variant_builder_clear (&writer.segments_builder);
+		g_variant_builder_clear (&writer.sub_patterns_builder);
+		g_variant_builder_clear (&line_states_builder);
+		g_free (languages);
+		return;
+	}
+
+	wait_highlight_cache_save (ce);
+
+	gtk_text_buffer_get_bounds (ce->priv->buffer, &start, &end);
+
+	save = g_slice_new (CacheSave);
+	save->text = gtk_text_buffer_get_slice (ce->priv->buffer, &start, &end, TRUE);
+	save->lang_id = g_strdup (gtk_source_language_get_id (ce->priv->ctx_data->lang));
+	save->languages = languages;
+	save->max_line_length = ce->priv->max_line_length;
+	save->n_lines = gtk_text_buffer_get_line_count (ce->priv->buffer);
+	save->char_count = gtk_text_buffer_get_char_count (ce->priv->buffer);
+	save->contexts = g_variant_builder_end (&writer.contexts_builder);
+	save->segments = g_variant_builder_end (&writer.segments_builder);
+	save->sub_patterns = g_variant_builder_end (&writer.sub_patterns_builder);
+	save->line_states = g_variant_builder_end (&line_states_builder);
+
+	ce->priv->cache_save_thread = g_thread_new ("gtksourceview-highlight-cache",
+						    (GThreadFunc) save_highlight_cache_thread,
+						    save);
+}
+
+/**
+ * cache_child_context_:
+ * @scratch: engine which owns the tree being read.
+ * @parent: parent context.
+ * @position: position of the #DefinitionChild among the children
+ * of the parent definition.
+ * @id: id of the child definition.
+ *
+ * Called only from read_cache_tree_().
+ *
+ * Returns: a new reference to the child context, or %NULL if
+ * the child does not match.
+ */
+static Context *
+cache_child_context_ (GtkSourceContextEngine *scratch,
+		      Context                *parent,
+		      gint                    position,
+		      const gchar            *id)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+
+	definition_iter_init (&iter, parent->definition);
+
+	while ((child_def = definition_iter_next (&iter)) != NULL && position-- > 0)
+		;
+
+	definition_iter_destroy (&iter);
+
+	if (child_def == NULL ||
+	    strcmp (child_def->u.definition->id, id) != 0 ||
+	    !DEFINITION_IS_FIXED (child_def->u.definition))
+		return NULL;
+
+	return create_child_context (scratch, parent, child_def, "");
+}
+
+/**
+ * offset_in_crlf_:
+ * @crlf: sorted offsets of the \n characters of \r\n terminators.
+ * @offset: character offset.
+ *
+ * Called only from read_cache_tree_().
+ *
+ * Returns: whether @offset falls between \r and \n.
+ */
+static gboolean
+offset_in_crlf_ (GArray *crlf,
+		 gint    offset)
+{
+	guint lo = 0;
+	guint hi = crlf->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+		gint mid_offset = g_array_index (crlf, gint, mid);
+
+		if (mid_offset == offset)
+			return TRUE;
+
+		if (mid_offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return FALSE;
+}
+
+/**
+ * read_cache_tree_:
+ * @scratch: engine with an empty tree.
+ * @text: the text.
+ * @contexts_iter: iterator over the contexts in the cache file.
+ * @segments_iter: iterator over the segments.
+ * @sub_patterns_iter: iterator over the sub patterns.
+ * @line_states_iter: iterator over the line states.
+ * @n_lines: number of lines in the text.
+ * @char_count: number of characters in the text.
+ *
+ * Builds the tree of @scratch from the cache file, checking that it
+ * is a valid tree for @text: contexts are children of their parents'
+ * definitions, segments and sub patterns are nested and in order, no
+ * offset falls inside a \r\n terminator, and the segment of a line
+ * state is a container which includes the start of its line. Called
+ * with the lock held. Called only from read_highlight_cache_().
+ *
+ * Returns: whether the tree was built, it must be destroyed
+ * otherwise.
+ */
+static gboolean
+read_cache_tree_ (GtkSourceContextEngine *scratch,
+		  const gchar            *text,
+		  GVariantIter           *contexts_iter,
+		  GVariantIter           *segments_iter,
+		  GVariantIter           *sub_patterns_iter,
+		  GVariantIter           *line_states_iter,
+		  gint                    n_lines,
+		  gint                    char_count)
+{
+	GPtrArray *contexts;
+	GPtrArray *segments;
+	GArray *line_starts;
+	GArray *crlf;
+	Segment *last_segment = NULL;
+	SubPattern *last_sp = NULL;
+	const gchar *id;
+	gint parent, position, context;
+	gint start_at, end_at;
+	gint start_len, end_len;
+	gboolean is_start;
+	gint index, line;
+	gint prev_line = 0;
+	gint offset = 0;
+	guint sp_index;
+	gboolean ok;
+	guint i;
+
+	/* Offsets in the tree are checked against the lines of the text. */
+	line_starts = g_array_new (FALSE, FALSE, sizeof (gint));
+	crlf = g_array_new (FALSE, FALSE, sizeof (gint));
+
+	while (TRUE)
+	{
+		LineInfo line_info;
+
+		g_array_append_val (line_starts, offset);
+		text += find_line_end (text, &line_info);
+		offset += line_info.char_length + line_info.eol_length;
+
+		if (line_info.eol_length == 0)
+			break;
+
+		if (line_info.eol_length == 2)
+		{
+			gint lf = offset - 1;
+			g_array_append_val (crlf, lf);
+		}
+	}
+
+	ok = line_starts->len == (guint) n_lines && offset == char_count;
+
+	contexts = g_ptr_array_new ();
+	segments = g_ptr_array_new ();
+	g_ptr_array_add (contexts, scratch->priv->root_context);
+
+	while (ok && g_variant_iter_next (contexts_iter, "(ii&s)", &parent, &position, &id))
+	{
+		Context *child = NULL;
+
+		if (parent >= 0 && (guint) parent < contexts->len && position >= 0)
+			child = cache_child_context_ (scratch,
+						      g_ptr_array_index (contexts, parent),
+						      position, id);
+
+		if (child != NULL)
+			g_ptr_array_add (contexts, child);
+		else
+			ok = FALSE;
+	}
+
+	while (ok && g_variant_iter_next (segments_iter, "(iiiiiib)",
+					  &parent, &context,
+					  &start_at, &end_at,
+					  &start_len, &end_len,
+					  &is_start))
+	{
+		Segment *segment;
+
+		ok = start_at <= end_at &&
+		     start_len >= 0 && start_len <= end_at - start_at &&
+		     end_len >= 0 && end_len <= end_at - start_at &&
+		     !offset_in_crlf_ (crlf, start_at) &&
+		     !offset_in_crlf_ (crlf, end_at);
+
+		if (!ok)
+			break;
+
+		if (segments->len == 0)
+		{
+			ok = parent == -1 && context == 0 && start_at == 0 && end_at == char_count;
+			segment = scratch->priv->root_segment;
+			segment->end_at = end_at;
+		}
+		else
+		{
+			Segment *parent_segment;
+			Context *segment_context;
+			gint min_start;
+
+			ok = parent >= 0 && (guint) parent < segments->len &&
+			     context > 0 && (guint) context < contexts->len;
+
+			if (!ok)
+				break;
+
+			parent_segment = g_ptr_array_index (segments, parent);
+			segment_context = g_ptr_array_index (contexts, context);
+
+			/* Children are saved in order. */
+			min_start = parent_segment->last_child != NULL ?
+				    parent_segment->last_child->end_at :
+				    parent_segment->start_at;
+
+			ok = segment_context->parent == parent_segment->context &&
+			     start_at >= min_start && end_at <= parent_segment->end_at;
+
+			if (!ok)
+				break;
+
+			segment = segment_new (scratch, parent_segment, segment_context,
+					       start_at, end_at, is_start);
+
+			segment->prev = parent_segment->last_child;
+
+			if (parent_segment->last_child != NULL)
+				parent_segment->last_child->next = segment;
+			else
+				parent_segment->children = segment;
+
+			parent_segment->last_child = segment;
+		}
+
+		segment->start_len = start_len;
+		segment->end_len = end_len;
+		g_ptr_array_add (segments, segment);
+	}
+
+	ok = ok && segments->len > 0;
+
+	while (ok && g_variant_iter_next (sub_patterns_iter, "(iuii)",
+					  &index, &sp_index, &start_at, &end_at))
+	{
+		SubPatternDefinition *sp_def = NULL;
+		Segment *segment = NULL;
+		SubPattern *sp;
+
+		if (index >= 0 && (guint) index < segments->len)
+		{
+			segment = g_ptr_array_index (segments, index);
+			sp_def = g_slist_nth_data (segment->context->definition->sub_patterns,
+						   sp_index);
+		}
+
+		ok = sp_def != NULL &&
+		     segment->start_at <= start_at && start_at <= end_at &&
+		     end_at <= segment->end_at &&
+		     !offset_in_crlf_ (crlf, start_at) &&
+		     !offset_in_crlf_ (crlf, end_at);
+
+		if (!ok)
+			break;
+
+		sp = node_pool_alloc0 (&scratch->priv->sub_pattern_pool);
+		sp->start_at = start_at;
+		sp->end_at = end_at;
+		sp->definition = sp_def;
+
+		/* Keep the order of the list, sub patterns of a
+		 * segment are saved one after another. */
+		if (segment == last_segment)
+		{
+			last_sp->next = sp;
+		}
+		else
+		{
+			sp->next = segment->sub_patterns;
+			segment->sub_patterns = sp;
+		}
+
+		last_segment = segment;
+		last_sp = sp;
+	}
+
+	while (ok && g_variant_iter_next (line_states_iter, "(ii)", &line, &index))
+	{
+		Segment *state;
+		gint line_start;
+
+		ok = line > prev_line && line < n_lines &&
+		     line % LINE_STATE_INTERVAL == 0 &&
+		     index >= 0 && (guint) index < segments->len;
+
+		if (!ok)
+			break;
+
+		/* The state contains the preceding line terminator. */
+		state = g_ptr_array_index (segments, index);
+		line_start = g_array_index (line_starts, gint, line);
+
+		ok = SEGMENT_IS_CONTAINER (state) &&
+		     state->start_at <= line_start && line_start <= state->end_at;
+
+		if (ok)
+			set_line_state (scratch, line, state);
+
+		prev_line = line;
+	}
+
+	scratch->priv->n_lines = n_lines;
+	g_array_free (line_starts, TRUE);
+	g_array_free (crlf, TRUE);
+
+	/* Segments hold their own references. */
+	for (i = contexts->len - 1; i > 0; i--)
+		context_unref (g_ptr_array_index (contexts, i));
+
+	g_ptr_array_free (contexts, TRUE);
+	g_ptr_array_free (segments, TRUE);
+
+	return ok;
+}
+
+/**
+ * read_highlight_cache_:
+ * @bg: #BackgroundAnalysis.
+ *
+ * Looks the snapshot of @bg up in the highlight cache and builds the
+ * tree of a new scratch engine from the cache file, which replaces
+ * the scratch engine of @bg. Called only from
+ * background_analysis_thread().
+ *
+ * Returns: whether the tree was read.
+ */
+static gboolean
+read_highlight_cache_ (BackgroundAnalysis *bg)
+{
+	GRecMutex *lock = &bg->scratch->priv->ctx_data->lock;
+	GtkSourceContextEngine *scratch;
+	GVariant *variant;
+	GVariantIter *contexts_iter;
+	GVariantIter *segments_iter;
+	GVariantIter *sub_patterns_iter;
+	GVariantIter *line_states_iter;
+	const gchar *own_lang_id;
+	gchar *filename;
+	gchar *checksum;
+	gchar *data;
+	gsize length;
+	guint32 version;
+	const gchar *file_checksum;
+	const gchar *lang_id;
+	const gchar *languages;
+	gint max_line_length, n_lines, char_count;
+
+	if (bg->cache_languages == NULL)
+		return FALSE;
+
+	own_lang_id = gtk_source_language_get_id (bg->scratch->priv->ctx_data->lang);
+	checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, bg->text,
+						  bg->text_end - bg->text);
+	filename = highlight_cache_file (own_lang_id, checksum);
+
+	if (!g_file_get_contents (filename, &data, &length, NULL))
+	{
+		g_free (checksum);
+		g_free (filename);
+		return FALSE;
+	}
+
+	variant = g_variant_new_from_data (G_VARIANT_TYPE (HIGHLIGHT_CACHE_FORMAT),
+					   data, length, FALSE,
+					   g_free, data);
+	g_variant_ref_sink (variant);
+
+	g_variant_get (variant, "(u&s&s&siiia(iis)a(iiiiiib)a(iuii)a(ii))",
+		       &version,
+		       &file_checksum,
+		       &lang_id,
+		       &languages,
+		       &max_line_length,
+		       &n_lines,
+		       &char_count,
+		       &contexts_iter,
+		       &segments_iter,
+		       &sub_patterns_iter,
+		       &line_states_iter);
+
+	if (version == HIGHLIGHT_CACHE_VERSION &&
+	    strcmp (file_checksum, checksum) == 0 &&
+	    strcmp (lang_id, own_lang_id) == 0 &&
+	    strcmp (languages, bg->cache_languages) == 0 &&
+	    max_line_length == bg->scratch->priv->max_line_length &&
+	    n_lines == bg->n_lines &&
+	    char_count == bg->char_count)
+	{
+		g_rec_mutex_lock (lock);
+
+		scratch = background_scratch_new_ (bg->scratch);
+		bg->loaded = read_cache_tree_ (scratch,
+					       bg->text,
+					       contexts_iter,
+					       segments_iter,
+					       sub_patterns_iter,
+					       line_states_iter,
+					       n_lines,
+					       char_count);
+
+		if (bg->loaded)
+		{
+			GtkSourceContextEngine *old = bg->scratch;
+
+			bg->scratch = scratch;
+			scratch = old;
+		}
+
+		segment_tree_destroy (scratch);
+
+		g_rec_mutex_unlock (lock);
+
+		g_object_unref (scratch);
+	}
+
+	/* Recently read files are kept longest, see
+	 * prune_highlight_cache_(). */
+	if (bg->loaded)
+		g_utime (filename, NULL);
+	else
+		bg->rejected = TRUE;
+
+	DEBUG (g_print ("%s %s\n", bg->loaded ? "loaded" : "ignored", filename));
+
+	g_variant_iter_free (contexts_iter);
+	g_variant_iter_free (segments_iter);
+	g_variant_iter_free (sub_patterns_iter);
+	g_variant_iter_free (line_states_iter);
+	g_variant_unref (variant);
+	g_free (checksum);
+	g_free (filename);
+
+	return bg->loaded;
+}
+
+/**
+ * load_highlight_cache:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * If the cache is to be looked up and nothing in the buffer is
+ * analyzed, starts the background analysis, which reads the syntax
+ * tree from the highlight cache if the buffer text is found there,
+ * see read_highlight_cache_(), and analyzes the text otherwise.
+ * The tree is saved once the text is analyzed, see
+ * save_highlight_cache().
+ *
+ * The cache is looked up once per text loaded into an empty buffer.
+ *
+ * Returns: whether the background analysis was started.
+ */
+static gboolean
+load_highlight_cache (GtkSourceContextEngine *ce)
+{
+	Segment *invalid;
+	gchar *languages;
+	gint char_count;
+
+	if (!ce->priv->cache_load_pending)
+		return FALSE;
+
+	ce->priv->cache_load_pending = FALSE;
+
+	if (ce->priv->disabled || ce->priv->sync_lines >= 0 ||
+	    ce->priv->background != NULL || ce->priv->partial_line != NULL)
+		return FALSE;
+
+	/* Only text loaded at once is looked up, i.e. the tree has
+	 * a single invalid segment covering the whole buffer. */
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	update_tree (ce);
+	invalid = ce->priv->root_segment->children;
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+
+	char_count = gtk_text_buffer_get_char_count (ce->priv->buffer);
+
+	if (invalid == NULL || invalid->next != NULL ||
+	    !SEGMENT_IS_INVALID (invalid) ||
+	    invalid->start_at != 0 || invalid->end_at != char_count)
+		return FALSE;
+
+	ce->priv->cache_save_pending = TRUE;
+
+	languages = highlight_cache_languages_ (ce);
+
+	if (languages == NULL)
+		return FALSE;
+
+	return start_background_analysis (ce, languages);
+}
+
+/* CONTEXT CLASSES -------------------------------------------------------- */
+
+/* Context classes are not stored in the buffer, queries are answered
+ * from the syntax tree: the classes of a character are the ones of
+ * the segments containing it, from the root down, and of their sub
+ * patterns containing it. Text which is not analyzed has none.
+ *
+ * Queries do not change the tree, they are answered from it as it is,
+ * also while a background analysis runs. The changes made to the
+ * buffer since the tree was last updated are still in invalid_regions:
+ * the text outside of them is found in the tree at shifted offsets,
+ * see get_query_span_(), and the changed text has no classes yet. */
+
+typedef struct
+{
+	const gchar *name;
+	gboolean     enabled;
+} ContextClassQuery;
+
+/* Text around a queried character which is either all in the tree,
+ * shifted by the same amount, or all changed since the tree was
+ * last updated. */
+typedef struct
+{
+	/* Offsets of the text in the buffer. */
+	gint		start;
+	gint		end;
+	/* Offset in the buffer minus offset in the tree. */
+	gint		delta;
+	/* Whether the text is in an invalid region. */
+	gboolean	changed;
+} QuerySpan;
+
+/**
+ * prepare_tree_query_:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Returns: whether there is a tree to answer a query from.
+ */
+static gboolean
+prepare_tree_query_ (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->buffer == NULL || ce->priv->root_segment == NULL || ce->priv->disabled)
+		return FALSE;
+
+	/* In bounded mode there is no tree, see highlight_window(). */
+	return ce->priv->sync_lines < 0;
+}
+
+/**
+ * get_query_span_:
+ * @ce: #GtkSourceContextEngine.
+ * @offset: offset of a character in the buffer.
+ * @span: (out): #QuerySpan containing the character.
+ *
+ * Finds where the character at @offset is in the tree. The invalid
+ * regions are applied to the tree one after another from the start
+ * of the buffer, see update_tree(), so the text after a region is
+ * shifted by the deltas of all the regions before it.
+ */
+static void
+get_query_span_ (GtkSourceContextEngine *ce,
+		 gint                    offset,
+		 QuerySpan              *span)
+{
+	GArray *regions = ce->priv->invalid_regions;
+	guint i;
+
+	span->start = 0;
+	span->end = G_MAXINT;
+	span->delta = 0;
+	span->changed = FALSE;
+
+	for (i = 0; i < regions->len; i++)
+	{
+		InvalidRegion *region = &g_array_index (regions, InvalidRegion, i);
+		gint start = get_mark_offset (ce->priv->buffer, region->start);
+		gint end = get_mark_offset (ce->priv->buffer, region->end);
+
+		if (offset < start)
+		{
+			span->end = start;
+			return;
+		}
+
+		if (offset < end)
+		{
+			span->start = start;
+			span->end = end;
+			span->changed = TRUE;
+			return;
+		}
+
+		span->start = end;
+		span->delta += region->delta;
+	}
+}
+
+/**
+ * get_context_class_segment_:
+ * @ce: #GtkSourceContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: offset of a character in the tree.
+ *
+ * Returns: the deepest segment containing the character at @offset,
+ * or %NULL if @offset is the end of the tree.
+ */
+static Segment *
+get_context_class_segment_ (GtkSourceContextEngine *ce,
+			    Segment                *hint,
+			    gint                    offset)
+{
+	Segment *segment;
+
+	if (offset >= ce->priv->root_segment->end_at)
+		return NULL;
+
+	segment = get_segment_at_offset (ce, hint, offset);
+
+	/* zero-length segments don't contain the character */
+	while (segment->end_at <= offset && segment->parent != NULL)
+		segment = segment->parent;
+
+	return segment;
+}
+
+static void
+apply_context_classes_ (GSList   *context_classes,
+			GFunc     func,
+			gpointer  user_data)
+{
+	for (; context_classes != NULL; context_classes = context_classes->next)
+		func (context_classes->data, user_data);
+}
+
+/**
+ * segment_foreach_context_class_:
+ * @segment: the segment returned by get_context_class_segment_().
+ * @offset: offset of the character.
+ * @func: function called for each #GtkSourceContextClass.
+ * @user_data: data passed to @func.
+ *
+ * Calls @func for the context classes set or unset at @offset, in
+ * the order the later ones override the earlier ones. Invalid
+ * segments have no classes.
+ */
+static void
+segment_foreach_context_class_ (Segment  *segment,
+				gint      offset,
+				GFunc     func,
+				gpointer  user_data)
+{
+	SubPattern *sp;
+
+	if (SEGMENT_IS_INVALID (segment))
+		return;
+
+	if (segment->parent != NULL)
+		segment_foreach_context_class_ (segment->parent, offset, func, user_data);
+
+	apply_context_classes_ (segment->context->definition->context_classes,
+				func, user_data);
+
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
+	{
+		if (sp->start_at <= offset && sp->end_at > offset)
+			apply_context_classes_ (sp->definition->context_classes,
+						func, user_data);
+	}
+}
+
+static void
+context_class_query_cb (GtkSourceContextClass *cclass,
+			ContextClassQuery     *query)
+{
+	if (strcmp (cclass->name, query->name) == 0)
+		query->enabled = cclass->enabled;
+}
+
+static gboolean
+segment_has_context_class_ (Segment     *segment,
+			    gint         offset,
+			    const gchar *name)
+{
+	ContextClassQuery query = {name, FALSE};
+
+	if (segment != NULL)
+		segment_foreach_context_class_ (segment, offset,
+						(GFunc) context_class_query_cb,
+						&query);
+
+	return query.enabled;
+}
+
+static void
+collect_context_classes_cb (GtkSourceContextClass *cclass,
+			    GPtrArray             *names)
+{
+	guint i;
+
+	for (i = 0; i < names->len; i++)
+	{
+		if (strcmp (g_ptr_array_index (names, i), cclass->name) == 0)
+			break;
+	}
+
+	if (cclass->enabled && i == names->len)
+		g_ptr_array_add (names, cclass->name);
+	else if (!cclass->enabled && i < names->len)
+		g_ptr_array_remove_index (names, i);
+}
+
+/**
+ * get_query_segment_:
+ * @ce: #GtkSourceContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: offset of a character in the buffer.
+ * @span: #QuerySpan containing the character.
+ *
+ * Returns: the segment get_context_class_segment_() finds for the
+ * character at @offset, or %NULL if it is changed text or the end
+ * of the buffer.
+ */
+static Segment *
+get_query_segment_ (GtkSourceContextEngine *ce,
+		    Segment                *hint,
+		    gint                    offset,
+		    const QuerySpan        *span)
+{
+	if (span->changed)
+		return NULL;
+
+	return get_context_class_segment_ (ce, hint, offset - span->delta);
+}
+
+/**
+ * get_query_hint_:
+ * @ce: #GtkSourceContextEngine.
+ * @iter: the queried position.
+ *
+ * Returns: a segment to start looking for the one at @iter from.
+ * Line states are numbered like the lines of the tree, so they
+ * only help if the tree is up to date.
+ */
+static Segment *
+get_query_hint_ (GtkSourceContextEngine *ce,
+		 const GtkTextIter      *iter)
+{
+	if (ce->priv->invalid_regions->len != 0)
+		return NULL;
+
+	return get_line_state (ce, gtk_text_iter_get_line (iter));
+}
+
+/**
+ * next_context_class_boundary_:
+ * @segment: the segment returned by get_context_class_segment_().
+ * @offset: offset of the character.
+ *
+ * Returns: the nearest offset after @offset where a segment or a sub
+ * pattern begins or ends, i.e. where the classes may change.
+ */
+static gint
+next_context_class_boundary_ (Segment *segment,
+			      gint     offset)
+{
+	gint next = segment->end_at;
+	Segment *child;
+	Segment *s;
+
+	/* children are either before or after the offset, start
+	 * from the end of the list which is closer to it */
+	if (segment->children != NULL &&
+	    ABS (segment->last_child->end_at - offset) < ABS (segment->children->start_at - offset))
+	{
+		for (child = segment->last_child; child != NULL && child->start_at > offset; child = child->prev)
+			next = MIN (next, child->start_at);
+	}
+	else
+	{
+		for (child = segment->children; child != NULL; child = child->next)
+		{
+			if (child->start_at > offset)
+			{
+				next = MIN (next, child->start_at);
+				break;
+			}
+		}
+	}
+
+	for (s = segment; s != NULL; s = s->parent)
+	{
+		SubPattern *sp;
+
+		for (sp = s->sub_patterns; sp != NULL; sp = sp->next)
+		{
+			if (sp->start_at > offset)
+				next = MIN (next, sp->start_at);
+			else if (sp->end_at > offset)
+				next = MIN (next, sp->end_at);
+		}
+	}
+
+	return next;
+}
+
+/**
+ * prev_context_class_boundary_:
+ * @segment: the segment returned by get_context_class_segment_()
+ * for the character before @offset.
+ * @offset: an offset.
+ *
+ * Returns: the nearest offset before @offset where a segment or a
+ * sub pattern begins or ends, i.e. where the classes may change.
+ */
+static gint
+prev_context_class_boundary_ (Segment *segment,
+			      gint     offset)
+{
+	gint prev = segment->start_at;
+	Segment *child;
+	Segment *s;
 
-	if (segment->prev != NULL)
-		segment->prev->next = segment->next;
+	if (segment->children != NULL &&
+	    ABS (segment->last_child->end_at - offset) < ABS (segment->children->start_at - offset))
+	{
+		for (child = segment->last_child; child != NULL; child = child->prev)
+		{
+			if (child->end_at < offset)
+			{
+				prev = MAX (prev, child->end_at);
+				break;
+			}
+		}
+	}
 	else
-		segment->parent->children = segment->next;
+	{
+		for (child = segment->children; child != NULL && child->end_at < offset; child = child->next)
+			prev = MAX (prev, child->end_at);
+	}
 
-	/* if ce->priv->hint is being deleted, set it to some
-	 * neighbour segment */
-	if (ce->priv->hint == segment)
+	for (s = segment; s != NULL; s = s->parent)
 	{
-		if (segment->next != NULL)
-			ce->priv->hint = segment->next;
-		else if (segment->prev != NULL)
-			ce->priv->hint = segment->prev;
-		else
-			ce->priv->hint = segment->parent;
+		SubPattern *sp;
+
+		for (sp = s->sub_patterns; sp != NULL; sp = sp->next)
+		{
+			if (sp->end_at < offset)
+				prev = MAX (prev, sp->end_at);
+			else if (sp->start_at < offset)
+				prev = MAX (prev, sp->start_at);
+		}
 	}
 
-        /* if ce->priv->hint2 is being deleted, set it to some
-         * neighbour segment */
-        if (ce->priv->hint2 == segment)
-        {
-                if (segment->next != NULL)
-                        ce->priv->hint2 = segment->next;
-                else if (segment->prev != NULL)
-                        ce->priv->hint2 = segment->prev;
-                else
-                        ce->priv->hint2 = segment->parent;
-        }
+	return prev;
+}
 
-	segment_destroy (ce, segment);
+static gboolean
+gtk_source_context_engine_iter_has_context_class (GtkSourceEngine   *engine,
+						  const GtkTextIter *iter,
+						  const gchar       *context_class)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	Segment *segment;
+	QuerySpan span;
+	gint offset;
+
+	if (!prepare_tree_query_ (ce))
+		return FALSE;
+
+	offset = gtk_text_iter_get_offset (iter);
+	get_query_span_ (ce, offset, &span);
+	segment = get_query_segment_ (ce, get_query_hint_ (ce, iter), offset, &span);
+
+	return segment_has_context_class_ (segment, offset - span.delta, context_class);
 }
 
-static void
-segment_erase_middle_ (GtkSourceContextEngine *ce,
-		       Segment                *segment,
-		       gint                    start,
-		       gint                    end)
+static gchar **
+gtk_source_context_engine_get_context_classes_at_iter (GtkSourceEngine   *engine,
+						       const GtkTextIter *iter)
 {
-	Segment *new_segment, *child;
-	SubPattern *sp;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	GPtrArray *names;
+	gchar **ret;
+	guint i;
 
-	new_segment = segment_new (ce,
-				   segment->parent,
-				   segment->context,
-				   end,
-				   segment->end_at,
-				   FALSE);
-	segment->end_at = start;
+	names = g_ptr_array_new ();
 
-	new_segment->next = segment->next;
-	segment->next = new_segment;
-	new_segment->prev = segment;
+	if (prepare_tree_query_ (ce))
+	{
+		Segment *segment;
+		QuerySpan span;
+		gint offset;
 
-	if (new_segment->next != NULL)
-		new_segment->next->prev = new_segment;
-	else
-		new_segment->parent->last_child = new_segment;
+		offset = gtk_text_iter_get_offset (iter);
+		get_query_span_ (ce, offset, &span);
+		segment = get_query_segment_ (ce, get_query_hint_ (ce, iter), offset, &span);
 
-	child = segment->children;
-	segment->children = NULL;
-	segment->last_child = NULL;
+		if (segment != NULL)
+			segment_foreach_context_class_ (segment, offset - span.delta,
+							(GFunc) collect_context_classes_cb,
+							names);
+	}
 
-	while (child != NULL)
+	ret = g_new (gchar *, names->len + 1);
+
+	for (i = 0; i < names->len; i++)
+		ret[i] = g_strdup (g_ptr_array_index (names, i));
+
+	ret[names->len] = NULL;
+
+	g_ptr_array_free (names, TRUE);
+	return ret;
+}
+
+/* Toggles are where the class is set on one side of the offset and not
+ * on the other one, like tag toggles. So there is one at the end of the
+ * buffer if the last character has the class. The search goes over the
+ * boundaries of segments and sub patterns, and over the boundaries of
+ * query spans, in buffer offsets. */
+static gboolean
+gtk_source_context_engine_iter_forward_to_context_class_toggle (GtkSourceEngine *engine,
+								GtkTextIter     *iter,
+								const gchar     *context_class)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	Segment *segment;
+	QuerySpan span;
+	gboolean enabled;
+	gint char_count;
+	gint offset;
+
+	if (!prepare_tree_query_ (ce))
+		return FALSE;
+
+	char_count = gtk_text_buffer_get_char_count (ce->priv->buffer);
+	offset = gtk_text_iter_get_offset (iter);
+
+	if (offset >= char_count)
+		return FALSE;
+
+	get_query_span_ (ce, offset, &span);
+	segment = get_query_segment_ (ce, get_query_hint_ (ce, iter), offset, &span);
+	enabled = segment_has_context_class_ (segment, offset - span.delta, context_class);
+
+	while (TRUE)
 	{
-		Segment *append_to;
-		Segment *next = child->next;
+		Segment *next;
 
-		if (child->start_at < start)
-		{
-			g_assert (child->end_at <= start);
-			append_to = segment;
-		}
+		if (segment != NULL)
+			offset = MIN (next_context_class_boundary_ (segment, offset - span.delta) + span.delta,
+				      span.end);
 		else
-		{
-			g_assert (child->start_at >= end);
-			append_to = new_segment;
-		}
+			offset = span.end;
 
-		child->parent = append_to;
+		offset = MIN (offset, char_count);
 
-		if (append_to->last_child != NULL)
+		if (offset >= span.end)
+			get_query_span_ (ce, offset, &span);
+
+		next = offset < char_count ? get_query_segment_ (ce, segment, offset, &span) : NULL;
+
+		if (segment_has_context_class_ (next, offset - span.delta, context_class) != enabled)
 		{
-			append_to->last_child->next = child;
-			child->prev = append_to->last_child;
-			child->next = NULL;
-			append_to->last_child = child;
+			gtk_text_iter_set_offset (iter, offset);
+			return TRUE;
 		}
-		else
+
+		if (offset == char_count)
 		{
-			child->next = child->prev = NULL;
-			append_to->last_child = child;
-			append_to->children = child;
+			gtk_text_buffer_get_end_iter (ce->priv->buffer, iter);
+			return FALSE;
 		}
 
-		child = next;
+		segment = next;
 	}
+}
 
-	sp = segment->sub_patterns;
-	segment->sub_patterns = NULL;
+static gboolean
+gtk_source_context_engine_iter_backward_to_context_class_toggle (GtkSourceEngine *engine,
+								 GtkTextIter     *iter,
+								 const gchar     *context_class)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	Segment *segment;
+	QuerySpan span;
+	gboolean enabled;
+	gint offset;
 
-	while (sp != NULL)
+	if (!prepare_tree_query_ (ce))
+		return FALSE;
+
+	offset = gtk_text_iter_get_offset (iter);
+
+	if (offset == 0)
+		return FALSE;
+
+	get_query_span_ (ce, offset - 1, &span);
+	segment = get_query_segment_ (ce, get_query_hint_ (ce, iter), offset - 1, &span);
+	enabled = segment_has_context_class_ (segment, offset - 1 - span.delta, context_class);
+
+	while (TRUE)
 	{
-		SubPattern *next = sp->next;
-		Segment *append_to;
+		Segment *prev;
 
-		if (sp->start_at < start)
+		if (segment != NULL)
+			offset = MAX (prev_context_class_boundary_ (segment, offset - span.delta) + span.delta,
+				      span.start);
+		else
+			offset = span.start;
+
+		if (offset == 0)
 		{
-			sp->end_at = MIN (sp->end_at, start);
-			append_to = segment;
+			gtk_text_buffer_get_start_iter (ce->priv->buffer, iter);
+			return enabled;
 		}
-		else
+
+		if (offset <= span.start)
+			get_query_span_ (ce, offset - 1, &span);
+
+		prev = get_query_segment_ (ce, segment, offset - 1, &span);
+
+		if (segment_has_context_class_ (prev, offset - 1 - span.delta, context_class) != enabled)
 		{
-			g_assert (sp->end_at > end);
-			sp->start_at = MAX (sp->start_at, end);
-			append_to = new_segment;
+			gtk_text_iter_set_offset (iter, offset);
+			return TRUE;
 		}
 
-		sp->next = append_to->sub_patterns;
-		append_to->sub_patterns = sp;
+		segment = prev;
+	}
+}
 
-		sp = next;
+
+/* TOKENS ----------------------------------------------------------------- */
+
+/* State of gtk_source_context_engine_foreach_token(). */
+typedef struct
+{
+	/* NULL when walking a tree built by
+	 * _gtk_source_context_engine_highlight_text(). */
+	GtkSourceBuffer		*buffer;
+	gint			 start_offset;
+	gint			 end_offset;
+	GtkSourceTokenFunc	 func;
+	gpointer		 user_data;
+
+	/* Stack of sets of context classes: the set of a token is
+	 * pushed on top of the set of the token containing it, and
+	 * popped when its nested tokens are done. */
+	GPtrArray		*classes;
+} TokenWalk;
+
+/**
+ * push_context_classes_:
+ * @classes: the stack of sets of context classes.
+ * @base: the beginning of the current set in @classes.
+ * @len: (inout): the length of the current set.
+ * @context_classes: list of #GtkSourceContextClass set or unset
+ * by a token.
+ *
+ * Pushes the current set changed by @context_classes, if they
+ * change anything.
+ *
+ * Returns: the beginning of the new current set.
+ */
+static guint
+push_context_classes_ (GPtrArray *classes,
+		       guint      base,
+		       guint     *len,
+		       GSList    *context_classes)
+{
+	guint new_base;
+	guint i;
+
+	if (context_classes == NULL)
+		return base;
+
+	new_base = classes->len;
+
+	for (i = 0; i < *len; i++)
+		g_ptr_array_add (classes, g_ptr_array_index (classes, base + i));
+
+	for (; context_classes != NULL; context_classes = context_classes->next)
+	{
+		GtkSourceContextClass *cclass = context_classes->data;
+
+		for (i = new_base; i < classes->len; i++)
+		{
+			if (strcmp (g_ptr_array_index (classes, i), cclass->name) == 0)
+				break;
+		}
+
+		if (cclass->enabled && i == classes->len)
+			g_ptr_array_add (classes, cclass->name);
+		else if (!cclass->enabled && i < classes->len)
+			g_ptr_array_remove_index_fast (classes, i);
 	}
 
-	CHECK_SEGMENT_CHILDREN (segment);
-	CHECK_SEGMENT_CHILDREN (new_segment);
+	*len = classes->len - new_base;
+	return new_base;
 }
 
 /**
- * segment_erase_range_:
- * @ce: #GtkSourceContextEngine.
- * @segment: the segment.
- * @start: start offset of range to erase, characters.
- * @end: end offset of range to erase, characters.
+ * emit_token_:
+ * @walk: #TokenWalk.
+ * @start_at: beginning of the token.
+ * @end_at: end of the token.
+ * @style: style id of the token or %NULL.
+ * @base: the beginning of the set of context classes of the token,
+ * which must be the top of the stack.
  *
- * Recurisvely removes segments from [@start, @end] interval
- * starting from @segment. If @segment belongs to the range,
- * or it's a zero-length segment at @end offset, and it's not
- * the toplevel segment, then it's removed from the tree.
- * If @segment intersects with the range (unless it's the toplevel
- * segment), then its ends are adjusted appropriately, and it's
- * split into two if it completely contains the range.
+ * Calls the #GtkSourceTokenFunc for the part of the token in the
+ * walked region, if any.
  */
 static void
-segment_erase_range_ (GtkSourceContextEngine *ce,
-		      Segment                *segment,
-		      gint                    start,
-		      gint                    end)
+emit_token_ (TokenWalk   *walk,
+	     gint         start_at,
+	     gint         end_at,
+	     const gchar *style,
+	     guint        base)
 {
-	g_assert (start < end);
+	start_at = MAX (start_at, walk->start_offset);
+	end_at = MIN (end_at, walk->end_offset);
 
-	if (segment->start_at == segment->end_at)
-	{
-		if (segment->start_at >= start && segment->start_at <= end)
-			segment_remove (ce, segment);
+	if (start_at >= end_at)
 		return;
-	}
 
-	if (segment->start_at > end || segment->end_at < start)
-		return;
+	g_ptr_array_add (walk->classes, NULL);
 
-	if (segment->start_at >= start && segment->end_at <= end && segment->parent)
+	walk->func (walk->buffer,
+		    start_at,
+		    end_at,
+		    style,
+		    (const gchar * const *) &g_ptr_array_index (walk->classes, base),
+		    walk->user_data);
+
+	g_ptr_array_set_size (walk->classes, walk->classes->len - 1);
+}
+
+static gboolean
+sub_pattern_before_ (SubPattern *sp1,
+		     SubPattern *sp2)
+{
+	if (sp1->start_at != sp2->start_at)
+		return sp1->start_at < sp2->start_at;
+
+	if (sp1->end_at != sp2->end_at)
+		return sp1->end_at > sp2->end_at;
+
+	return GPOINTER_TO_SIZE (sp1) < GPOINTER_TO_SIZE (sp2);
+}
+
+/**
+ * next_sub_pattern_:
+ * @segment: segment.
+ * @prev: the last sub pattern walked or %NULL.
+ *
+ * Sub patterns are not sorted in the list, and there are few of
+ * them, so they are walked in order by looking for the next one.
+ *
+ * Returns: the sub pattern of @segment following @prev, the ones
+ * starting first and then the longest ones first.
+ */
+static SubPattern *
+next_sub_pattern_ (Segment    *segment,
+		   SubPattern *prev)
+{
+	SubPattern *sp;
+	SubPattern *next = NULL;
+
+	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
 	{
-		segment_remove (ce, segment);
-		return;
+		if ((prev == NULL || sub_pattern_before_ (prev, sp)) &&
+		    (next == NULL || sub_pattern_before_ (sp, next)))
+			next = sp;
 	}
 
-	if (segment->start_at == end)
+	return next;
+}
+
+/**
+ * path_child_:
+ * @segment: segment.
+ * @deepest: the segment at the beginning of the walked region.
+ *
+ * Returns: the child of @segment which is an ancestor of @deepest or
+ * @deepest itself, or %NULL.
+ */
+static Segment *
+path_child_ (Segment *segment,
+	     Segment *deepest)
+{
+	for (; deepest != NULL; deepest = deepest->parent)
 	{
-		Segment *child = segment->children;
+		if (deepest->parent == segment)
+			return deepest;
+	}
+
+	return NULL;
+}
+
+/**
+ * foreach_token_in_segment_:
+ * @walk: #TokenWalk.
+ * @segment: segment.
+ * @deepest: the segment at the beginning of the walked region,
+ * tokens are walked from its branch.
+ * @base: the beginning of the set of context classes of the parent.
+ * @len: the length of the set.
+ *
+ * Emits the tokens of @segment, its sub patterns and its children,
+ * in order of their start offsets.
+ */
+static void
+foreach_token_in_segment_ (TokenWalk *walk,
+			   Segment   *segment,
+			   Segment   *deepest,
+			   guint      base,
+			   guint      len)
+{
+	ContextDefinition *definition;
+	SubPattern *sp;
+	Segment *child;
+	guint n_classes;
+
+	if (SEGMENT_IS_INVALID (segment))
+		return;
+
+	if (segment->start_at >= walk->end_offset || segment->end_at <= walk->start_offset)
+		return;
+
 
-		while (child != NULL && child->start_at == end)
-		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
-		}
-	}
-	else if (segment->end_at == start)
-	{
-		Segment *child = segment->last_child;
+	definition = segment->context->definition;
+	n_classes = walk->classes->len;
+	base = push_context_classes_ (walk->classes, base, &len, definition->context_classes);
 
-		while (child != NULL && child->end_at == start)
-		{
-			Segment *prev = child->prev;
-			segment_erase_range_ (ce, child, start, end);
-			child = prev;
-		}
-	}
-	else
+	if (segment->context->style != NULL || definition->context_classes != NULL)
 	{
-		Segment *child = segment->children;
+		gint start_at = segment->start_at;
+		gint end_at = segment->end_at;
 
-		while (child != NULL)
+		if (segment->context->style != NULL && HAS_OPTION (definition, STYLE_INSIDE))
 		{
-			Segment *next = child->next;
-			segment_erase_range_ (ce, child, start, end);
-			child = next;
+			start_at += segment->start_len;
+			end_at -= segment->end_len;
 		}
+
+		emit_token_ (walk, start_at, end_at, segment->context->style, base);
 	}
 
-	if (segment->sub_patterns != NULL)
-	{
-		SubPattern *sp;
+	child = path_child_ (segment, deepest);
+	if (child == NULL)
+		child = segment->children;
 
-		sp = segment->sub_patterns;
-		segment->sub_patterns = NULL;
+	sp = next_sub_pattern_ (segment, NULL);
 
-		while (sp != NULL)
+	while (child != NULL || sp != NULL)
+	{
+		if (sp != NULL && (child == NULL || sp->start_at <= child->start_at))
 		{
-			SubPattern *next = sp->next;
+			SubPatternDefinition *sp_def = sp->definition;
 
-			if (sp->start_at >= start && sp->end_at <= end)
-				sub_pattern_free (sp);
-			else
-				segment_add_subpattern (segment, sp);
+			if (sp->start_at >= walk->end_offset)
+				break;
 
-			sp = next;
-		}
-	}
+			if (sp_def->style != NULL || sp_def->context_classes != NULL)
+			{
+				guint n_sp_classes = walk->classes->len;
+				guint sp_len = len;
+				guint sp_base;
+
+				sp_base = push_context_classes_ (walk->classes, base, &sp_len,
+								 sp_def->context_classes);
+				emit_token_ (walk, sp->start_at, sp->end_at, sp_def->style, sp_base);
+				g_ptr_array_set_size (walk->classes, n_sp_classes);
+			}
 
-	if (segment->parent != NULL)
-	{
-		/* Now all children and subpatterns are cleaned up,
-		 * so we only need to split segment properly if its middle
-		 * was erased. Otherwise, only ends need to be adjusted. */
-		if (segment->start_at < start && segment->end_at > end)
-		{
-			segment_erase_middle_ (ce, segment, start, end);
+			sp = next_sub_pattern_ (segment, sp);
 		}
 		else
 		{
-			g_assert ((segment->start_at >= start && segment->end_at > end) ||
-				  (segment->start_at < start && segment->end_at <= end));
+			if (child->start_at >= walk->end_offset)
+				break;
 
-			if (segment->end_at > end)
-			{
-				/* If we erase the beginning, we need to clear
-				 * is_start flag. */
-				segment->start_at = end;
-				segment->is_start = FALSE;
-			}
-			else
-			{
-				segment->end_at = start;
-			}
+			foreach_token_in_segment_ (walk, child, deepest, base, len);
+			child = child->next;
 		}
 	}
+
+	g_ptr_array_set_size (walk->classes, n_classes);
 }
 
-/**
- * segment_merge:
- * @ce: #GtkSourceContextEngine.
- * @first: first segment.
- * @second: second segment.
- *
- * Merges adjacent segments @first and @second given
- * their contexts are equal.
- */
 static void
-segment_merge (GtkSourceContextEngine *ce,
-	       Segment                *first,
-	       Segment                *second)
+gtk_source_context_engine_foreach_token (GtkSourceEngine    *engine,
+					 const GtkTextIter  *start,
+					 const GtkTextIter  *end,
+					 GtkSourceTokenFunc  func,
+					 gpointer            user_data)
 {
-	Segment *parent;
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+	TokenWalk walk;
+	Segment *deepest;
+	gint invalid_line;
 
-	if (first == second)
+	if (ce->priv->disabled || ce->priv->buffer == NULL)
 		return;
 
-	g_assert (!SEGMENT_IS_INVALID (first));
-	g_assert (first->context == second->context);
-	g_assert (first->end_at == second->start_at);
+	/* Tokens come from the tree, so analyze the region first,
+	 * without touching the tags. */
+	if (ce->priv->background != NULL)
+	{
+		finish_background_analysis (ce, FALSE);
 
-	if (first->parent != second->parent)
-		segment_merge (ce, first->parent, second->parent);
+		if (ce->priv->disabled)
+			return;
+	}
 
-	parent = first->parent;
+	invalid_line = get_invalid_line (ce);
 
-	g_assert (first->next == second);
-	g_assert (first->parent == second->parent);
-	g_assert (second != parent->children);
+	if (invalid_line >= 0 && invalid_line <= gtk_text_iter_get_line (end))
+		update_syntax (ce, end, 0);
 
-	if (second == parent->last_child)
-		parent->last_child = first;
-	first->next = second->next;
-	if (second->next != NULL)
-		second->next->prev = first;
+	if (!prepare_tree_query_ (ce))
+		return;
 
-	first->end_at = second->end_at;
+	/* Changes after @end are not analyzed, but the tree must still
+	 * match the buffer there. */
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	update_tree (ce);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
 
-	if (second->children != NULL)
-	{
-		Segment *child;
+	walk.buffer = GTK_SOURCE_BUFFER (ce->priv->buffer);
+	walk.start_offset = gtk_text_iter_get_offset (start);
+	walk.end_offset = gtk_text_iter_get_offset (end);
+	walk.func = func;
+	walk.user_data = user_data;
 
-		for (child = second->children; child != NULL; child = child->next)
-			child->parent = first;
+	if (walk.start_offset >= walk.end_offset)
+		return;
 
-		if (first->children == NULL)
-		{
-			g_assert (!first->last_child);
-			first->children = second->children;
-			first->last_child = second->last_child;
-		}
-		else
-		{
-			first->last_child->next = second->children;
-			second->children->prev = first->last_child;
-			first->last_child = second->last_child;
-		}
-	}
+	deepest = get_segment_at_offset (ce,
+					 get_line_state (ce, gtk_text_iter_get_line (start)),
+					 walk.start_offset);
 
-	if (second->sub_patterns != NULL)
+	walk.classes = g_ptr_array_new ();
+	foreach_token_in_segment_ (&walk, ce->priv->root_segment, deepest, 0, 0);
+	g_ptr_array_free (walk.classes, TRUE);
+}
+
+
+/* HEADLESS HIGHLIGHTING -------------------------------------------------- */
+
+/* A styled token containing the current position, see StyleRuns. */
+typedef struct
+{
+	gint			 end_at;
+	const gchar		*style;
+} StyleSpan;
+
+/* State of _gtk_source_context_engine_highlight_text(): the nested
+ * tokens are turned into runs of text with the style of the innermost
+ * styled token, like the tags with the highest priority would do. */
+typedef struct
+{
+	/* Current position, in characters and in the text. */
+	gint			 offset;
+	const gchar		*pos;
+
+	/* Beginning and style of the run which is not emitted yet. */
+	const gchar		*run;
+	const gchar		*run_style;
+
+	/* StyleSpan's of the styled tokens containing the current
+	 * position, the innermost one last. */
+	GArray			*spans;
+
+	GtkSourceStyleRunFunc	 func;
+	gpointer		 user_data;
+} StyleRuns;
+
+/**
+ * style_runs_set_style_:
+ * @runs: #StyleRuns.
+ * @style: style of the text from the current position.
+ *
+ * Emits the pending run if the style changes at the current position.
+ */
+static void
+style_runs_set_style_ (StyleRuns   *runs,
+		       const gchar *style)
+{
+	if (g_strcmp0 (style, runs->run_style) == 0)
+		return;
+
+	if (runs->pos > runs->run)
+		runs->func (runs->run, runs->pos - runs->run, runs->run_style, runs->user_data);
+
+	runs->run = runs->pos;
+	runs->run_style = style;
+}
+
+/**
+ * style_runs_move_:
+ * @runs: #StyleRuns.
+ * @offset: offset to move to.
+ *
+ * Moves the current position forward to @offset, leaving the
+ * tokens which end on the way.
+ */
+static void
+style_runs_move_ (StyleRuns *runs,
+		  gint       offset)
+{
+	while (runs->offset < offset)
 	{
-		if (first->sub_patterns == NULL)
+		const gchar *style = NULL;
+		gint next = offset;
+
+		if (runs->spans->len != 0)
 		{
-			first->sub_patterns = second->sub_patterns;
+			StyleSpan *span = &g_array_index (runs->spans, StyleSpan,
+							  runs->spans->len - 1);
+			next = MIN (next, span->end_at);
+			style = span->style;
 		}
-		else
+
+		style_runs_set_style_ (runs, style);
+
+		runs->pos = g_utf8_offset_to_pointer (runs->pos, next - runs->offset);
+		runs->offset = next;
+
+		while (runs->spans->len != 0 &&
+		       g_array_index (runs->spans, StyleSpan, runs->spans->len - 1).end_at <= next)
 		{
-			while (second->sub_patterns != NULL)
-			{
-				SubPattern *sp = second->sub_patterns;
-				second->sub_patterns = sp->next;
-				sp->next = first->sub_patterns;
-				first->sub_patterns = sp;
-			}
+			g_array_set_size (runs->spans, runs->spans->len - 1);
 		}
 	}
+}
 
-	second->children = NULL;
-	second->last_child = NULL;
-	second->sub_patterns = NULL;
+static void
+style_runs_token_cb_ (G_GNUC_UNUSED GtkSourceBuffer     *buffer,
+		      gint                                start_offset,
+		      gint                                end_offset,
+		      const gchar                        *style_id,
+		      G_GNUC_UNUSED const gchar * const  *context_classes,
+		      StyleRuns                          *runs)
+{
+	StyleSpan span;
 
-	segment_destroy (ce, second);
+	style_runs_move_ (runs, start_offset);
+
+	if (style_id == NULL)
+		return;
+
+	span.end_at = end_offset;
+	span.style = style_id;
+
+	/* Tokens are nested, but do not trust sub patterns blindly. */
+	if (runs->spans->len != 0)
+	{
+		span.end_at = MIN (span.end_at,
+				   g_array_index (runs->spans, StyleSpan, runs->spans->len - 1).end_at);
+	}
+
+	g_array_append_val (runs->spans, span);
 }
 
 /**
- * erase_segments:
- * @ce: #GtkSourceContextEngine.
- * @start: start offset of region to erase, characters.
- * @end: end offset of region to erase, characters.
- * @hint: segment around @start to make it faster.
+ * _gtk_source_context_engine_highlight_text:
+ * @ce: #GtkSourceContextEngine, not attached to any buffer.
+ * @text: valid UTF-8 text without nul characters, which does not need
+ * to be nul-terminated.
+ * @length: length of @text in bytes.
+ * @func: function called for each run of @text.
+ * @user_data: user data for @func.
  *
- * Erases all non-toplevel segments in the interval
- * [@start, @end]. Its action on the tree is roughly
- * equivalent to segment_erase_range_(ce->priv->root_segment, start, end)
- * (but that does not accept toplevel segment).
+ * Analyzes @text the way the background analysis analyzes a snapshot
+ * of a buffer, in a scratch engine, and calls @func for consecutive
+ * runs of @text covering all of it, with the style of each run. Neither
+ * @ce nor the language data are modified, so this may be called from
+ * several threads at once with the same engine.
  */
-static void
-erase_segments (GtkSourceContextEngine *ce,
-		gint                    start,
-		gint                    end,
-		Segment                *hint)
-{
-	Segment *root = ce->priv->root_segment;
-	Segment *child, *hint_prev;
-
-	if (root->children == NULL)
-		return;
+void
+_gtk_source_context_engine_highlight_text (GtkSourceContextEngine *ce,
+					   const gchar            *text,
+					   gsize                   length,
+					   GtkSourceStyleRunFunc   func,
+					   gpointer                user_data)
+{
+	GtkSourceContextEngine *scratch;
+	GRecMutex *lock = &ce->priv->ctx_data->lock;
+	const gchar *text_end = text + length;
+	const gchar *last_line = text_end;
+	const gchar *pos = text;
+	gchar *last_line_copy = NULL;
+	Segment *state;
+	StyleRuns runs;
+	TokenWalk walk;
+	gint offset = 0;
+	gint line_no = 0;
+	gint regex_slot;
 
-	if (hint == NULL)
-		hint = ce->priv->hint;
+	g_return_if_fail (ce->priv->buffer == NULL);
 
-	if (hint != NULL)
-		while (hint != NULL && hint->parent != ce->priv->root_segment)
-			hint = hint->parent;
+	g_rec_mutex_lock (lock);
+	scratch = background_scratch_new_ (ce);
+	context_freeze (scratch->priv->root_context);
+	g_rec_mutex_unlock (lock);
 
-	if (hint == NULL)
-		hint = root->children;
+	state = scratch->priv->root_segment;
 
-	hint_prev = hint->prev;
+	/* fill_line_info() looks for the nul character, which may not be
+	 * there, so the text after the last \n is analyzed from a copy. */
+	while (last_line > text && last_line[-1] != '\n')
+		last_line--;
 
-	child = hint;
-	while (child != NULL)
+	/* Regexes in lang files do not take BOM into account. */
+	if (length >= 3 && IS_BOM (g_utf8_get_char (text)))
 	{
-		Segment *next = child->next;
+		pos = g_utf8_next_char (text);
+		offset = 1;
+	}
 
-		if (child->end_at < start)
+	regex_slot = _gtk_source_regex_acquire_thread_slot ();
+	_gtk_source_regex_set_thread_slot (regex_slot);
+
+	while (pos < text_end && !scratch->priv->disabled)
+	{
+		if (pos >= last_line && last_line_copy == NULL)
 		{
-			child = next;
+			last_line_copy = g_strndup (pos, text_end - pos);
+			text_end = last_line_copy + (text_end - pos);
+			pos = last_line_copy;
+		}
 
-			if (next != NULL)
-				ce->priv->hint = next;
+		if (regex_slot == 0)
+			g_rec_mutex_lock (lock);
 
-			continue;
-		}
+		background_analyze_line_ (scratch, &state, &pos, &offset, &line_no);
 
-		if (child->start_at > end)
-		{
-			ce->priv->hint = child;
-			break;
-		}
+		if (regex_slot == 0)
+			g_rec_mutex_unlock (lock);
+	}
+
+	_gtk_source_regex_set_thread_slot (0);
+
+	if (regex_slot != 0)
+		_gtk_source_regex_release_thread_slot (regex_slot);
+
+	g_free (last_line_copy);
+
+	g_rec_mutex_lock (lock);
+	context_thaw (scratch->priv->root_context);
+	g_rec_mutex_unlock (lock);
+
+	runs.offset = 0;
+	runs.pos = text;
+	runs.run = text;
+	runs.run_style = NULL;
+	runs.spans = g_array_new (FALSE, FALSE, sizeof (StyleSpan));
+	runs.func = func;
+	runs.user_data = user_data;
+
+	walk.buffer = NULL;
+	walk.start_offset = 0;
+	walk.end_offset = offset;
+	walk.func = (GtkSourceTokenFunc) style_runs_token_cb_;
+	walk.user_data = &runs;
+	walk.classes = g_ptr_array_new ();
+
+	foreach_token_in_segment_ (&walk, scratch->priv->root_segment, NULL, 0, 0);
+
+	/* The text left unanalyzed if the analysis was disabled has no
+	 * style, then the last run is emitted. */
+	style_runs_move_ (&runs, offset);
+	style_runs_set_style_ (&runs, NULL);
+	runs.pos = text + length;
+
+	if (runs.pos > runs.run)
+		func (runs.run, runs.pos - runs.run, runs.run_style, user_data);
+
+	g_ptr_array_free (walk.classes, TRUE);
+	g_array_free (runs.spans, TRUE);
+
+	g_rec_mutex_lock (lock);
+	segment_tree_destroy (scratch);
+	g_rec_mutex_unlock (lock);
+
+	g_object_unref (scratch);
+}
+
+
+/* VISIBLE AREA ----------------------------------------------------------- */
+
+/**
+ * forget_provisional_highlighting:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Makes highlight_window() analyze again the text it has
+ * already highlighted, called when the buffer is modified.
+ */
+static void
+forget_provisional_highlighting (GtkSourceContextEngine *ce)
+{
+	window_scratch_free (ce);
+
+	if (ce->priv->provisional_region == NULL ||
+	    gtk_text_region_subregions (ce->priv->provisional_region) == 0)
+		return;
+
+	gtk_text_region_destroy (ce->priv->provisional_region, FALSE);
+	ce->priv->provisional_region = gtk_text_region_new (ce->priv->buffer);
+}
+
+/**
+ * window_scratch_free:
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Destroys the tree kept by highlight_window(), which is no longer
+ * valid once the text changes.
+ */
+static void
+window_scratch_free (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->window_scratch == NULL)
+		return;
 
-		segment_erase_range_ (ce, child, start, end);
-		child = next;
-	}
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
+	segment_tree_destroy (ce->priv->window_scratch);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
 
-	child = hint_prev;
-	while (child != NULL)
-	{
-		Segment *prev = child->prev;
+	g_object_unref (ce->priv->window_scratch);
+	ce->priv->window_scratch = NULL;
+	ce->priv->window_state = NULL;
+}
 
-		if (ce->priv->hint == NULL)
-			ce->priv->hint = child;
+/**
+ * window_is_highlighted_:
+ * @ce: #GtkSourceContextEngine.
+ * @start: the beginning of the window.
+ * @end: the end of the window.
+ *
+ * Returns: whether the whole window is in provisional_region.
+ * Called only from highlight_window().
+ */
+static gboolean
+window_is_highlighted_ (GtkSourceContextEngine *ce,
+			const GtkTextIter      *start,
+			const GtkTextIter      *end)
+{
+	GtkTextRegion *region;
+	GtkTextIter s, e;
+	gboolean retval = FALSE;
 
-		if (child->start_at > end)
-		{
-			child = prev;
-			continue;
-		}
+	region = gtk_text_region_intersect (ce->priv->provisional_region, start, end);
 
-		if (child->end_at < start)
-		{
-			break;
-		}
+	if (region == NULL)
+		return FALSE;
 
-		segment_erase_range_ (ce, child, start, end);
-		child = prev;
+	if (gtk_text_region_subregions (region) == 1 &&
+	    gtk_text_region_nth_subregion (region, 0, &s, &e))
+	{
+		retval = gtk_text_iter_equal (&s, start) &&
+			 gtk_text_iter_equal (&e, end);
 	}
 
-	CHECK_TREE (ce);
+	gtk_text_region_destroy (region, TRUE);
+	return retval;
 }
 
-#define IS_BOM(c) (c == 0xFEFF)
-
 /**
- * update_syntax:
+ * highlight_window:
  * @ce: #GtkSourceContextEngine.
- * @end: desired end of region to analyze or %NULL.
- * @time: maximal amount of time in milliseconds allowed to spend here
- * or 0 for 'unlimited'.
+ * @start: the beginning of the window.
+ * @end: the end of the window.
  *
- * Updates syntax tree. If @end is not %NULL, then it analyzes
- * (reanalyzes invalid areas in) region from start of buffer
- * to @end. Otherwise, it analyzes batch of text starting at
- * first invalid line.
- * In order to avoid blocking ui it uses a timer and stops
- * when time elapsed is greater than @time, so analyzed region is
- * not necessarily what's requested (unless @time is 0).
+ * @time: time limit in milliseconds, or 0.
+ *
+ * Highlights the window without analyzing the text before it. The text
+ * is analyzed into a scratch tree from RESYNC_LINES lines above the window,
+ * starting in the root context: most languages get back to the right
+ * state within a few lines, e.g. after a blank line or a closing brace.
+ * The tags are replaced with ones from the real tree when update_syntax()
+ * gets there. Analysis stops after @time, in which case only the
+ * beginning of the window is highlighted.
+ *
+ * The scratch tree is kept until the text changes, see window_scratch,
+ * so the next frame continues where this one stopped, even in the middle
+ * of a line, as long as that is not above the place where it would start
+ * over and the tree begins above the window.
+ *
+ * If GtkSourceBuffer:highlight-sync-lines is set, there is no real tree:
+ * this is the only analysis done, from that many lines above the window,
+ * so it does not depend on the size of the buffer.
  */
-/* XXX it must be refactored. */
 static void
-update_syntax (GtkSourceContextEngine *ce,
-	       const GtkTextIter      *end,
-	       gint                    time)
+highlight_window (GtkSourceContextEngine *ce,
+		  const GtkTextIter      *start,
+		  const GtkTextIter      *end,
+		  gint                    time)
 {
-	GtkTextBuffer *buffer;
-	GtkTextIter start_iter, end_iter;
+	GtkSourceContextEngine *scratch;
+	GtkTextIter win_start, win_end;
 	GtkTextIter line_start, line_end;
 	Segment *state;
-	Segment *invalid;
-	gint start_offset, end_offset;
-	gint line_start_offset, line_end_offset;
-	gint analyzed_end;
-	gboolean first_line = FALSE;
+	gint sync_offset;
 	GTimer *timer;
 
-	buffer = ce->priv->buffer;
-	state = ce->priv->root_segment;
+	win_start = *start;
+	gtk_text_iter_set_line_offset (&win_start, 0);
+	win_end = *end;
+	if (!gtk_text_iter_starts_line (&win_end))
+		gtk_text_iter_forward_line (&win_end);
 
-	context_freeze (ce->priv->root_context);
-	update_tree (ce);
+	if (gtk_text_iter_equal (&win_start, &win_end) ||
+	    window_is_highlighted_ (ce, &win_start, &win_end))
+		return;
 
-	if (!gtk_text_buffer_get_char_count (buffer))
-	{
-		segment_tree_zero_len (ce);
-		goto out;
-	}
+	line_start = win_start;
+	gtk_text_iter_backward_lines (&line_start,
+				      ce->priv->sync_lines >= 0 ? ce->priv->sync_lines : RESYNC_LINES);
 
-	invalid = get_invalid_segment (ce);
+	/* Regexes in lang files do not take BOM into account. */
+	if (gtk_text_iter_is_start (&line_start) &&
+	    IS_BOM (gtk_text_iter_get_char (&line_start)))
+		gtk_text_iter_forward_char (&line_start);
 
-	if (invalid == NULL)
-		goto out;
+	sync_offset = gtk_text_iter_get_offset (&line_start);
 
-	if (end != NULL && invalid->start_at >= gtk_text_iter_get_offset (end))
-		goto out;
+	scratch = ce->priv->window_scratch;
 
-	if (end != NULL)
-	{
-		end_offset = gtk_text_iter_get_offset (end);
-		start_offset = MIN (end_offset, invalid->start_at);
-	}
-	else
+	if (scratch != NULL &&
+	    (scratch->priv->root_segment->start_at > gtk_text_iter_get_offset (&win_start) ||
+	     ce->priv->window_end < sync_offset))
 	{
-		start_offset = invalid->start_at;
-		end_offset = gtk_text_buffer_get_char_count (buffer);
+		window_scratch_free (ce);
+		scratch = NULL;
 	}
 
-	gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start_offset);
-	gtk_text_buffer_get_iter_at_offset (buffer, &end_iter, end_offset);
+	g_rec_mutex_lock (&ce->priv->ctx_data->lock);
 
-	if (!gtk_text_iter_starts_line (&start_iter))
+	if (scratch == NULL)
 	{
-		gtk_text_iter_set_line_offset (&start_iter, 0);
-		start_offset = gtk_text_iter_get_offset (&start_iter);
-	}
+		scratch = _gtk_source_context_engine_new (ce->priv->ctx_data);
+		scratch->priv->max_line_length = ce->priv->max_line_length;
+		scratch->priv->root_context = context_new (scratch, NULL, ce->priv->root_context->definition,
+							   NULL, NULL, FALSE);
+		scratch->priv->root_segment = create_segment (scratch, NULL, scratch->priv->root_context,
+							      sync_offset, sync_offset, TRUE, NULL);
 
-	if (!gtk_text_iter_starts_line (&end_iter))
-	{
-		gtk_text_iter_forward_line (&end_iter);
-		end_offset = gtk_text_iter_get_offset (&end_iter);
+		ce->priv->window_scratch = scratch;
+		ce->priv->window_end = sync_offset;
+		ce->priv->window_state = scratch->priv->root_segment;
 	}
-
-	if (0 == start_offset)
+	else if (scratch->priv->partial_line != NULL)
 	{
-		first_line = TRUE;
-
-		/* If it is the first line and it starts with BOM, skip it
-		 * since regexes in lang files do not take it into account */
-		gunichar c = gtk_text_iter_get_char (&start_iter);
-		if (IS_BOM (c))
-		{
-			gtk_text_iter_forward_char (&start_iter);
-			start_offset = gtk_text_iter_get_offset (&start_iter);
-		}
+		gtk_text_iter_set_offset (&line_start, scratch->priv->partial_line->line.start_at);
 	}
-
-	/* This happens after deleting all text on last line. */
-	if (start_offset == end_offset)
+	else
 	{
-		g_assert (end_offset == gtk_text_buffer_get_char_count (buffer));
-		g_assert (g_slist_length (ce->priv->invalid) == 1);
-		segment_remove (ce, invalid);
-		CHECK_TREE (ce);
-		goto out;
+		gtk_text_iter_set_offset (&line_start, ce->priv->window_end);
 	}
 
+	state = ce->priv->window_state;
+	context_freeze (scratch->priv->root_context);
 
-	/* Main loop */
-
-	line_start = start_iter;
-	line_start_offset = start_offset;
 	line_end = line_start;
 	gtk_text_iter_forward_line (&line_end);
-	line_end_offset = gtk_text_iter_get_offset (&line_end);
-	analyzed_end = line_end_offset;
 
 	timer = g_timer_new ();
 
-	while (TRUE)
+	while (gtk_text_iter_compare (&line_start, &win_end) < 0 &&
+	       !gtk_text_iter_equal (&line_start, &line_end))
 	{
 		LineInfo line;
-		gboolean next_line_invalid = FALSE;
-		gboolean need_invalidate_next = FALSE;
+		gint line_pos = 0;
+		gchar *partial_text = NULL;
+		gboolean done;
 
-		/* Last buffer line. */
-		if (line_start_offset == line_end_offset)
+		if (scratch->priv->partial_line != NULL)
 		{
-			g_assert (line_start_offset == gtk_text_buffer_get_char_count (buffer));
-			break;
-		}
-
-		/* Analyze the line */
-		erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
-		get_line_info (buffer, &line_start, &line_end, &line);
+			/* Continue where the previous frame stopped. */
+			PartialLine *partial = scratch->priv->partial_line;
 
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
+			line = partial->line;
+			partial_text = partial->text;
+			line_pos = partial->line_pos;
 
-		if (first_line)
-		{
-			state = ce->priv->root_segment;
+			g_slice_free (PartialLine, partial);
+			scratch->priv->partial_line = NULL;
 		}
 		else
 		{
-			state = get_segment_at_offset (ce,
-						       ce->priv->hint ? ce->priv->hint : state,
-						       line_start_offset - 1);
+			get_line_info (scratch, ce->priv->buffer, &line_start, &line_end, &line);
 		}
 
-		g_assert (state->context != NULL);
-
-		ce->priv->hint2 = ce->priv->hint;
-
-		if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
-			ce->priv->hint2 = NULL;
-
-		state = analyze_line (ce, state, &line);
+		scratch->priv->hint2 = scratch->priv->hint;
 
-		/* At this point analyze_line() could have disabled highlighting */
-		if (ce->priv->disabled)
-			return;
+		if (scratch->priv->hint2 != NULL && scratch->priv->hint2->parent != state)
+			scratch->priv->hint2 = NULL;
 
-#ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
-#endif
+		done = analyze_line (scratch, &state, &line, &line_pos,
+				     timer, time);
 
-		/* XXX this is wrong */
-		/* I don't know anymore why it's wrong, I guess it means
-		 * "may be inefficient" */
-		if (ce->priv->hint2 != NULL)
-			ce->priv->hint = ce->priv->hint2;
+		if (scratch->priv->hint2 != NULL)
+			scratch->priv->hint = scratch->priv->hint2;
 		else
-			ce->priv->hint = state;
-
-		line_info_destroy (&line);
-
-		gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
-		analyzed_end = line_end_offset;
-		invalid = get_invalid_segment (ce);
+			scratch->priv->hint = state;
 
-		if (invalid != NULL)
+		/* The real analysis will deal with it. */
+		if (scratch->priv->disabled)
 		{
-			GtkTextIter iter;
-
-			gtk_text_buffer_get_iter_at_offset (buffer, &iter, invalid->start_at);
-			gtk_text_iter_set_line_offset (&iter, 0);
-
-			if (gtk_text_iter_get_offset (&iter) == line_end_offset)
-				next_line_invalid = TRUE;
+			g_free (partial_text);
+			break;
 		}
 
-		if (!next_line_invalid)
+		if (!done)
 		{
-			Segment *old_state, *hint;
+			PartialLine *partial;
+
+			/* As in update_syntax(), the text is copied since
+			 * get_line_info() reuses it. */
+			if (partial_text == NULL)
+				partial_text = g_strdup (line.text);
+
+			partial = g_slice_new (PartialLine);
+			partial->line = line;
+			partial->line.text = partial_text;
+			partial->text = partial_text;
+			partial->line_pos = line_pos;
+			partial->state = state;
+			scratch->priv->partial_line = partial;
+
+			gtk_text_iter_set_offset (&line_start,
+						  line_pos_to_offset (&line, line_pos));
+			break;
+		}
 
-			hint = ce->priv->hint ? ce->priv->hint : state;
-			old_state = get_segment_at_offset (ce, hint, line_end_offset);
+		g_free (partial_text);
 
-			/* We can merge old and new stuff if: contexts are the same,
-			 * and the segment on the next line is continuation of the
-			 * segment from previous line. */
-			if (old_state != state &&
-			    (old_state->context != state->context || state->is_start))
-			{
-				need_invalidate_next = TRUE;
-				next_line_invalid = TRUE;
-			}
-			else
-			{
-				segment_merge (ce, state, old_state);
-				CHECK_TREE (ce);
-			}
-		}
+		line_start = line_end;
+		gtk_text_iter_forward_line (&line_end);
 
-		if ((time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time) ||
-		    line_end_offset >= end_offset ||
-		    (invalid == NULL && !next_line_invalid))
-		{
-			if (need_invalidate_next)
-				insert_range (ce, line_end_offset, 0);
+		if (time != 0 && g_timer_elapsed (timer, NULL) * 1000 > time)
 			break;
-		}
+	}
 
-		if (next_line_invalid)
-		{
-			line_start_offset = line_end_offset;
-			line_start = line_end;
-			gtk_text_iter_forward_line (&line_end);
-			line_end_offset = gtk_text_iter_get_offset (&line_end);
-		}
-		else
-		{
-			gtk_text_buffer_get_iter_at_offset (buffer, &line_start, invalid->start_at);
-			gtk_text_iter_set_line_offset (&line_start, 0);
-			line_start_offset = gtk_text_iter_get_offset (&line_start);
-			line_end = line_start;
-			gtk_text_iter_forward_line (&line_end);
-			line_end_offset = gtk_text_iter_get_offset (&line_end);
-		}
+	context_thaw (scratch->priv->root_context);
 
-		first_line = (0 == line_start_offset);
-	}
+	ce->priv->window_end = gtk_text_iter_get_offset (&line_start);
+	ce->priv->window_state = state;
 
-	if (analyzed_end == gtk_text_buffer_get_char_count (buffer))
+	if (scratch->priv->disabled)
 	{
-		g_assert (g_slist_length (ce->priv->invalid) <= 1);
-
-		if (ce->priv->invalid != NULL)
-		{
-			invalid = get_invalid_segment (ce);
-			segment_remove (ce, invalid);
-			CHECK_TREE (ce);
-		}
+		g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+		window_scratch_free (ce);
+		g_timer_destroy (timer);
+		return;
 	}
 
-	if (!all_analyzed (ce))
-		install_idle_worker (ce);
-
-	gtk_text_iter_set_offset (&end_iter, analyzed_end);
+	/* The tree may already reach past the window. */
+	if (gtk_text_iter_compare (&line_start, &win_end) > 0)
+		line_start = win_end;
 
-	refresh_range (ce, &start_iter, &end_iter);
+	if (gtk_text_iter_compare (&line_start, &win_start) > 0)
+	{
+		apply_tags (ce, scratch->priv->root_segment, &win_start, &line_start);
+		gtk_text_region_add (ce->priv->provisional_region, &win_start, &line_start);
+	}
 
-	PROFILE (g_print ("analyzed %d chars from %d to %d in %fms\n",
-			  analyzed_end - start_offset, start_offset, analyzed_end,
+	PROFILE (g_print ("provisionally highlighted lines %d to %d in %fms\n",
+			  gtk_text_iter_get_line (&win_start),
+			  gtk_text_iter_get_line (&line_start),
 			  g_timer_elapsed (timer, NULL) * 1000));
 
 	g_timer_destroy (timer);
 
-out:
-	/* must call context_thaw, so this is the only return point */
-	context_thaw (ce->priv->root_context);
+	g_rec_mutex_unlock (&ce->priv->ctx_data->lock);
+}
+
+/**
+ * highlight_visible_area:
+ * @ce: #GtkSourceContextEngine.
+ * @start: the beginning of the visible area.
+ * @end: the end of the visible area.
+ * @invalid_line: first invalid line.
+ *
+ * Called when a frame is drawn and the visible area is not analyzed yet,
+ * so that it does not have to wait for idle worker to get there.
+ * If the visible area is close to the analyzed text, it is analyzed
+ * normally; otherwise it is highlighted by highlight_window(). Either
+ * way no more than FRAME_UPDATE_TIME_SLICE is spent here.
+ */
+static void
+highlight_visible_area (GtkSourceContextEngine *ce,
+			const GtkTextIter      *start,
+			const GtkTextIter      *end,
+			gint                    invalid_line)
+{
+	gint start_line = gtk_text_iter_get_line (start);
+
+	if (ce->priv->background == NULL &&
+	    start_line - invalid_line <= RESYNC_LINES)
+	{
+		update_syntax (ce, end, FRAME_UPDATE_TIME_SLICE);
+
+		if (!ce->priv->disabled)
+			ensure_highlighted (ce, start, end);
+	}
+	else
+	{
+		highlight_window (ce, start, end, FRAME_UPDATE_TIME_SLICE);
+	}
 }
 
 
@@ -5705,6 +11862,9 @@ context_definition_new (const gchar        *id,
 
 	definition->context_classes = copy_context_classes (context_classes);
 
+	if (type == CONTEXT_TYPE_SIMPLE)
+		definition->keywords = keyword_set_new_from_pattern (match);
+
 	return definition;
 }
 
@@ -5757,6 +11917,8 @@ context_definition_unref (ContextDefinition *definition)
 	g_free (definition->id);
 	g_free (definition->default_style);
 	_gtk_source_regex_unref (definition->reg_all);
+	keyword_set_free (definition->keywords);
+	keyword_set_free (definition->child_keywords);
 
 	g_slist_free_full (definition->context_classes,
 	                   (GDestroyNotify)gtk_source_context_class_free);
@@ -6374,6 +12536,7 @@ check_segment (GtkSourceContextEngine *ce,
 	if (segment->children != NULL)
 		g_assert (!SEGMENT_IS_INVALID (segment) && SEGMENT_IS_CONTAINER (segment));
 
+
 	for (child = segment->children; child != NULL; child = child->next)
 	{
 		g_assert (child->parent == segment);
@@ -6437,7 +12600,7 @@ check_tree (GtkSourceContextEngine *ce)
 
 	g_assert (root->start_at == 0);
 
-	if (ce->priv->invalid_region.empty)
+	if (ce->priv->invalid_regions->len == 0)
 		g_assert (root->end_at == gtk_text_buffer_get_char_count (ce->priv->buffer));
 
 	g_assert (!root->parent);
@@ -26,6 +26,7 @@
 #include "gtksourceengine.h"
 #include "gtksourcetypes.h"
 #include "gtksourcetypes-private.h"
+#include "gtksourcehighlighter.h"
 
 G_BEGIN_DECLS
 
@@ -92,6 +93,52 @@ void			 gtk_source_context_class_free			(GtkSourceContextClass	 *cclass);
 G_GNUC_INTERNAL
 GtkSourceContextEngine	*_gtk_source_context_engine_new			(GtkSourceContextData	 *data);
 
+G_GNUC_INTERNAL
+GtkSourceContextEngine	*_gtk_source_context_engine_get_for_buffer	(GtkTextBuffer		 *buffer);
+
+G_GNUC_INTERNAL
+gsize			 _gtk_source_context_engine_get_memory_usage	(GtkSourceContextEngine	 *ce);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_line_cache_stats
+									(GtkSourceContextEngine	 *ce,
+									 guint			 *hits,
+									 guint			 *misses);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_tag_stats	(GtkSourceContextEngine	 *ce,
+									 guint			 *operations,
+									 guint			 *saved);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_cache_stats	(GtkSourceContextEngine	 *ce,
+									 guint			 *loads,
+									 guint			 *rejects);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_analysis_stats	(GtkSourceContextEngine	 *ce,
+									 guint			 *lines);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_set_parallel_chunks	(GtkSourceContextEngine	 *ce,
+									 guint			  n_chunks);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_parallel_stats	(GtkSourceContextEngine	 *ce,
+									 guint			 *chunks);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_get_reg_all_stats	(guint			 *compiled,
+									 guint			 *reused,
+									 gdouble		 *compile_time);
+
+G_GNUC_INTERNAL
+void			 _gtk_source_context_engine_highlight_text	(GtkSourceContextEngine	 *ce,
+									 const gchar		 *text,
+									 gsize			  length,
+									 GtkSourceStyleRunFunc	  func,
+									 gpointer		  user_data);
+
 G_GNUC_INTERNAL
 gboolean		 _gtk_source_context_data_define_context	(GtkSourceContextData	 *data,
 									 const gchar		 *id,
@@ -77,6 +77,19 @@ _gtk_source_engine_text_deleted (GtkSourceEngine *engine,
 							    length);
 }
 
+void
+_gtk_source_engine_text_truncated (GtkSourceEngine *engine,
+				   gint             length,
+				   gint             n_lines)
+{
+	g_return_if_fail (GTK_SOURCE_IS_ENGINE (engine));
+	g_return_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->text_truncated != NULL);
+
+	GTK_SOURCE_ENGINE_GET_CLASS (engine)->text_truncated (engine,
+							      length,
+							      n_lines);
+}
+
 void
 _gtk_source_engine_update_highlight (GtkSourceEngine   *engine,
 				     const GtkTextIter *start,
@@ -104,13 +117,78 @@ _gtk_source_engine_set_style_scheme (GtkSourceEngine      *engine,
 	GTK_SOURCE_ENGINE_GET_CLASS (engine)->set_style_scheme (engine, scheme);
 }
 
-GtkTextTag *
-_gtk_source_engine_get_context_class_tag (GtkSourceEngine *engine,
-					  const gchar     *context_class)
+gboolean
+_gtk_source_engine_iter_has_context_class (GtkSourceEngine   *engine,
+					   const GtkTextIter *iter,
+					   const gchar       *context_class)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_has_context_class != NULL, FALSE);
+
+	return GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_has_context_class (engine,
+									     iter,
+									     context_class);
+}
+
+gchar **
+_gtk_source_engine_get_context_classes_at_iter (GtkSourceEngine   *engine,
+						const GtkTextIter *iter)
 {
 	g_return_val_if_fail (GTK_SOURCE_IS_ENGINE (engine), NULL);
-	g_return_val_if_fail (context_class != NULL, NULL);
+	g_return_val_if_fail (iter != NULL, NULL);
+	g_return_val_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->get_context_classes_at_iter != NULL, NULL);
+
+	return GTK_SOURCE_ENGINE_GET_CLASS (engine)->get_context_classes_at_iter (engine,
+										  iter);
+}
 
-	return GTK_SOURCE_ENGINE_GET_CLASS (engine)->get_context_class_tag (engine,
-									    context_class);
+gboolean
+_gtk_source_engine_iter_forward_to_context_class_toggle (GtkSourceEngine *engine,
+							 GtkTextIter     *iter,
+							 const gchar     *context_class)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_forward_to_context_class_toggle != NULL, FALSE);
+
+	return GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_forward_to_context_class_toggle (engine,
+											   iter,
+											   context_class);
+}
+
+gboolean
+_gtk_source_engine_iter_backward_to_context_class_toggle (GtkSourceEngine *engine,
+							  GtkTextIter     *iter,
+							  const gchar     *context_class)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_ENGINE (engine), FALSE);
+	g_return_val_if_fail (iter != NULL, FALSE);
+	g_return_val_if_fail (context_class != NULL, FALSE);
+	g_return_val_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_backward_to_context_class_toggle != NULL, FALSE);
+
+	return GTK_SOURCE_ENGINE_GET_CLASS (engine)->iter_backward_to_context_class_toggle (engine,
+											    iter,
+											    context_class);
+}
+
+void
+_gtk_source_engine_foreach_token (GtkSourceEngine    *engine,
+				  const GtkTextIter  *start,
+				  const GtkTextIter  *end,
+				  GtkSourceTokenFunc  func,
+				  gpointer            user_data)
+{
+	g_return_if_fail (GTK_SOURCE_IS_ENGINE (engine));
+	g_return_if_fail (start != NULL && end != NULL);
+	g_return_if_fail (func != NULL);
+	g_return_if_fail (GTK_SOURCE_ENGINE_GET_CLASS (engine)->foreach_token != NULL);
+
+	GTK_SOURCE_ENGINE_GET_CLASS (engine)->foreach_token (engine,
+							     start,
+							     end,
+							     func,
+							     user_data);
 }
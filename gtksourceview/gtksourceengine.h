@@ -25,6 +25,7 @@
 #include <gtk/gtk.h>
 #include "gtksourcetypes.h"
 #include "gtksourcetypes-private.h"
+#include "gtksourcebuffer.h"
 
 G_BEGIN_DECLS
 
@@ -55,6 +56,9 @@ struct _GtkSourceEngineClass
 	void     (* text_deleted)     (GtkSourceEngine      *engine,
 				       gint                  offset,
 				       gint                  length);
+	void     (* text_truncated)   (GtkSourceEngine      *engine,
+				       gint                  length,
+				       gint                  n_lines);
 
 	void     (* update_highlight) (GtkSourceEngine      *engine,
 				       const GtkTextIter    *start,
@@ -64,9 +68,27 @@ struct _GtkSourceEngineClass
 	void     (* set_style_scheme) (GtkSourceEngine      *engine,
 				       GtkSourceStyleScheme *scheme);
 
-	GtkTextTag *(* get_context_class_tag)
+	gboolean (* iter_has_context_class)
 				      (GtkSourceEngine      *engine,
+				       const GtkTextIter    *iter,
 				       const gchar          *context_class);
+	gchar  **(* get_context_classes_at_iter)
+				      (GtkSourceEngine      *engine,
+				       const GtkTextIter    *iter);
+	gboolean (* iter_forward_to_context_class_toggle)
+				      (GtkSourceEngine      *engine,
+				       GtkTextIter          *iter,
+				       const gchar          *context_class);
+	gboolean (* iter_backward_to_context_class_toggle)
+				      (GtkSourceEngine      *engine,
+				       GtkTextIter          *iter,
+				       const gchar          *context_class);
+
+	void     (* foreach_token)    (GtkSourceEngine      *engine,
+				       const GtkTextIter    *start,
+				       const GtkTextIter    *end,
+				       GtkSourceTokenFunc    func,
+				       gpointer              user_data);
 };
 
 G_GNUC_INTERNAL
@@ -86,6 +108,11 @@ void        _gtk_source_engine_text_deleted	(GtkSourceEngine      *engine,
 						 gint                  offset,
 						 gint                  length);
 
+G_GNUC_INTERNAL
+void        _gtk_source_engine_text_truncated	(GtkSourceEngine      *engine,
+						 gint                  length,
+						 gint                  n_lines);
+
 G_GNUC_INTERNAL
 void        _gtk_source_engine_update_highlight	(GtkSourceEngine      *engine,
 						 const GtkTextIter    *start,
@@ -97,9 +124,34 @@ void        _gtk_source_engine_set_style_scheme	(GtkSourceEngine      *engine,
 						 GtkSourceStyleScheme *scheme);
 
 G_GNUC_INTERNAL
-GtkTextTag *_gtk_source_engine_get_context_class_tag
-						 (GtkSourceEngine     *engine,
-						  const gchar         *context_class);
+gboolean    _gtk_source_engine_iter_has_context_class
+						(GtkSourceEngine      *engine,
+						 const GtkTextIter    *iter,
+						 const gchar          *context_class);
+
+G_GNUC_INTERNAL
+gchar     **_gtk_source_engine_get_context_classes_at_iter
+						(GtkSourceEngine      *engine,
+						 const GtkTextIter    *iter);
+
+G_GNUC_INTERNAL
+gboolean    _gtk_source_engine_iter_forward_to_context_class_toggle
+						(GtkSourceEngine      *engine,
+						 GtkTextIter          *iter,
+						 const gchar          *context_class);
+
+G_GNUC_INTERNAL
+gboolean    _gtk_source_engine_iter_backward_to_context_class_toggle
+						(GtkSourceEngine      *engine,
+						 GtkTextIter          *iter,
+						 const gchar          *context_class);
+
+G_GNUC_INTERNAL
+void        _gtk_source_engine_foreach_token	(GtkSourceEngine      *engine,
+						 const GtkTextIter    *start,
+						 const GtkTextIter    *end,
+						 GtkSourceTokenFunc    func,
+						 gpointer              user_data);
 
 G_END_DECLS
 
@@ -0,0 +1,815 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/* gtksourcehighlighter.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <gdk/gdk.h>
+#include "gtksourcehighlighter.h"
+#include "gtksourcecontextengine.h"
+#include "gtksourcelanguage.h"
+#include "gtksourcelanguage-private.h"
+#include "gtksourcestylescheme.h"
+#include "gtksourcestyle-private.h"
+#include "gtksourceview-i18n.h"
+
+/**
+ * SECTION:highlighter
+ * @Short_description: Syntax highlighting without a buffer
+ * @Title: GtkSourceHighlighter
+ * @See_also: #GtkSourceBuffer, #GtkSourceLanguage
+ *
+ * A #GtkSourceHighlighter highlights text with a #GtkSourceLanguage,
+ * without a #GtkSourceBuffer, text tags or a main loop. The text is
+ * analyzed at once, and the runs of text which have the same style are
+ * given to a #GtkSourceStyleRunFunc, see gtk_source_highlighter_highlight().
+ * The text can also be written as HTML, as text with ANSI escape
+ * sequences for terminals, or as a JSON list of the styled runs.
+ *
+ * A highlighter does not change once it is created, and the language data
+ * are shared and only read by the analysis, so the same highlighter may
+ * be used by several threads at once, e.g. by the threads of a
+ * #GThreadPool highlighting many files. The language and the style scheme
+ * should not be used with buffers at the same time, though.
+ */
+
+#define MAX_STYLE_DEPENDENCY_DEPTH	50
+
+enum
+{
+	PROP_0,
+	PROP_LANGUAGE,
+	PROP_STYLE_SCHEME
+};
+
+/* How the HTML and ANSI writers write a run of text with some style. */
+typedef struct
+{
+	/* Opening span tag, or NULL. */
+	gchar *html;
+	/* Escape sequence which sets the style, or NULL. */
+	gchar *ansi;
+} StyleFormat;
+
+/* State of the writers, see format_text(). */
+typedef struct
+{
+	GtkSourceHighlighter *highlighter;
+	GString *output;
+	const gchar *text;
+	gboolean first;
+} Writer;
+
+struct _GtkSourceHighlighterPrivate
+{
+	GtkSourceLanguage *language;
+	GtkSourceStyleScheme *scheme;
+
+	/* Engine which is not attached to any buffer, or NULL if the
+	 * language file cannot be parsed. */
+	GtkSourceContextEngine *engine;
+
+	/* StyleFormat's indexed by style id, see get_style_format(). */
+	GHashTable *formats;
+};
+
+/* Style schemes cache the styles they are asked for, and highlighters may
+ * share schemes, so styles are looked up with this lock held. */
+static GMutex style_lock;
+
+G_DEFINE_TYPE_WITH_PRIVATE (GtkSourceHighlighter, gtk_source_highlighter, G_TYPE_OBJECT)
+
+static void
+style_format_free (StyleFormat *format)
+{
+	g_free (format->html);
+	g_free (format->ansi);
+	g_slice_free (StyleFormat, format);
+}
+
+static void
+gtk_source_highlighter_constructed (GObject *object)
+{
+	GtkSourceHighlighter *highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+	GtkSourceEngine *engine = NULL;
+
+	if (highlighter->priv->language != NULL)
+		engine = _gtk_source_language_create_engine (highlighter->priv->language);
+
+	if (engine != NULL)
+		highlighter->priv->engine = GTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	G_OBJECT_CLASS (gtk_source_highlighter_parent_class)->constructed (object);
+}
+
+static void
+gtk_source_highlighter_dispose (GObject *object)
+{
+	GtkSourceHighlighter *highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	g_clear_object (&highlighter->priv->engine);
+	g_clear_object (&highlighter->priv->language);
+	g_clear_object (&highlighter->priv->scheme);
+
+	G_OBJECT_CLASS (gtk_source_highlighter_parent_class)->dispose (object);
+}
+
+static void
+gtk_source_highlighter_finalize (GObject *object)
+{
+	GtkSourceHighlighter *highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	g_hash_table_destroy (highlighter->priv->formats);
+
+	G_OBJECT_CLASS (gtk_source_highlighter_parent_class)->finalize (object);
+}
+
+static void
+gtk_source_highlighter_get_property (GObject    *object,
+				     guint       prop_id,
+				     GValue     *value,
+				     GParamSpec *pspec)
+{
+	GtkSourceHighlighter *highlighter;
+
+	g_return_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (object));
+
+	highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	switch (prop_id)
+	{
+		case PROP_LANGUAGE:
+			g_value_set_object (value, highlighter->priv->language);
+			break;
+
+		case PROP_STYLE_SCHEME:
+			g_value_set_object (value, highlighter->priv->scheme);
+			break;
+
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void
+gtk_source_highlighter_set_property (GObject      *object,
+				     guint         prop_id,
+				     const GValue *value,
+				     GParamSpec   *pspec)
+{
+	GtkSourceHighlighter *highlighter;
+
+	g_return_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (object));
+
+	highlighter = GTK_SOURCE_HIGHLIGHTER (object);
+
+	switch (prop_id)
+	{
+		case PROP_LANGUAGE:
+			highlighter->priv->language = g_value_dup_object (value);
+			break;
+
+		case PROP_STYLE_SCHEME:
+			highlighter->priv->scheme = g_value_dup_object (value);
+			break;
+
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+			break;
+	}
+}
+
+static void
+gtk_source_highlighter_class_init (GtkSourceHighlighterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->constructed = gtk_source_highlighter_constructed;
+	object_class->dispose = gtk_source_highlighter_dispose;
+	object_class->finalize = gtk_source_highlighter_finalize;
+	object_class->get_property = gtk_source_highlighter_get_property;
+	object_class->set_property = gtk_source_highlighter_set_property;
+
+	/**
+	 * GtkSourceHighlighter:language:
+	 *
+	 * The #GtkSourceLanguage used to analyze the text.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LANGUAGE,
+					 g_param_spec_object ("language",
+							      _("Language"),
+							      _("Language object to get highlighting patterns from"),
+							      GTK_SOURCE_TYPE_LANGUAGE,
+							      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+	/**
+	 * GtkSourceHighlighter:style-scheme:
+	 *
+	 * The #GtkSourceStyleScheme used by the HTML and ANSI writers, or
+	 * %NULL. Without a style scheme, HTML spans have the style ids as
+	 * classes, and no escape sequences are written.
+	 *
+	 * Since: 3.10
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_STYLE_SCHEME,
+					 g_param_spec_object ("style-scheme",
+							      _("Style scheme"),
+							      _("Style scheme"),
+							      GTK_SOURCE_TYPE_STYLE_SCHEME,
+							      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+}
+
+static void
+gtk_source_highlighter_init (GtkSourceHighlighter *highlighter)
+{
+	highlighter->priv = gtk_source_highlighter_get_instance_private (highlighter);
+
+	highlighter->priv->formats = g_hash_table_new_full (g_str_hash,
+							    g_str_equal,
+							    g_free,
+							    (GDestroyNotify) style_format_free);
+}
+
+/* Called with style_lock held. */
+static GtkSourceStyle *
+lookup_style (GtkSourceHighlighter *highlighter,
+	      const gchar          *style_id)
+{
+	GtkSourceStyle *style;
+	const gchar *map_to = style_id;
+	gint guard = 0;
+
+	style = gtk_source_style_scheme_get_style (highlighter->priv->scheme, style_id);
+
+	/* See set_tag_style() in the context engine. */
+	while (style == NULL && guard++ <= MAX_STYLE_DEPENDENCY_DEPTH)
+	{
+		map_to = gtk_source_language_get_style_fallback (highlighter->priv->language, map_to);
+		if (map_to == NULL)
+			break;
+
+		style = gtk_source_style_scheme_get_style (highlighter->priv->scheme, map_to);
+	}
+
+	return style;
+}
+
+static void
+append_ansi_color (GString     *params,
+		   const gchar *code,
+		   const gchar *color)
+{
+	GdkRGBA rgba;
+
+	if (!gdk_rgba_parse (&rgba, color))
+		return;
+
+	g_string_append_printf (params, "%s%s;2;%d;%d;%d",
+				params->len != 0 ? ";" : "",
+				code,
+				(gint) (rgba.red * 255 + 0.5),
+				(gint) (rgba.green * 255 + 0.5),
+				(gint) (rgba.blue * 255 + 0.5));
+}
+
+/* Called with style_lock held. */
+static StyleFormat *
+style_format_new (GtkSourceHighlighter *highlighter,
+		  const gchar          *style_id)
+{
+	StyleFormat *format;
+	GtkSourceStyle *style;
+	GString *css;
+	GString *params;
+	gchar *escaped;
+
+	format = g_slice_new0 (StyleFormat);
+
+	if (highlighter->priv->scheme == NULL)
+	{
+		escaped = g_strdelimit (g_markup_escape_text (style_id, -1), ":", '-');
+		format->html = g_strdup_printf ("<span class=\"%s\">", escaped);
+		g_free (escaped);
+
+		return format;
+	}
+
+	style = lookup_style (highlighter, style_id);
+
+	if (style == NULL)
+		return format;
+
+	css = g_string_new (NULL);
+	params = g_string_new (NULL);
+
+	if (style->mask & GTK_SOURCE_STYLE_USE_FOREGROUND)
+	{
+		g_string_append_printf (css, "color: %s; ", style->foreground);
+		append_ansi_color (params, "38", style->foreground);
+	}
+
+	if (style->mask & GTK_SOURCE_STYLE_USE_BACKGROUND)
+	{
+		g_string_append_printf (css, "background-color: %s; ", style->background);
+		append_ansi_color (params, "48", style->background);
+	}
+
+	if (style->mask & GTK_SOURCE_STYLE_USE_BOLD)
+	{
+		g_string_append_printf (css, "font-weight: %s; ", style->bold ? "bold" : "normal");
+
+		if (style->bold)
+			g_string_append (params, params->len != 0 ? ";1" : "1");
+	}
+
+	if (style->mask & GTK_SOURCE_STYLE_USE_ITALIC)
+	{
+		g_string_append_printf (css, "font-style: %s; ", style->italic ? "italic" : "normal");
+
+		if (style->italic)
+			g_string_append (params, params->len != 0 ? ";3" : "3");
+	}
+
+	if ((style->mask & GTK_SOURCE_STYLE_USE_UNDERLINE) && style->underline)
+	{
+		g_string_append (css, "text-decoration: underline; ");
+		g_string_append (params, params->len != 0 ? ";4" : "4");
+	}
+
+	if ((style->mask & GTK_SOURCE_STYLE_USE_STRIKETHROUGH) && style->strikethrough)
+	{
+		g_string_append (css, "text-decoration: line-through; ");
+		g_string_append (params, params->len != 0 ? ";9" : "9");
+	}
+
+	if (css->len != 0)
+	{
+		g_string_truncate (css, css->len - 1);
+		escaped = g_markup_escape_text (css->str, -1);
+		format->html = g_strdup_printf ("<span style=\"%s\">", escaped);
+		g_free (escaped);
+	}
+
+	if (params->len != 0)
+		format->ansi = g_strdup_printf ("\033[%sm", params->str);
+
+	g_string_free (css, TRUE);
+	g_string_free (params, TRUE);
+
+	return format;
+}
+
+/**
+ * get_style_format:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @style_id: a style id.
+ *
+ * Formats are made the first time a style is used, and then kept until
+ * the highlighter is finalized.
+ *
+ * Returns: the #StyleFormat of @style_id.
+ */
+static const StyleFormat *
+get_style_format (GtkSourceHighlighter *highlighter,
+		  const gchar          *style_id)
+{
+	StyleFormat *format;
+
+	g_mutex_lock (&style_lock);
+
+	format = g_hash_table_lookup (highlighter->priv->formats, style_id);
+
+	if (format == NULL)
+	{
+		format = style_format_new (highlighter, style_id);
+		g_hash_table_insert (highlighter->priv->formats, g_strdup (style_id), format);
+	}
+
+	g_mutex_unlock (&style_lock);
+
+	return format;
+}
+
+static void
+append_escaped (GString     *output,
+		const gchar *text,
+		gsize        length,
+		gboolean     json)
+{
+	const gchar *end = text + length;
+	const gchar *p;
+
+	for (p = text; p < end; p++)
+	{
+		const gchar *entity = NULL;
+
+		switch (*p)
+		{
+			case '&':
+				entity = json ? NULL : "&amp;";
+				break;
+			case '<':
+				entity = json ? NULL : "&lt;";
+				break;
+			case '>':
+				entity = json ? NULL : "&gt;";
+				break;
+			case '"':
+				entity = json ? "\\\"" : "&quot;";
+				break;
+			case '\\':
+				entity = json ? "\\\\" : NULL;
+				break;
+			default:
+				break;
+		}
+
+		if (entity != NULL)
+		{
+			g_string_append_len (output, text, p - text);
+			g_string_append (output, entity);
+			text = p + 1;
+		}
+	}
+
+	g_string_append_len (output, text, end - text);
+}
+
+static void
+html_run_cb (const gchar *text,
+	     gsize        length,
+	     const gchar *style_id,
+	     Writer      *writer)
+{
+	const StyleFormat *format = NULL;
+
+	if (style_id != NULL)
+		format = get_style_format (writer->highlighter, style_id);
+
+	if (format != NULL && format->html != NULL)
+		g_string_append (writer->output, format->html);
+
+	append_escaped (writer->output, text, length, FALSE);
+
+	if (format != NULL && format->html != NULL)
+		g_string_append (writer->output, "</span>");
+}
+
+static void
+ansi_run_cb (const gchar *text,
+	     gsize        length,
+	     const gchar *style_id,
+	     Writer      *writer)
+{
+	const StyleFormat *format = NULL;
+
+	if (style_id != NULL)
+		format = get_style_format (writer->highlighter, style_id);
+
+	if (format != NULL && format->ansi != NULL)
+		g_string_append (writer->output, format->ansi);
+
+	g_string_append_len (writer->output, text, length);
+
+	if (format != NULL && format->ansi != NULL)
+		g_string_append (writer->output, "\033[0m");
+}
+
+static void
+json_run_cb (const gchar *text,
+	     gsize        length,
+	     const gchar *style_id,
+	     Writer      *writer)
+{
+	if (style_id == NULL)
+		return;
+
+	g_string_append_printf (writer->output,
+				"%s{\"start\": %" G_GSIZE_FORMAT ", \"end\": %" G_GSIZE_FORMAT ", \"style\": \"",
+				writer->first ? "" : ",\n ",
+				(gsize) (text - writer->text),
+				(gsize) (text - writer->text) + length);
+	append_escaped (writer->output, style_id, strlen (style_id), TRUE);
+	g_string_append (writer->output, "\"}");
+
+	writer->first = FALSE;
+}
+
+static gchar *
+format_text (GtkSourceHighlighter  *highlighter,
+	     const gchar           *text,
+	     gssize                 length,
+	     GtkSourceStyleRunFunc  func,
+	     const gchar           *prefix,
+	     const gchar           *suffix,
+	     GError               **error)
+{
+	Writer writer;
+
+	if (length < 0)
+		length = strlen (text);
+
+	writer.highlighter = highlighter;
+	writer.output = g_string_sized_new (length * 2 + strlen (prefix) + strlen (suffix));
+	writer.text = text;
+	writer.first = TRUE;
+
+	g_string_append (writer.output, prefix);
+
+	if (!gtk_source_highlighter_highlight (highlighter, text, length, func, &writer, error))
+	{
+		g_string_free (writer.output, TRUE);
+		return NULL;
+	}
+
+	g_string_append (writer.output, suffix);
+
+	return g_string_free (writer.output, FALSE);
+}
+
+/**
+ * gtk_source_highlighter_new:
+ * @language: a #GtkSourceLanguage.
+ * @scheme: (allow-none): a #GtkSourceStyleScheme, or %NULL.
+ *
+ * Creates a highlighter for text in @language. The language file is
+ * parsed here, so that the highlighter can be used by other threads
+ * afterwards.
+ *
+ * Returns: a new #GtkSourceHighlighter.
+ * Since: 3.10
+ */
+GtkSourceHighlighter *
+gtk_source_highlighter_new (GtkSourceLanguage    *language,
+			    GtkSourceStyleScheme *scheme)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_LANGUAGE (language), NULL);
+	g_return_val_if_fail (scheme == NULL || GTK_SOURCE_IS_STYLE_SCHEME (scheme), NULL);
+
+	return g_object_new (GTK_SOURCE_TYPE_HIGHLIGHTER,
+			     "language", language,
+			     "style-scheme", scheme,
+			     NULL);
+}
+
+/**
+ * gtk_source_highlighter_get_language:
+ * @highlighter: a #GtkSourceHighlighter.
+ *
+ * Returns: (transfer none): the #GtkSourceLanguage of @highlighter.
+ * Since: 3.10
+ */
+GtkSourceLanguage *
+gtk_source_highlighter_get_language (GtkSourceHighlighter *highlighter)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), NULL);
+
+	return highlighter->priv->language;
+}
+
+/**
+ * gtk_source_highlighter_get_style_scheme:
+ * @highlighter: a #GtkSourceHighlighter.
+ *
+ * Returns: (transfer none): the #GtkSourceStyleScheme of @highlighter,
+ * or %NULL.
+ * Since: 3.10
+ */
+GtkSourceStyleScheme *
+gtk_source_highlighter_get_style_scheme (GtkSourceHighlighter *highlighter)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), NULL);
+
+	return highlighter->priv->scheme;
+}
+
+/**
+ * gtk_source_highlighter_highlight:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @text: UTF-8 text.
+ * @length: the length of @text in bytes, or -1 if it is nul-terminated.
+ * @func: (scope call): function called for each run of text.
+ * @user_data: user data passed to @func.
+ * @error: location for a #GError, or %NULL.
+ *
+ * Analyzes the whole @text and calls @func for the runs of text which
+ * have the same style, in order. The style of a run is the style of
+ * the innermost context or sub pattern containing it, the one whose tag
+ * would be shown in a #GtkSourceBuffer. @text does not need to be
+ * nul-terminated, so it may be the contents of a #GMappedFile.
+ *
+ * This function may be called by several threads at once.
+ *
+ * Returns: %TRUE on success, %FALSE if @text is not valid UTF-8 or
+ * contains nul characters.
+ * Since: 3.10
+ */
+gboolean
+gtk_source_highlighter_highlight (GtkSourceHighlighter   *highlighter,
+				  const gchar            *text,
+				  gssize                  length,
+				  GtkSourceStyleRunFunc   func,
+				  gpointer                user_data,
+				  GError                **error)
+{
+	const gchar *end;
+
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), FALSE);
+	g_return_val_if_fail (text != NULL, FALSE);
+	g_return_val_if_fail (func != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	if (length < 0)
+		length = strlen (text);
+
+	if (!g_utf8_validate (text, length, &end))
+	{
+		g_set_error (error,
+			     G_CONVERT_ERROR,
+			     G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+			     _("The text is not valid UTF-8 at byte %d"),
+			     (gint) (end - text));
+		return FALSE;
+	}
+
+	if (length == 0)
+		return TRUE;
+
+	if (highlighter->priv->engine != NULL)
+	{
+		_gtk_source_context_engine_highlight_text (highlighter->priv->engine,
+							   text,
+							   length,
+							   func,
+							   user_data);
+	}
+	else
+	{
+		func (text, length, NULL, user_data);
+	}
+
+	return TRUE;
+}
+
+/**
+ * gtk_source_highlighter_highlight_file:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @filename: (type filename): the name of a UTF-8 text file.
+ * @func: (scope call): function called for each run of text.
+ * @user_data: user data passed to @func.
+ * @error: location for a #GError, or %NULL.
+ *
+ * Maps @filename into memory with #GMappedFile and highlights its
+ * contents, see gtk_source_highlighter_highlight(). The text given to
+ * @func is only valid during the call.
+ *
+ * Returns: %TRUE on success, %FALSE if the file cannot be mapped or
+ * is not valid UTF-8.
+ * Since: 3.10
+ */
+gboolean
+gtk_source_highlighter_highlight_file (GtkSourceHighlighter   *highlighter,
+				       const gchar            *filename,
+				       GtkSourceStyleRunFunc   func,
+				       gpointer                user_data,
+				       GError                **error)
+{
+	GMappedFile *file;
+	const gchar *contents;
+	gsize length;
+	gboolean ret;
+
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+	g_return_val_if_fail (func != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	file = g_mapped_file_new (filename, FALSE, error);
+
+	if (file == NULL)
+		return FALSE;
+
+	contents = g_mapped_file_get_contents (file);
+	length = g_mapped_file_get_length (file);
+
+	/* Empty files are not mapped. */
+	if (contents == NULL)
+	{
+		contents = "";
+		length = 0;
+	}
+
+	ret = gtk_source_highlighter_highlight (highlighter, contents, length, func, user_data, error);
+
+	g_mapped_file_unref (file);
+	return ret;
+}
+
+/**
+ * gtk_source_highlighter_to_html:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @text: UTF-8 text.
+ * @length: the length of @text in bytes, or -1 if it is nul-terminated.
+ * @error: location for a #GError, or %NULL.
+ *
+ * Highlights @text as HTML: a &lt;pre&gt; element where the styled runs
+ * are in &lt;span&gt; elements. The spans have inline styles from the
+ * style scheme of @highlighter, or, without one, the style ids as classes,
+ * with ':' replaced by '-'.
+ *
+ * Returns: the HTML to be freed with g_free(), or %NULL on error.
+ * Since: 3.10
+ */
+gchar *
+gtk_source_highlighter_to_html (GtkSourceHighlighter  *highlighter,
+				const gchar           *text,
+				gssize                 length,
+				GError               **error)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), NULL);
+	g_return_val_if_fail (text != NULL, NULL);
+
+	return format_text (highlighter, text, length,
+			    (GtkSourceStyleRunFunc) html_run_cb,
+			    "<pre>", "</pre>\n",
+			    error);
+}
+
+/**
+ * gtk_source_highlighter_to_ansi:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @text: UTF-8 text.
+ * @length: the length of @text in bytes, or -1 if it is nul-terminated.
+ * @error: location for a #GError, or %NULL.
+ *
+ * Highlights @text for a terminal: the styled runs are surrounded by
+ * ANSI escape sequences setting the colors (in 24 bits) and the font of
+ * the style scheme of @highlighter. Without a style scheme, the text is
+ * returned as is.
+ *
+ * Returns: the text to be freed with g_free(), or %NULL on error.
+ * Since: 3.10
+ */
+gchar *
+gtk_source_highlighter_to_ansi (GtkSourceHighlighter  *highlighter,
+				const gchar           *text,
+				gssize                 length,
+				GError               **error)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), NULL);
+	g_return_val_if_fail (text != NULL, NULL);
+
+	return format_text (highlighter, text, length,
+			    (GtkSourceStyleRunFunc) ansi_run_cb,
+			    "", "",
+			    error);
+}
+
+/**
+ * gtk_source_highlighter_to_json:
+ * @highlighter: a #GtkSourceHighlighter.
+ * @text: UTF-8 text.
+ * @length: the length of @text in bytes, or -1 if it is nul-terminated.
+ * @error: location for a #GError, or %NULL.
+ *
+ * Highlights @text as a JSON array of the styled runs, in order. Each
+ * run is an object with the offsets in bytes of its "start" and "end",
+ * and the id of its "style". The text itself is not included, and the
+ * style scheme of @highlighter is not used.
+ *
+ * Returns: the JSON text to be freed with g_free(), or %NULL on error.
+ * Since: 3.10
+ */
+gchar *
+gtk_source_highlighter_to_json (GtkSourceHighlighter  *highlighter,
+				const gchar           *text,
+				gssize                 length,
+				GError               **error)
+{
+	g_return_val_if_fail (GTK_SOURCE_IS_HIGHLIGHTER (highlighter), NULL);
+	g_return_val_if_fail (text != NULL, NULL);
+
+	return format_text (highlighter, text, length,
+			    (GtkSourceStyleRunFunc) json_run_cb,
+			    "[", "]\n",
+			    error);
+}
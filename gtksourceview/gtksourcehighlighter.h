@@ -0,0 +1,109 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*- */
+/* gtksourcehighlighter.h
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __GTK_SOURCE_HIGHLIGHTER_H__
+#define __GTK_SOURCE_HIGHLIGHTER_H__
+
+#include <glib-object.h>
+#include <gtksourceview/gtksourcetypes.h>
+
+G_BEGIN_DECLS
+
+#define GTK_SOURCE_TYPE_HIGHLIGHTER             (gtk_source_highlighter_get_type ())
+#define GTK_SOURCE_HIGHLIGHTER(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), GTK_SOURCE_TYPE_HIGHLIGHTER, GtkSourceHighlighter))
+#define GTK_SOURCE_HIGHLIGHTER_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), GTK_SOURCE_TYPE_HIGHLIGHTER, GtkSourceHighlighterClass))
+#define GTK_SOURCE_IS_HIGHLIGHTER(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GTK_SOURCE_TYPE_HIGHLIGHTER))
+#define GTK_SOURCE_IS_HIGHLIGHTER_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), GTK_SOURCE_TYPE_HIGHLIGHTER))
+#define GTK_SOURCE_HIGHLIGHTER_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS ((obj), GTK_SOURCE_TYPE_HIGHLIGHTER, GtkSourceHighlighterClass))
+
+typedef struct _GtkSourceHighlighterClass    GtkSourceHighlighterClass;
+typedef struct _GtkSourceHighlighterPrivate  GtkSourceHighlighterPrivate;
+
+/**
+ * GtkSourceStyleRunFunc:
+ * @text: the beginning of the run, in the highlighted text.
+ * @length: the length of the run in bytes.
+ * @style_id: (allow-none): the id of the style of the run, or %NULL.
+ * @user_data: user data passed to gtk_source_highlighter_highlight().
+ *
+ * Function called by gtk_source_highlighter_highlight() for each run of
+ * text which has the same style. The runs follow each other and cover
+ * the whole text.
+ *
+ * Since: 3.10
+ */
+typedef void (* GtkSourceStyleRunFunc) (const gchar *text,
+					gsize        length,
+					const gchar *style_id,
+					gpointer     user_data);
+
+struct _GtkSourceHighlighter
+{
+	GObject parent;
+
+	GtkSourceHighlighterPrivate *priv;
+};
+
+struct _GtkSourceHighlighterClass
+{
+	GObjectClass parent_class;
+
+	gpointer padding[10];
+};
+
+GType			 gtk_source_highlighter_get_type		(void) G_GNUC_CONST;
+
+GtkSourceHighlighter	*gtk_source_highlighter_new			(GtkSourceLanguage	 *language,
+									 GtkSourceStyleScheme	 *scheme);
+
+GtkSourceLanguage	*gtk_source_highlighter_get_language		(GtkSourceHighlighter	 *highlighter);
+
+GtkSourceStyleScheme	*gtk_source_highlighter_get_style_scheme	(GtkSourceHighlighter	 *highlighter);
+
+gboolean		 gtk_source_highlighter_highlight		(GtkSourceHighlighter	 *highlighter,
+									 const gchar		 *text,
+									 gssize			  length,
+									 GtkSourceStyleRunFunc	  func,
+									 gpointer		  user_data,
+									 GError			**error);
+
+gboolean		 gtk_source_highlighter_highlight_file		(GtkSourceHighlighter	 *highlighter,
+									 const gchar		 *filename,
+									 GtkSourceStyleRunFunc	  func,
+									 gpointer		  user_data,
+									 GError			**error);
+
+gchar			*gtk_source_highlighter_to_html			(GtkSourceHighlighter	 *highlighter,
+									 const gchar		 *text,
+									 gssize			  length,
+									 GError			**error);
+
+gchar			*gtk_source_highlighter_to_ansi			(GtkSourceHighlighter	 *highlighter,
+									 const gchar		 *text,
+									 gssize			  length,
+									 GError			**error);
+
+gchar			*gtk_source_highlighter_to_json			(GtkSourceHighlighter	 *highlighter,
+									 const gchar		 *text,
+									 gssize			  length,
+									 GError			**error);
+
+G_END_DECLS
+
+#endif /* __GTK_SOURCE_HIGHLIGHTER_H__ */
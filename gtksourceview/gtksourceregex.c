@@ -20,8 +20,16 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <string.h>
 #include <glib.h>
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
 #include "gtksourceview-i18n.h"
 #include "gtksourceview-utils.h"
 #include "gtksourceregex.h"
@@ -29,21 +37,75 @@
 /*
  * GRegex wrapper which adds a few features needed for syntax highlighting,
  * in particular resolving "\%{...@start}" and forbidding the use of \C.
+ *
+ * When built with PCRE2, patterns are also compiled with its JIT compiler
+ * and matched with it, since GRegex does not support JIT. The GRegex is
+ * still created: it validates the pattern the same way as before, and it
+ * is used when JIT is not available, or when the JIT stack is exhausted.
+ * It is optimized only if it is the one used for matching.
+ *
+ * PCRE2 also tells which bytes can start a match. This is used to skip
+ * positions where the regex cannot match without calling the regex
+ * engine at all, which is what happens for most of the positions where
+ * the context engine tries to match the start of child contexts.
+ *
+ * Setting the GTK_SOURCE_REGEX_DISABLE_JIT environment variable turns
+ * off both, leaving plain GRegex matching.
  */
 
+#ifdef HAVE_PCRE2
+/* JIT compiled pattern, shared between regexes created from the same
+ * pattern by _gtk_source_regex_resolve(), possibly in different threads. */
+typedef struct _JitCode JitCode;
+
+struct _JitCode
+{
+	pcre2_code *code;
+	gint ref_count;
+};
+#endif
+
+/* Number of threads which may match regexes at the same time without
+ * a lock, in addition to the ones which hold the lock of the language,
+ * see _gtk_source_regex_acquire_thread_slot(). */
+#define MAX_THREAD_SLOTS 32
+
+/* State of the last match done by a thread. */
+typedef struct _RegexMatch RegexMatch;
+
+struct _RegexMatch
+{
+	GMatchInfo *match;
+#ifdef HAVE_PCRE2
+	/* Allocated once and reused by every match. */
+	pcre2_match_data *match_data;
+	const gchar *subject;
+	gint n_matched;
+#endif
+
+	/* Whether the last match was done with JIT. */
+	guint jit_matched : 1;
+};
+
+static gchar	*fetch_named	(GtkSourceRegex *regex,
+				 const gchar    *name);
+
 /* Regex used to match "\%{...@start}". */
 static GRegex *
 get_start_ref_regex (void)
 {
-	static GRegex *start_ref_regex = NULL;
+	static gsize start_ref_regex = 0;
 
-	if (start_ref_regex == NULL)
+	if (g_once_init_enter (&start_ref_regex))
 	{
-		start_ref_regex = g_regex_new ("(?<!\\\\)(\\\\\\\\)*\\\\%\\{(.*?)@start\\}",
-					       G_REGEX_OPTIMIZE, 0, NULL);
+		GRegex *regex;
+
+		regex = g_regex_new ("(?<!\\\\)(\\\\\\\\)*\\\\%\\{(.*?)@start\\}",
+				     G_REGEX_OPTIMIZE, 0, NULL);
+		g_once_init_leave (&start_ref_regex, (gsize) regex);
 	}
 
-	return start_ref_regex;
+	return (GRegex *) start_ref_regex;
 }
 
 struct _GtkSourceRegex
@@ -55,14 +117,65 @@ struct _GtkSourceRegex
 		} info;
 		struct {
 			GRegex *regex;
-			GMatchInfo *match;
+
+			/* The last match of the threads which hold the
+			 * lock of the language, and of the threads which
+			 * have their own slot, allocated on first use. */
+			RegexMatch match;
+			RegexMatch *thread_matches;
+#ifdef HAVE_PCRE2
+			JitCode *jit;
+
+			/* Bitmap of bytes which may start a match, valid
+			 * if has_first_bytes is set. first_byte is the
+			 * only byte in the set, or -1. */
+			guint8 first_bytes[32];
+			gint first_byte;
+			guint has_first_bytes : 1;
+			guint anchored : 1;
+#endif
 		} regex;
 	} u;
 
-	guint ref_count;
+	gint ref_count;
 	guint resolved : 1;
 };
 
+/* Maximum number of expanded regexes kept by _gtk_source_regex_resolve(). */
+#define RESOLVE_CACHE_SIZE 512
+
+/* Regexes compiled by _gtk_source_regex_resolve(), indexed by expanded
+ * pattern and flags. The compiled code is what gets shared: every resolved
+ * GtkSourceRegex still has its own match info, so the cache can be used
+ * by engines of different languages at the same time. */
+typedef struct _ResolveCacheEntry ResolveCacheEntry;
+
+struct _ResolveCacheEntry
+{
+	gchar *pattern;
+	GRegexCompileFlags flags;
+	GRegex *regex;
+#ifdef HAVE_PCRE2
+	JitCode *jit;
+	guint8 first_bytes[32];
+	gint first_byte;
+	guint has_first_bytes : 1;
+	guint anchored : 1;
+#endif
+
+	/* Link in resolve_cache.queue, most recently used first. */
+	GList link;
+};
+
+static struct
+{
+	GMutex lock;
+	GHashTable *entries;
+	GQueue queue;
+	guint hits;
+	guint misses;
+} resolve_cache;
+
 /* Check whether pattern contains \C escape sequence,
  * which means "single byte" in pcre and naturally leads
  * to crash if used for highlighting.
@@ -98,6 +211,413 @@ find_single_byte_escape (const gchar *string)
 	return FALSE;
 }
 
+#ifdef HAVE_PCRE2
+/* Set by _gtk_source_regex_set_jit_enabled(), or -1. */
+static gint jit_enabled_override = -1;
+
+/* Whether PCRE2 is used at all, see GTK_SOURCE_REGEX_DISABLE_JIT. */
+static gboolean
+jit_enabled (void)
+{
+	static gsize enabled = 0;
+	gint override = g_atomic_int_get (&jit_enabled_override);
+
+	if (override >= 0)
+		return override;
+
+	if (g_once_init_enter (&enabled))
+	{
+		gsize value = g_getenv ("GTK_SOURCE_REGEX_DISABLE_JIT") == NULL ? 1 : 2;
+		g_once_init_leave (&enabled, value);
+	}
+
+	return enabled == 1;
+}
+
+/**
+ * compile_pcre2:
+ * @pattern: the regular expression.
+ * @flags: compile options for @pattern, as passed to g_regex_new().
+ *
+ * Compiles @pattern with the options GRegex would use.
+ *
+ * Returns: the compiled pattern, or %NULL if some of @flags cannot be
+ * translated or if PCRE2 does not accept the pattern.
+ */
+static pcre2_code *
+compile_pcre2 (const gchar        *pattern,
+	       GRegexCompileFlags  flags)
+{
+	static const struct {
+		GRegexCompileFlags flag;
+		guint32 option;
+	} options_map[] = {
+		{ G_REGEX_CASELESS, PCRE2_CASELESS },
+		{ G_REGEX_MULTILINE, PCRE2_MULTILINE },
+		{ G_REGEX_DOTALL, PCRE2_DOTALL },
+		{ G_REGEX_EXTENDED, PCRE2_EXTENDED },
+		{ G_REGEX_ANCHORED, PCRE2_ANCHORED },
+		{ G_REGEX_DOLLAR_ENDONLY, PCRE2_DOLLAR_ENDONLY },
+		{ G_REGEX_UNGREEDY, PCRE2_UNGREEDY },
+		{ G_REGEX_NO_AUTO_CAPTURE, PCRE2_NO_AUTO_CAPTURE },
+		{ G_REGEX_FIRSTLINE, PCRE2_FIRSTLINE },
+		{ G_REGEX_DUPNAMES, PCRE2_DUPNAMES }
+	};
+	const GRegexCompileFlags newline_flags = G_REGEX_NEWLINE_CR | G_REGEX_NEWLINE_LF |
+						 G_REGEX_NEWLINE_ANYCRLF;
+	GRegexCompileFlags known_flags = G_REGEX_OPTIMIZE | G_REGEX_BSR_ANYCRLF | newline_flags;
+	pcre2_compile_context *context;
+	pcre2_code *code;
+	guint32 options = PCRE2_UTF | PCRE2_UCP | PCRE2_NO_UTF_CHECK;
+	guint32 newline;
+	PCRE2_SIZE error_offset;
+	gint error_code;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (options_map); i++)
+	{
+		known_flags |= options_map[i].flag;
+		if (flags & options_map[i].flag)
+			options |= options_map[i].option;
+	}
+
+	/* G_REGEX_RAW, G_REGEX_JAVASCRIPT_COMPAT... */
+	if ((flags & ~known_flags) != 0)
+		return NULL;
+
+	switch (flags & newline_flags)
+	{
+		case G_REGEX_NEWLINE_CR:
+			newline = PCRE2_NEWLINE_CR;
+			break;
+		case G_REGEX_NEWLINE_LF:
+			newline = PCRE2_NEWLINE_LF;
+			break;
+		case G_REGEX_NEWLINE_CRLF:
+			newline = PCRE2_NEWLINE_CRLF;
+			break;
+		case G_REGEX_NEWLINE_ANYCRLF:
+			newline = PCRE2_NEWLINE_ANYCRLF;
+			break;
+		default:
+			newline = PCRE2_NEWLINE_ANY;
+			break;
+	}
+
+	context = pcre2_compile_context_create (NULL);
+	pcre2_set_newline (context, newline);
+	pcre2_set_bsr (context, (flags & G_REGEX_BSR_ANYCRLF) ? PCRE2_BSR_ANYCRLF :
+							       PCRE2_BSR_UNICODE);
+
+	code = pcre2_compile ((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+			      options, &error_code, &error_offset, context);
+	pcre2_compile_context_free (context);
+
+	return code;
+}
+
+/**
+ * jit_code_new:
+ * @pattern: the regular expression.
+ * @flags: compile options for @pattern, as passed to g_regex_new().
+ *
+ * Returns: a new #JitCode, or %NULL if JIT is not available or the
+ * pattern cannot be compiled by PCRE2.
+ */
+static JitCode *
+jit_code_new (const gchar        *pattern,
+	      GRegexCompileFlags  flags)
+{
+	pcre2_code *code;
+	JitCode *jit;
+
+	if (!jit_enabled ())
+		return NULL;
+
+	code = compile_pcre2 (pattern, flags);
+
+	if (code == NULL)
+		return NULL;
+
+	if (pcre2_jit_compile (code, PCRE2_JIT_COMPLETE) != 0)
+	{
+		pcre2_code_free (code);
+		return NULL;
+	}
+
+	jit = g_slice_new (JitCode);
+	jit->code = code;
+	jit->ref_count = 1;
+
+	return jit;
+}
+
+static JitCode *
+jit_code_ref (JitCode *jit)
+{
+	if (jit != NULL)
+		g_atomic_int_inc (&jit->ref_count);
+	return jit;
+}
+
+static void
+jit_code_unref (JitCode *jit)
+{
+	if (jit != NULL && g_atomic_int_dec_and_test (&jit->ref_count))
+	{
+		pcre2_code_free (jit->code);
+		g_slice_free (JitCode, jit);
+	}
+}
+
+#define FIRST_BYTE_IS_SET(set,byte) (((set)[(guchar) (byte) >> 3] & (1 << ((guchar) (byte) & 7))) != 0)
+#define FIRST_BYTE_SET(set,byte) ((set)[(guchar) (byte) >> 3] |= (1 << ((guchar) (byte) & 7)))
+
+/**
+ * compute_first_bytes:
+ * @regex: a resolved #GtkSourceRegex.
+ * @pattern: the regular expression.
+ * @flags: compile options for @pattern, as passed to g_regex_new().
+ *
+ * Asks PCRE2 which bytes can start a match of @pattern. PCRE2 only
+ * studies unanchored patterns, so anchored ones are compiled again
+ * without G_REGEX_ANCHORED for that. Otherwise the JIT code of @regex
+ * is used if there is one.
+ */
+static void
+compute_first_bytes (GtkSourceRegex     *regex,
+		     const gchar        *pattern,
+		     GRegexCompileFlags  flags)
+{
+	guint8 *set = regex->u.regex.first_bytes;
+	pcre2_code *code;
+	guint32 type = 0;
+	gint n_bytes = 0;
+	gint byte;
+
+	regex->u.regex.anchored = (flags & G_REGEX_ANCHORED) != 0;
+	regex->u.regex.has_first_bytes = FALSE;
+
+	if (!jit_enabled ())
+		return;
+
+	if (regex->u.regex.jit != NULL && !regex->u.regex.anchored)
+		code = regex->u.regex.jit->code;
+	else
+		code = compile_pcre2 (pattern, flags & ~G_REGEX_ANCHORED);
+
+	if (code == NULL)
+		return;
+
+	memset (set, 0, sizeof (regex->u.regex.first_bytes));
+	pcre2_pattern_info (code, PCRE2_INFO_FIRSTCODETYPE, &type);
+
+	if (type == 1)
+	{
+		guint32 unit;
+
+		pcre2_pattern_info (code, PCRE2_INFO_FIRSTCODEUNIT, &unit);
+		FIRST_BYTE_SET (set, unit);
+
+		/* PCRE2 does not tell whether the first code unit is
+		 * caseless. Some non-ASCII characters match ASCII letters
+		 * caselessly, so add them too. */
+		if (g_ascii_isalpha (unit) || unit >= 0x80)
+		{
+			FIRST_BYTE_SET (set, g_ascii_tolower (unit));
+			FIRST_BYTE_SET (set, g_ascii_toupper (unit));
+
+			for (byte = 0xC0; byte <= 0xFF; byte++)
+				FIRST_BYTE_SET (set, byte);
+		}
+
+		regex->u.regex.has_first_bytes = TRUE;
+	}
+	else if (type == 0)
+	{
+		const guint8 *bitmap = NULL;
+
+		pcre2_pattern_info (code, PCRE2_INFO_FIRSTBITMAP, &bitmap);
+
+		if (bitmap != NULL)
+		{
+			memcpy (set, bitmap, sizeof (regex->u.regex.first_bytes));
+			regex->u.regex.has_first_bytes = TRUE;
+		}
+	}
+
+	if (regex->u.regex.jit == NULL || code != regex->u.regex.jit->code)
+		pcre2_code_free (code);
+
+	regex->u.regex.first_byte = -1;
+
+	if (!regex->u.regex.has_first_bytes)
+		return;
+
+	for (byte = 0; byte < 256; byte++)
+	{
+		if (FIRST_BYTE_IS_SET (set, byte))
+		{
+			regex->u.regex.first_byte = byte;
+			n_bytes++;
+		}
+	}
+
+	if (n_bytes != 1)
+		regex->u.regex.first_byte = -1;
+}
+
+/**
+ * skip_to_first_byte:
+ * @regex: a resolved #GtkSourceRegex with first bytes.
+ * @line: the text to match.
+ * @byte_length: the length of @line.
+ * @byte_pos: where the match would start.
+ *
+ * Returns: the first position from @byte_pos where @regex may match,
+ * or -1 if it cannot match.
+ */
+static gint
+skip_to_first_byte (GtkSourceRegex *regex,
+		    const gchar    *line,
+		    gint            byte_length,
+		    gint            byte_pos)
+{
+	const guint8 *set = regex->u.regex.first_bytes;
+	const gchar *found;
+	gint pos;
+
+	if (regex->u.regex.anchored)
+	{
+		if (byte_pos < byte_length && FIRST_BYTE_IS_SET (set, line[byte_pos]))
+			return byte_pos;
+		return -1;
+	}
+
+	if (regex->u.regex.first_byte >= 0)
+	{
+		if (byte_pos >= byte_length)
+			return -1;
+
+		found = memchr (line + byte_pos, regex->u.regex.first_byte, byte_length - byte_pos);
+		return found != NULL ? found - line : -1;
+	}
+
+	for (pos = byte_pos; pos < byte_length; pos++)
+	{
+		if (FIRST_BYTE_IS_SET (set, line[pos]))
+			return pos;
+	}
+
+	return -1;
+}
+#endif /* HAVE_PCRE2 */
+
+/* Slots in use, see _gtk_source_regex_acquire_thread_slot(). */
+static struct
+{
+	GMutex lock;
+	guint32 used;
+} thread_slots;
+
+/* Slot of the calling thread, or 0. */
+static GPrivate thread_slot;
+
+/**
+ * _gtk_source_regex_acquire_thread_slot:
+ *
+ * A regex keeps the state of its last match, so it may be matched by
+ * one thread at a time: the context engine does it with the lock of
+ * the language held. A thread which uses a slot of its own, see
+ * _gtk_source_regex_set_thread_slot(), keeps its matches apart from
+ * the other threads, and may match regexes without the lock.
+ *
+ * Returns: a free slot, or 0 if all of them are in use.
+ */
+gint
+_gtk_source_regex_acquire_thread_slot (void)
+{
+	gint slot;
+
+	g_mutex_lock (&thread_slots.lock);
+
+	for (slot = 1; slot < MAX_THREAD_SLOTS; slot++)
+	{
+		if ((thread_slots.used & (1u << slot)) == 0)
+		{
+			thread_slots.used |= 1u << slot;
+			break;
+		}
+	}
+
+	g_mutex_unlock (&thread_slots.lock);
+
+	return slot < MAX_THREAD_SLOTS ? slot : 0;
+}
+
+void
+_gtk_source_regex_release_thread_slot (gint slot)
+{
+	g_return_if_fail (slot > 0 && slot < MAX_THREAD_SLOTS);
+
+	g_mutex_lock (&thread_slots.lock);
+	thread_slots.used &= ~(1u << slot);
+	g_mutex_unlock (&thread_slots.lock);
+}
+
+/**
+ * _gtk_source_regex_set_thread_slot:
+ * @slot: a slot returned by _gtk_source_regex_acquire_thread_slot(),
+ * or 0.
+ *
+ * Makes the calling thread keep the state of its matches in @slot.
+ * With 0 it uses again the state shared by the threads which hold
+ * the lock.
+ */
+void
+_gtk_source_regex_set_thread_slot (gint slot)
+{
+	g_private_set (&thread_slot, GINT_TO_POINTER (slot));
+}
+
+/* The state of the last match of @regex in the calling thread. */
+static RegexMatch *
+get_match (GtkSourceRegex *regex)
+{
+	gint slot = GPOINTER_TO_INT (g_private_get (&thread_slot));
+	RegexMatch *matches;
+
+	if (slot == 0)
+		return &regex->u.regex.match;
+
+	matches = g_atomic_pointer_get (&regex->u.regex.thread_matches);
+
+	if (matches == NULL)
+	{
+		matches = g_new0 (RegexMatch, MAX_THREAD_SLOTS);
+
+		if (!g_atomic_pointer_compare_and_exchange (&regex->u.regex.thread_matches,
+							    NULL, matches))
+		{
+			g_free (matches);
+			matches = g_atomic_pointer_get (&regex->u.regex.thread_matches);
+		}
+	}
+
+	return &matches[slot];
+}
+
+static void
+regex_match_clear (RegexMatch *m)
+{
+	if (m->match != NULL)
+		g_match_info_free (m->match);
+#ifdef HAVE_PCRE2
+	if (m->match_data != NULL)
+		pcre2_match_data_free (m->match_data);
+#endif
+}
+
 /**
  * gtk_source_regex_new:
  * @pattern: the regular expression.
@@ -137,16 +657,37 @@ _gtk_source_regex_new (const gchar           *pattern,
 	}
 	else
 	{
+		GRegexCompileFlags regex_flags = flags | G_REGEX_NEWLINE_LF;
+
 		regex->resolved = TRUE;
-		regex->u.regex.regex = g_regex_new (pattern,
-						    flags | G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF, 0,
-						    error);
+
+#ifdef HAVE_PCRE2
+		/* With JIT code the GRegex is rarely matched, optimizing
+		 * it would only make compiling slower. */
+		regex->u.regex.jit = jit_code_new (pattern, regex_flags);
+
+		if (regex->u.regex.jit == NULL)
+			regex_flags |= G_REGEX_OPTIMIZE;
+#else
+		regex_flags |= G_REGEX_OPTIMIZE;
+#endif
+
+		regex->u.regex.regex = g_regex_new (pattern, regex_flags, 0, error);
 
 		if (regex->u.regex.regex == NULL)
 		{
+#ifdef HAVE_PCRE2
+			jit_code_unref (regex->u.regex.jit);
+#endif
 			g_slice_free (GtkSourceRegex, regex);
 			regex = NULL;
 		}
+#ifdef HAVE_PCRE2
+		else
+		{
+			compute_first_bytes (regex, pattern, flags | G_REGEX_NEWLINE_LF);
+		}
+#endif
 	}
 
 	return regex;
@@ -156,20 +697,32 @@ GtkSourceRegex *
 _gtk_source_regex_ref (GtkSourceRegex *regex)
 {
 	if (regex != NULL)
-		regex->ref_count++;
+		g_atomic_int_inc (&regex->ref_count);
 	return regex;
 }
 
 void
 _gtk_source_regex_unref (GtkSourceRegex *regex)
 {
-	if (regex != NULL && --regex->ref_count == 0)
+	if (regex != NULL && g_atomic_int_dec_and_test (&regex->ref_count))
 	{
 		if (regex->resolved)
 		{
 			g_regex_unref (regex->u.regex.regex);
-			if (regex->u.regex.match)
-				g_match_info_free (regex->u.regex.match);
+			regex_match_clear (&regex->u.regex.match);
+
+			if (regex->u.regex.thread_matches != NULL)
+			{
+				gint slot;
+
+				for (slot = 1; slot < MAX_THREAD_SLOTS; slot++)
+					regex_match_clear (&regex->u.regex.thread_matches[slot]);
+
+				g_free (regex->u.regex.thread_matches);
+			}
+#ifdef HAVE_PCRE2
+			jit_code_unref (regex->u.regex.jit);
+#endif
 		}
 		else
 		{
@@ -179,6 +732,190 @@ _gtk_source_regex_unref (GtkSourceRegex *regex)
 	}
 }
 
+static guint
+resolve_cache_entry_hash (gconstpointer key)
+{
+	const ResolveCacheEntry *entry = key;
+	return g_str_hash (entry->pattern) ^ entry->flags;
+}
+
+static gboolean
+resolve_cache_entry_equal (gconstpointer a,
+			   gconstpointer b)
+{
+	const ResolveCacheEntry *entry_a = a;
+	const ResolveCacheEntry *entry_b = b;
+
+	return entry_a->flags == entry_b->flags &&
+	       strcmp (entry_a->pattern, entry_b->pattern) == 0;
+}
+
+static void
+resolve_cache_entry_free (ResolveCacheEntry *entry)
+{
+	g_regex_unref (entry->regex);
+#ifdef HAVE_PCRE2
+	jit_code_unref (entry->jit);
+#endif
+	g_free (entry->pattern);
+	g_slice_free (ResolveCacheEntry, entry);
+}
+
+/**
+ * resolve_cache_lookup:
+ * @pattern: expanded pattern.
+ * @flags: compile flags of @pattern.
+ *
+ * Looks for a regex already compiled from @pattern and @flags.
+ *
+ * Returns: a new resolved #GtkSourceRegex sharing the cached #GRegex,
+ * or %NULL.
+ */
+static GtkSourceRegex *
+resolve_cache_lookup (const gchar        *pattern,
+		      GRegexCompileFlags  flags)
+{
+	ResolveCacheEntry key;
+	ResolveCacheEntry *entry = NULL;
+	GtkSourceRegex *regex = NULL;
+
+	key.pattern = (gchar *) pattern;
+	key.flags = flags;
+
+	g_mutex_lock (&resolve_cache.lock);
+
+	if (resolve_cache.entries != NULL)
+		entry = g_hash_table_lookup (resolve_cache.entries, &key);
+
+	if (entry != NULL)
+	{
+		g_queue_unlink (&resolve_cache.queue, &entry->link);
+		g_queue_push_head_link (&resolve_cache.queue, &entry->link);
+
+		regex = g_slice_new0 (GtkSourceRegex);
+		regex->ref_count = 1;
+		regex->resolved = TRUE;
+		regex->u.regex.regex = g_regex_ref (entry->regex);
+#ifdef HAVE_PCRE2
+		regex->u.regex.jit = jit_code_ref (entry->jit);
+		memcpy (regex->u.regex.first_bytes, entry->first_bytes, sizeof (entry->first_bytes));
+		regex->u.regex.first_byte = entry->first_byte;
+		regex->u.regex.has_first_bytes = entry->has_first_bytes;
+		regex->u.regex.anchored = entry->anchored;
+#endif
+
+		resolve_cache.hits++;
+	}
+	else
+	{
+		resolve_cache.misses++;
+	}
+
+	g_mutex_unlock (&resolve_cache.lock);
+
+	return regex;
+}
+
+/**
+ * resolve_cache_store:
+ * @pattern: expanded pattern.
+ * @flags: compile flags of @pattern.
+ * @regex: resolved regex compiled from @pattern.
+ *
+ * Adds @regex to the cache, dropping the least recently used entry
+ * if the cache is full.
+ */
+static void
+resolve_cache_store (const gchar        *pattern,
+		     GRegexCompileFlags  flags,
+		     GtkSourceRegex     *regex)
+{
+	ResolveCacheEntry *entry;
+
+	g_mutex_lock (&resolve_cache.lock);
+
+	if (resolve_cache.entries == NULL)
+	{
+		resolve_cache.entries = g_hash_table_new (resolve_cache_entry_hash,
+							  resolve_cache_entry_equal);
+		g_queue_init (&resolve_cache.queue);
+	}
+
+	entry = g_slice_new0 (ResolveCacheEntry);
+	entry->pattern = g_strdup (pattern);
+	entry->flags = flags;
+
+	/* Another thread may have compiled the same pattern meanwhile. */
+	if (g_hash_table_lookup (resolve_cache.entries, entry) != NULL)
+	{
+		g_free (entry->pattern);
+		g_slice_free (ResolveCacheEntry, entry);
+		g_mutex_unlock (&resolve_cache.lock);
+		return;
+	}
+
+	entry->regex = g_regex_ref (regex->u.regex.regex);
+#ifdef HAVE_PCRE2
+	entry->jit = jit_code_ref (regex->u.regex.jit);
+	memcpy (entry->first_bytes, regex->u.regex.first_bytes, sizeof (entry->first_bytes));
+	entry->first_byte = regex->u.regex.first_byte;
+	entry->has_first_bytes = regex->u.regex.has_first_bytes;
+	entry->anchored = regex->u.regex.anchored;
+#endif
+	entry->link.data = entry;
+	g_hash_table_add (resolve_cache.entries, entry);
+	g_queue_push_head_link (&resolve_cache.queue, &entry->link);
+
+	if (resolve_cache.queue.length > RESOLVE_CACHE_SIZE)
+	{
+		GList *last = g_queue_pop_tail_link (&resolve_cache.queue);
+
+		g_hash_table_remove (resolve_cache.entries, last->data);
+		resolve_cache_entry_free (last->data);
+	}
+
+	g_mutex_unlock (&resolve_cache.lock);
+}
+
+/**
+ * _gtk_source_regex_get_resolve_cache_stats:
+ * @hits: (out): return location for the number of expanded regexes
+ * found in the cache.
+ * @misses: (out): return location for the number of expanded regexes
+ * which had to be compiled.
+ *
+ * Gets statistics about the cache used by _gtk_source_regex_resolve().
+ */
+void
+_gtk_source_regex_get_resolve_cache_stats (guint *hits,
+					   guint *misses)
+{
+	g_mutex_lock (&resolve_cache.lock);
+
+	if (hits != NULL)
+		*hits = resolve_cache.hits;
+	if (misses != NULL)
+		*misses = resolve_cache.misses;
+
+	g_mutex_unlock (&resolve_cache.lock);
+}
+
+/**
+ * _gtk_source_regex_set_jit_enabled:
+ * @enabled: whether to match with PCRE2 JIT code.
+ *
+ * Overrides GTK_SOURCE_REGEX_DISABLE_JIT for the regexes created
+ * afterwards, so that tests can run the same pattern through both
+ * PCRE2 and GRegex. Does nothing without PCRE2.
+ */
+void
+_gtk_source_regex_set_jit_enabled (gboolean enabled)
+{
+#ifdef HAVE_PCRE2
+	g_atomic_int_set (&jit_enabled_override, enabled != FALSE);
+#endif
+}
+
 struct RegexResolveData {
 	GtkSourceRegex *start_regex;
 	const gchar *matched_text;
@@ -199,13 +936,11 @@ replace_start_regex (const GMatchInfo *match_info,
 
 	if (num < 0)
 	{
-		subst = g_match_info_fetch_named (data->start_regex->u.regex.match,
-						  num_string);
+		subst = fetch_named (data->start_regex, num_string);
 	}
 	else
 	{
-		subst = g_match_info_fetch (data->start_regex->u.regex.match,
-					    num);
+		subst = _gtk_source_regex_fetch (data->start_regex, num);
 	}
 
 	if (subst != NULL)
@@ -242,7 +977,9 @@ replace_start_regex (const GMatchInfo *match_info,
  * If the regular expression contains references to the start regular
  * expression in the form "\%{start_sub_pattern@start}", it replaces
  * them (they are extracted from @start_regex and @matched_text) and
- * returns the new regular expression.
+ * returns the new regular expression. Regular expressions expanded
+ * to the same pattern are compiled only once, as long as they stay in
+ * the cache.
  *
  * Returns: a #GtkSourceRegex.
  */
@@ -265,8 +1002,20 @@ _gtk_source_regex_resolve (GtkSourceRegex *regex,
 					       -1, 0, 0,
 					       replace_start_regex,
 					       &data, NULL);
+
+	new_regex = resolve_cache_lookup (expanded_regex, regex->u.info.flags);
+	if (new_regex != NULL)
+	{
+		g_free (expanded_regex);
+		return new_regex;
+	}
+
 	new_regex = _gtk_source_regex_new (expanded_regex, regex->u.info.flags, NULL);
-	if (new_regex == NULL || !new_regex->resolved)
+	if (new_regex != NULL && new_regex->resolved)
+	{
+		resolve_cache_store (expanded_regex, regex->u.info.flags, new_regex);
+	}
+	else
 	{
 		_gtk_source_regex_unref (new_regex);
 		g_warning ("Regular expression %s cannot be expanded.",
@@ -292,31 +1041,222 @@ _gtk_source_regex_match (GtkSourceRegex *regex,
 			 gint             byte_length,
 			 gint             byte_pos)
 {
+	RegexMatch *m;
 	gboolean result;
 
 	g_assert (regex->resolved);
 
-	if (regex->u.regex.match)
+	m = get_match (regex);
+
+	if (m->match)
 	{
-		g_match_info_free (regex->u.regex.match);
-		regex->u.regex.match = NULL;
+		g_match_info_free (m->match);
+		m->match = NULL;
 	}
 
+#ifdef HAVE_PCRE2
+	if (regex->u.regex.has_first_bytes)
+	{
+		if (byte_length < 0)
+			byte_length = strlen (line);
+
+		byte_pos = skip_to_first_byte (regex, line, byte_length, byte_pos);
+
+		/* No match, fetch functions see the NULL match info. */
+		if (byte_pos < 0)
+		{
+			m->jit_matched = FALSE;
+			return FALSE;
+		}
+	}
+
+	if (regex->u.regex.jit != NULL)
+	{
+		gint rc;
+
+		if (m->match_data == NULL)
+			m->match_data = pcre2_match_data_create_from_pattern (regex->u.regex.jit->code, NULL);
+
+		if (byte_length < 0)
+			byte_length = strlen (line);
+
+		rc = pcre2_match (regex->u.regex.jit->code,
+				  (PCRE2_SPTR) line, byte_length, byte_pos,
+				  PCRE2_NO_UTF_CHECK,
+				  m->match_data,
+				  NULL);
+
+		/* Other errors, e.g. PCRE2_ERROR_JIT_STACKLIMIT, are
+		 * left to GRegex. */
+		if (rc >= 0 || rc == PCRE2_ERROR_NOMATCH)
+		{
+			m->jit_matched = TRUE;
+			m->subject = line;
+			m->n_matched = rc;
+			return rc >= 0;
+		}
+	}
+#endif
+
+	m->jit_matched = FALSE;
+
 	result = g_regex_match_full (regex->u.regex.regex, line,
 				     byte_length, byte_pos,
-				     0, &regex->u.regex.match,
+				     0, &m->match,
 				     NULL);
 
 	return result;
 }
 
+/* Positions in bytes of the sub pattern @num of the last match. */
+static gboolean
+fetch_pos_bytes (GtkSourceRegex *regex,
+		 gint            num,
+		 gint           *start_pos,
+		 gint           *end_pos)
+{
+	RegexMatch *m = get_match (regex);
+
+#ifdef HAVE_PCRE2
+	if (m->jit_matched)
+	{
+		PCRE2_SIZE *ovector;
+
+		if (num < 0 || num >= m->n_matched)
+			return FALSE;
+
+		ovector = pcre2_get_ovector_pointer (m->match_data);
+
+		if (ovector[2 * num] == PCRE2_UNSET)
+			return FALSE;
+
+		*start_pos = ovector[2 * num];
+		*end_pos = ovector[2 * num + 1];
+		return TRUE;
+	}
+#endif
+
+	if (m->match == NULL)
+		return FALSE;
+
+	return g_match_info_fetch_pos (m->match, num, start_pos, end_pos);
+}
+
+#ifdef HAVE_PCRE2
+/* Same as GRegex: the first set sub pattern with this name. */
+static gint
+jit_named_sub_pattern_number (GtkSourceRegex *regex,
+			      const gchar    *name)
+{
+	PCRE2_SPTR first, last, entry;
+	gint entry_size;
+
+	entry_size = pcre2_substring_nametable_scan (regex->u.regex.jit->code,
+						     (PCRE2_SPTR) name,
+						     &first, &last);
+	if (entry_size <= 0)
+		return -1;
+
+	for (entry = first; entry <= last; entry += entry_size)
+	{
+		gint num = (entry[0] << 8) + entry[1];
+		gint start_pos, end_pos;
+
+		if (fetch_pos_bytes (regex, num, &start_pos, &end_pos))
+			return num;
+	}
+
+	return (first[0] << 8) + first[1];
+}
+#endif
+
+static gboolean
+fetch_named_pos_bytes (GtkSourceRegex *regex,
+		       const gchar    *name,
+		       gint           *start_pos,
+		       gint           *end_pos)
+{
+	RegexMatch *m = get_match (regex);
+
+#ifdef HAVE_PCRE2
+	if (m->jit_matched)
+	{
+		return fetch_pos_bytes (regex,
+					jit_named_sub_pattern_number (regex, name),
+					start_pos, end_pos);
+	}
+#endif
+
+	if (m->match == NULL)
+		return FALSE;
+
+	return g_match_info_fetch_named_pos (m->match, name, start_pos, end_pos);
+}
+
+static gchar *
+fetch_named (GtkSourceRegex *regex,
+	     const gchar    *name)
+{
+	RegexMatch *m = get_match (regex);
+
+#ifdef HAVE_PCRE2
+	if (m->jit_matched)
+	{
+		gint start_pos, end_pos;
+		gint num;
+
+		if (m->n_matched < 0)
+			return NULL;
+
+		/* Same as g_match_info_fetch_named(): %NULL for an unknown
+		 * name and for a sub pattern after the last one set. */
+		num = jit_named_sub_pattern_number (regex, name);
+
+		if (num < 0 || num >= m->n_matched)
+			return NULL;
+
+		if (!fetch_pos_bytes (regex, num, &start_pos, &end_pos))
+			return g_strdup ("");
+
+		return g_strndup (m->subject + start_pos, end_pos - start_pos);
+	}
+#endif
+
+	if (m->match == NULL)
+		return NULL;
+
+	return g_match_info_fetch_named (m->match, name);
+}
+
 gchar *
 _gtk_source_regex_fetch (GtkSourceRegex *regex,
 		         gint            num)
 {
+	RegexMatch *m;
+
 	g_assert (regex->resolved);
 
-	return g_match_info_fetch (regex->u.regex.match, num);
+	m = get_match (regex);
+
+#ifdef HAVE_PCRE2
+	if (m->jit_matched)
+	{
+		gint start_pos, end_pos;
+
+		if (num >= m->n_matched)
+			return NULL;
+
+		if (!fetch_pos_bytes (regex, num, &start_pos, &end_pos))
+			return g_strdup ("");
+
+		return g_strndup (m->subject + start_pos, end_pos - start_pos);
+	}
+#endif
+
+	if (m->match == NULL)
+		return NULL;
+
+	return g_match_info_fetch (m->match, num);
 }
 
 void
@@ -330,7 +1270,7 @@ _gtk_source_regex_fetch_pos (GtkSourceRegex *regex,
 
 	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &byte_start_pos, &byte_end_pos))
+	if (!fetch_pos_bytes (regex, num, &byte_start_pos, &byte_end_pos))
 	{
 		if (start_pos != NULL)
 			*start_pos = -1;
@@ -357,7 +1297,30 @@ _gtk_source_regex_fetch_pos_bytes (GtkSourceRegex *regex,
 
 	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_pos (regex->u.regex.match, num, &start_pos, &end_pos))
+	if (!fetch_pos_bytes (regex, num, &start_pos, &end_pos))
+	{
+		start_pos = -1;
+		end_pos = -1;
+	}
+
+	if (start_pos_p != NULL)
+		*start_pos_p = start_pos;
+	if (end_pos_p != NULL)
+		*end_pos_p = end_pos;
+}
+
+void
+_gtk_source_regex_fetch_named_pos_bytes (GtkSourceRegex *regex,
+					 const gchar    *name,
+					 gint           *start_pos_p, /* byte offsets */
+					 gint           *end_pos_p)   /* byte offsets */
+{
+	gint start_pos;
+	gint end_pos;
+
+	g_assert (regex->resolved);
+
+	if (!fetch_named_pos_bytes (regex, name, &start_pos, &end_pos))
 	{
 		start_pos = -1;
 		end_pos = -1;
@@ -380,7 +1343,7 @@ _gtk_source_regex_fetch_named_pos (GtkSourceRegex *regex,
 
 	g_assert (regex->resolved);
 
-	if (!g_match_info_fetch_named_pos (regex->u.regex.match, name, &byte_start_pos, &byte_end_pos))
+	if (!fetch_named_pos_bytes (regex, name, &byte_start_pos, &byte_end_pos))
 	{
 		if (start_pos != NULL)
 			*start_pos = -1;
@@ -44,9 +44,25 @@ GtkSourceRegex	*_gtk_source_regex_resolve	(GtkSourceRegex *regex,
 						 GtkSourceRegex *start_regex,
 						 const gchar    *matched_text);
 
+G_GNUC_INTERNAL
+void		 _gtk_source_regex_get_resolve_cache_stats (guint *hits,
+							    guint *misses);
+
+G_GNUC_INTERNAL
+void		 _gtk_source_regex_set_jit_enabled (gboolean enabled);
+
 G_GNUC_INTERNAL
 gboolean	 _gtk_source_regex_is_resolved	(GtkSourceRegex *regex);
 
+G_GNUC_INTERNAL
+gint		 _gtk_source_regex_acquire_thread_slot (void);
+
+G_GNUC_INTERNAL
+void		 _gtk_source_regex_release_thread_slot (gint slot);
+
+G_GNUC_INTERNAL
+void		 _gtk_source_regex_set_thread_slot (gint slot);
+
 G_GNUC_INTERNAL
 gboolean	_gtk_source_regex_match		(GtkSourceRegex *regex,
 						 const gchar    *line,
@@ -77,6 +93,12 @@ void		 _gtk_source_regex_fetch_named_pos (GtkSourceRegex *regex,
 						    gint           *start_pos, /* character offsets */
 						    gint           *end_pos);  /* character offsets */
 
+G_GNUC_INTERNAL
+void		 _gtk_source_regex_fetch_named_pos_bytes (GtkSourceRegex *regex,
+							  const gchar    *name,
+							  gint           *start_pos_p, /* byte offsets */
+							  gint           *end_pos_p);  /* byte offsets */
+
 G_GNUC_INTERNAL
 const gchar	*_gtk_source_regex_get_pattern	(GtkSourceRegex *regex);
 
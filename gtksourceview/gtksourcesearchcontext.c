@@ -180,7 +180,10 @@
  * buffer contents "aaa". There is one occurrence: the first two letters. If we
  * insert an extra 'a' at the end of the buffer, the occurrence is modified to
  * take the next two letters. That's why the buffer is re-scanned entirely on
- * each insertion or deletion in the buffer.
+ * each insertion or deletion in the buffer. Except when the buffer is in
+ * append-only mode: text appended at the end or removed at the beginning
+ * re-scans only the lines around the change, otherwise a log growing line by
+ * line would be re-scanned entirely for each new line.
  *
  * For searching the matches, the easiest solution is to retrieve all the buffer
  * contents, and search the occurrences on this big string. But it takes a lot
@@ -2369,6 +2372,16 @@ update (GtkSourceSearchContext *search)
 	add_subregion_to_scan (search, &start, &end);
 }
 
+/* In append-only mode, a regex search re-scans only the lines where text is
+ * appended or removed, instead of the whole buffer. See
+ * gtk_source_buffer_set_append_only().
+ */
+static gboolean
+is_append_only (GtkSourceSearchContext *search)
+{
+	return gtk_source_buffer_get_append_only (GTK_SOURCE_BUFFER (search->priv->buffer));
+}
+
 static void
 insert_text_before_cb (GtkSourceSearchContext *search,
 		       GtkTextIter            *location,
@@ -2379,8 +2392,19 @@ insert_text_before_cb (GtkSourceSearchContext *search,
 
 	clear_task (search);
 
-	if (search_text != NULL &&
-	    !gtk_source_search_settings_get_regex_enabled (search->priv->settings))
+	if (gtk_source_search_settings_get_regex_enabled (search->priv->settings))
+	{
+		if (gtk_text_iter_is_end (location) &&
+		    is_append_only (search))
+		{
+			GtkTextIter start = *location;
+			GtkTextIter end = *location;
+
+			gtk_text_iter_set_line_offset (&start, 0);
+			remove_occurrences_in_range (search, &start, &end);
+		}
+	}
+	else if (search_text != NULL)
 	{
 		GtkTextIter start = *location;
 		GtkTextIter end = *location;
@@ -2396,20 +2420,29 @@ insert_text_after_cb (GtkSourceSearchContext *search,
 		      gchar                  *text,
 		      gint                    length)
 {
+	GtkTextIter start;
+	GtkTextIter end;
+
+	start = end = *location;
+
+	gtk_text_iter_backward_chars (&start,
+				      g_utf8_strlen (text, length));
+
 	if (gtk_source_search_settings_get_regex_enabled (search->priv->settings))
 	{
-		update (search);
+		if (gtk_text_iter_is_end (&end) &&
+		    is_append_only (search))
+		{
+			gtk_text_iter_set_line_offset (&start, 0);
+			add_subregion_to_scan (search, &start, &end);
+		}
+		else
+		{
+			update (search);
+		}
 	}
 	else
 	{
-		GtkTextIter start;
-		GtkTextIter end;
-
-		start = end = *location;
-
-		gtk_text_iter_backward_chars (&start,
-					      g_utf8_strlen (text, length));
-
 		add_subregion_to_scan (search, &start, &end);
 	}
 }
@@ -2427,6 +2460,20 @@ delete_range_before_cb (GtkSourceSearchContext *search,
 
 	if (gtk_source_search_settings_get_regex_enabled (search->priv->settings))
 	{
+		if (gtk_text_iter_is_start (delete_start) &&
+		    is_append_only (search))
+		{
+			GtkTextIter start = *delete_start;
+			GtkTextIter end = *delete_end;
+
+			if (!gtk_text_iter_ends_line (&end))
+			{
+				gtk_text_iter_forward_to_line_end (&end);
+			}
+
+			remove_occurrences_in_range (search, &start, &end);
+		}
+
 		return;
 	}
 
@@ -2460,7 +2507,22 @@ delete_range_after_cb (GtkSourceSearchContext *search,
 {
 	if (gtk_source_search_settings_get_regex_enabled (search->priv->settings))
 	{
-		update (search);
+		if (gtk_text_iter_is_start (start) &&
+		    is_append_only (search))
+		{
+			GtkTextIter line_end = *end;
+
+			if (!gtk_text_iter_ends_line (&line_end))
+			{
+				gtk_text_iter_forward_to_line_end (&line_end);
+			}
+
+			add_subregion_to_scan (search, start, &line_end);
+		}
+		else
+		{
+			update (search);
+		}
 	}
 	else
 	{
@@ -37,6 +37,7 @@ typedef struct _GtkSourceGutter			GtkSourceGutter;
 typedef struct _GtkSourceGutterRenderer		GtkSourceGutterRenderer;
 typedef struct _GtkSourceGutterRendererPixbuf	GtkSourceGutterRendererPixbuf;
 typedef struct _GtkSourceGutterRendererText	GtkSourceGutterRendererText;
+typedef struct _GtkSourceHighlighter		GtkSourceHighlighter;
 typedef struct _GtkSourceLanguage		GtkSourceLanguage;
 typedef struct _GtkSourceLanguageManager	GtkSourceLanguageManager;
 typedef struct _GtkSourceMarkAttributes		GtkSourceMarkAttributes;
@@ -1,6 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <gtksourceview/gtksource.h>
+#include "gtksourceview/gtksourcecontextengine.h"
 
 static void
 test_get_buffer (void)
@@ -27,12 +30,814 @@ test_get_buffer (void)
 	g_object_unref (view);
 }
 
+static GtkSourceLanguage *
+get_test_language (void)
+{
+	GtkSourceLanguageManager *manager;
+	gchar **lang_dirs;
+
+	manager = gtk_source_language_manager_get_default ();
+
+	lang_dirs = g_new0 (gchar *, 3);
+	lang_dirs[0] = g_build_filename (TOP_SRCDIR, "tests", "language-specs", NULL);
+	lang_dirs[1] = g_build_filename (TOP_SRCDIR, "data", "language-specs", NULL);
+
+	gtk_source_language_manager_set_search_path (manager, lang_dirs);
+	g_strfreev (lang_dirs);
+
+	return gtk_source_language_manager_get_language (manager, "test-full");
+}
+
+static gboolean
+has_string_at (GtkSourceBuffer *buffer,
+	       gint             offset)
+{
+	GtkTextIter iter;
+
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, offset);
+	return gtk_source_buffer_iter_has_context_class (buffer, &iter, "string");
+}
+
+static void
+test_max_highlight_line_length (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	GString *text;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	g_assert_cmpint (gtk_source_buffer_get_max_highlight_line_length (buffer), ==, -1);
+
+	text = g_string_new ("\"a\" ");
+	for (i = 0; i < 100; i++)
+		g_string_append (text, "xxxxxxxxxx");
+	g_string_append (text, " \"b\"\n\"c\"\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert (has_string_at (buffer, 1));
+	g_assert (has_string_at (buffer, 1006));
+	g_assert (has_string_at (buffer, 1010));
+
+	/* Only the beginning of the long line is highlighted. */
+	gtk_source_buffer_set_max_highlight_line_length (buffer, 100);
+	g_assert_cmpint (gtk_source_buffer_get_max_highlight_line_length (buffer), ==, 100);
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert (has_string_at (buffer, 1));
+	g_assert (!has_string_at (buffer, 1006));
+	g_assert (has_string_at (buffer, 1010));
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+
+	/* A comment opened before the limit ends with its line, the end
+	 * of the comment is past the limit but the next line is not in it. */
+	buffer = gtk_source_buffer_new_with_language (
+		gtk_source_language_manager_get_language (gtk_source_language_manager_get_default (), "c"));
+	gtk_source_buffer_set_max_highlight_line_length (buffer, 100);
+
+	text = g_string_new ("/* ");
+	for (i = 0; i < 20; i++)
+		g_string_append (text, "xxxxxxxxxx");
+	g_string_append (text, " */\n\"c\"\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, 50);
+	g_assert (gtk_source_buffer_iter_has_context_class (buffer, &start, "comment"));
+	gtk_text_buffer_get_iter_at_line_offset (GTK_TEXT_BUFFER (buffer), &start, 1, 1);
+	g_assert (!gtk_source_buffer_iter_has_context_class (buffer, &start, "comment"));
+	g_assert (gtk_source_buffer_iter_has_context_class (buffer, &start, "string"));
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static gint
+n_tags_at (GtkSourceBuffer *buffer,
+	   gint             offset)
+{
+	GtkTextIter iter;
+	GSList *tags;
+	gint n_tags;
+
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, offset);
+	tags = gtk_text_iter_get_tags (&iter);
+	n_tags = g_slist_length (tags);
+	g_slist_free (tags);
+
+	return n_tags;
+}
+
+static void
+test_highlight_visible_only (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	GString *text;
+	gint last_line_offset;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	g_assert (!gtk_source_buffer_get_highlight_visible_only (buffer));
+
+	gtk_source_buffer_set_highlight_visible_only (buffer, TRUE);
+	g_assert (gtk_source_buffer_get_highlight_visible_only (buffer));
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 50000; i++)
+		g_string_append (text, "\"a\"\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	last_line_offset = text->len - 4;
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+
+	g_assert_cmpint (n_tags_at (buffer, 1), ==, 1);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset + 1), ==, 1);
+
+	/* Highlighting the first line drops the style of the others, but
+	 * not the context classes. */
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &end, 1);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert_cmpint (n_tags_at (buffer, 1), ==, 1);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset + 1), ==, 0);
+	g_assert (has_string_at (buffer, last_line_offset + 1));
+
+	/* And it comes back when the line is highlighted again. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, last_line_offset);
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset + 1), ==, 1);
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static void
+test_highlight_sync_lines (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	GString *text;
+	gint last_line_offset;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	g_assert_cmpint (gtk_source_buffer_get_highlight_sync_lines (buffer), ==, -1);
+
+	gtk_source_buffer_set_highlight_sync_lines (buffer, 10);
+	g_assert_cmpint (gtk_source_buffer_get_highlight_sync_lines (buffer), ==, 10);
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 50000; i++)
+		g_string_append (text, "\"a\"\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	last_line_offset = text->len - 4;
+
+	/* Only the last line is analyzed and highlighted. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, last_line_offset);
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset + 1), ==, 1);
+	g_assert_cmpint (n_tags_at (buffer, 1), ==, 0);
+
+	/* There is no syntax tree to find context classes in. */
+	g_assert (!has_string_at (buffer, last_line_offset + 1));
+
+	/* Edits are highlighted again when asked. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, last_line_offset);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &start, "x ", -1);
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, last_line_offset);
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset), ==, 0);
+	g_assert_cmpint (n_tags_at (buffer, last_line_offset + 3), ==, 1);
+
+	/* Going back to the whole buffer analysis. */
+	gtk_source_buffer_set_highlight_sync_lines (buffer, -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert_cmpint (n_tags_at (buffer, 1), ==, 1);
+	g_assert (has_string_at (buffer, last_line_offset + 3));
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static GtkSourceContextEngine *
+get_engine (GtkSourceBuffer *buffer)
+{
+	GtkSourceContextEngine *ce;
+
+	ce = _gtk_source_context_engine_get_for_buffer (GTK_TEXT_BUFFER (buffer));
+	g_assert (ce != NULL);
+
+	return ce;
+}
+
+static void
+highlight_all (GtkSourceBuffer *buffer)
+{
+	GtkTextIter start, end;
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+}
+
+static void
+test_memory_usage (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter;
+	gsize memory;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "x \"a\" foo\n", -1);
+	highlight_all (buffer);
+	memory = _gtk_source_context_engine_get_memory_usage (get_engine (buffer));
+	g_assert_cmpuint (memory, >, 0);
+
+	/* More segments take more nodes from the pool. */
+	for (i = 0; i < 1000; i++)
+	{
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &iter);
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "\"b\" bar \"c\"\n", -1);
+	}
+
+	highlight_all (buffer);
+	g_assert_cmpuint (_gtk_source_context_engine_get_memory_usage (get_engine (buffer)), >, memory);
+
+	g_object_unref (buffer);
+}
+
+static void
+test_line_cache (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter;
+	GString *text;
+	guint hits, misses;
+	guint new_hits, new_misses;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append_printf (text, "x \"%d\" foo\n", i);
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	highlight_all (buffer);
+	_gtk_source_context_engine_get_line_cache_stats (get_engine (buffer), &hits, &misses);
+	g_assert_cmpuint (misses, >, 0);
+
+	/* Unchanged lines analyzed again come from the cache. */
+	for (i = 0; i < 10; i++)
+	{
+		gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter, 50);
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "x \"7\" foo\n", -1);
+		highlight_all (buffer);
+	}
+
+	_gtk_source_context_engine_get_line_cache_stats (get_engine (buffer), &new_hits, &new_misses);
+	g_assert_cmpuint (new_hits, >=, hits + 10);
+	g_assert_cmpuint (new_misses, <, misses + 10);
+	g_assert (has_string_at (buffer, 10 * 10 + 40 * 11 + 3));
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static void
+test_tag_stats (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter iter;
+	GString *text;
+	guint operations, saved;
+	guint new_operations, new_saved;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append (text, "x \"a\" foo\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	highlight_all (buffer);
+	_gtk_source_context_engine_get_tag_stats (get_engine (buffer), &operations, &saved);
+	g_assert_cmpuint (operations, >, 0);
+
+	/* Typing in a string leaves the tags where they are. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, 50 * 10 + 3);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "b", -1);
+	highlight_all (buffer);
+	_gtk_source_context_engine_get_tag_stats (get_engine (buffer), &new_operations, &new_saved);
+	g_assert_cmpuint (new_operations, ==, operations);
+	g_assert_cmpuint (new_saved, >, saved);
+	g_assert (has_string_at (buffer, 50 * 10 + 3));
+	g_assert_cmpint (n_tags_at (buffer, 50 * 10 + 3), ==, 1);
+	saved = new_saved;
+
+	/* Closing the string early moves its tag. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, 50 * 10 + 3);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "\" ", -1);
+	highlight_all (buffer);
+	_gtk_source_context_engine_get_tag_stats (get_engine (buffer), &new_operations, NULL);
+	g_assert_cmpuint (new_operations, >, operations);
+	g_assert_cmpint (n_tags_at (buffer, 50 * 10 + 4), ==, 0);
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static void
+tag_changed_cb (GtkTextBuffer     *buffer,
+		GtkTextTag        *tag,
+		const GtkTextIter *start,
+		const GtkTextIter *end,
+		gint              *lines)
+{
+	gint line;
+
+	for (line = gtk_text_iter_get_line (start); line <= gtk_text_iter_get_line (end); line++)
+		lines[line]++;
+}
+
+static void
+test_separate_edits (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	GString *text;
+	gint lines[301] = { 0 };
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 300; i++)
+		g_string_append (text, "x \"a\" foo\n");
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+
+	/* Two edits far apart before the buffer is highlighted again. */
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, 10);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &start, "\"b\" ", -1);
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &start, 250);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &start, "\"c\" ", -1);
+
+	g_signal_connect (buffer, "apply-tag", G_CALLBACK (tag_changed_cb), lines);
+	g_signal_connect (buffer, "remove-tag", G_CALLBACK (tag_changed_cb), lines);
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+
+	/* Both edited lines are analyzed and highlighted... */
+	g_assert (has_string_at (buffer, 10 * 10 + 1));
+	g_assert (has_string_at (buffer, 10 * 10 + 7));
+	g_assert (has_string_at (buffer, 250 * 10 + 4 + 1));
+	g_assert (has_string_at (buffer, 250 * 10 + 4 + 7));
+	g_assert_cmpint (lines[10], >, 0);
+	g_assert_cmpint (lines[250], >, 0);
+
+	/* ...but the text between them is not. */
+	for (i = 20; i < 240; i++)
+		g_assert_cmpint (lines[i], ==, 0);
+
+	g_assert (has_string_at (buffer, 100 * 10 + 4 + 3));
+	g_assert_cmpint (n_tags_at (buffer, 100 * 10 + 4 + 3), ==, 1);
+
+	g_string_free (text, TRUE);
+	g_object_unref (buffer);
+}
+
+static void
+test_append_only (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	guint lines, new_lines;
+	gint i;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	g_assert (!gtk_source_buffer_get_append_only (buffer));
+
+	gtk_source_buffer_set_append_only (buffer, TRUE);
+	g_assert (gtk_source_buffer_get_append_only (buffer));
+
+	for (i = 0; i < 200; i++)
+	{
+		gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+		gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &end, "x \"a\"\n", -1);
+	}
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert (has_string_at (buffer, 3));
+	g_assert (!has_string_at (buffer, 0));
+	g_assert (has_string_at (buffer, 6 * 199 + 3));
+
+	_gtk_source_context_engine_get_analysis_stats (get_engine (buffer), &lines);
+	g_assert_cmpuint (lines, >=, 200);
+
+	/* Drop the first 100 lines, the kept ones are not analyzed again. */
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &start);
+	gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &end, 100);
+	gtk_text_buffer_delete (GTK_TEXT_BUFFER (buffer), &start, &end);
+	g_assert_cmpint (gtk_text_buffer_get_line_count (GTK_TEXT_BUFFER (buffer)), ==, 101);
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	_gtk_source_context_engine_get_analysis_stats (get_engine (buffer), &new_lines);
+	g_assert_cmpuint (new_lines, ==, lines);
+	g_assert (has_string_at (buffer, 3));
+	g_assert (!has_string_at (buffer, 0));
+	g_assert (has_string_at (buffer, 6 * 99 + 3));
+	g_assert (!has_string_at (buffer, 6 * 99));
+
+	/* Appending after the truncation still works. */
+	gtk_text_buffer_get_end_iter (GTK_TEXT_BUFFER (buffer), &end);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &end, "\"b\" y\n", -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	lines = new_lines;
+	_gtk_source_context_engine_get_analysis_stats (get_engine (buffer), &new_lines);
+	g_assert_cmpuint (new_lines - lines, <, 10);
+	g_assert (has_string_at (buffer, 6 * 100 + 1));
+	g_assert (!has_string_at (buffer, 6 * 100 + 4));
+
+	g_object_unref (buffer);
+}
+
+static void
+test_context_classes (void)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end, iter;
+	gchar **classes;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "x \"ab\" y\n", -1);
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+
+	/* Classes are not stored as tags. */
+	g_assert_cmpint (n_tags_at (buffer, 0), ==, 0);
+
+	g_assert (!has_string_at (buffer, 0));
+	g_assert (has_string_at (buffer, 2));
+	g_assert (has_string_at (buffer, 5));
+	g_assert (!has_string_at (buffer, 6));
+	g_assert (!has_string_at (buffer, 9));
+
+	classes = gtk_source_buffer_get_context_classes_at_iter (buffer, &start);
+	g_assert_cmpint (g_strv_length (classes), ==, 1);
+	g_assert_cmpstr (classes[0], ==, "no-spell-check");
+	g_strfreev (classes);
+
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, 3);
+	classes = gtk_source_buffer_get_context_classes_at_iter (buffer, &iter);
+	g_assert_cmpint (g_strv_length (classes), ==, 1);
+	g_assert_cmpstr (classes[0], ==, "string");
+	g_strfreev (classes);
+
+	iter = start;
+	g_assert (gtk_source_buffer_iter_forward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 2);
+	g_assert (gtk_source_buffer_iter_forward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 6);
+	g_assert (!gtk_source_buffer_iter_forward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert (gtk_text_iter_is_end (&iter));
+
+	g_assert (gtk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 6);
+	g_assert (gtk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 2);
+	g_assert (!gtk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert (gtk_text_iter_is_start (&iter));
+
+	/* Edits are seen right away in the analyzed text. */
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &iter, 0);
+	gtk_text_buffer_insert (GTK_TEXT_BUFFER (buffer), &iter, "yy", -1);
+	g_assert (!has_string_at (buffer, 2));
+	g_assert (has_string_at (buffer, 4));
+
+	/* Toggles are found around the edit before it is analyzed. */
+	gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+	g_assert (gtk_source_buffer_iter_forward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 4);
+	g_assert (gtk_source_buffer_iter_forward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 8);
+	g_assert (gtk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert_cmpint (gtk_text_iter_get_offset (&iter), ==, 4);
+	g_assert (!gtk_source_buffer_iter_backward_to_context_class_toggle (buffer, &iter, "string"));
+	g_assert (gtk_text_iter_is_start (&iter));
+
+	g_object_unref (buffer);
+}
+
+static void
+append_token_cb (GtkSourceBuffer     *buffer,
+		 gint                 start_offset,
+		 gint                 end_offset,
+		 const gchar         *style_id,
+		 const gchar * const *context_classes,
+		 GString             *tokens)
+{
+	gchar *classes;
+
+	classes = g_strjoinv (",", (gchar **) context_classes);
+	g_string_append_printf (tokens, "%d-%d %s %s;",
+				start_offset,
+				end_offset,
+				style_id != NULL ? style_id : "-",
+				classes);
+	g_free (classes);
+}
+
+static gchar *
+get_tokens (GtkSourceBuffer *buffer,
+	    gint             start_offset,
+	    gint             end_offset)
+{
+	GtkTextIter start, end;
+	GString *tokens;
+
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &start, start_offset);
+	gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (buffer), &end, end_offset);
+
+	tokens = g_string_new (NULL);
+	gtk_source_buffer_foreach_token (buffer, &start, &end,
+					 (GtkSourceTokenFunc) append_token_cb,
+					 tokens);
+
+	return g_string_free (tokens, FALSE);
+}
+
+static void
+test_foreach_token (void)
+{
+	GtkSourceBuffer *buffer;
+	gchar *tokens;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), "x \"ab\" foo\n", -1);
+
+	/* The text is analyzed, but not highlighted. */
+	tokens = get_tokens (buffer, 0, 11);
+	g_assert_cmpstr (tokens, ==,
+			 "0-11 - no-spell-check;"
+			 "2-6 test-full:string string;"
+			 "7-10 test-full:keyword no-spell-check;");
+	g_assert_cmpint (n_tags_at (buffer, 3), ==, 0);
+	g_free (tokens);
+
+	tokens = get_tokens (buffer, 3, 8);
+	g_assert_cmpstr (tokens, ==,
+			 "3-8 - no-spell-check;"
+			 "3-6 test-full:string string;"
+			 "7-8 test-full:keyword no-spell-check;");
+	g_free (tokens);
+
+	g_object_unref (buffer);
+}
+
+/* Analyzes @text split into @n_chunks chunks analyzed in parallel, or
+ * from the start by the main thread if @n_chunks is 0. */
+static gchar *
+get_analyzed_tokens (GtkSourceLanguage *language,
+		     const gchar       *text,
+		     guint              n_chunks,
+		     guint             *chunks_analyzed)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	gchar *tokens;
+
+	buffer = gtk_source_buffer_new_with_language (language);
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text, -1);
+
+	/* The first idle starts analyzing big buffers in other threads
+	 * and ensure_highlight() waits for them. Without it the text is
+	 * analyzed by ensure_highlight() itself, from the start. */
+	if (n_chunks != 0)
+	{
+		_gtk_source_context_engine_set_parallel_chunks (get_engine (buffer), n_chunks);
+
+		while (gtk_events_pending ())
+			gtk_main_iteration ();
+	}
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	tokens = get_tokens (buffer, 0, gtk_text_iter_get_offset (&end));
+
+	if (chunks_analyzed != NULL)
+		_gtk_source_context_engine_get_parallel_stats (get_engine (buffer), chunks_analyzed);
+
+	g_object_unref (buffer);
+	return tokens;
+}
+
+static void
+test_parallel_analysis (void)
+{
+	GtkSourceLanguage *language;
+	GString *text;
+	gchar *serial;
+	gchar *parallel;
+	guint chunks;
+	gint i, j;
+
+	/* Big enough to be split into four chunks, however many processors
+	 * there are. Most lines are in comments, so chunks usually begin
+	 * in one. */
+	text = g_string_new (NULL);
+	for (i = 0; i < 5000; i++)
+	{
+		g_string_append (text, "#!x \"a\" foo\n/* #!x\n");
+		for (j = 0; j < 10; j++)
+			g_string_append (text, "\"b\" xx yyyyyyyyyy\n");
+		g_string_append (text, "*/ \"c\" /* d */\n\"e\" bar\n");
+	}
+
+	language = get_test_language ();
+	serial = get_analyzed_tokens (language, text->str, 0, NULL);
+	parallel = get_analyzed_tokens (language, text->str, 4, &chunks);
+	g_assert_cmpstr (parallel, ==, serial);
+	g_free (serial);
+	g_free (parallel);
+
+	/* Chunks need regex slots, which only PCRE2 has. */
+	if (chunks == 0)
+	{
+		g_test_skip ("text not analyzed in chunks");
+		g_string_free (text, TRUE);
+		return;
+	}
+
+	g_assert_cmpuint (chunks, >=, 3);
+
+	language = gtk_source_language_manager_get_language (gtk_source_language_manager_get_default (),
+							     "test-first-line");
+	serial = get_analyzed_tokens (language, text->str, 0, NULL);
+	parallel = get_analyzed_tokens (language, text->str, 4, &chunks);
+	g_assert_cmpstr (parallel, ==, serial);
+	g_assert_cmpuint (chunks, >=, 3);
+
+	/* Only the first line of the buffer is a shebang. */
+	g_assert (strstr (parallel, "0-11 test-first-line:shebang shebang;") != NULL);
+	g_assert (strstr (parallel, ":shebang") == g_strrstr (parallel, ":shebang"));
+
+	g_free (serial);
+	g_free (parallel);
+	g_string_free (text, TRUE);
+}
+
+static gchar *
+get_highlighted_tokens (const gchar *text,
+			guint       *loads,
+			guint       *rejects)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start, end;
+	gchar *tokens;
+
+	buffer = gtk_source_buffer_new_with_language (get_test_language ());
+	gtk_source_buffer_set_highlight_cache (buffer, TRUE);
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text, -1);
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	g_assert (has_string_at (buffer, 2));
+	g_assert (!has_string_at (buffer, 0));
+
+	tokens = get_tokens (buffer, 0, gtk_text_iter_get_offset (&end));
+	_gtk_source_context_engine_get_cache_stats (get_engine (buffer), loads, rejects);
+
+	g_object_unref (buffer);
+	return tokens;
+}
+
+static void
+test_highlight_cache (void)
+{
+	GtkSourceBuffer *buffer;
+	GString *text;
+	GDir *dir;
+	const gchar *name;
+	gchar *dirname;
+	gchar *filename;
+	gchar *contents;
+	gchar *tokens;
+	gchar *cached_tokens;
+	guint loads, rejects;
+	gint i;
+
+	buffer = gtk_source_buffer_new (NULL);
+	g_assert (!gtk_source_buffer_get_highlight_cache (buffer));
+	gtk_source_buffer_set_highlight_cache (buffer, TRUE);
+	g_assert (gtk_source_buffer_get_highlight_cache (buffer));
+	g_object_unref (buffer);
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 300; i++)
+		g_string_append (text, "x \"a\" foo\n");
+
+	/* The tree is saved once the text is analyzed. */
+	tokens = get_highlighted_tokens (text->str, &loads, &rejects);
+	g_assert_cmpuint (loads, ==, 0);
+	g_assert_cmpuint (rejects, ==, 0);
+
+	dirname = g_build_filename (g_get_user_cache_dir (), "gtksourceview-3.0", "highlight", NULL);
+	dir = g_dir_open (dirname, 0, NULL);
+	g_assert (dir != NULL);
+	name = g_dir_read_name (dir);
+	g_assert (name != NULL);
+	filename = g_build_filename (dirname, name, NULL);
+	g_assert (g_dir_read_name (dir) == NULL);
+	g_dir_close (dir);
+
+	/* Then it is read back. */
+	cached_tokens = get_highlighted_tokens (text->str, &loads, &rejects);
+	g_assert_cmpuint (loads, ==, 1);
+	g_assert_cmpuint (rejects, ==, 0);
+	g_assert_cmpstr (cached_tokens, ==, tokens);
+	g_free (cached_tokens);
+
+	/* A broken cache file is ignored, and saved again. */
+	g_file_set_contents (filename, "garbage", -1, NULL);
+
+	cached_tokens = get_highlighted_tokens (text->str, &loads, &rejects);
+	g_assert_cmpuint (loads, ==, 0);
+	g_assert_cmpuint (rejects, ==, 1);
+	g_assert_cmpstr (cached_tokens, ==, tokens);
+	g_free (cached_tokens);
+
+	g_file_get_contents (filename, &contents, NULL, NULL);
+	g_assert_cmpstr (contents, !=, "garbage");
+	g_free (contents);
+
+	g_remove (filename);
+	g_rmdir (dirname);
+	g_free (filename);
+	g_free (dirname);
+
+	dirname = g_build_filename (g_get_user_cache_dir (), "gtksourceview-3.0", NULL);
+	g_rmdir (dirname);
+	g_free (dirname);
+
+	g_free (tokens);
+	g_string_free (text, TRUE);
+}
+
 int
 main (int argc, char** argv)
 {
+	gchar *cache_dir;
+	gint ret;
+
+	/* Keep the highlight cache out of the user's one. */
+	cache_dir = g_dir_make_tmp ("test-buffer-XXXXXX", NULL);
+	g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
 	gtk_test_init (&argc, &argv);
 
 	g_test_add_func ("/Buffer/bug-634510", test_get_buffer);
+	g_test_add_func ("/Buffer/max-highlight-line-length", test_max_highlight_line_length);
+	g_test_add_func ("/Buffer/highlight-visible-only", test_highlight_visible_only);
+	g_test_add_func ("/Buffer/highlight-sync-lines", test_highlight_sync_lines);
+	g_test_add_func ("/Buffer/memory-usage", test_memory_usage);
+	g_test_add_func ("/Buffer/line-cache", test_line_cache);
+	g_test_add_func ("/Buffer/tag-stats", test_tag_stats);
+	g_test_add_func ("/Buffer/separate-edits", test_separate_edits);
+	g_test_add_func ("/Buffer/append-only", test_append_only);
+	g_test_add_func ("/Buffer/context-classes", test_context_classes);
+	g_test_add_func ("/Buffer/foreach-token", test_foreach_token);
+	g_test_add_func ("/Buffer/parallel-analysis", test_parallel_analysis);
+	g_test_add_func ("/Buffer/highlight-cache", test_highlight_cache);
+
+	ret = g_test_run();
+
+	g_rmdir (cache_dir);
+	g_free (cache_dir);
 
-	return g_test_run();
+	return ret;
 }
@@ -0,0 +1,223 @@
+/*
+ * test-highlight-performances.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gtk/gtk.h>
+#include <gtksourceview/gtksource.h>
+#include "gtksourceview/gtksourcecontextengine.h"
+
+/* This measures the time needed to highlight whole buffers with some of
+ * the shipped language definitions, where almost all the time is spent
+ * matching regexes.
+ *
+ * The measures are done twice: with the default regex backend (PCRE2 JIT
+ * and the first byte prefilter when gtksourceview is built with it), and
+ * with plain GRegex, in a child process where GTK_SOURCE_REGEX_DISABLE_JIT
+ * is set.
+ *
+ * The number of regexes for all transitions compiled by the context
+ * engine (see create_reg_all()) is also printed, it matters for
+ * languages embedding other ones, like html.
+ */
+
+#define MIN_LINES 50000
+
+#define HTML_SAMPLE \
+	"<html>\n" \
+	"<head>\n" \
+	"<style type=\"text/css\">\n" \
+	"  body { margin: 0; font-family: sans-serif; }\n" \
+	"  p.note:hover { color: #204a87; }\n" \
+	"</style>\n" \
+	"<script type=\"text/javascript\">\n" \
+	"  function toggle (id) {\n" \
+	"    var e = document.getElementById (id); /* element */\n" \
+	"    e.style.display = e.style.display == 'none' ? '' : 'none';\n" \
+	"  }\n" \
+	"</script>\n" \
+	"</head>\n" \
+	"<body onload=\"toggle ('x')\">\n" \
+	"  <!-- comment -->\n" \
+	"  <p class=\"note\" id=\"x\">Some &amp; text</p>\n" \
+	"</body>\n" \
+	"</html>\n"
+
+/* Samples are read from @filename, or taken from @contents. */
+static const struct {
+	const gchar *language_id;
+	const gchar *filename;
+	const gchar *contents;
+} samples[] = {
+	{ "c", "gtksourceview/gtksourcecontextengine.c", NULL },
+	{ "xml", "data/language-specs/c.lang", NULL },
+	{ "python", "tests/test-completion.py", NULL },
+	{ "sh", "tests/testfiles.sh", NULL },
+	{ "html", NULL, HTML_SAMPLE }
+};
+
+static gdouble
+highlight_sample (GtkSourceLanguage *language,
+		  const gchar       *contents,
+		  gint              *n_lines)
+{
+	GtkSourceBuffer *buffer;
+	GtkTextIter start;
+	GtkTextIter end;
+	GString *text;
+	GTimer *timer;
+	gdouble elapsed;
+
+	buffer = gtk_source_buffer_new_with_language (language);
+
+	text = g_string_new (NULL);
+	*n_lines = 0;
+	while (*n_lines < MIN_LINES)
+	{
+		const gchar *p;
+
+		g_string_append (text, contents);
+
+		for (p = contents; *p != '\0'; p++)
+		{
+			if (*p == '\n')
+				(*n_lines)++;
+		}
+	}
+
+	gtk_text_buffer_set_text (GTK_TEXT_BUFFER (buffer), text->str, -1);
+	g_string_free (text, TRUE);
+
+	gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer), &start, &end);
+
+	timer = g_timer_new ();
+	gtk_source_buffer_ensure_highlight (buffer, &start, &end);
+	elapsed = g_timer_elapsed (timer, NULL);
+
+	g_timer_destroy (timer);
+	g_object_unref (buffer);
+
+	return elapsed;
+}
+
+static void
+run_samples (const gchar *backend)
+{
+	GtkSourceLanguageManager *manager;
+	gchar **lang_dirs;
+	guint i;
+
+	manager = gtk_source_language_manager_new ();
+
+	lang_dirs = g_new0 (gchar *, 2);
+	lang_dirs[0] = g_build_filename (TOP_SRCDIR, "data", "language-specs", NULL);
+	gtk_source_language_manager_set_search_path (manager, lang_dirs);
+	g_strfreev (lang_dirs);
+
+	for (i = 0; i < G_N_ELEMENTS (samples); i++)
+	{
+		GtkSourceLanguage *language;
+		gchar *contents = NULL;
+		gint n_lines;
+		gdouble elapsed;
+		guint compiled, reused;
+		guint prev_compiled, prev_reused;
+		gdouble compile_time, prev_compile_time;
+
+		language = gtk_source_language_manager_get_language (manager,
+								     samples[i].language_id);
+
+		if (samples[i].filename != NULL)
+		{
+			gchar *filename;
+
+			filename = g_build_filename (TOP_SRCDIR, samples[i].filename, NULL);
+			g_file_get_contents (filename, &contents, NULL, NULL);
+			g_free (filename);
+		}
+		else
+		{
+			contents = g_strdup (samples[i].contents);
+		}
+
+		if (language == NULL || contents == NULL)
+		{
+			g_print ("%s: skipped\n", samples[i].language_id);
+			g_free (contents);
+			continue;
+		}
+
+		_gtk_source_context_engine_get_reg_all_stats (&prev_compiled,
+							      &prev_reused,
+							      &prev_compile_time);
+
+		elapsed = highlight_sample (language, contents, &n_lines);
+
+		_gtk_source_context_engine_get_reg_all_stats (&compiled,
+							      &reused,
+							      &compile_time);
+
+		g_print ("%s, %s: %d lines in %lf seconds (%.0lf lines/s), "
+			 "%u transition regexes compiled in %lf seconds, %u reused.\n",
+			 backend,
+			 samples[i].language_id,
+			 n_lines,
+			 elapsed,
+			 n_lines / elapsed,
+			 compiled - prev_compiled,
+			 compile_time - prev_compile_time,
+			 reused - prev_reused);
+
+		g_free (contents);
+	}
+
+	g_object_unref (manager);
+}
+
+int
+main (int argc, char *argv[])
+{
+	gchar **envp;
+	gchar *child_argv[2];
+	GError *error = NULL;
+
+	gtk_init (&argc, &argv);
+
+	if (g_getenv ("GTK_SOURCE_REGEX_DISABLE_JIT") != NULL)
+	{
+		run_samples ("GRegex");
+		return 0;
+	}
+
+	run_samples ("default");
+
+	envp = g_get_environ ();
+	envp = g_environ_setenv (envp, "GTK_SOURCE_REGEX_DISABLE_JIT", "1", TRUE);
+
+	child_argv[0] = argv[0];
+	child_argv[1] = NULL;
+
+	if (!g_spawn_sync (NULL, child_argv, envp, G_SPAWN_CHILD_INHERITS_STDIN,
+			   NULL, NULL, NULL, NULL, NULL, &error))
+	{
+		g_warning ("Cannot run the GRegex measures: %s", error->message);
+		g_error_free (error);
+	}
+
+	g_strfreev (envp);
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * test-highlighter.c
+ * This file is part of GtkSourceView
+ *
+ * GtkSourceView is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GtkSourceView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gtk/gtk.h>
+#include <gtksourceview/gtksource.h>
+
+#define N_THREADS 4
+
+static GtkSourceHighlighter *
+get_test_highlighter (void)
+{
+	GtkSourceLanguageManager *manager;
+	GtkSourceLanguage *language;
+	gchar **lang_dirs;
+
+	manager = gtk_source_language_manager_get_default ();
+
+	lang_dirs = g_new0 (gchar *, 3);
+	lang_dirs[0] = g_build_filename (TOP_SRCDIR, "tests", "language-specs", NULL);
+	lang_dirs[1] = g_build_filename (TOP_SRCDIR, "data", "language-specs", NULL);
+
+	gtk_source_language_manager_set_search_path (manager, lang_dirs);
+	g_strfreev (lang_dirs);
+
+	language = gtk_source_language_manager_get_language (manager, "test-full");
+
+	return gtk_source_highlighter_new (language, NULL);
+}
+
+/* Styled runs are written between brackets. */
+static void
+append_run_cb (const gchar *text,
+	       gsize        length,
+	       const gchar *style_id,
+	       GString     *runs)
+{
+	if (style_id != NULL)
+		g_string_append_c (runs, '[');
+
+	g_string_append_len (runs, text, length);
+
+	if (style_id != NULL)
+		g_string_append_c (runs, ']');
+}
+
+static gchar *
+get_runs (GtkSourceHighlighter *highlighter,
+	  const gchar          *text,
+	  gssize                length)
+{
+	GString *runs = g_string_new (NULL);
+	GError *error = NULL;
+
+	gtk_source_highlighter_highlight (highlighter,
+					  text,
+					  length,
+					  (GtkSourceStyleRunFunc) append_run_cb,
+					  runs,
+					  &error);
+	g_assert_no_error (error);
+
+	return g_string_free (runs, FALSE);
+}
+
+static void
+test_runs (void)
+{
+	GtkSourceHighlighter *highlighter;
+	gchar *runs;
+
+	highlighter = get_test_highlighter ();
+
+	runs = get_runs (highlighter, "x \"ab\" foo\n\"c", -1);
+	g_assert_cmpstr (runs, ==, "x [\"ab\"] [foo]\n[\"c]");
+	g_free (runs);
+
+	runs = get_runs (highlighter, "foo\r\nbar", -1);
+	g_assert_cmpstr (runs, ==, "[foo]\r\n[bar]");
+	g_free (runs);
+
+	runs = get_runs (highlighter, "", -1);
+	g_assert_cmpstr (runs, ==, "");
+	g_free (runs);
+
+	/* The text does not need to be nul-terminated. */
+	runs = get_runs (highlighter, "foo bar", 3);
+	g_assert_cmpstr (runs, ==, "[foo]");
+	g_free (runs);
+
+	runs = get_runs (highlighter, "\"a\"\n\"bc\" x", 8);
+	g_assert_cmpstr (runs, ==, "[\"a\"]\n[\"bc\"]");
+	g_free (runs);
+
+	g_object_unref (highlighter);
+}
+
+static void
+test_invalid_text (void)
+{
+	GtkSourceHighlighter *highlighter;
+	GString *runs;
+	GError *error = NULL;
+	gboolean ok;
+
+	highlighter = get_test_highlighter ();
+	runs = g_string_new (NULL);
+
+	ok = gtk_source_highlighter_highlight (highlighter,
+					       "foo \xff",
+					       -1,
+					       (GtkSourceStyleRunFunc) append_run_cb,
+					       runs,
+					       &error);
+	g_assert (!ok);
+	g_assert_error (error, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE);
+	g_assert_cmpstr (runs->str, ==, "");
+
+	g_error_free (error);
+	g_string_free (runs, TRUE);
+	g_object_unref (highlighter);
+}
+
+static void
+test_writers (void)
+{
+	GtkSourceHighlighter *highlighter;
+	gchar *output;
+
+	highlighter = get_test_highlighter ();
+
+	output = gtk_source_highlighter_to_html (highlighter, "foo <a> \"&\"", -1, NULL);
+	g_assert_cmpstr (output, ==,
+			 "<pre><span class=\"test-full-keyword\">foo</span> &lt;a&gt; "
+			 "<span class=\"test-full-string\">&quot;&amp;&quot;</span></pre>\n");
+	g_free (output);
+
+	/* Without a style scheme there is nothing to set. */
+	output = gtk_source_highlighter_to_ansi (highlighter, "x foo", -1, NULL);
+	g_assert_cmpstr (output, ==, "x foo");
+	g_free (output);
+
+	output = gtk_source_highlighter_to_json (highlighter, "x foo \"b\"", -1, NULL);
+	g_assert_cmpstr (output, ==,
+			 "[{\"start\": 2, \"end\": 5, \"style\": \"test-full:keyword\"},\n"
+			 " {\"start\": 6, \"end\": 9, \"style\": \"test-full:string\"}]\n");
+	g_free (output);
+
+	g_object_unref (highlighter);
+}
+
+static gpointer
+highlight_thread (GtkSourceHighlighter *highlighter)
+{
+	GString *text;
+	gchar *output;
+	gint i;
+
+	text = g_string_new (NULL);
+	for (i = 0; i < 1000; i++)
+		g_string_append (text, "foo \"bar\" baz\n");
+
+	output = gtk_source_highlighter_to_json (highlighter, text->str, text->len, NULL);
+
+	g_string_free (text, TRUE);
+	return output;
+}
+
+static void
+test_threads (void)
+{
+	GtkSourceHighlighter *highlighter;
+	GThread *threads[N_THREADS];
+	gchar *expected;
+	gint i;
+
+	highlighter = get_test_highlighter ();
+
+	expected = highlight_thread (highlighter);
+
+	for (i = 0; i < N_THREADS; i++)
+	{
+		threads[i] = g_thread_new ("test-highlighter",
+					   (GThreadFunc) highlight_thread,
+					   highlighter);
+	}
+
+	for (i = 0; i < N_THREADS; i++)
+	{
+		gchar *output = g_thread_join (threads[i]);
+
+		g_assert_cmpstr (output, ==, expected);
+		g_free (output);
+	}
+
+	g_free (expected);
+	g_object_unref (highlighter);
+}
+
+int
+main (int argc, char **argv)
+{
+	gtk_test_init (&argc, &argv);
+
+	g_test_add_func ("/Highlighter/runs", test_runs);
+	g_test_add_func ("/Highlighter/invalid-text", test_invalid_text);
+	g_test_add_func ("/Highlighter/writers", test_writers);
+	g_test_add_func ("/Highlighter/threads", test_threads);
+
+	return g_test_run ();
+}
@@ -13,12 +13,140 @@ test_slash_c_pattern (void)
 	g_assert (regex == NULL);
 }
 
+static void
+test_resolve_cache (void)
+{
+	GtkSourceRegex *start;
+	GtkSourceRegex *end;
+	GtkSourceRegex *resolved1;
+	GtkSourceRegex *resolved2;
+	guint hits, misses;
+	guint new_hits, new_misses;
+
+	start = _gtk_source_regex_new ("<<(?P<delim>\\w+)", 0, NULL);
+	end = _gtk_source_regex_new ("^\\%{delim@start}$", 0, NULL);
+	g_assert (start != NULL && end != NULL);
+	g_assert (!_gtk_source_regex_is_resolved (end));
+
+	g_assert (_gtk_source_regex_match (start, "cat <<EOF_RESOLVE_CACHE", -1, 0));
+
+	_gtk_source_regex_get_resolve_cache_stats (&hits, &misses);
+
+	resolved1 = _gtk_source_regex_resolve (end, start, "cat <<EOF_RESOLVE_CACHE");
+	resolved2 = _gtk_source_regex_resolve (end, start, "cat <<EOF_RESOLVE_CACHE");
+
+	_gtk_source_regex_get_resolve_cache_stats (&new_hits, &new_misses);
+	g_assert_cmpuint (new_misses, ==, misses + 1);
+	g_assert_cmpuint (new_hits, ==, hits + 1);
+
+	g_assert (resolved1 != resolved2);
+	g_assert_cmpstr (_gtk_source_regex_get_pattern (resolved1), ==,
+			 _gtk_source_regex_get_pattern (resolved2));
+	g_assert (_gtk_source_regex_match (resolved1, "EOF_RESOLVE_CACHE", -1, 0));
+	g_assert (_gtk_source_regex_match (resolved2, "EOF_RESOLVE_CACHE", -1, 0));
+	g_assert (!_gtk_source_regex_match (resolved2, "EOF", -1, 0));
+
+	_gtk_source_regex_unref (resolved1);
+	_gtk_source_regex_unref (resolved2);
+	_gtk_source_regex_unref (start);
+	_gtk_source_regex_unref (end);
+}
+
+static void
+test_first_bytes (void)
+{
+	GtkSourceRegex *regex;
+	gint start_pos, end_pos;
+
+	/* Anchored, as context definition regexes. */
+	regex = _gtk_source_regex_new ("\"|'", G_REGEX_ANCHORED, NULL);
+	g_assert (!_gtk_source_regex_match (regex, "a \"b\"", -1, 0));
+	g_assert (_gtk_source_regex_match (regex, "a \"b\"", -1, 2));
+	_gtk_source_regex_fetch_pos_bytes (regex, 0, &start_pos, &end_pos);
+	g_assert_cmpint (start_pos, ==, 2);
+	g_assert_cmpint (end_pos, ==, 3);
+	g_assert (!_gtk_source_regex_match (regex, "a \"b\"", -1, 6));
+	_gtk_source_regex_unref (regex);
+
+	/* Case insensitive, the match does not start at the first byte. */
+	regex = _gtk_source_regex_new ("(?i)select", 0, NULL);
+	g_assert (_gtk_source_regex_match (regex, "xx SELECT x", -1, 0));
+	_gtk_source_regex_fetch_pos_bytes (regex, 0, &start_pos, &end_pos);
+	g_assert_cmpint (start_pos, ==, 3);
+	g_assert (!_gtk_source_regex_match (regex, "xx SELECT x", -1, 4));
+	_gtk_source_regex_unref (regex);
+
+	/* Lookbehind before the start position. */
+	regex = _gtk_source_regex_new ("(?<=a)b", 0, NULL);
+	g_assert (_gtk_source_regex_match (regex, "ab", -1, 1));
+	_gtk_source_regex_unref (regex);
+}
+
+static gchar *
+resolve_named (const gchar *name,
+	       const gchar *text)
+{
+	GtkSourceRegex *start;
+	GtkSourceRegex *end;
+	GtkSourceRegex *resolved;
+	gchar *pattern;
+	gchar *result;
+
+	start = _gtk_source_regex_new ("<<(?P<quote>')?(?P<delim>\\w+)", 0, NULL);
+	pattern = g_strdup_printf ("^\\%%{%s@start}$", name);
+	end = _gtk_source_regex_new (pattern, 0, NULL);
+	g_assert (start != NULL && end != NULL);
+
+	g_assert (_gtk_source_regex_match (start, text, -1, 0));
+	resolved = _gtk_source_regex_resolve (end, start, text);
+	result = g_strdup (_gtk_source_regex_get_pattern (resolved));
+
+	_gtk_source_regex_unref (resolved);
+	_gtk_source_regex_unref (end);
+	_gtk_source_regex_unref (start);
+	g_free (pattern);
+
+	return result;
+}
+
+/* PCRE2 and GRegex must agree on unset and unknown named groups. */
+static void
+test_fetch_named (void)
+{
+	gboolean jit;
+
+	for (jit = FALSE; jit <= TRUE; jit++)
+	{
+		gchar *result;
+
+		_gtk_source_regex_set_jit_enabled (jit);
+
+		result = resolve_named ("delim", "cat <<EOF_FETCH_NAMED");
+		g_assert_cmpstr (result, ==, "^EOF_FETCH_NAMED$");
+		g_free (result);
+
+		result = resolve_named ("quote", "cat <<EOF_FETCH_NAMED");
+		g_assert_cmpstr (result, ==, "^$");
+		g_free (result);
+
+		g_test_expect_message (G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+				       "*Invalid group: unknown*");
+		result = resolve_named ("unknown", "cat <<EOF_FETCH_NAMED");
+		g_test_assert_expected_messages ();
+		g_assert_cmpstr (result, ==, "^$");
+		g_free (result);
+	}
+}
+
 int
 main (int argc, char** argv)
 {
 	gtk_test_init (&argc, &argv);
 
 	g_test_add_func ("/Regex/slash-c", test_slash_c_pattern);
+	g_test_add_func ("/Regex/resolve-cache", test_resolve_cache);
+	g_test_add_func ("/Regex/first-bytes", test_first_bytes);
+	g_test_add_func ("/Regex/fetch-named", test_fetch_named);
 
 	return g_test_run();
 }